@@ -24,6 +24,9 @@
 #define VERTEX_POS 0
 #define VERTEX_NORMAL 1
 #define VERTEX_COLOR 2
+// Per-instance attributes of the instanced scene (see State::instancedScene)
+#define VERTEX_INSTANCE_BOUNDS 3  // vec4(center, radius)
+#define VERTEX_INSTANCE_COLOR 4
 
 // Uniform buffer object indexes
 #define UBO_SCENE 0
@@ -36,6 +39,30 @@
 #define IMG_COLOR 6
 #define IMG_WEIGHTED_COLOR 7
 #define IMG_WEIGHTED_REVEAL 8
+// GPU culling (see cull.comp.glsl and hiz.comp.glsl)
+#define IMG_DEPTH 9           // m_depthImage, sampled
+#define IMG_HIZ 10            // All levels of the Hi-Z pyramid, sampled
+#define IMG_HIZ_LEVELS 11     // Each level of the Hi-Z pyramid, as an array of storage images
+#define BUF_OBJECT_BOUNDS 12  // One bounding sphere per object
+#define BUF_DRAW_COMMANDS 13  // Indirect draw commands written by the culling shader
+#define BUF_DRAW_COUNTS 14    // Number of draw commands per CULL_REGION_*
+// Compute composite (see oitComposite.comp.glsl)
+#define IMG_COMPOSITE 15  // The sorted and blended transparent color of each pixel or sample
+// Fragment statistics (see fragmentStats.comp.glsl)
+#define IMG_FRAGMENT_STATS 16  // Per-pixel fragment counts, with one STATS_LAYER_* per layer
+#define BUF_FRAGMENT_STATS 17  // The FragmentStats of the frame
+// Moment-based OIT (see oitMoments.frag.glsl)
+#define IMG_MOMENTS 18         // Absorbance-weighted power moments b_1...b_4 of depth
+#define IMG_MOMENTS_ZEROTH 19  // Total absorbance b_0
+#define IMG_MOMENTS_ACCUM 20   // Sum of the transmittance-weighted premultiplied colors
+// Front-to-back object order (see cull.comp.glsl)
+#define BUF_SORT_KEYS 21     // The visible transparent objects and their depth buckets
+#define BUF_SORT_BUCKETS 22  // Per-bucket counts, then per-bucket write positions
+// Compute resolve (see resolve.comp.glsl)
+#define IMG_RESOLVE_SRC 23  // m_colorImage, sampled
+#define IMG_RESOLVE_DST 24  // m_guiCompositeImage, as a storage image
+// Mesh shaders (see sphere.task.glsl and sphere.mesh.glsl)
+#define BUF_INSTANCE_COLORS 25  // m_instanceColorBuffer: one vec4 color per object of the instanced scene
 
 // Although these are formally enums, we use #defines here to make them
 // compatible with GLSL.
@@ -48,7 +75,8 @@
 #define OIT_SPINLOCK 4
 #define OIT_INTERLOCK 5
 #define OIT_WEIGHTED 6
-#define NUM_ALGORITHMS 7
+#define OIT_MOMENTS 7
+#define NUM_ALGORITHMS 8
 
 // OIT passes
 #define PASS_DEPTH 0
@@ -63,6 +91,111 @@
 #define AA_SSAA_8X 5
 #define NUM_AATYPES 6
 
+// How the composite passes sort the fragments of a pixel or sample (see
+// sortFragments in oitCompositeDefines.glsl)
+#define SORT_BUBBLE 0
+#define SORT_INSERTION 1
+#define SORT_NETWORK 2
+#define NUM_SORTS 3
+
+// How OIT_SPINLOCK's color pass takes its per-pixel lock (see
+// oitSpinlock.frag.glsl): spin on the atomic exchange, read the lock with an
+// exponential backoff between attempts, or take the lock once per pixel for
+// all lanes of a subgroup that shade it.
+#define SPIN_PLAIN 0
+#define SPIN_BACKOFF 1
+#define SPIN_SUBGROUP 2
+#define NUM_SPIN_STRATEGIES 3
+// The most times SPIN_BACKOFF reads the lock between two attempts
+#define SPIN_MAX_BACKOFF 64
+
+// How the A-buffers with a fixed number of entries per pixel or sample (all
+// but OIT_LINKEDLIST's) order their entries (see abufferIndex):
+// - ABUFFER_LAYOUT_LAYERS stores one plane of pixels, in rows, per layer.
+// - ABUFFER_LAYOUT_TILED also stores one plane per layer, but orders the pixels
+//   of each ABUFFER_TILE_SIZE x ABUFFER_TILE_SIZE block along a Morton curve,
+//   so that nearby pixels (such as those of a quad or warp) share cache lines.
+//   Planes are padded to whole blocks.
+// - ABUFFER_LAYOUT_PIXELS stores all entries of a pixel next to each other.
+#define ABUFFER_LAYOUT_LAYERS 0
+#define ABUFFER_LAYOUT_TILED 1
+#define ABUFFER_LAYOUT_PIXELS 2
+#define NUM_ABUFFER_LAYOUTS 3
+#define ABUFFER_TILE_SIZE 8
+
+// The fragment size at which the color passes of OIT_WEIGHTED and OIT_MOMENTS
+// shade with VK_KHR_fragment_shading_rate (see State::activeShadingRate).
+// Devices clamp sizes they don't support for a sample count to smaller ones.
+#define SHADING_RATE_1X1 0
+#define SHADING_RATE_1X2 1
+#define SHADING_RATE_2X1 2
+#define SHADING_RATE_2X2 3
+#define SHADING_RATE_4X4 4
+#define NUM_SHADING_RATES 5
+
+// With State::frameTags (OIT_FRAME_TAGS), the per-pixel fragment counters and
+// the Loop32 and Loop64 depths store PushConstants::frameTag in their upper
+// bits. The renderer advances the tag instead of clearing them, and the
+// shaders treat values with other tags as empty. Tags go from 1 to
+// FRAME_TAG_MAX; after that, the renderer clears everything and starts over.
+#define FRAME_TAG_SHIFT 24
+#define FRAME_TAG_MAX 255
+
+// GPU culling: the culling shader writes the draw commands of the transparent
+// objects (which come first in the mesh) and of the opaque objects into two
+// separate regions of BUF_DRAW_COMMANDS, each with its own count.
+#define CULL_REGION_TRANSPARENT 0
+#define CULL_REGION_OPAQUE 1
+#define NUM_CULL_REGIONS 2
+
+#define CULL_WORKGROUP_SIZE 64
+// With State::frontToBack, cull.comp.glsl runs three passes over the
+// transparent objects: the culling pass, which sorts the visible ones into
+// OBJECT_SORT_BUCKETS buckets by their nearest view depth, a scan over the
+// buckets, and a pass that writes the draw commands in bucket order.
+#define CULL_PASS_CULL 0
+#define CULL_PASS_SCAN 1
+#define CULL_PASS_SCATTER 2
+#define OBJECT_SORT_BUCKETS 256
+#define HIZ_WORKGROUP_SIZE 8
+// Enough levels for a 32768 x 32768 depth buffer
+#define HIZ_MAX_LEVELS 16
+
+// With State::meshShaders, sphere.task.glsl runs one workgroup per object,
+// with one invocation per patch of up to MESH_PATCH_QUADS x MESH_PATCH_QUADS
+// quads of its sphere, and sphere.mesh.glsl runs one workgroup per patch
+// that might be visible. A sphere with subdivision level s has 2s x s quads,
+// so MESH_MAX_SUBDIV is the most that fits into one task workgroup.
+#define MESH_PATCH_QUADS 8
+#define MESH_WORKGROUP_SIZE 32
+#define MESH_MAX_SUBDIV 32
+// vkCmdDrawMeshTasksEXT spreads the objects over rows of this many workgroups,
+// the smallest maxTaskWorkGroupCount[0] that implementations can have.
+#define MESH_TASK_GROUPS_X 65535
+
+// The compute composite shader processes COMPOSITE_WORKGROUP_SIZE x
+// COMPOSITE_WORKGROUP_SIZE pixels per workgroup.
+#define COMPOSITE_WORKGROUP_SIZE 8
+
+// The compute resolve shader writes RESOLVE_WORKGROUP_SIZE x
+// RESOLVE_WORKGROUP_SIZE pixels of m_guiCompositeImage per workgroup.
+#define RESOLVE_WORKGROUP_SIZE 8
+
+// Fragment statistics: IMG_FRAGMENT_STATS has a layer for the number of
+// transparent fragments of each pixel, one for the number of them that
+// didn't fit into the A-buffer (and were tail-blended or dropped), one for
+// the number of stores and atomics that wrote to the A-buffer, and one for the
+// number of times OIT_SPINLOCK tried to take a lock.
+#define STATS_LAYER_FRAGMENTS 0
+#define STATS_LAYER_OVERFLOW 1
+#define STATS_LAYER_WRITES 2
+#define STATS_LAYER_LOCK_ATTEMPTS 3
+#define NUM_STATS_LAYERS 4
+// FragmentStats::histogram counts the pixels with 1, 2, ... fragments; its
+// last bin also includes all pixels with more fragments.
+#define STATS_HISTOGRAM_BINS 128
+#define STATS_WORKGROUP_SIZE 16
+
 // Affects several techniques, does a coarse depth-test to avoid
 // longer-lasting actions (helps when many layers are used)
 #define USE_EARLYDEPTH 1
@@ -73,14 +206,19 @@
 using namespace glm;  // Make glm::mat4 correspond to mat4, e.g.
 #endif                   // #ifdef __cplusplus
 
+// The most views rendered at once with VK_KHR_multiview (see
+// State::usesMultiview); SceneData has a set of matrices for each.
+#define OIT_MAX_VIEWS 2
+
 struct SceneData
 {
-  // Vectors are multiplied on the right.
-  mat4 projViewMatrix;
-  mat4 viewMatrix;
-  mat4 viewMatrixInverseTranspose;
+  // Vectors are multiplied on the right. Shaders that draw into the views
+  // index these with VIEW_INDEX; the compute passes use view 0.
+  mat4 projViewMatrix[OIT_MAX_VIEWS];
+  mat4 viewMatrix[OIT_MAX_VIEWS];
+  mat4 viewMatrixInverseTranspose[OIT_MAX_VIEWS];
 
-  ivec3 viewport;  // (width, height, width*height)
+  ivec3 viewport;  // (width, height, pixels per A-buffer plane; see abufferIndex) of the region the A-buffer covers (the image, or a tile)
   // For SIMPLE, INTERLOCK, SPINLOCK, LOOP, and LOOP64, the number of OIT layers;
   // for LINKEDLIST, the total number of elements in the A-buffer.
   uint linkedListAllocatedPerElement;
@@ -90,6 +228,49 @@ struct SceneData
   vec2  _pad1;
 };
 
+// Push constants, which change per tile when rendering transparent objects in
+// tiles (see Sample::renderTiled), and per dispatch when culling objects.
+struct PushConstants
+{
+  ivec2 tileOffset;  // The top-left pixel of the current tile in the color image; (0, 0) if not using tiles.
+
+  // For cull.comp.glsl:
+  uint cullFirstObject;   // The first object to cull; also the index of the region's first draw command.
+  uint cullNumObjects;    // The number of objects to cull.
+  uint cullRegion;        // CULL_REGION_TRANSPARENT or CULL_REGION_OPAQUE
+  uint cullOcclusion;     // If nonzero, also culls against the Hi-Z pyramid.
+  uint indicesPerObject;  // The number of triangle indices per object.
+  uint cullSort;          // If nonzero, writes sort keys instead of draw commands (see CULL_PASS_*).
+
+  // For the transparent passes:
+  uint frameTag;  // With State::frameTags, the tag of the values written since the last clear (see FRAME_TAG_SHIFT).
+
+  // For hiz.comp.glsl:
+  uint hizLevel;  // The level of the Hi-Z pyramid to write.
+  uint hizNumLevels;
+
+  // For sphere.task.glsl; pushed by Sample::cmdDrawObjects.
+  uint meshFirstObject;
+  uint meshNumObjects;
+  uint meshSubdiv;  // The subdivision level of the resident scene's sphere.
+};
+
+// The fragment statistics of a frame, reduced from IMG_FRAGMENT_STATS by
+// fragmentStats.comp.glsl. Only pixels with at least one transparent fragment
+// are counted.
+struct FragmentStats
+{
+  uint coveredPixels;      // Pixels with at least one transparent fragment
+  uint totalFragments;     // Transparent fragments of all pixels
+  uint overflowFragments;  // Fragments that didn't fit into the A-buffer
+  uint overflowPixels;     // Pixels with at least one such fragment
+  uint maxFragments;       // The most fragments of any pixel
+  uint aBufferWrites;      // Stores and atomics that wrote to the A-buffer
+  uint lockAttempts;       // Atomic exchanges OIT_SPINLOCK used to take locks
+  uint _pad[1];
+  uint histogram[STATS_HISTOGRAM_BINS];  // Number of pixels per number of fragments
+};
+
 // GLSL-only code
 #ifndef __cplusplus
 
@@ -99,16 +280,58 @@ layout(std140, binding = UBO_SCENE) uniform sceneBuffer
   SceneData scene;
 };
 
+layout(push_constant) uniform pushConstantBuffer
+{
+  PushConstants pushConstants;
+};
+
+// Returns whether the sphere is at least partially inside the view frustum.
+bool isSphereInFrustum(vec3 center, float radius)
+{
+  // Extract the frustum planes from the rows of the projection-view matrix
+  // (Gribb and Hartmann); since we use a [0, 1] depth range, the near plane
+  // is the third row itself.
+  const mat4 m    = transpose(scene.projViewMatrix[0]);
+  vec4 planes[6]  = vec4[6](m[3] + m[0], m[3] - m[0], m[3] + m[1], m[3] - m[1], m[2], m[3] - m[2]);
+  const vec4 cPos = vec4(center, 1.0);
+  for(int i = 0; i < 6; i++)
+  {
+    if(dot(planes[i], cPos) < -radius * length(planes[i].xyz))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
 #ifndef OIT_LAYERS
 #define OIT OIT_INTERLOCK
 #define OIT_LAYERS 8
 #define OIT_LOOP_DEPTH
 #define OIT_TAILBLEND 1
 #define OIT_INTERLOCK_IS_ORDERED 1
+#define OIT_INTERLOCK_MLAB 0
 #define OIT_MSAA 8
 #define OIT_SAMPLE_SHADING 1
+#define OIT_SORT SORT_BUBBLE
+#define SCENE_INSTANCED 0
+#define OIT_STATS 0
+#define OIT_PACKED_ABUFFER 0
+#define OIT_SPIN_STRATEGY SPIN_PLAIN
+#define OIT_LINKEDLIST_SUBGROUP 0
+#define OIT_ABUFFER_LAYOUT ABUFFER_LAYOUT_LAYERS
+#define OIT_FRAME_TAGS 0
+#define OIT_VIEWS 1
 #endif
 
+// The view that the current vertex or fragment is drawn for, with OIT_VIEWS
+// views of VK_KHR_multiview (see SceneData).
+#if OIT_VIEWS > 1
+#define VIEW_INDEX gl_ViewIndex
+#else  // #if OIT_VIEWS > 1
+#define VIEW_INDEX 0
+#endif  // #if OIT_VIEWS > 1
+
 // When using MSAA, we can either use the coverage shading technique (not
 // coverage-to-alpha! This stores the coverage (i.e. MSAA sample mask) of each
 // fragment in the A-buffer) or sample shading (lower-level supersampling; each
@@ -116,4 +339,124 @@ layout(std140, binding = UBO_SCENE) uniform sceneBuffer
 // We want to use coverage shading if using MSAA and not using sample shading.
 #define OIT_COVERAGE_SHADING ((OIT_MSAA != 1) && (OIT_SAMPLE_SHADING == 0))
 
+// With OIT_PACKED_ABUFFER (see State::packedABuffer), the second component of
+// each A-buffer entry packs a 24-bit unorm depth into its upper bits and the
+// fragment's 8-bit coverage mask into its lower bits, instead of storing a
+// float depth and a separate mask. Since the depth is in the upper bits, these
+// values still sort by depth when compared as uints.
+#if OIT_PACKED_ABUFFER
+#if OIT_MSAA > 8
+#error "OIT_PACKED_ABUFFER only has room for 8 coverage bits!"
+#endif
+#define entryDepth(e) ((e).g)
+#define entryMask(e) ((e).g & 0xFFu)
+#define ENTRY_DEPTH_FAR 0xFFFFFFFFu  // Further away than all fragments
+#else  // #if OIT_PACKED_ABUFFER
+#define entryDepth(e) uintBitsToFloat((e).g)
+#define entryMask(e) ((e).b)
+#define ENTRY_DEPTH_FAR 0x7F800000u  // +infinity as a float
+#endif  // #if OIT_PACKED_ABUFFER
+
+// Returns the index of the given layer of a pixel (or with sample shading,
+// sample) in an A-buffer with layersPerSample entries per pixel or sample,
+// using OIT_ABUFFER_LAYOUT. scene.viewport.z is the size of a plane.
+int abufferIndex(ivec2 pixel, int sample, int layer, int layersPerSample)
+{
+#if OIT_ABUFFER_LAYOUT == ABUFFER_LAYOUT_PIXELS
+  return (sample * scene.viewport.z + pixel.y * scene.viewport.x + pixel.x) * layersPerSample + layer;
+#else  // #if OIT_ABUFFER_LAYOUT == ABUFFER_LAYOUT_PIXELS
+#if OIT_ABUFFER_LAYOUT == ABUFFER_LAYOUT_TILED
+  // Interleave the bits of the position within the block
+  const ivec2 local  = pixel & (ABUFFER_TILE_SIZE - 1);
+  int         morton = 0;
+  for(int bit = 0; (1 << bit) < ABUFFER_TILE_SIZE; bit++)
+  {
+    morton |= ((local.x >> bit) & 1) << (2 * bit);
+    morton |= ((local.y >> bit) & 1) << (2 * bit + 1);
+  }
+  const int   blocksX    = (scene.viewport.x + ABUFFER_TILE_SIZE - 1) / ABUFFER_TILE_SIZE;
+  const ivec2 block      = pixel / ABUFFER_TILE_SIZE;
+  const int   planeIndex = (block.y * blocksX + block.x) * (ABUFFER_TILE_SIZE * ABUFFER_TILE_SIZE) + morton;
+#else   // #if OIT_ABUFFER_LAYOUT == ABUFFER_LAYOUT_TILED
+  const int planeIndex = pixel.y * scene.viewport.x + pixel.x;
+#endif  // #if OIT_ABUFFER_LAYOUT == ABUFFER_LAYOUT_TILED
+  return (sample * layersPerSample + layer) * scene.viewport.z + planeIndex;
+#endif  // #if OIT_ABUFFER_LAYOUT == ABUFFER_LAYOUT_PIXELS
+}
+
+// Returns the difference between the indices of consecutive layers of the
+// same pixel or sample in the A-buffer.
+int abufferLayerStride()
+{
+#if OIT_ABUFFER_LAYOUT == ABUFFER_LAYOUT_PIXELS
+  return 1;
+#else
+  return scene.viewport.z;
+#endif
+}
+
+// Per-pixel fragment counters (IMG_AUX): with OIT_FRAME_TAGS, a counter is
+// (tag << FRAME_TAG_SHIFT) | count. Since tags increase, imageAtomicMax with
+// counterTagged(0) resets counters from earlier tags to 0.
+#if OIT_FRAME_TAGS
+// Returns the count that a stored counter value represents.
+uint counterCount(uint stored)
+{
+  const bool current = ((stored >> FRAME_TAG_SHIFT) == pushConstants.frameTag);
+  return current ? (stored & ((1u << FRAME_TAG_SHIFT) - 1u)) : 0u;
+}
+// Returns the value to store for a count.
+uint counterTagged(uint count)
+{
+  return (pushConstants.frameTag << FRAME_TAG_SHIFT) | count;
+}
+#else   // #if OIT_FRAME_TAGS
+uint counterCount(uint stored)
+{
+  return stored;
+}
+uint counterTagged(uint count)
+{
+  return count;
+}
+#endif  // #if OIT_FRAME_TAGS
+
+// Loop32 and Loop64 depths, which the A-buffer is cleared to 0xFFFFFFFF for:
+// with OIT_FRAME_TAGS, a depth is ((FRAME_TAG_MAX - tag) << FRAME_TAG_SHIFT)
+// plus a 24-bit unorm depth. Depths from earlier tags and cleared values then
+// compare greater than all current depths, so they behave like empty entries
+// when inserting. Otherwise, depths are floats reinterpreted as uints.
+uint loopDepth(float depth)
+{
+#if OIT_FRAME_TAGS
+  const uint depth24 = uint(clamp(depth, 0.0, 1.0) * 16777215.0 + 0.5);
+  return ((FRAME_TAG_MAX - pushConstants.frameTag) << FRAME_TAG_SHIFT) | depth24;
+#else   // #if OIT_FRAME_TAGS
+  return floatBitsToUint(depth);
+#endif  // #if OIT_FRAME_TAGS
+}
+// Returns whether a stored Loop32 or Loop64 depth is empty.
+bool loopDepthEmpty(uint stored)
+{
+#if OIT_FRAME_TAGS
+  return (stored >> FRAME_TAG_SHIFT) != (FRAME_TAG_MAX - pushConstants.frameTag);
+#else   // #if OIT_FRAME_TAGS
+  return stored == 0xFFFFFFFFu;
+#endif  // #if OIT_FRAME_TAGS
+}
+
+// With sample shading, the passes that count fragments (see oitStats.glsl)
+// run once per covered sample, so IMG_FRAGMENT_STATS holds sums over each
+// pixel's samples. This converts such a sum to a count per pixel, rounding up
+// so that a fragment that only covers some samples still counts once, as it
+// would without sample shading.
+uint statsPerPixel(uint sampleSum)
+{
+#if OIT_SAMPLE_SHADING
+  return (sampleSum + OIT_MSAA - 1) / OIT_MSAA;
+#else   // #if OIT_SAMPLE_SHADING
+  return sampleSum;
+#endif  // #if OIT_SAMPLE_SHADING
+}
+
 #endif  // #ifndef __cplusplus
\ No newline at end of file
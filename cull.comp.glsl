@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2020-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2020-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+// Culls a range of objects, each with a bounding sphere, against the view
+// frustum and optionally against the Hi-Z pyramid built by hiz.comp.glsl.
+// For each object that may be visible, appends a draw command to its region
+// of the indirect draw buffer, which is then drawn using
+// vkCmdDrawIndexedIndirectCount. With the instanced scene, each command
+// draws one instance of the sphere instead of a range of the mesh.
+//
+// To draw the transparent objects roughly from front to back, the culling
+// pass (with pushConstants.cullSort) instead appends each visible object and
+// its depth bucket to BUF_SORT_KEYS, and counts the objects per bucket. A
+// CULL_PASS_SCAN dispatch then turns the counts into the first position of
+// each bucket, and CULL_PASS_SCATTER writes each object's draw command at its
+// bucket's next position. This is a single pass of a counting sort, so objects
+// in the same bucket are drawn in any order.
+
+#version 460
+#extension GL_GOOGLE_include_directive : enable
+
+#include "common.h"
+
+#ifndef CULL_PASS
+#define CULL_PASS CULL_PASS_CULL
+#endif
+
+#if CULL_PASS == CULL_PASS_SCAN
+layout(local_size_x = OBJECT_SORT_BUCKETS) in;
+#else
+layout(local_size_x = CULL_WORKGROUP_SIZE) in;
+#endif
+
+// Matches VkDrawIndexedIndirectCommand.
+struct DrawIndexedIndirectCommand
+{
+  uint indexCount;
+  uint instanceCount;
+  uint firstIndex;
+  int  vertexOffset;
+  uint firstInstance;
+};
+
+layout(binding = IMG_HIZ) uniform sampler2D texHiz;
+
+layout(std430, binding = BUF_OBJECT_BOUNDS) readonly buffer objectBoundsBuffer
+{
+  vec4 objectBounds[];  // (center.xyz, radius)
+};
+
+layout(std430, binding = BUF_DRAW_COMMANDS) writeonly buffer drawCommandsBuffer
+{
+  DrawIndexedIndirectCommand drawCommands[];
+};
+
+layout(std430, binding = BUF_DRAW_COUNTS) buffer drawCountsBuffer
+{
+  uint drawCounts[NUM_CULL_REGIONS];
+};
+
+layout(std430, binding = BUF_SORT_KEYS) buffer sortKeysBuffer
+{
+  uvec2 sortKeys[];  // (object, bucket), at the same slots as the draw commands
+};
+
+layout(std430, binding = BUF_SORT_BUCKETS) buffer sortBucketsBuffer
+{
+  uint bucketCounts[OBJECT_SORT_BUCKETS];     // Cleared to 0 each frame
+  uint bucketPositions[OBJECT_SORT_BUCKETS];  // Written by CULL_PASS_SCAN
+};
+
+// Writes the draw command of an object to a slot of BUF_DRAW_COMMANDS.
+void writeDrawCommand(uint slot, uint object)
+{
+  DrawIndexedIndirectCommand command;
+  command.indexCount    = pushConstants.indicesPerObject;
+  command.instanceCount = 1;
+#if SCENE_INSTANCED
+  // Draw the object's instance of the sphere.
+  command.firstIndex    = 0;
+  command.firstInstance = object;
+#else
+  command.firstIndex    = object * pushConstants.indicesPerObject;
+  command.firstInstance = 0;
+#endif
+  command.vertexOffset  = 0;
+  drawCommands[slot]    = command;
+}
+
+#if CULL_PASS == CULL_PASS_CULL
+
+// Returns whether the sphere is completely hidden behind the depths in the
+// Hi-Z pyramid.
+bool isOccluded(vec3 center, float radius)
+{
+  // Project the corners of the sphere's bounding box, and find their screen
+  // rectangle and nearest depth.
+  vec2  ndcMin = vec2(1.0);
+  vec2  ndcMax = vec2(-1.0);
+  float zMin   = 1.0;
+  for(int i = 0; i < 8; i++)
+  {
+    const vec3 corner = center + radius * vec3((i & 1) != 0 ? 1.0 : -1.0,  //
+                                               (i & 2) != 0 ? 1.0 : -1.0,  //
+                                               (i & 4) != 0 ? 1.0 : -1.0);
+    const vec4 clip   = scene.projViewMatrix[0] * vec4(corner, 1.0);
+    if(clip.w <= 0.0)
+    {
+      // The box crosses the camera plane; conservatively treat it as visible.
+      return false;
+    }
+    const vec3 ndc = clip.xyz / clip.w;
+    ndcMin         = min(ndcMin, ndc.xy);
+    ndcMax         = max(ndcMax, ndc.xy);
+    zMin           = min(zMin, ndc.z);
+  }
+
+  // Find the pixels the rectangle covers in the depth buffer.
+  const ivec2 size     = textureSize(texHiz, 0);
+  const ivec2 pixelMin = clamp(ivec2((ndcMin * 0.5 + 0.5) * vec2(size)), ivec2(0), size - 1);
+  const ivec2 pixelMax = clamp(ivec2((ndcMax * 0.5 + 0.5) * vec2(size)), ivec2(0), size - 1);
+
+  // Choose the smallest level at which the rectangle covers at most 2x2 texels.
+  const ivec2 extent = pixelMax - pixelMin;
+  int         level  = 0;
+  while(level < int(pushConstants.hizNumLevels) - 1 && ((extent.x | extent.y) >> level) != 0)
+  {
+    level++;
+  }
+
+  // Each Hi-Z texel covers at least the pixels below it at that level, so
+  // these four texels cover the whole rectangle.
+  const ivec2 levelMax = textureSize(texHiz, level) - 1;
+  const ivec2 texelMin = min(pixelMin >> level, levelMax);
+  const ivec2 texelMax = min(pixelMax >> level, levelMax);
+  float       hizDepth = texelFetch(texHiz, texelMin, level).r;
+  hizDepth             = max(hizDepth, texelFetch(texHiz, ivec2(texelMax.x, texelMin.y), level).r);
+  hizDepth             = max(hizDepth, texelFetch(texHiz, ivec2(texelMin.x, texelMax.y), level).r);
+  hizDepth             = max(hizDepth, texelFetch(texHiz, texelMax, level).r);
+
+  // The opaque objects use VK_COMPARE_OP_LESS, so larger depths are further away.
+  return zMin > hizDepth;
+}
+
+// Returns the bucket of the sphere's nearest view depth. The buckets divide
+// the range between the near and far planes of the projection (see
+// Sample::updateUniformBuffer) logarithmically, so that nearby objects, which
+// cover more pixels, are sorted more finely.
+uint depthBucket(vec3 center, float radius)
+{
+  const float nearPlane = 0.01;
+  const float farPlane  = 50.0;
+  // For a perspective projection, w is the view depth.
+  const float viewDepth = (scene.projViewMatrix[0] * vec4(center, 1.0)).w - radius;
+  const float t         = log(max(viewDepth, nearPlane) / nearPlane) / log(farPlane / nearPlane);
+  return min(uint(max(t, 0.0) * OBJECT_SORT_BUCKETS), OBJECT_SORT_BUCKETS - 1);
+}
+
+void main()
+{
+  const uint i = gl_GlobalInvocationID.x;
+  if(i >= pushConstants.cullNumObjects)
+  {
+    return;
+  }
+
+  const uint  object = pushConstants.cullFirstObject + i;
+  const vec4  bounds = objectBounds[object];
+  const vec3  center = bounds.xyz;
+  const float radius = bounds.w;
+
+  if(!isSphereInFrustum(center, radius))
+  {
+    return;
+  }
+
+  if(pushConstants.cullOcclusion != 0 && isOccluded(center, radius))
+  {
+    return;
+  }
+
+  // Each region starts at its first object, so it has room for all of them.
+  const uint slot = pushConstants.cullFirstObject + atomicAdd(drawCounts[pushConstants.cullRegion], 1);
+
+  if(pushConstants.cullSort != 0)
+  {
+    const uint bucket = depthBucket(center, radius);
+    sortKeys[slot]    = uvec2(object, bucket);
+    atomicAdd(bucketCounts[bucket], 1);
+    return;
+  }
+
+  writeDrawCommand(slot, object);
+}
+
+#elif CULL_PASS == CULL_PASS_SCAN
+
+shared uint sharedSums[OBJECT_SORT_BUCKETS];
+
+// A single workgroup with one invocation per bucket computes the exclusive
+// prefix sum of the bucket counts.
+void main()
+{
+  const uint bucket  = gl_LocalInvocationIndex;
+  const uint count   = bucketCounts[bucket];
+  sharedSums[bucket] = count;
+  memoryBarrierShared();
+  barrier();
+
+  // Hillis-Steele inclusive scan
+  for(uint offset = 1; offset < OBJECT_SORT_BUCKETS; offset *= 2)
+  {
+    const uint value = (bucket >= offset) ? sharedSums[bucket - offset] : 0;
+    memoryBarrierShared();
+    barrier();
+    sharedSums[bucket] += value;
+    memoryBarrierShared();
+    barrier();
+  }
+
+  bucketPositions[bucket] = sharedSums[bucket] - count;
+}
+
+#elif CULL_PASS == CULL_PASS_SCATTER
+
+// One invocation per object the culling pass may have appended.
+void main()
+{
+  const uint i = gl_GlobalInvocationID.x;
+  if(i >= drawCounts[pushConstants.cullRegion])
+  {
+    return;
+  }
+
+  const uvec2 key  = sortKeys[pushConstants.cullFirstObject + i];
+  const uint  slot = pushConstants.cullFirstObject + atomicAdd(bucketPositions[key.y], 1);
+  writeDrawCommand(slot, key.x);
+}
+
+#endif  // #if CULL_PASS == CULL_PASS_CULL
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2020-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2020-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+
+// Draws the per-pixel fragment counts of IMG_FRAGMENT_STATS over the image
+// (see State::fragmentHeatmap). Pixels go from blue (one fragment) to green
+// (OIT_LAYERS fragments, what the A-buffer can sort per pixel) to red (twice
+// that or more), and pixels with fragments that didn't fit into the A-buffer
+// are hatched.
+
+#version 460
+#extension GL_GOOGLE_include_directive : enable
+
+#include "shaderCommon.glsl"
+
+layout(binding = IMG_FRAGMENT_STATS, r32ui) uniform restrict readonly uimage2DArray imgFragmentStats;
+
+layout(location = 0) out vec4 outColor;
+
+void main()
+{
+  const ivec2 pixel     = ivec2(gl_FragCoord.xy);
+  const uint  fragments = statsPerPixel(imageLoad(imgFragmentStats, ivec3(pixel, STATS_LAYER_FRAGMENTS)).r);
+  const uint  overflow  = statsPerPixel(imageLoad(imgFragmentStats, ivec3(pixel, STATS_LAYER_OVERFLOW)).r);
+
+  if(fragments == 0)
+  {
+    outColor = vec4(0);
+    return;
+  }
+
+  const float t   = clamp(float(fragments) / float(2 * OIT_LAYERS), 0.0, 1.0);
+  vec3        rgb = (t < 0.5) ? mix(vec3(0, 0, 1), vec3(0, 1, 0), 2.0 * t) : mix(vec3(0, 1, 0), vec3(1, 0, 0), 2.0 * t - 1.0);
+
+  if(overflow != 0 && ((pixel.x + pixel.y) & 4) != 0)
+  {
+    rgb = mix(rgb, vec3(1), 0.5);
+  }
+
+  // Premultiplied alpha
+  const float alpha = 0.85;
+  outColor          = vec4(rgb * alpha, alpha);
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2020-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2020-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+
+// Reduces the per-pixel fragment counts the color passes wrote to
+// IMG_FRAGMENT_STATS (see oitStats.glsl) to the FragmentStats in
+// BUF_FRAGMENT_STATS: one invocation per pixel of m_colorImage, which converts
+// sums over samples to per-pixel counts (see statsPerPixel). Each workgroup
+// first accumulates its pixels in shared memory, so that it only needs one
+// global atomic per histogram bin it uses.
+
+#version 460
+#extension GL_GOOGLE_include_directive : enable
+
+#include "common.h"
+
+layout(local_size_x = STATS_WORKGROUP_SIZE, local_size_y = STATS_WORKGROUP_SIZE) in;
+
+layout(binding = IMG_FRAGMENT_STATS, r32ui) uniform restrict readonly uimage2DArray imgFragmentStats;
+
+layout(binding = BUF_FRAGMENT_STATS, std430) restrict buffer fragmentStatsBuffer
+{
+  FragmentStats stats;
+};
+
+shared uint sharedHistogram[STATS_HISTOGRAM_BINS];
+shared uint sharedCoveredPixels;
+shared uint sharedTotalFragments;
+shared uint sharedOverflowFragments;
+shared uint sharedOverflowPixels;
+shared uint sharedMaxFragments;
+shared uint sharedWrites;
+shared uint sharedLockAttempts;
+
+void main()
+{
+  const uint localIndex = gl_LocalInvocationIndex;
+  const uint numLocal   = STATS_WORKGROUP_SIZE * STATS_WORKGROUP_SIZE;
+
+  for(uint bin = localIndex; bin < STATS_HISTOGRAM_BINS; bin += numLocal)
+  {
+    sharedHistogram[bin] = 0;
+  }
+  if(localIndex == 0)
+  {
+    sharedCoveredPixels     = 0;
+    sharedTotalFragments    = 0;
+    sharedOverflowFragments = 0;
+    sharedOverflowPixels    = 0;
+    sharedMaxFragments      = 0;
+    sharedWrites            = 0;
+    sharedLockAttempts      = 0;
+  }
+  memoryBarrierShared();
+  barrier();
+
+  const ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+  if(all(lessThan(pixel, imageSize(imgFragmentStats).xy)))
+  {
+    const uint fragments = statsPerPixel(imageLoad(imgFragmentStats, ivec3(pixel, STATS_LAYER_FRAGMENTS)).r);
+    const uint overflow  = statsPerPixel(imageLoad(imgFragmentStats, ivec3(pixel, STATS_LAYER_OVERFLOW)).r);
+    const uint writes    = statsPerPixel(imageLoad(imgFragmentStats, ivec3(pixel, STATS_LAYER_WRITES)).r);
+    const uint attempts  = statsPerPixel(imageLoad(imgFragmentStats, ivec3(pixel, STATS_LAYER_LOCK_ATTEMPTS)).r);
+    if(fragments != 0)
+    {
+      atomicAdd(sharedHistogram[min(fragments, STATS_HISTOGRAM_BINS - 1)], 1u);
+      atomicAdd(sharedCoveredPixels, 1u);
+      atomicAdd(sharedTotalFragments, fragments);
+      atomicMax(sharedMaxFragments, fragments);
+    }
+    if(overflow != 0)
+    {
+      atomicAdd(sharedOverflowFragments, overflow);
+      atomicAdd(sharedOverflowPixels, 1u);
+    }
+    if(writes != 0)
+    {
+      atomicAdd(sharedWrites, writes);
+    }
+    if(attempts != 0)
+    {
+      atomicAdd(sharedLockAttempts, attempts);
+    }
+  }
+  memoryBarrierShared();
+  barrier();
+
+  for(uint bin = localIndex; bin < STATS_HISTOGRAM_BINS; bin += numLocal)
+  {
+    if(sharedHistogram[bin] != 0)
+    {
+      atomicAdd(stats.histogram[bin], sharedHistogram[bin]);
+    }
+  }
+  if(localIndex == 0 && sharedWrites != 0)
+  {
+    atomicAdd(stats.aBufferWrites, sharedWrites);
+  }
+  if(localIndex == 0 && sharedLockAttempts != 0)
+  {
+    atomicAdd(stats.lockAttempts, sharedLockAttempts);
+  }
+  if(localIndex == 0 && sharedCoveredPixels != 0)
+  {
+    atomicAdd(stats.coveredPixels, sharedCoveredPixels);
+    atomicAdd(stats.totalFragments, sharedTotalFragments);
+    atomicAdd(stats.overflowFragments, sharedOverflowFragments);
+    atomicAdd(stats.overflowPixels, sharedOverflowPixels);
+    atomicMax(stats.maxFragments, sharedMaxFragments);
+  }
+}
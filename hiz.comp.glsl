@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2020-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2020-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+// Builds one level of a Hi-Z pyramid from the opaque objects' depth buffer:
+// each texel of level n stores the furthest depth of the texels of level n-1
+// it covers, and level 0 stores the furthest depth of each pixel's samples.
+// cull.comp.glsl then uses this to test whether the transparent objects are
+// hidden behind the opaque objects.
+
+#version 460
+#extension GL_GOOGLE_include_directive : enable
+
+#include "common.h"
+
+layout(local_size_x = HIZ_WORKGROUP_SIZE, local_size_y = HIZ_WORKGROUP_SIZE) in;
+
+#if OIT_MSAA != 1
+layout(binding = IMG_DEPTH) uniform sampler2DMS texDepth;
+#else
+layout(binding = IMG_DEPTH) uniform sampler2D texDepth;
+#endif
+
+layout(binding = IMG_HIZ_LEVELS, r32f) uniform image2D imgHizLevels[HIZ_MAX_LEVELS];
+
+// Returns the farthest depth of all samples of a pixel of the depth buffer.
+float loadDepth(ivec2 coord)
+{
+#if OIT_MSAA != 1
+  float depth = 0.0;
+  for(int i = 0; i < OIT_MSAA; i++)
+  {
+    depth = max(depth, texelFetch(texDepth, coord, i).r);
+  }
+  return depth;
+#else
+  return texelFetch(texDepth, coord, 0).r;
+#endif
+}
+
+void main()
+{
+  const uint  level   = pushConstants.hizLevel;
+  const ivec2 dstSize = imageSize(imgHizLevels[level]);
+  const ivec2 coord   = ivec2(gl_GlobalInvocationID.xy);
+  if(any(greaterThanEqual(coord, dstSize)))
+  {
+    return;
+  }
+
+  float depth = 0.0;
+  if(level == 0)
+  {
+    depth = loadDepth(coord);
+  }
+  else
+  {
+    // Each texel covers 2x2 texels of the previous level. When the previous
+    // level has an odd size, the last row or column also covers the texels
+    // that would otherwise be left over.
+    const ivec2 srcSize = imageSize(imgHizLevels[level - 1]);
+    ivec2       srcEnd  = coord * 2 + 1;
+    if(coord.x == dstSize.x - 1)
+    {
+      srcEnd.x = srcSize.x - 1;
+    }
+    if(coord.y == dstSize.y - 1)
+    {
+      srcEnd.y = srcSize.y - 1;
+    }
+
+    for(int y = coord.y * 2; y <= srcEnd.y; y++)
+    {
+      for(int x = coord.x * 2; x <= srcEnd.x; x++)
+      {
+        depth = max(depth, imageLoad(imgHizLevels[level - 1], ivec2(x, y)).r);
+      }
+    }
+  }
+
+  imageStore(imgHizLevels[level], coord, vec4(depth));
+}
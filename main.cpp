@@ -30,6 +30,7 @@
 // oitRender.cpp: Main OIT-specific rendering functions.
 // oit.cpp: Main OIT-specific resource creation functions.
 // oitGui.cpp: GUI for the application.
+// oitShaderCache.cpp: Shader system, with the on-disk SPIR-V and pipeline caches.
 // utilities_vk.h: Helper functions that can exist without a sample.
 // main.cpp: All other functions not specific to OIT.
 
@@ -50,6 +51,7 @@
 #include <GLFW/glfw3.h>
 
 #include <algorithm>
+#include <array>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
@@ -58,6 +60,7 @@
 #include <random>
 #include <set>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
 #define IMGUI_DEFINE_MATH_OPERATORS
@@ -98,7 +101,8 @@ void Sample::resize(int width, int height)
 {
   assert(width == m_windowState.m_swapSize[0]);
   assert(height == m_windowState.m_swapSize[1]);
-  updateRendererImmediate(true, false);
+  // The next frame recreates the swapchain-sized resources.
+  m_swapchainSizeChanged = true;
 }
 
 bool Sample::mouse_pos(int x, int y)
@@ -147,53 +151,53 @@ bool Sample::begin()
   // Components that can change are handled by updateRendererFromState.
   m_ringFences.init(m_context);
   m_ringCmdPool.init(m_context, m_context.m_queueGCT.familyIndex, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT);
+  // One recording worker per core, for State::usesParallelRecording
+  m_recordingWorkers.init(std::max(1u, std::thread::hardware_concurrency()));
+  m_recordingCmdPools = std::vector<nvvk::RingCommandPool>(m_recordingWorkers.getNumWorkers());
+  for(nvvk::RingCommandPool& pool : m_recordingCmdPools)
+  {
+    pool.init(m_context, m_context.m_queueGCT.familyIndex, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT);
+  }
   m_submission.init(m_context.m_queueGCT.queue);
+  m_deferredDestroyer.init(m_ringFences.getCycleSize());
 
   createTextureSampler();
 
   m_allocatorDma.init(m_context.m_device, m_context.m_physicalDevice);
-  // Configure shader system (note that this also creates shader modules as we add them)
-  {
-    // Initialize shader system (this keeps track of shaders so that you can reload all of them at once):
-    m_shaderModuleManager.init(m_context);
-    // Add search paths for files and includes
-    m_shaderModuleManager.addDirectory("GLSL_" PROJECT_NAME);  // For when running in the install directory
-    m_shaderModuleManager.addDirectory(".");
-    m_shaderModuleManager.addDirectory(NVPSystem::exePath() + PROJECT_RELDIRECTORY);
-    m_shaderModuleManager.addDirectory(NVPSystem::exePath() + PROJECT_RELDIRECTORY + "..");
-    m_shaderModuleManager.addDirectory("..");     // for when working directory in Debug is $(ProjectDir)
-    m_shaderModuleManager.addDirectory("../..");  // for when using $(TargetDir)
-    m_shaderModuleManager.addDirectory("../shipped/" PROJECT_NAME);  // For when running from the bin_x64 directory on Linux
-    m_shaderModuleManager.addDirectory("../../shipped/" PROJECT_NAME);     // for when using $(TargetDir)
-    m_shaderModuleManager.addDirectory("../../../shipped/" PROJECT_NAME);  // for when using $(TargetDir) and build_all
-    // We have to manually set up paths to files we could include.
-    m_shaderModuleManager.registerInclude("common.h");
-    m_shaderModuleManager.registerInclude("oitColorDepthDefines.glsl");
-    m_shaderModuleManager.registerInclude("oitCompositeDefines.glsl");
-    m_shaderModuleManager.registerInclude("shaderCommon.glsl");
-  }
+  m_frameMemory.init(m_context.m_device, m_context.m_physicalDevice);
+  createUniformBuffer();
+  initSceneUpload();
+  // Configure shader system (see oitShaderCache.cpp)
+  initShaderSystem();
 
   // Call updateRendererImmediate to set up the rest of the renderer with the initial swapchain size:
   {
     updateRendererImmediate(true, true);
+    // Later scenes are built while rendering the previous one, but there's
+    // nothing to render before the first one is resident.
+    updateScene(true);
   }
 
+  // Optionally compile the shaders of all other permutations in the background
+  startShaderPrecompile();
+
   // Register enumerations with the Dear ImGui registry
   {
     m_imGuiRegistry.enumAdd(GUI_ALGORITHM, OIT_SIMPLE, "simple");
     m_imGuiRegistry.enumAdd(GUI_ALGORITHM, OIT_LINKEDLIST, "linkedlist");
     m_imGuiRegistry.enumAdd(GUI_ALGORITHM, OIT_LOOP, "loop32 two pass");
 
-    if(m_context.hasDeviceExtension(VK_KHR_SHADER_ATOMIC_INT64_EXTENSION_NAME))
+    if(isAlgorithmSupported(OIT_LOOP64))
     {
       m_imGuiRegistry.enumAdd(GUI_ALGORITHM, OIT_LOOP64, "loop64");
     }
     m_imGuiRegistry.enumAdd(GUI_ALGORITHM, OIT_SPINLOCK, "spinlock");
-    if(m_context.hasDeviceExtension(VK_EXT_FRAGMENT_SHADER_INTERLOCK_EXTENSION_NAME))
+    if(isAlgorithmSupported(OIT_INTERLOCK))
     {
       m_imGuiRegistry.enumAdd(GUI_ALGORITHM, OIT_INTERLOCK, "interlock");
     }
     m_imGuiRegistry.enumAdd(GUI_ALGORITHM, OIT_WEIGHTED, "weighted blend");
+    m_imGuiRegistry.enumAdd(GUI_ALGORITHM, OIT_MOMENTS, "moment-based");
 
     m_imGuiRegistry.enumAdd(GUI_OITSAMPLES, 1, "1");
     m_imGuiRegistry.enumAdd(GUI_OITSAMPLES, 2, "2");
@@ -208,6 +212,32 @@ bool Sample::begin()
     m_imGuiRegistry.enumAdd(GUI_AA, AA_SUPER_4X, "super 4x");
     m_imGuiRegistry.enumAdd(GUI_AA, AA_MSAA_8X, "msaa 8x pixel-shading");
     m_imGuiRegistry.enumAdd(GUI_AA, AA_SSAA_8X, "msaa 8x sample-shading");
+
+    m_imGuiRegistry.enumAdd(GUI_TILESIZE, 0, "off");
+    m_imGuiRegistry.enumAdd(GUI_TILESIZE, 256, "256");
+    m_imGuiRegistry.enumAdd(GUI_TILESIZE, 512, "512");
+    m_imGuiRegistry.enumAdd(GUI_TILESIZE, 1024, "1024");
+
+    m_imGuiRegistry.enumAdd(GUI_SORT, SORT_BUBBLE, "bubble");
+    m_imGuiRegistry.enumAdd(GUI_SORT, SORT_INSERTION, "insertion");
+    m_imGuiRegistry.enumAdd(GUI_SORT, SORT_NETWORK, "network");
+
+    m_imGuiRegistry.enumAdd(GUI_ABUFFER_LAYOUT, ABUFFER_LAYOUT_LAYERS, "layers");
+    m_imGuiRegistry.enumAdd(GUI_ABUFFER_LAYOUT, ABUFFER_LAYOUT_TILED, "tiled layers");
+    m_imGuiRegistry.enumAdd(GUI_ABUFFER_LAYOUT, ABUFFER_LAYOUT_PIXELS, "pixels");
+
+    m_imGuiRegistry.enumAdd(GUI_SHADING_RATE, SHADING_RATE_1X1, "1x1");
+    m_imGuiRegistry.enumAdd(GUI_SHADING_RATE, SHADING_RATE_1X2, "1x2");
+    m_imGuiRegistry.enumAdd(GUI_SHADING_RATE, SHADING_RATE_2X1, "2x1");
+    m_imGuiRegistry.enumAdd(GUI_SHADING_RATE, SHADING_RATE_2X2, "2x2");
+    m_imGuiRegistry.enumAdd(GUI_SHADING_RATE, SHADING_RATE_4X4, "4x4");
+
+    m_imGuiRegistry.enumAdd(GUI_SPINLOCK, SPIN_PLAIN, "spin");
+    m_imGuiRegistry.enumAdd(GUI_SPINLOCK, SPIN_BACKOFF, "backoff");
+    if(isFragmentBallotSupported())
+    {
+      m_imGuiRegistry.enumAdd(GUI_SPINLOCK, SPIN_SUBGROUP, "subgroup leader");
+    }
   }
 
   // Initialize camera
@@ -226,9 +256,90 @@ bool Sample::begin()
   m_frame     = 0;
   m_lastState = m_state;
 
+  // Start the benchmark if it was requested on the command line
+  benchmarkBegin();
+
   return true;  // Initialization succeeded
 }
 
+bool Sample::isGpuCullingSupported()
+{
+  return m_context.m_physicalInfo.features12.drawIndirectCount == VK_TRUE;
+}
+
+bool Sample::isComputeCompositeSupported()
+{
+  // oitComposite.comp.glsl sorts a power-of-two number of elements per
+  // invocation in shared memory; each element is a uvec3 with coverage
+  // shading (unless it's packed) and a uvec2 otherwise.
+  VkDeviceSize sortSize = 1;
+  while(sortSize < m_state.oitLayers)
+  {
+    sortSize *= 2;
+  }
+  const VkDeviceSize elementBytes = ((m_state.coverageShading() && !m_state.usesPackedABuffer()) ? 3 : 2) * sizeof(uint32_t);
+  const VkDeviceSize sharedBytes  = sortSize * elementBytes * COMPOSITE_WORKGROUP_SIZE * COMPOSITE_WORKGROUP_SIZE;
+  return sharedBytes <= m_context.m_physicalInfo.properties10.limits.maxComputeSharedMemorySize;
+}
+
+bool Sample::isFragmentBallotSupported()
+{
+  const VkPhysicalDeviceVulkan11Properties& properties11 = m_context.m_physicalInfo.properties11;
+  return ((properties11.subgroupSupportedStages & VK_SHADER_STAGE_FRAGMENT_BIT) != 0)
+         && ((properties11.subgroupSupportedOperations & VK_SUBGROUP_FEATURE_BALLOT_BIT) != 0);
+}
+
+bool Sample::isComputeResolveSupported()
+{
+  // resolve.comp.glsl writes m_guiCompositeImage without a format qualifier,
+  // since GLSL has none for BGRA formats.
+  VkFormatProperties formatProperties;
+  vkGetPhysicalDeviceFormatProperties(m_context.m_physicalDevice, m_guiCompositeColorFormat, &formatProperties);
+  return ((formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT) != 0)
+         && (m_context.m_physicalInfo.features10.shaderStorageImageWriteWithoutFormat == VK_TRUE);
+}
+
+bool Sample::isShadingRateSupported()
+{
+  // The extension requires pipelineFragmentShadingRate, which is all we use.
+  return m_context.hasDeviceExtension(VK_KHR_FRAGMENT_SHADING_RATE_EXTENSION_NAME);
+}
+
+bool Sample::isMeshShaderSupported()
+{
+  // We only enable the extension if it has both taskShader and meshShader.
+  return m_context.hasDeviceExtension(VK_EXT_MESH_SHADER_EXTENSION_NAME);
+}
+
+bool Sample::isMultiviewSupported()
+{
+  return (m_context.m_physicalInfo.features11.multiview == VK_TRUE)
+         && (m_context.m_physicalInfo.properties11.maxMultiviewViewCount >= OIT_MAX_VIEWS);
+}
+
+VkShaderStageFlags Sample::getSceneShaderStages()
+{
+  VkShaderStageFlags stages = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT;
+  if(isMeshShaderSupported())
+  {
+    stages |= VK_SHADER_STAGE_TASK_BIT_EXT | VK_SHADER_STAGE_MESH_BIT_EXT;
+  }
+  return stages;
+}
+
+bool Sample::isAlgorithmSupported(uint32_t algorithm)
+{
+  switch(algorithm)
+  {
+    case OIT_LOOP64:
+      return m_context.hasDeviceExtension(VK_KHR_SHADER_ATOMIC_INT64_EXTENSION_NAME);
+    case OIT_INTERLOCK:
+      return m_context.hasDeviceExtension(VK_EXT_FRAGMENT_SHADER_INTERLOCK_EXTENSION_NAME);
+    default:
+      return (algorithm < NUM_ALGORITHMS);
+  }
+}
+
 void Sample::updateRendererImmediate(bool swapchainSizeChanged, bool forceRebuildAll)
 {
   VkCommandBuffer cmd = createTempCmdBuffer();
@@ -240,11 +351,102 @@ void Sample::updateRendererImmediate(bool swapchainSizeChanged, bool forceRebuil
   vkDeviceWaitIdle(m_context);
   m_ringFences.reset();
   m_ringCmdPool.reset();
+  for(nvvk::RingCommandPool& pool : m_recordingCmdPools)
+  {
+    pool.reset();
+  }
+  // Nothing is in flight anymore, so retired objects can be destroyed now.
+  m_deferredDestroyer.releaseAll();
+}
+
+void Sample::retire(std::function<void()>&& destroy)
+{
+  // The current cycle's fence will be waited on again only after the frame
+  // that's currently being recorded (or was submitted last) has finished.
+  m_deferredDestroyer.retire(m_ringFences.getCycleIndex(), std::move(destroy));
+}
+
+void Sample::retireImage(ImageAndView& image)
+{
+  if(image.view != nullptr)
+  {
+    ImageAndView retired = image;
+    retire([this, retired]() mutable { retired.destroy(m_context, m_allocatorDma); });
+  }
+  image = ImageAndView();
+}
+
+void Sample::retireBuffer(BufferAndView& buffer)
+{
+  if(buffer.buffer.buffer != nullptr)
+  {
+    BufferAndView retired = buffer;
+    retire([this, retired]() mutable { retired.destroy(m_context, m_allocatorDma); });
+  }
+  buffer = BufferAndView();
+}
+
+void Sample::retireBuffer(nvvk::Buffer& buffer)
+{
+  if(buffer.buffer != nullptr)
+  {
+    nvvk::Buffer retired = buffer;
+    retire([this, retired]() mutable { m_allocatorDma.destroy(retired); });
+  }
+  buffer = nvvk::Buffer();
+}
+
+void Sample::retireBuffer(ReadbackRing& buffer)
+{
+  if(buffer.buffer.buffer != nullptr)
+  {
+    ReadbackRing retired = buffer;
+    retire([this, retired]() mutable { retired.destroy(m_allocatorDma); });
+  }
+  buffer = ReadbackRing();
 }
 
 void Sample::cmdUpdateRendererFromState(VkCommandBuffer cmdBuffer, bool swapchainSizeChanged, bool forceRebuildAll)
 {
   m_state.recomputeAntialiasingSettings();
+  if(!isGpuCullingSupported())
+  {
+    m_state.gpuCulling = false;
+  }
+  if(!isComputeCompositeSupported())
+  {
+    m_state.computeComposite = false;
+  }
+  if((m_state.spinlockStrategy >= NUM_SPIN_STRATEGIES)
+     || ((m_state.spinlockStrategy == SPIN_SUBGROUP) && !isFragmentBallotSupported()))
+  {
+    m_state.spinlockStrategy = SPIN_PLAIN;
+  }
+  if(!isFragmentBallotSupported())
+  {
+    m_state.linkedListSubgroupAlloc = false;
+  }
+  if(m_state.aBufferLayout >= NUM_ABUFFER_LAYOUTS)
+  {
+    m_state.aBufferLayout = ABUFFER_LAYOUT_LAYERS;
+  }
+  if(!isComputeResolveSupported())
+  {
+    m_state.computeResolve = false;
+  }
+  m_state.recordingThreads = std::min(m_state.recordingThreads, m_recordingWorkers.getNumWorkers());
+  if((m_state.shadingRate >= NUM_SHADING_RATES) || !isShadingRateSupported())
+  {
+    m_state.shadingRate = SHADING_RATE_1X1;
+  }
+  if(!isMeshShaderSupported())
+  {
+    m_state.meshShaders = false;
+  }
+  if(!isMultiviewSupported())
+  {
+    m_state.multiview = false;
+  }
 
   // Determine what needs to be rebuilt
   swapchainSizeChanged |= forceRebuildAll;
@@ -257,12 +459,29 @@ void Sample::cmdUpdateRendererFromState(VkCommandBuffer cmdBuffer, bool swapchai
                                  || (m_state.interlockIsOrdered != m_lastState.interlockIsOrdered)  //
                                  || (m_state.msaa != m_lastState.msaa)                              //
                                  || (m_state.sampleShading != m_lastState.sampleShading)            //
+                                 || (m_state.gpuCulling != m_lastState.gpuCulling)                  //
+                                 || (m_state.usesFrontToBack() != m_lastState.usesFrontToBack())    //
+                                 || (m_state.instancedScene != m_lastState.instancedScene)          //
+                                 || (m_state.usesComputeComposite() != m_lastState.usesComputeComposite())  //
+                                 || (m_state.sortStrategy != m_lastState.sortStrategy)              //
+                                 || (m_state.countsFragments() != m_lastState.countsFragments())    //
+                                 || (m_state.usesAdaptiveLayers() != m_lastState.usesAdaptiveLayers())  //
+                                 || (m_state.usesPackedABuffer() != m_lastState.usesPackedABuffer())  //
+                                 || (m_state.usesMLAB() != m_lastState.usesMLAB())                  //
+                                 || (m_state.spinlockStrategy != m_lastState.spinlockStrategy)      //
+                                 || (m_state.usesSubgroupAlloc() != m_lastState.usesSubgroupAlloc())  //
+                                 || (m_state.activeABufferLayout() != m_lastState.activeABufferLayout())  //
+                                 || (m_state.usesFrameTags() != m_lastState.usesFrameTags())        //
+                                 || (m_state.computeResolve != m_lastState.computeResolve)          //
+                                 || (m_state.usesMeshShaders() != m_lastState.usesMeshShaders())    //
+                                 || (m_state.usesMultiview() != m_lastState.usesMultiview())        //
                                  || forceRebuildAll;
 
   const bool sceneNeedsReinit = (m_state.numObjects != m_lastState.numObjects)     //
                                 || (m_state.scaleWidth != m_lastState.scaleWidth)  //
                                 || (m_state.scaleMin != m_lastState.scaleMin)      //
                                 || (m_state.subdiv != m_lastState.subdiv)          //
+                                || (m_state.instancedScene != m_lastState.instancedScene)  //
                                 || forceRebuildAll;
 
   const bool imagesNeedReinit = (m_state.supersample != m_lastState.supersample)         //
@@ -272,6 +491,16 @@ void Sample::cmdUpdateRendererFromState(VkCommandBuffer cmdBuffer, bool swapchai
                                 || (m_state.oitLayers != m_lastState.oitLayers)          //
                                 || ((m_state.algorithm == OIT_LINKEDLIST)
                                     && (m_state.linkedListAllocatedPerElement != m_lastState.linkedListAllocatedPerElement))  //
+                                || ((m_state.algorithm == OIT_LINKEDLIST)
+                                    && (m_state.linkedListAdaptive != m_lastState.linkedListAdaptive))  //
+                                || (m_state.tileSize != m_lastState.tileSize)                           //
+                                || (m_state.gpuCulling != m_lastState.gpuCulling)                       //
+                                || (m_state.usesComputeComposite() != m_lastState.usesComputeComposite())  //
+                                || (m_state.countsFragments() != m_lastState.countsFragments())         //
+                                || (m_state.usesPackedABuffer() != m_lastState.usesPackedABuffer())     //
+                                || (m_state.activeABufferLayout() != m_lastState.activeABufferLayout())  //
+                                || (m_state.computeResolve != m_lastState.computeResolve)               //
+                                || (m_state.usesMultiview() != m_lastState.usesMultiview())             //
                                 || swapchainSizeChanged  //
                                 || forceRebuildAll;
 
@@ -279,33 +508,48 @@ void Sample::cmdUpdateRendererFromState(VkCommandBuffer cmdBuffer, bool swapchai
                                         || ((m_state.algorithm != OIT_LOOP64) && (m_lastState.algorithm == OIT_LOOP64))  //
                                         || forceRebuildAll;
 
-  const bool framebuffersAndDescriptorsNeedReinit = imagesNeedReinit  //
-                                                    || vsyncChanged   //
-                                                    || forceRebuildAll;
-
   const bool renderPassesNeedReinit = (m_state.msaa != m_lastState.msaa)  //
+                                      || (m_state.usesTransparentSubpasses() != m_lastState.usesTransparentSubpasses())  //
+                                      || (m_state.usesTransparentSubpasses()
+                                          && (m_state.numTransparentPasses() != m_lastState.numTransparentPasses()))  //
+                                      || (m_state.usesMultiview() != m_lastState.usesMultiview())  //
                                       || forceRebuildAll;
 
+  // The descriptor sets also reference the scene's culling buffers, but
+  // updateScene updates them once the new scene is resident. Framebuffers
+  // can only be used with the render passes they were created for.
+  const bool framebuffersAndDescriptorsNeedReinit = imagesNeedReinit           //
+                                                    || vsyncChanged            //
+                                                    || renderPassesNeedReinit  //
+                                                    || forceRebuildAll;
+
+  // The shading rate is part of the pipelines (see createGraphicsPipeline).
+  const bool shadingRateChanged = (m_state.activeShadingRate() != m_lastState.activeShadingRate());
+
   const bool pipelinesNeedReinit = (m_state.algorithm != m_lastState.algorithm)  //
-                                   || shadersNeedUpdate || imagesNeedReinit;
+                                   || shadersNeedUpdate || imagesNeedReinit || renderPassesNeedReinit || shadingRateChanged;
 
   const bool anythingChanged = shadersNeedUpdate || sceneNeedsReinit || imagesNeedReinit || descriptorSetsNeedReinit
-                               || framebuffersAndDescriptorsNeedReinit || renderPassesNeedReinit;
+                               || framebuffersAndDescriptorsNeedReinit || renderPassesNeedReinit || shadingRateChanged;
 
   if(anythingChanged)
   {
-    vkDeviceWaitIdle(m_context);
     LOGI("framebuffer: %d x %d (%d msaa)\n", m_windowState.m_swapSize[0], m_windowState.m_swapSize[1], m_state.msaa);
 
     if(vsyncChanged || swapchainSizeChanged)
     {
       m_swapChain.cmdUpdateBarriers(cmdBuffer);
-      createUniformBuffers();
     }
 
     if(sceneNeedsReinit)
     {
-      initScene(cmdBuffer);
+      initScene();
+      // The new pipelines' vertex input only matches the new scene, so it
+      // can't keep rendering the old one.
+      if((m_state.instancedScene != m_lastState.instancedScene) && !forceRebuildAll)
+      {
+        updateScene(true);
+      }
     }
 
     if(imagesNeedReinit)
@@ -341,12 +585,15 @@ void Sample::cmdUpdateRendererFromState(VkCommandBuffer cmdBuffer, bool swapchai
 
     setUpViewportsAndScissors();
     m_lastVsync = getVsync();
+    // New images and shaders don't understand the old frame tags.
+    m_frameTag = 0;
   }
 }
 
 void Sample::end()
 {
   vkDeviceWaitIdle(m_context);
+  stopShaderPrecompile();
   m_profilerVK.deinit();
 
   ImGui::ShutdownVK();
@@ -354,25 +601,38 @@ void Sample::end()
 
   // From updateRendererFromState
   destroyGraphicsPipelines();
+  destroyPipelineCache();
   m_shaderModuleManager.deinit();
   destroyFramebuffers();
   destroyNonGUIRenderPasses();
   destroyGUIRenderPass();
   destroyDescriptorSets();
   destroyFrameImages();
+  destroySceneUpload();
   destroyScene();
-  destroyUniformBuffers();
+  destroyUniformBuffer();
+  retireBuffer(m_benchmarkCapture);
+  // The device is idle, so destroy everything that was retired above.
+  m_deferredDestroyer.releaseAll();
   // From begin
+  m_frameMemory.deinit();
   m_allocatorDma.deinit();
 
   destroyTextureSampler();
   m_ringCmdPool.deinit();
+  for(nvvk::RingCommandPool& pool : m_recordingCmdPools)
+  {
+    pool.deinit();
+  }
+  m_recordingCmdPools.clear();
+  m_recordingWorkers.deinit();
   m_ringFences.deinit();
 }
 
 void Sample::destroyTextureSampler()
 {
   vkDestroySampler(m_context, m_pointSampler, nullptr);
+  vkDestroySampler(m_context, m_nearestSampler, nullptr);
 }
 
 void Sample::createTextureSampler()
@@ -391,126 +651,515 @@ void Sample::createTextureSampler()
   samplerInfo.mipmapMode              = VK_SAMPLER_MIPMAP_MODE_NEAREST;
 
   NVVK_CHECK(vkCreateSampler(m_context, &samplerInfo, nullptr, &m_pointSampler));
+
+  // Create a nearest-neighbor sampler for reading depth and Hi-Z texels
+  samplerInfo.magFilter    = VK_FILTER_NEAREST;
+  samplerInfo.minFilter    = VK_FILTER_NEAREST;
+  samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerInfo.maxLod       = VK_LOD_CLAMP_NONE;
+
+  NVVK_CHECK(vkCreateSampler(m_context, &samplerInfo, nullptr, &m_nearestSampler));
 }
 
-void Sample::destroyUniformBuffers()
+void Sample::destroyUniformBuffer()
 {
-  for(nvvk::Buffer& uniformBuffer : m_uniformBuffers)
+  if(m_uniformBufferMapped != nullptr)
   {
-    m_allocatorDma.destroy(uniformBuffer);
+    m_allocatorDma.unmap(m_uniformBuffer);
+    m_uniformBufferMapped = nullptr;
   }
+  retireBuffer(m_uniformBuffer);
 }
 
-void Sample::createUniformBuffers()
+void Sample::createUniformBuffer()
 {
-  destroyUniformBuffers();
-
-  VkDeviceSize bufferSize = sizeof(SceneData);
+  destroyUniformBuffer();
 
-  m_uniformBuffers.resize(m_swapChain.getImageCount());
+  // Dynamic offsets must be multiples of minUniformBufferOffsetAlignment,
+  // which is a power of two.
+  const VkDeviceSize alignment = m_context.m_physicalInfo.properties10.limits.minUniformBufferOffsetAlignment;
+  m_uniformBufferStride        = (sizeof(SceneData) + alignment - 1) & ~(alignment - 1);
 
-  for(uint32_t i = 0; i < m_swapChain.getImageCount(); i++)
-  {
-    m_uniformBuffers[i] = m_allocatorDma.createBuffer(bufferSize,                          // Buffer size
-                                                      VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,  // Usage
-                                                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT  // Memory flags
-    );
-  }
+  m_uniformBuffer = m_allocatorDma.createBuffer(m_uniformBufferStride * m_ringFences.getCycleSize(),  // Buffer size
+                                                VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,                   // Usage
+                                                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT  // Memory flags
+  );
+  m_debug.setObjectName(m_uniformBuffer.buffer, "m_uniformBuffer");
+  // The memory is host-coherent, so writes don't need to be flushed.
+  m_uniformBufferMapped = static_cast<uint8_t*>(m_allocatorDma.map(m_uniformBuffer));
 }
 
 void Sample::destroyScene()
 {
-  m_allocatorDma.destroy(m_indexBuffer);
-  m_allocatorDma.destroy(m_vertexBuffer);
+  retireBuffer(m_indexBuffer);
+  retireBuffer(m_vertexBuffer);
+  retireBuffer(m_instanceColorBuffer);
+  retireBuffer(m_objectBoundsBuffer);
+  retireBuffer(m_drawCommandsBuffer);
+  retireBuffer(m_drawCountsBuffer);
+  retireBuffer(m_sortKeysBuffer);
+  retireBuffer(m_sortBucketsBuffer);
 }
 
-void Sample::initScene(VkCommandBuffer commandBuffer)
+// A seed for each object's random engine, derived from the fixed seed.
+// Hashing the object index avoids the correlation between the sequences of
+// consecutive seeds of std::default_random_engine.
+static uint32_t getObjectSeed(uint32_t object)
+{
+  uint32_t h = object * 0x9E3779B9u + 3625u;  // Fixed seed
+  h ^= h >> 16;
+  h *= 0x7FEB352Du;
+  h ^= h >> 15;
+  h *= 0x846CA68Bu;
+  h ^= h >> 16;
+  return h;
+}
+
+// Generates the scene for the given settings, using all cores. Each object is
+// written to its own range of the preallocated arrays using its own random
+// engine, so the result doesn't depend on how the objects are split between
+// threads.
+static void generateScene(SceneGeometry& geometry, uint32_t numObjects, uint32_t subdiv, float scaleMin, float scaleWidth, bool instanced)
 {
-  destroyScene();
   // A Mesh consists of vectors of vertices, triangle list indices, and lines.
   // It assumes that its type contains variables, at least, each vertex's position, normal, and color.
   // (We'll ignore lines when converting this to a vertex and index buffer.)
-  nvh::geometry::Mesh<Vertex> completeMesh;
+  // Every object is a scaled and translated copy of this unit sphere.
+  nvh::geometry::Mesh<Vertex> sphere;
+  nvh::geometry::Sphere<Vertex>::add(sphere, glm::mat4(1.f), subdiv * 2, subdiv);
+
+  const uint32_t  sphereVertices = sphere.getVerticesCount();
+  const uint32_t  sphereIndices  = sphere.getTriangleIndicesCount();
+  const uint32_t* sphereIndexData = reinterpret_cast<const uint32_t*>(sphere.m_indicesTriangles.data());
+
+  geometry.objectTriangleIndices = sphereIndices;
+  geometry.subdiv                = subdiv;
+  geometry.instanced             = instanced;
+  geometry.objectBounds.resize(numObjects);
+  if(instanced)
+  {
+    // The instances transform and color the sphere in object.vert.glsl.
+    geometry.vertices = sphere.m_vertices;
+    geometry.indices.assign(sphereIndexData, sphereIndexData + sphereIndices);
+    geometry.instanceColors.resize(numObjects);
+  }
+  else
+  {
+    geometry.vertices.resize(static_cast<size_t>(numObjects) * sphereVertices);
+    geometry.indices.resize(static_cast<size_t>(numObjects) * sphereIndices);
+  }
+
+  auto generateObjects = [&](uint32_t firstObject, uint32_t endObject) {
+    std::uniform_real_distribution<float> uniformDist;
+    for(uint32_t i = firstObject; i < endObject; i++)
+    {
+      std::default_random_engine rnd(getObjectSeed(i));
+
+      // Generate a random position in [-GLOBAL_SCALE/2, GLOBAL_SCALE/2)^3
+      glm::vec3 center(uniformDist(rnd), uniformDist(rnd), uniformDist(rnd));
+      center = (center - glm::vec3(0.5)) * GLOBAL_SCALE;
+
+      // Generate a random radius
+      float radius = GLOBAL_SCALE * 0.9f / GRID_SIZE;
+      radius *= uniformDist(rnd) * scaleWidth + scaleMin;
+
+      geometry.objectBounds[i] = glm::vec4(center, radius);
+
+      // Color in unpremultiplied linear space
+      glm::vec4 color(uniformDist(rnd), uniformDist(rnd), uniformDist(rnd), uniformDist(rnd));
+      color.x *= color.x;
+      color.y *= color.y;
+      color.z *= color.z;
+
+      if(instanced)
+      {
+        geometry.instanceColors[i] = color;
+        continue;
+      }
+
+      // Scale, translate, and color the sphere. The scale is uniform, so the
+      // normals stay the same.
+      Vertex* vertices = &geometry.vertices[static_cast<size_t>(i) * sphereVertices];
+      for(uint32_t v = 0; v < sphereVertices; v++)
+      {
+        vertices[v].pos    = center + radius * sphere.m_vertices[v].pos;
+        vertices[v].normal = sphere.m_vertices[v].normal;
+        vertices[v].color  = color;
+      }
+
+      uint32_t*      indices     = &geometry.indices[static_cast<size_t>(i) * sphereIndices];
+      const uint32_t firstVertex = i * sphereVertices;
+      for(uint32_t t = 0; t < sphereIndices; t++)
+      {
+        indices[t] = sphereIndexData[t] + firstVertex;
+      }
+    }
+  };
+
+  const uint32_t numThreads       = std::max(1u, std::min(std::thread::hardware_concurrency(), numObjects));
+  const uint32_t objectsPerThread = (numObjects + numThreads - 1) / numThreads;
+
+  std::vector<std::thread> threads;
+  for(uint32_t t = 1; t < numThreads; t++)
+  {
+    const uint32_t firstObject = std::min(t * objectsPerThread, numObjects);
+    const uint32_t endObject   = std::min(firstObject + objectsPerThread, numObjects);
+    threads.emplace_back(generateObjects, firstObject, endObject);
+  }
+  generateObjects(0, std::min(objectsPerThread, numObjects));
+  for(std::thread& thread : threads)
+  {
+    thread.join();
+  }
+}
+
+void Sample::initScene()
+{
+  if(isSceneBuilding())
+  {
+    // updateScene starts over once the current build has finished.
+    m_sceneRequested = true;
+    return;
+  }
 
-  // We'll use C++11-style random number generation here, but you could also do this
-  // with rand() and srand().
-  std::default_random_engine            rnd(3625);  // Fixed seed
-  std::uniform_real_distribution<float> uniformDist;
+  m_sceneRequested = false;
+  m_sceneGenerated = false;
+  m_sceneThread    = std::thread([this, numObjects = m_state.numObjects, subdiv = m_state.subdiv, scaleMin = m_state.scaleMin,
+                               scaleWidth = m_state.scaleWidth, instanced = m_state.instancedScene]() {
+    generateScene(m_sceneGeometry, numObjects, subdiv, scaleMin, scaleWidth, instanced);
+    m_sceneGenerated = true;
+  });
+}
+
+void Sample::initSceneUpload()
+{
+  m_sceneStaging.init(m_allocatorDma.getMemoryAllocator());
+
+  VkCommandPoolCreateInfo poolInfo = {VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
+  poolInfo.flags                   = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  poolInfo.queueFamilyIndex        = m_context.m_queueT.familyIndex;
+  NVVK_CHECK(vkCreateCommandPool(m_context, &poolInfo, nullptr, &m_sceneUploadCmdPool));
+
+  // Timeline semaphores are core in Vulkan 1.2.
+  VkSemaphoreTypeCreateInfo timelineInfo = {VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO};
+  timelineInfo.semaphoreType             = VK_SEMAPHORE_TYPE_TIMELINE;
+  timelineInfo.initialValue              = 0;
+  VkSemaphoreCreateInfo semaphoreInfo    = {VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO};
+  semaphoreInfo.pNext                    = &timelineInfo;
+  NVVK_CHECK(vkCreateSemaphore(m_context, &semaphoreInfo, nullptr, &m_sceneUploadSemaphore));
+  m_debug.setObjectName(m_sceneUploadSemaphore, "m_sceneUploadSemaphore");
+  m_sceneUploadValue = 0;
+}
+
+void Sample::destroySceneUpload()
+{
+  // The device is idle; finish generating a scene so that its thread can be joined.
+  if(m_sceneThread.joinable())
+  {
+    m_sceneThread.join();
+  }
+  m_sceneGeometry = SceneGeometry();
 
-  for(uint32_t i = 0; i < m_state.numObjects; i++)
+  for(nvvk::Buffer* buffer : {&m_pendingScene.vertices, &m_pendingScene.indices, &m_pendingScene.objectBounds,
+                              &m_pendingScene.instanceColors, &m_pendingScene.drawCommands, &m_pendingScene.drawCounts,
+                              &m_pendingScene.sortKeys, &m_pendingScene.sortBuckets})
   {
-    // Generate a random position in [-GLOBAL_SCALE/2, GLOBAL_SCALE/2)^3
-    glm::vec3 center(uniformDist(rnd), uniformDist(rnd), uniformDist(rnd));
-    center = (center - glm::vec3(0.5)) * GLOBAL_SCALE;
+    m_allocatorDma.destroy(*buffer);
+  }
+  m_sceneUploading = false;
+
+  m_sceneUploadChunks.clear();
+  m_sceneStaging.deinit();
+  vkDestroyCommandPool(m_context, m_sceneUploadCmdPool, nullptr);  // Also frees the chunks' command buffers
+  m_sceneUploadCmdPool = nullptr;
+  vkDestroySemaphore(m_context, m_sceneUploadSemaphore, nullptr);
+  m_sceneUploadSemaphore = nullptr;
+}
 
-    // Generate a random radius
-    float radius = GLOBAL_SCALE * 0.9f / GRID_SIZE;
-    radius *= uniformDist(rnd) * m_state.scaleWidth + m_state.scaleMin;
+void Sample::updateScene(bool waitUntilResident)
+{
+  // The most bytes a frame submits to the transfer queue, and the most chunks
+  // in flight. This bounds the staging memory and the per-frame CPU time.
+  const VkDeviceSize maxChunkBytes  = 64 * 1024 * 1024;
+  const size_t       maxChunksInFlight = 4;
 
-    // Our vectors are vertical, so this represents a scale followed by a translation:
-    glm::mat4 matrix = glm::translate(glm::mat4(1.f), center) * glm::scale(glm::mat4(1.f), glm::vec3(radius));
+  const bool separateTransferFamily = (m_context.m_queueT.familyIndex != m_context.m_queueGCT.familyIndex);
 
-    // Add a sphere to the complete mesh, and then color it:
-    const uint32_t vtxStart = completeMesh.getVerticesCount();  // First vertex to color
+  do
+  {
+    // Release the staging memory of the chunks that have finished
+    uint64_t finishedValue = 0;
+    NVVK_CHECK(vkGetSemaphoreCounterValue(m_context, m_sceneUploadSemaphore, &finishedValue));
+    while(!m_sceneUploadChunks.empty() && m_sceneUploadChunks.front().timelineValue <= finishedValue)
+    {
+      m_sceneStaging.releaseResourceSet(m_sceneUploadChunks.front().stagingSet);
+      vkFreeCommandBuffers(m_context, m_sceneUploadCmdPool, 1, &m_sceneUploadChunks.front().cmdBuffer);
+      m_sceneUploadChunks.erase(m_sceneUploadChunks.begin());
+    }
 
-    nvh::geometry::Sphere<Vertex>::add(completeMesh, matrix, m_state.subdiv * 2, m_state.subdiv);
+    // Once the geometry has been generated, create the buffers to upload it to
+    if(!m_sceneUploading && m_sceneThread.joinable() && (m_sceneGenerated || waitUntilResident))
+    {
+      m_sceneThread.join();
+      if(m_sceneRequested)
+      {
+        // The settings changed while generating; this scene is out of date.
+        initScene();
+        continue;
+      }
+
+      const SceneGeometry& geometry = m_sceneGeometry;
+      const uint32_t       numObjects = static_cast<uint32_t>(geometry.objectBounds.size());
+
+      m_pendingScene.vertices =
+          m_allocatorDma.createBuffer(geometry.vertices.size() * sizeof(Vertex),
+                                      VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+      m_debug.setObjectName(m_pendingScene.vertices.buffer, "m_vertexBuffer");
+      m_pendingScene.indices =
+          m_allocatorDma.createBuffer(geometry.indices.size() * sizeof(uint32_t),
+                                      VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+      m_debug.setObjectName(m_pendingScene.indices.buffer, "m_indexBuffer");
+
+      if(geometry.instanced)
+      {
+        // The mesh shaders read the colors from a storage buffer.
+        m_pendingScene.instanceColors =
+            m_allocatorDma.createBuffer(geometry.instanceColors.size() * sizeof(glm::vec4),
+                                        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+                                            | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+        m_debug.setObjectName(m_pendingScene.instanceColors.buffer, "m_instanceColorBuffer");
+      }
+
+      // Create the buffers used for GPU culling. The culling shader overwrites
+      // the draw commands and counts each frame. The instanced scene also reads
+      // the bounding spheres as per-instance vertex attributes.
+      m_pendingScene.objectBounds =
+          m_allocatorDma.createBuffer(geometry.objectBounds.size() * sizeof(glm::vec4),
+                                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT
+                                          | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+      m_debug.setObjectName(m_pendingScene.objectBounds.buffer, "m_objectBoundsBuffer");
+
+      m_pendingScene.drawCommands = m_allocatorDma.createBuffer(sizeof(VkDrawIndexedIndirectCommand) * numObjects,
+                                                                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT);
+      m_debug.setObjectName(m_pendingScene.drawCommands.buffer, "m_drawCommandsBuffer");
+
+      m_pendingScene.drawCounts = m_allocatorDma.createBuffer(sizeof(uint32_t) * NUM_CULL_REGIONS,
+                                                              VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT
+                                                                  | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+      m_debug.setObjectName(m_pendingScene.drawCounts.buffer, "m_drawCountsBuffer");
+
+      // Front-to-back ordering sorts the visible transparent objects through
+      // these (see cull.comp.glsl).
+      m_pendingScene.sortKeys = m_allocatorDma.createBuffer(sizeof(glm::uvec2) * numObjects, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+      m_debug.setObjectName(m_pendingScene.sortKeys.buffer, "m_sortKeysBuffer");
+
+      m_pendingScene.sortBuckets = m_allocatorDma.createBuffer(sizeof(uint32_t) * 2 * OBJECT_SORT_BUCKETS,
+                                                               VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+      m_debug.setObjectName(m_pendingScene.sortBuckets.buffer, "m_sortBucketsBuffer");
+
+      m_sceneUploading    = true;
+      m_sceneUploadRegion = 0;
+      m_sceneUploadOffset = 0;
+    }
 
-    if(i == 0)
+    if(!m_sceneUploading)
     {
-      m_objectTriangleIndices = completeMesh.getTriangleIndicesCount();
+      continue;
     }
 
-    // Color in unpremultiplied linear space
-    glm::vec4 color(uniformDist(rnd), uniformDist(rnd), uniformDist(rnd), uniformDist(rnd));
-    color.x *= color.x;
-    color.y *= color.y;
-    color.z *= color.z;
-    uint32_t vtxEnd = completeMesh.getVerticesCount();
-    for(uint32_t v = vtxStart; v < vtxEnd; v++)
+    // The regions of m_sceneGeometry to upload, in order; the instance colors
+    // are empty unless the scene is instanced.
+    const std::array<VkBuffer, 4> regionBuffers = {m_pendingScene.vertices.buffer, m_pendingScene.indices.buffer,
+                                                   m_pendingScene.objectBounds.buffer, m_pendingScene.instanceColors.buffer};
+    const std::array<const void*, 4>  regionData  = {m_sceneGeometry.vertices.data(), m_sceneGeometry.indices.data(),
+                                                   m_sceneGeometry.objectBounds.data(), m_sceneGeometry.instanceColors.data()};
+    const std::array<VkDeviceSize, 4> regionSizes = {m_sceneGeometry.vertices.size() * sizeof(Vertex),
+                                                     m_sceneGeometry.indices.size() * sizeof(uint32_t),
+                                                     m_sceneGeometry.objectBounds.size() * sizeof(glm::vec4),
+                                                     m_sceneGeometry.instanceColors.size() * sizeof(glm::vec4)};
+    // The buffers the transfer queue writes, for the queue family ownership transfer
+    std::vector<VkBufferMemoryBarrier> ownershipBarriers;
+    for(size_t i = 0; i < regionBuffers.size(); i++)
     {
-      completeMesh.m_vertices[v].color = color;
+      if(separateTransferFamily && regionSizes[i] > 0)
+      {
+        VkBufferMemoryBarrier barrier = {VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER};
+        barrier.srcQueueFamilyIndex   = m_context.m_queueT.familyIndex;
+        barrier.dstQueueFamilyIndex   = m_context.m_queueGCT.familyIndex;
+        barrier.buffer                = regionBuffers[i];
+        barrier.size                  = VK_WHOLE_SIZE;
+        ownershipBarriers.push_back(barrier);
+      }
     }
-  }
 
-  // Count the total number of triangle indices
-  m_sceneTriangleIndices = completeMesh.getTriangleIndicesCount();
+    if(m_sceneUploadRegion < regionBuffers.size())
+    {
+      // Stream the next chunk, unless too many are in flight already
+      if(m_sceneUploadChunks.size() >= maxChunksInFlight)
+      {
+        if(waitUntilResident)
+        {
+          VkSemaphoreWaitInfo waitInfo = {VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO};
+          waitInfo.semaphoreCount      = 1;
+          waitInfo.pSemaphores         = &m_sceneUploadSemaphore;
+          waitInfo.pValues             = &m_sceneUploadChunks.front().timelineValue;
+          NVVK_CHECK(vkWaitSemaphores(m_context, &waitInfo, UINT64_MAX));
+        }
+        continue;
+      }
+
+      VkCommandBufferAllocateInfo allocInfo = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
+      allocInfo.commandPool                 = m_sceneUploadCmdPool;
+      allocInfo.level                       = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+      allocInfo.commandBufferCount          = 1;
+      VkCommandBuffer cmd                   = nullptr;
+      NVVK_CHECK(vkAllocateCommandBuffers(m_context, &allocInfo, &cmd));
+      VkCommandBufferBeginInfo beginInfo = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+      beginInfo.flags                    = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+      NVVK_CHECK(vkBeginCommandBuffer(cmd, &beginInfo));
+
+      VkDeviceSize chunkBytes = 0;
+      while(m_sceneUploadRegion < regionBuffers.size() && chunkBytes < maxChunkBytes)
+      {
+        const VkDeviceSize size =
+            std::min(regionSizes[m_sceneUploadRegion] - m_sceneUploadOffset, maxChunkBytes - chunkBytes);
+        if(size > 0)
+        {
+          m_sceneStaging.cmdToBuffer(cmd, regionBuffers[m_sceneUploadRegion], m_sceneUploadOffset, size,
+                                     static_cast<const char*>(regionData[m_sceneUploadRegion]) + m_sceneUploadOffset);
+        }
+        chunkBytes += size;
+        m_sceneUploadOffset += size;
+        // Move on to the next region that isn't empty
+        while(m_sceneUploadRegion < regionBuffers.size() && m_sceneUploadOffset == regionSizes[m_sceneUploadRegion])
+        {
+          m_sceneUploadRegion++;
+          m_sceneUploadOffset = 0;
+        }
+      }
+
+      if(m_sceneUploadRegion == regionBuffers.size() && !ownershipBarriers.empty())
+      {
+        // Release the buffers to the graphics queue family; updateScene
+        // acquires them below.
+        for(VkBufferMemoryBarrier& release : ownershipBarriers)
+        {
+          release.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        }
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr,
+                             static_cast<uint32_t>(ownershipBarriers.size()), ownershipBarriers.data(), 0, nullptr);
+      }
+      NVVK_CHECK(vkEndCommandBuffer(cmd));
+
+      m_sceneUploadValue++;
+      VkTimelineSemaphoreSubmitInfo timelineInfo = {VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO};
+      timelineInfo.signalSemaphoreValueCount     = 1;
+      timelineInfo.pSignalSemaphoreValues        = &m_sceneUploadValue;
+      VkSubmitInfo submitInfo                    = {VK_STRUCTURE_TYPE_SUBMIT_INFO};
+      submitInfo.pNext                           = &timelineInfo;
+      submitInfo.commandBufferCount              = 1;
+      submitInfo.pCommandBuffers                 = &cmd;
+      submitInfo.signalSemaphoreCount            = 1;
+      submitInfo.pSignalSemaphores               = &m_sceneUploadSemaphore;
+      NVVK_CHECK(vkQueueSubmit(m_context.m_queueT.queue, 1, &submitInfo, VK_NULL_HANDLE));
+
+      m_sceneUploadChunks.push_back({m_sceneUploadValue, m_sceneStaging.finalizeResources(), cmd});
+      continue;
+    }
 
-  // Create the vertex and index buffers and synchronously upload them to the
-  // GPU, waiting for them to finish uploading. Note that applications may wish
-  // to implement asynchronous uploads, which you can see how to do in the
-  // vk_async_resources sample.
+    // Everything has been submitted; wait for the transfer queue to finish
+    if(waitUntilResident)
+    {
+      VkSemaphoreWaitInfo waitInfo = {VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO};
+      waitInfo.semaphoreCount      = 1;
+      waitInfo.pSemaphores         = &m_sceneUploadSemaphore;
+      waitInfo.pValues             = &m_sceneUploadValue;
+      NVVK_CHECK(vkWaitSemaphores(m_context, &waitInfo, UINT64_MAX));
+    }
+    else if(finishedValue < m_sceneUploadValue)
+    {
+      continue;
+    }
 
-  nvvk::StagingMemoryManager scopedTransfer(m_allocatorDma.getMemoryAllocator());
-  {
-    // When this goes out of scope, it'll synchronously perform all of the copy operations.
-    // 'scopedTransfer' can then safely go out of scope after it.
-    nvvk::ScopeCommandBuffer cmd(m_context, m_context.m_queueT, m_context.m_queueT);
-
-    // Create vertex buffer
-    VkDeviceSize vtxBufferSize = static_cast<VkDeviceSize>(completeMesh.getVerticesSize());
-    m_vertexBuffer             = m_allocatorDma.createBuffer(vtxBufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
-    scopedTransfer.cmdToBuffer(cmd, m_vertexBuffer.buffer, 0, vtxBufferSize, completeMesh.m_vertices.data());
-    m_debug.setObjectName(m_vertexBuffer.buffer, "m_vertexBuffer");
-
-    VkDeviceSize idxBufferSize = static_cast<VkDeviceSize>(completeMesh.getTriangleIndicesSize());
-    m_indexBuffer              = m_allocatorDma.createBuffer(idxBufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
-    scopedTransfer.cmdToBuffer(cmd, m_indexBuffer.buffer, 0, idxBufferSize, completeMesh.m_indicesTriangles.data());
-    m_debug.setObjectName(m_indexBuffer.buffer, "m_indexBuffer");
-  }
+    // Make later submissions to the graphics queue wait on the upload; with a
+    // separate transfer queue family, this also acquires the buffers.
+    {
+      VkCommandBuffer acquireCmd = nullptr;
+      if(!ownershipBarriers.empty())
+      {
+        acquireCmd = m_ringCmdPool.createCommandBuffer();
+        for(VkBufferMemoryBarrier& acquire : ownershipBarriers)
+        {
+          acquire.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+        }
+        vkCmdPipelineBarrier(acquireCmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                             VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr,
+                             static_cast<uint32_t>(ownershipBarriers.size()), ownershipBarriers.data(), 0, nullptr);
+        NVVK_CHECK(vkEndCommandBuffer(acquireCmd));
+      }
+
+      const VkPipelineStageFlags    waitStage    = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+      VkTimelineSemaphoreSubmitInfo timelineInfo = {VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO};
+      timelineInfo.waitSemaphoreValueCount       = 1;
+      timelineInfo.pWaitSemaphoreValues          = &m_sceneUploadValue;
+      VkSubmitInfo submitInfo                    = {VK_STRUCTURE_TYPE_SUBMIT_INFO};
+      submitInfo.pNext                           = &timelineInfo;
+      submitInfo.waitSemaphoreCount              = 1;
+      submitInfo.pWaitSemaphores                 = &m_sceneUploadSemaphore;
+      submitInfo.pWaitDstStageMask               = &waitStage;
+      submitInfo.commandBufferCount              = (acquireCmd != nullptr ? 1 : 0);
+      submitInfo.pCommandBuffers                 = &acquireCmd;
+      NVVK_CHECK(vkQueueSubmit(m_context.m_queueGCT.queue, 1, &submitInfo, VK_NULL_HANDLE));
+      if(waitUntilResident)
+      {
+        // The ring command pool may be reset before the next frame's fence.
+        NVVK_CHECK(vkQueueWaitIdle(m_context.m_queueGCT.queue));
+      }
+    }
+
+    // Replace the resident scene
+    destroyScene();
+    m_vertexBuffer          = m_pendingScene.vertices;
+    m_indexBuffer           = m_pendingScene.indices;
+    m_objectBoundsBuffer    = m_pendingScene.objectBounds;
+    m_instanceColorBuffer   = m_pendingScene.instanceColors;
+    m_drawCommandsBuffer    = m_pendingScene.drawCommands;
+    m_drawCountsBuffer      = m_pendingScene.drawCounts;
+    m_sortKeysBuffer        = m_pendingScene.sortKeys;
+    m_sortBucketsBuffer     = m_pendingScene.sortBuckets;
+    m_pendingScene          = SceneBuffers();
+    m_objectTriangleIndices = m_sceneGeometry.objectTriangleIndices;
+    m_sceneNumObjects       = static_cast<uint32_t>(m_sceneGeometry.objectBounds.size());
+    m_sceneInstanced        = m_sceneGeometry.instanced;
+    m_sceneSubdiv           = m_sceneGeometry.subdiv;
+    m_sceneGeometry         = SceneGeometry();
+    m_sceneUploading        = false;
+    LOGI("scene: %u objects resident%s\n", m_sceneNumObjects, (m_sceneInstanced ? " (instanced)" : ""));
+
+    // The descriptor sets reference the scene's culling buffers.
+    updateAllDescriptorSets();
+
+    if(m_sceneRequested)
+    {
+      initScene();
+    }
+  } while(waitUntilResident && isSceneBuilding());
 }
 
 void Sample::destroyFramebuffers()
 {
-  vkDestroyFramebuffer(m_context, m_mainColorDepthFramebuffer, nullptr);
-  m_mainColorDepthFramebuffer = nullptr;
-
-  vkDestroyFramebuffer(m_context, m_guiFramebuffer, nullptr);
-  m_guiFramebuffer = nullptr;
-
-  if(m_weightedFramebuffer != nullptr)
+  VkDevice device = m_context;
+  for(VkFramebuffer* framebuffer :
+      {&m_mainColorDepthFramebuffer, &m_guiFramebuffer, &m_weightedFramebuffer, &m_momentsFramebuffer, &m_transparentFramebuffer})
   {
-    vkDestroyFramebuffer(m_context, m_weightedFramebuffer, nullptr);
-    m_weightedFramebuffer = nullptr;
+    if(*framebuffer != nullptr)
+    {
+      VkFramebuffer retired = *framebuffer;
+      retire([device, retired]() { vkDestroyFramebuffer(device, retired, nullptr); });
+      *framebuffer = nullptr;
+    }
   }
 }
 
@@ -532,6 +1181,15 @@ void Sample::createFramebuffers()
     NVVK_CHECK(vkCreateFramebuffer(m_context, &fbInfo, NULL, &m_mainColorDepthFramebuffer));
 
     m_debug.setObjectName(m_mainColorDepthFramebuffer, "m_mainColorDepthFramebuffer");
+
+    // m_renderPassTransparent has the same attachments, but more subpasses,
+    // so it isn't compatible with m_mainColorDepthFramebuffer.
+    if(m_renderPassTransparent != nullptr)
+    {
+      fbInfo.renderPass = m_renderPassTransparent;
+      NVVK_CHECK(vkCreateFramebuffer(m_context, &fbInfo, NULL, &m_transparentFramebuffer));
+      m_debug.setObjectName(m_transparentFramebuffer, "m_transparentFramebuffer");
+    }
   }
 
   // Weighted color + weighted reveal framebuffer (for Weighted, Blended
@@ -556,6 +1214,29 @@ void Sample::createFramebuffers()
     m_debug.setObjectName(m_weightedFramebuffer, "m_weightedColorRevealFramebuffer");
   }
 
+  // Moments + zeroth moment + accumulated color framebuffer (for Moment-Based
+  // Order-Independent Transparency); see m_renderPassMoments.
+  if(m_state.algorithm == OIT_MOMENTS)
+  {
+    std::array<VkImageView, 5> attachments = {m_oitMomentsImage.view,        //
+                                              m_oitMomentsZerothImage.view,  //
+                                              m_oitMomentsAccumImage.view,   //
+                                              m_colorImage.view,             //
+                                              m_depthImage.view};
+
+    VkFramebufferCreateInfo framebufferInfo = {VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO};
+    framebufferInfo.renderPass              = m_renderPassMoments;
+    framebufferInfo.attachmentCount         = static_cast<uint32_t>(attachments.size());
+    framebufferInfo.pAttachments            = attachments.data();
+    framebufferInfo.width                   = m_oitMomentsImage.c_width;
+    framebufferInfo.height                  = m_oitMomentsImage.c_height;
+    framebufferInfo.layers                  = 1;
+
+    NVVK_CHECK(vkCreateFramebuffer(m_context, &framebufferInfo, nullptr, &m_momentsFramebuffer));
+
+    m_debug.setObjectName(m_momentsFramebuffer, "m_momentsFramebuffer");
+  }
+
   // ui related
   {
     VkImageView uiTarget = m_guiCompositeImage.view;
@@ -589,34 +1270,32 @@ void Sample::setUpViewportsAndScissors()
   m_viewportGUI.maxDepth = 1.0f;
 }
 
-void Sample::createOrReloadShaderModule(nvvk::ShaderModuleID& shaderModule,
-                                        VkShaderStageFlags    shaderStage,
-                                        const std::string&    filename,
-                                        const std::string&    prepend)
+void Sample::destroyGraphicsPipeline(VkPipeline& pipeline)
 {
-  if(shaderModule.isValid())
-  {
-    // Reload and recompile this module from source.
-    m_shaderModuleManager.reloadModule(shaderModule);
-  }
-  else
+  if(pipeline != nullptr)
   {
-    // Register and compile the shader module with the shader module manager.
-    shaderModule = m_shaderModuleManager.createShaderModule(shaderStage, filename, prepend);
+    VkDevice   device  = m_context;
+    VkPipeline retired = pipeline;
+    retire([device, retired]() { vkDestroyPipeline(device, retired, nullptr); });
+    pipeline = nullptr;
   }
-  assert(shaderModule.isValid());
-#ifdef _DEBUG
-  std::string generatedShaderName = filename + " " + prepend;
-  m_debug.setObjectName(m_shaderModuleManager.get(shaderModule), generatedShaderName.c_str());
-#endif  // #if _DEBUG
 }
 
-void Sample::destroyGraphicsPipeline(VkPipeline& pipeline)
+// Returns the fragment size of a SHADING_RATE_* value.
+static VkExtent2D getShadingRateFragmentSize(uint32_t shadingRate)
 {
-  if(pipeline != nullptr)
+  switch(shadingRate)
   {
-    vkDestroyPipeline(m_context, pipeline, nullptr);
-    pipeline = nullptr;
+    case SHADING_RATE_1X2:
+      return {1, 2};
+    case SHADING_RATE_2X1:
+      return {2, 1};
+    case SHADING_RATE_2X2:
+      return {2, 2};
+    case SHADING_RATE_4X4:
+      return {4, 4};
+    default:
+      return {1, 1};
   }
 }
 
@@ -633,15 +1312,32 @@ VkPipeline Sample::createGraphicsPipeline(const nvvk::ShaderModuleID& vertShader
 
   nvvk::GraphicsPipelineGeneratorCombined pipelineState(m_context, m_descriptorInfo.getPipeLayout(), renderPass);
 
-  pipelineState.addShader(vertShaderModule,           // Shader module
-                          VK_SHADER_STAGE_VERTEX_BIT  // Stage
-  );
+  // With mesh shaders, the task and mesh shaders generate the spheres instead
+  // of reading them from the vertex buffers. Single-sided pipelines also cull
+  // the back-facing patches.
+  const bool usesMeshShaders = usesVertexInput && m_state.usesMeshShaders();
+  if(usesMeshShaders)
+  {
+    const nvvk::ShaderModuleID& taskShaderModuleID = (isDoubleSided ? m_shaderSphereTask : m_shaderSphereTaskBackfaces);
+    pipelineState.addShader(m_shaderModuleManager.get(taskShaderModuleID),  // Shader module
+                            VK_SHADER_STAGE_TASK_BIT_EXT                    // Stage
+    );
+    pipelineState.addShader(m_shaderModuleManager.get(m_shaderSphereMesh),  // Shader module
+                            VK_SHADER_STAGE_MESH_BIT_EXT                    // Stage
+    );
+  }
+  else
+  {
+    pipelineState.addShader(vertShaderModule,           // Shader module
+                            VK_SHADER_STAGE_VERTEX_BIT  // Stage
+    );
+  }
 
   pipelineState.addShader(fragShaderModule,             // Shader module
                           VK_SHADER_STAGE_FRAGMENT_BIT  // Stage
   );
 
-  if(usesVertexInput)
+  if(usesVertexInput && !usesMeshShaders)
   {
     // Vertex input layout
     VkVertexInputBindingDescription bindingDescription = Vertex::getBindingDescription();
@@ -652,6 +1348,19 @@ VkPipeline Sample::createGraphicsPipeline(const nvvk::ShaderModuleID& vertShader
     {
       pipelineState.addAttributeDescription(attribute);
     }
+
+    // cmdUpdateRendererFromState makes sure that the resident scene matches m_state.instancedScene.
+    if(m_state.instancedScene)
+    {
+      for(const auto& instanceBinding : Vertex::getInstanceBindingDescriptions())
+      {
+        pipelineState.addBindingDescription(instanceBinding);
+      }
+      for(const auto& instanceAttribute : Vertex::getInstanceAttributeDescriptions())
+      {
+        pipelineState.addAttributeDescription(instanceAttribute);
+      }
+    }
   }
 
   pipelineState.inputAssemblyState.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
@@ -674,6 +1383,8 @@ VkPipeline Sample::createGraphicsPipeline(const nvvk::ShaderModuleID& vertShader
   pipelineState.setViewport(0, viewport);
   pipelineState.setScissorsCount(1);
   pipelineState.setScissor(0, scissor);
+  // The scissor rectangle selects the tile when rendering in tiles (see Sample::cmdSetTile).
+  pipelineState.addDynamicStateEnable(VK_DYNAMIC_STATE_SCISSOR);
 
   // Enable backface culling
   pipelineState.rasterizationState.cullMode        = (isDoubleSided ? VK_CULL_MODE_NONE : VK_CULL_MODE_BACK_BIT);
@@ -757,6 +1468,40 @@ VkPipeline Sample::createGraphicsPipeline(const nvvk::ShaderModuleID& vertShader
                                                 VK_BLEND_FACTOR_SRC_ALPHA,            // Destination alpha blend factor
                                                 VK_BLEND_OP_ADD));                    // Alpha blend operation
       break;
+    case BlendMode::MOMENTS_DEPTH:
+      // Test but don't write to depth
+      pipelineState.depthStencilState.depthTestEnable  = true;
+      pipelineState.depthStencilState.depthWriteEnable = false;
+      pipelineState.depthStencilState.depthCompareOp   = compareOp;
+      pipelineState.setBlendAttachmentCount(2);
+      for(uint32_t attachment = 0; attachment < 2; attachment++)
+      {
+        pipelineState.setBlendAttachmentState(attachment,  // Attachment
+                                              nvvk::GraphicsPipelineState::makePipelineColorBlendAttachmentState(
+                                                  allBits, VK_TRUE,     //
+                                                  VK_BLEND_FACTOR_ONE,  // Source color blend factor
+                                                  VK_BLEND_FACTOR_ONE,  // Destination color blend factor
+                                                  VK_BLEND_OP_ADD,      // Color blend operation
+                                                  VK_BLEND_FACTOR_ONE,  // Source alpha blend factor
+                                                  VK_BLEND_FACTOR_ONE,  // Destination alpha blend factor
+                                                  VK_BLEND_OP_ADD));    // Alpha blend operation
+      }
+      break;
+    case BlendMode::MOMENTS_COLOR:
+      // Test but don't write to depth
+      pipelineState.depthStencilState.depthTestEnable  = true;
+      pipelineState.depthStencilState.depthWriteEnable = false;
+      pipelineState.depthStencilState.depthCompareOp   = compareOp;
+      pipelineState.setBlendAttachmentState(0,  // Attachment
+                                            nvvk::GraphicsPipelineState::makePipelineColorBlendAttachmentState(
+                                                allBits, VK_TRUE,     //
+                                                VK_BLEND_FACTOR_ONE,  // Source color blend factor
+                                                VK_BLEND_FACTOR_ONE,  // Destination color blend factor
+                                                VK_BLEND_OP_ADD,      // Color blend operation
+                                                VK_BLEND_FACTOR_ONE,  // Source alpha blend factor
+                                                VK_BLEND_FACTOR_ONE,  // Destination alpha blend factor
+                                                VK_BLEND_OP_ADD));    // Alpha blend operation
+      break;
     default:
       assert(!"Blend mode configuration not implemented!");
       break;
@@ -765,7 +1510,22 @@ VkPipeline Sample::createGraphicsPipeline(const nvvk::ShaderModuleID& vertShader
   pipelineState.setRenderPass(renderPass);
   pipelineState.createInfo.subpass = subpass;
 
-  VkPipeline pipeline = pipelineState.createPipeline();
+  // The color passes of OIT_WEIGHTED and OIT_MOMENTS (the only ones that use
+  // these blend modes) can shade several pixels per invocation; the blend
+  // units then write the result to each covered pixel and sample.
+  VkPipelineFragmentShadingRateStateCreateInfoKHR shadingRateState = {VK_STRUCTURE_TYPE_PIPELINE_FRAGMENT_SHADING_RATE_STATE_CREATE_INFO_KHR};
+  const bool isTransparentColorPass = (blendMode == BlendMode::WEIGHTED_COLOR) || (blendMode == BlendMode::MOMENTS_DEPTH)
+                                      || (blendMode == BlendMode::MOMENTS_COLOR);
+  if(isTransparentColorPass && (m_state.activeShadingRate() != SHADING_RATE_1X1))
+  {
+    shadingRateState.fragmentSize = getShadingRateFragmentSize(m_state.activeShadingRate());
+    // There's no primitive or attachment rate to combine with.
+    shadingRateState.combinerOps[0] = VK_FRAGMENT_SHADING_RATE_COMBINER_OP_KEEP_KHR;
+    shadingRateState.combinerOps[1] = VK_FRAGMENT_SHADING_RATE_COMBINER_OP_KEEP_KHR;
+    pipelineState.createInfo.pNext  = &shadingRateState;
+  }
+
+  VkPipeline pipeline = pipelineState.createPipeline(m_pipelineCache);
   if(pipeline == VK_NULL_HANDLE)
   {
     throw std::runtime_error("Failed to create graphics pipeline!");
@@ -785,6 +1545,29 @@ VkPipeline Sample::createGraphicsPipeline(const nvvk::ShaderModuleID& vertShader
   return pipeline;
 }
 
+VkPipeline Sample::createComputePipeline(const nvvk::ShaderModuleID& compShaderModuleID)
+{
+  VkComputePipelineCreateInfo createInfo = {VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO};
+  createInfo.stage.sType                 = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  createInfo.stage.stage                 = VK_SHADER_STAGE_COMPUTE_BIT;
+  createInfo.stage.module                = m_shaderModuleManager.get(compShaderModuleID);
+  createInfo.stage.pName                 = "main";
+  createInfo.layout                      = m_descriptorInfo.getPipeLayout();
+
+  VkPipeline pipeline = VK_NULL_HANDLE;
+  if(vkCreateComputePipelines(m_context, m_pipelineCache, 1, &createInfo, nullptr, &pipeline) != VK_SUCCESS)
+  {
+    throw std::runtime_error("Failed to create compute pipeline!");
+  }
+
+#ifdef _DEBUG
+  std::string generatedPipelineName = std::to_string(compShaderModuleID.m_value);
+  m_debug.setObjectName(pipeline, generatedPipelineName.c_str());
+#endif
+
+  return pipeline;
+}
+
 VkCommandBuffer Sample::createTempCmdBuffer()
 {
   VkCommandBuffer          cmd       = m_ringCmdPool.createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, false);
@@ -798,24 +1581,39 @@ VkCommandBuffer Sample::createTempCmdBuffer()
 // Main rendering logic                                                      //
 ///////////////////////////////////////////////////////////////////////////////
 
-void Sample::updateUniformBuffer(uint32_t currentImage, double time)
+void Sample::updateUniformBuffer(uint32_t ringCycle, double time)
 {
   const uint32_t width       = m_colorImage.c_width;
   const uint32_t height      = m_colorImage.c_height;
   const float    aspectRatio = static_cast<float>(width) / static_cast<float>(height);
   glm::mat4      projection  = glm::perspectiveRH_ZO(glm::radians(45.0f), aspectRatio, 0.01f, 50.0f);
   projection[1][1] *= -1;
-  glm::mat4 view = m_cameraControl.m_viewMatrix;
 
-  m_sceneUbo.projViewMatrix             = projection * view;
-  m_sceneUbo.viewMatrix                 = view;
-  m_sceneUbo.viewMatrixInverseTranspose = glm::transpose(glm::inverse(view));
+  // With multiview, the left and right eyes are eyeSeparation apart along the
+  // camera's x axis and look in the same direction. Otherwise, view 0 is the
+  // camera itself.
+  for(uint32_t viewIndex = 0; viewIndex < OIT_MAX_VIEWS; viewIndex++)
+  {
+    // Moving an eye left moves the scene right in its view space.
+    glm::mat4 eye(1.0f);
+    if(m_state.usesMultiview())
+    {
+      eye[3][0] = (viewIndex == 0 ? 0.5f : -0.5f) * m_state.eyeSeparation;
+    }
+    const glm::mat4 view = eye * m_cameraControl.m_viewMatrix;
+
+    m_sceneUbo.projViewMatrix[viewIndex]             = projection * view;
+    m_sceneUbo.viewMatrix[viewIndex]                 = view;
+    m_sceneUbo.viewMatrixInverseTranspose[viewIndex] = glm::transpose(glm::inverse(view));
+  }
 
-  m_sceneUbo.viewport = glm::ivec3(width, height, width * height);
+  // The A-buffer covers either the whole image, or one tile at a time.
+  const uint32_t oitWidth  = m_oitTileExtent.width;
+  const uint32_t oitHeight = m_oitTileExtent.height;
+  m_sceneUbo.viewport      = glm::ivec3(oitWidth, oitHeight, getABufferPlaneSize());
 
-  void* data = m_allocatorDma.map(m_uniformBuffers[currentImage]);
-  memcpy(data, &m_sceneUbo, sizeof(m_sceneUbo));
-  m_allocatorDma.unmap(m_uniformBuffers[currentImage]);
+  // Frames in flight use the slots of the other ring cycles.
+  memcpy(m_uniformBufferMapped + ringCycle * m_uniformBufferStride, &m_sceneUbo, sizeof(m_sceneUbo));
 }
 
 void Sample::copyOffscreenToBackBuffer(int winWidth, int winHeight, ImDrawData* imguiDrawData)
@@ -825,7 +1623,7 @@ void Sample::copyOffscreenToBackBuffer(int winWidth, int winHeight, ImDrawData*
   // generally a different format (B8G8R8A8_SRGB) than m_guiCompositeImage (R8G8B8A8) (which in turn is required by
   // linear-space rendering) and sometimes a different size xor has different MSAA samples/pixel, the worst case
   // (MSAA resolve + change of format) takes two steps.
-  // Note that we could do this in one step, and further customize the filters used, using a custom kernel.
+  // State::computeResolve does this in one step instead, using a custom kernel (see resolve.comp.glsl).
   // Finally, Vulkan allows us to access the swapchain images themselves. However, while a previous version of this
   // sample did that, we now render the GUI to intermediate offscreen image, as this avoids potential problems with
   // swapchain recreation, and may be more familiar to developers used to OpenGL applications.
@@ -833,16 +1631,16 @@ void Sample::copyOffscreenToBackBuffer(int winWidth, int winHeight, ImDrawData*
   // As a result of the differences between MSAA resolve + downscaling, there are a few cases to handle.
   // Here's a high-level node graph overview of this function:
   //
-  //       MSAA?          Downsample?    Neither?
-  //    m_colorImage     m_colorImage  m_colorImage
-  //         |               |              |
-  // vkCmdResolveImage  vkCmdBlitImage      |
-  //         V               V              |
-  //         m_downsampleImage  .-----------*
-  //                 |          V
-  //                vkCmdCopyImage (reinterpret data)
-  //                 V
-  //        m_guiCompositeImage
+  //       MSAA?          Downsample?    Neither?       computeResolve?
+  //    m_colorImage     m_colorImage  m_colorImage     m_colorImage
+  //         |               |              |                |
+  // vkCmdResolveImage  vkCmdBlitImage      |                |
+  //         V               V              |                |
+  //         m_downsampleImage  .-----------*                |
+  //                 |          V                            |
+  //                vkCmdCopyImage (reinterpret data)  resolve.comp.glsl
+  //                 V                                       |
+  //        m_guiCompositeImage  <---------------------------*
   //                 |
   //       render Dear ImGui GUI
   //                 V
@@ -855,85 +1653,141 @@ void Sample::copyOffscreenToBackBuffer(int winWidth, int winHeight, ImDrawData*
   // Prepare to transfer from m_colorImage; check its initial state for soundness
   assert(m_colorImage.currentLayout == VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
   assert(m_colorImage.currentAccesses == (VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT));
-  m_colorImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_ACCESS_TRANSFER_READ_BIT);
 
-  // Tracks the image that will be passed to vkCmdCopyImage
-  // These are the defaults if no resolve or downsample is required.
-  VkImage       copySrcImage  = m_colorImage.image.image;
-  VkImageLayout copySrcLayout = m_colorImage.currentLayout;
-
-  // If resolve or downsample required
-  if(m_state.msaa != 1 || m_state.supersample != 1)
+  if(m_state.computeResolve)
   {
-    // Prepare to transfer data to m_downsampleImage
-    m_downsampleImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_ACCESS_TRANSFER_WRITE_BIT);
-
-    // MSAA branch
-    if(m_state.msaa != 1)
-    {
-      // Resolve the MSAA image m_colorImage to m_downsampleImage
-      VkImageResolve region            = {0};  // Zero-initialize
-      region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-      region.srcSubresource.layerCount = 1;
-      region.dstSubresource            = region.srcSubresource;
-      region.extent                    = {m_colorImage.c_width, m_colorImage.c_height, 1};
-
-      vkCmdResolveImage(cmdBuffer,                        // Command buffer
-                        m_colorImage.image.image,         // Source image
-                        m_colorImage.currentLayout,       // Source image layout
-                        m_downsampleImage.image.image,    // Destination image
-                        m_downsampleImage.currentLayout,  // Destination image layout
-                        1,                                // Number of regions
-                        &region);                         // Regions
-    }
-    else
+    // resolve.comp.glsl replaces all of the steps below up to the GUI.
+    m_colorImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_ACCESS_SHADER_READ_BIT);
+    m_guiCompositeImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_GENERAL, VK_ACCESS_SHADER_WRITE_BIT);
+
+    // This is a separate command buffer, so it has to bind the descriptor set again.
+    cmdBindDescriptorSet(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE);
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineResolve);
+    // One invocation per pixel of m_guiCompositeImage
+    vkCmdDispatch(cmdBuffer, (m_guiCompositeImage.c_width + RESOLVE_WORKGROUP_SIZE - 1) / RESOLVE_WORKGROUP_SIZE,
+                  (m_guiCompositeImage.c_height + RESOLVE_WORKGROUP_SIZE - 1) / RESOLVE_WORKGROUP_SIZE, 1);
+
+    // The GUI render pass starts with m_guiCompositeImage in TRANSFER_DST_OPTIMAL.
+    m_guiCompositeImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_ACCESS_TRANSFER_WRITE_BIT);
+  }
+  else
+  {
+    m_colorImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_ACCESS_TRANSFER_READ_BIT);
+
+    // Tracks the image that will be passed to vkCmdCopyImage
+    // These are the defaults if no resolve or downsample is required.
+    VkImage       copySrcImage  = m_colorImage.image.image;
+    VkImageLayout copySrcLayout = m_colorImage.currentLayout;
+
+    // With multiview, m_colorImage has a layer per view, which go side by
+    // side on the screen. If the swapchain's width isn't a multiple of the
+    // number of views, the last view has to leave out its right column.
+    const uint32_t numViews        = m_colorImage.c_layers;
+    const uint32_t viewWidth       = m_colorImage.c_width / m_state.supersample;
+    auto           viewScreenWidth = [&](uint32_t view) {
+      return std::min(viewWidth, m_guiCompositeImage.c_width - view * viewWidth);
+    };
+
+    // If resolve or downsample required
+    if(m_state.msaa != 1 || m_state.supersample != 1)
     {
-      // Downsample m_colorImage to m_downsampleTargeImage
-      VkImageBlit region               = {0};  // Zero-initialize
-      region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-      region.srcSubresource.layerCount = 1;
-      region.dstSubresource            = region.srcSubresource;
-      region.srcOffsets[1]             = {static_cast<int32_t>(m_colorImage.c_width),   //
-                                          static_cast<int32_t>(m_colorImage.c_height),  //
-                                          1};
-      region.dstOffsets[1]             = {static_cast<int32_t>(m_downsampleImage.c_width),   //
-                                          static_cast<int32_t>(m_downsampleImage.c_height),  //
-                                          1};
-
-      vkCmdBlitImage(cmdBuffer,                        // Command buffer
-                     m_colorImage.image.image,         // Source image
-                     m_colorImage.currentLayout,       // Source image
-                     m_downsampleImage.image.image,    // Destination image
-                     m_downsampleImage.currentLayout,  // Destination image layout
-                     1,                                // Number of regions
-                     &region,                          // Regions
-                     VK_FILTER_LINEAR);                // Use tent filtering (= box filtering in this case)
+      // Prepare to transfer data to m_downsampleImage. It shares memory with
+      // the weighted and moment-based targets, which this frame may have just
+      // drawn to, and it's overwritten completely, so discard its contents.
+      m_downsampleImage.discard(VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
+      m_downsampleImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_ACCESS_TRANSFER_WRITE_BIT);
+
+      // MSAA branch
+      if(m_state.msaa != 1)
+      {
+        // Resolve the MSAA image m_colorImage to m_downsampleImage
+        std::array<VkImageResolve, OIT_MAX_VIEWS> regions = {};  // Zero-initialize
+        for(uint32_t view = 0; view < numViews; view++)
+        {
+          VkImageResolve& region               = regions[view];
+          region.srcSubresource.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT;
+          region.srcSubresource.layerCount     = 1;
+          region.dstSubresource                = region.srcSubresource;
+          region.srcSubresource.baseArrayLayer = view;
+          region.dstOffset                     = {static_cast<int32_t>(view * viewWidth), 0, 0};
+          region.extent                        = {viewScreenWidth(view), m_colorImage.c_height, 1};
+        }
+
+        vkCmdResolveImage(cmdBuffer,                        // Command buffer
+                          m_colorImage.image.image,         // Source image
+                          m_colorImage.currentLayout,       // Source image layout
+                          m_downsampleImage.image.image,    // Destination image
+                          m_downsampleImage.currentLayout,  // Destination image layout
+                          numViews,                         // Number of regions
+                          regions.data());                  // Regions
+      }
+      else
+      {
+        // Downsample m_colorImage to m_downsampleTargeImage
+        std::array<VkImageBlit, OIT_MAX_VIEWS> regions = {};  // Zero-initialize
+        for(uint32_t view = 0; view < numViews; view++)
+        {
+          const int32_t dstX                   = static_cast<int32_t>(view * viewWidth);
+          const int32_t dstWidth               = static_cast<int32_t>(viewScreenWidth(view));
+          VkImageBlit&  region                 = regions[view];
+          region.srcSubresource.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT;
+          region.srcSubresource.layerCount     = 1;
+          region.dstSubresource                = region.srcSubresource;
+          region.srcSubresource.baseArrayLayer = view;
+          region.srcOffsets[1]                 = {dstWidth * m_state.supersample,              //
+                                                  static_cast<int32_t>(m_colorImage.c_height),  //
+                                                  1};
+          region.dstOffsets[0]                 = {dstX, 0, 0};
+          region.dstOffsets[1]                 = {dstX + dstWidth,                                //
+                                                  static_cast<int32_t>(m_downsampleImage.c_height),  //
+                                                  1};
+        }
+
+        vkCmdBlitImage(cmdBuffer,                        // Command buffer
+                       m_colorImage.image.image,         // Source image
+                       m_colorImage.currentLayout,       // Source image
+                       m_downsampleImage.image.image,    // Destination image
+                       m_downsampleImage.currentLayout,  // Destination image layout
+                       numViews,                         // Number of regions
+                       regions.data(),                   // Regions
+                       VK_FILTER_LINEAR);                // Use tent filtering (= box filtering in this case)
+      }
+
+      // Prepare to transfer data from m_downsampleImage, and set copySrcImage and copySrcLayout.
+      m_downsampleImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_ACCESS_TRANSFER_READ_BIT);
+      copySrcImage  = m_downsampleImage.image.image;
+      copySrcLayout = m_downsampleImage.currentLayout;
     }
 
-    // Prepare to transfer data from m_downsampleImage, and set copySrcImage and copySrcLayout.
-    m_downsampleImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_ACCESS_TRANSFER_READ_BIT);
-    copySrcImage  = m_downsampleImage.image.image;
-    copySrcLayout = m_downsampleImage.currentLayout;
-  }
-
-  // Prepare to transfer data to m_guiCompositeImage
-  m_guiCompositeImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_ACCESS_TRANSFER_WRITE_BIT);
+    // Prepare to transfer data to m_guiCompositeImage
+    m_guiCompositeImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_ACCESS_TRANSFER_WRITE_BIT);
 
-  // Now, we want to copy data from copySrcImage to m_guiCompositeImage instead of blitting it, since blitting will try
-  // to convert the sRGB data and store it in linear format, which isn't what we want.
-  {
-    VkImageCopy region               = {0};
-    region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    region.srcSubresource.layerCount = 1;
-    region.dstSubresource            = region.srcSubresource;
-    region.extent                    = {m_guiCompositeImage.c_width, m_guiCompositeImage.c_height, 1};
-    vkCmdCopyImage(cmdBuffer,                          // Command buffer
-                   copySrcImage,                       // Source image
-                   copySrcLayout,                      // Source image layout
-                   m_guiCompositeImage.image.image,    // Destination image
-                   m_guiCompositeImage.currentLayout,  // Destination image layout
-                   1,                                  // Number of regions
-                   &region);                           // Regions
+    // Now, we want to copy data from copySrcImage to m_guiCompositeImage instead of blitting it, since blitting will try
+    // to convert the sRGB data and store it in linear format, which isn't what we want.
+    // m_downsampleImage already has the views side by side; m_colorImage
+    // still has them in its layers.
+    {
+      const uint32_t numRegions = (copySrcImage == m_colorImage.image.image ? numViews : 1);
+      std::array<VkImageCopy, OIT_MAX_VIEWS> regions = {};
+      for(uint32_t view = 0; view < numRegions; view++)
+      {
+        const uint32_t width                 = (numRegions == 1 ? m_guiCompositeImage.c_width : viewScreenWidth(view));
+        VkImageCopy&   region                = regions[view];
+        region.srcSubresource.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.srcSubresource.layerCount     = 1;
+        region.dstSubresource                = region.srcSubresource;
+        region.srcSubresource.baseArrayLayer = view;
+        region.dstOffset                     = {static_cast<int32_t>(view * viewWidth), 0, 0};
+        region.extent                        = {width, m_guiCompositeImage.c_height, 1};
+      }
+      vkCmdCopyImage(cmdBuffer,                          // Command buffer
+                     copySrcImage,                       // Source image
+                     copySrcLayout,                      // Source image layout
+                     m_guiCompositeImage.image.image,    // Destination image
+                     m_guiCompositeImage.currentLayout,  // Destination image layout
+                     numRegions,                         // Number of regions
+                     regions.data());                    // Regions
+    }
   }
 
   // Now, render the GUI.
@@ -972,6 +1826,13 @@ void Sample::copyOffscreenToBackBuffer(int winWidth, int winHeight, ImDrawData*
     m_guiCompositeImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_ACCESS_TRANSFER_READ_BIT);
   }
 
+  // The benchmark's error measurements compare this image without the GUI.
+  if(m_benchmarkCaptureRequested)
+  {
+    cmdBenchmarkCapture(cmdBuffer);
+    m_benchmarkCaptureRequested = false;
+  }
+
   // Finally, blit to the swapchain.
   {
     // Soundness check
@@ -1048,26 +1909,58 @@ void Sample::think(double time)
   // Create Dear ImGui interface
   DoGUI(width, height, time);
 
-  // If elements of m_state change, this reinitializes parts of the renderer.
-  updateRendererImmediate(false, false);
+  // In benchmark mode, this sets m_state to the combination being measured.
+  if(m_benchmarkActive)
+  {
+    benchmarkAdvance();
+  }
 
   // Begin frame
   {
     m_submissionWaitForRead = true;
     m_ringFences.setCycleAndWait(m_frame);
     m_ringCmdPool.setCycle(m_ringFences.getCycleIndex());
+    for(nvvk::RingCommandPool& pool : m_recordingCmdPools)
+    {
+      pool.setCycle(m_ringFences.getCycleIndex());
+    }
+    // The frames that could have used objects retired during this cycle's
+    // previous use have finished now.
+    m_deferredDestroyer.releaseCycle(m_ringFences.getCycleIndex());
   }
 
-  // Update camera
-  m_cameraControl.processActions(glm::ivec2(getWidth(), getHeight()),
-                                 glm::vec2(m_windowState.m_mouseCurrent[0], m_windowState.m_mouseCurrent[1]),
-                                 m_windowState.m_mouseButtonFlags, m_windowState.m_mouseWheel);
+  VkCommandBuffer cmdBuffer = m_ringCmdPool.createCommandBuffer();
+
+  // If elements of m_state change, this reinitializes parts of the renderer.
+  // This is recorded into this frame's command buffer (for instance, the
+  // initial layout transitions of new images), and retires the objects it
+  // replaces, so frames in flight keep rendering with the old ones.
+  cmdUpdateRendererFromState(cmdBuffer, m_swapchainSizeChanged, false);
+  m_swapchainSizeChanged = false;
+
+  // If a new scene is being built, upload the next part of it, or switch to
+  // it once it's resident.
+  updateScene(false);
+
+  // Now that this cycle's previous frame has finished, grow or shrink the
+  // linked-list A-buffer if needed, and read back its fragment statistics,
+  // which pick the number of layers with adaptive layer counts.
+  updateLinkedListCapacity();
+  const bool newFragmentStats = updateFragmentStats();
+  updateAdaptiveLayers(newFragmentStats);
+
+  // Update camera (the benchmark keeps it fixed so that all combinations render the same image)
+  if(!m_benchmarkActive)
+  {
+    m_cameraControl.processActions(glm::ivec2(getWidth(), getHeight()),
+                                   glm::vec2(m_windowState.m_mouseCurrent[0], m_windowState.m_mouseCurrent[1]),
+                                   m_windowState.m_mouseButtonFlags, m_windowState.m_mouseWheel);
+  }
 
   // Update the GPU's uniform buffer
-  updateUniformBuffer(m_swapChain.getActiveImageIndex(), frameStartTime);
+  updateUniformBuffer(m_ringFences.getCycleIndex(), frameStartTime);
 
   // Record this frame's command buffer
-  VkCommandBuffer cmdBuffer = m_ringCmdPool.createCommandBuffer();
   {
     render(cmdBuffer);
     NVVK_CHECK(vkEndCommandBuffer(cmdBuffer));
@@ -1077,7 +1970,7 @@ void Sample::think(double time)
   // Render Dear ImGui and translate the internal image to the swapchain
   {
     ImGui::Render();
-    copyOffscreenToBackBuffer(width, height, ImGui::GetDrawData());
+    copyOffscreenToBackBuffer(width, height, (m_state.drawUI ? ImGui::GetDrawData() : nullptr));
   }
 
   // End frame
@@ -1089,6 +1982,45 @@ void Sample::think(double time)
   }
 }
 
+void Sample::setupConfigParameters()
+{
+  // Benchmark mode; see BenchmarkSettings for a description of each parameter. For instance,
+  //   -oitbenchmark results -oitbenchalgorithms 0,1,4 -oitbenchaa 0,1 -oitbenchlayers 4,8,16
+  // measures 18 combinations and writes results.csv and results.json.
+  m_parameterList.add("oitbenchmark", &m_benchmarkSettings.outputFilename);
+  m_parameterList.add("oitbenchalgorithms", &m_benchmarkSettings.algorithms);
+  m_parameterList.add("oitbenchaa", &m_benchmarkSettings.aaTypes);
+  m_parameterList.add("oitbenchlayers", &m_benchmarkSettings.oitLayers);
+  m_parameterList.add("oitbenchlistalloc", &m_benchmarkSettings.linkedListAllocatedPerElement);
+  m_parameterList.add("oitbenchobjects", &m_benchmarkSettings.numObjects);
+  m_parameterList.add("oitbenchtransparent", &m_benchmarkSettings.percentTransparent);
+  m_parameterList.add("oitbenchcomputecomposite", &m_benchmarkSettings.computeComposite);
+  m_parameterList.add("oitbenchsort", &m_benchmarkSettings.sortStrategy);
+  m_parameterList.add("oitbenchstats", &m_benchmarkSettings.fragmentStats);
+  m_parameterList.add("oitbenchreference", &m_benchmarkSettings.reference);
+  m_parameterList.add("oitbenchadaptive", &m_benchmarkSettings.adaptiveLayers);
+  m_parameterList.add("oitbenchpacked", &m_benchmarkSettings.packedABuffer);
+  m_parameterList.add("oitbenchmlab", &m_benchmarkSettings.interlockMLAB);
+  m_parameterList.add("oitbenchfronttoback", &m_benchmarkSettings.frontToBack);
+  m_parameterList.add("oitbenchspin", &m_benchmarkSettings.spinlockStrategy);
+  m_parameterList.add("oitbenchlistsubgroup", &m_benchmarkSettings.linkedListSubgroupAlloc);
+  m_parameterList.add("oitbenchlayout", &m_benchmarkSettings.aBufferLayout);
+  m_parameterList.add("oitbenchframetags", &m_benchmarkSettings.frameTags);
+  m_parameterList.add("oitbenchresolve", &m_benchmarkSettings.computeResolve);
+  m_parameterList.add("oitbenchsubpass", &m_benchmarkSettings.subpassComposite);
+  m_parameterList.add("oitbenchthreads", &m_benchmarkSettings.recordingThreads);
+  m_parameterList.add("oitbenchshadingrate", &m_benchmarkSettings.shadingRate);
+  m_parameterList.add("oitbenchmesh", &m_benchmarkSettings.meshShaders);
+  m_parameterList.add("oitbenchwarmup", &m_benchmarkSettings.warmupFrames);
+  m_parameterList.add("oitbenchframes", &m_benchmarkSettings.measureFrames);
+
+  // Shader caches (see oitShaderCache.cpp):
+  //   -oitshadercache 0 disables the on-disk SPIR-V and pipeline caches.
+  //   -oitprecompile 1 fills the SPIR-V cache for all permutations in a background thread.
+  m_parameterList.add("oitshadercache", &m_shaderCacheEnabled);
+  m_parameterList.add("oitprecompile", &m_precompileShaders);
+}
+
 int main(int argc, const char** argv)
 {
   NVPSystem system(PROJECT_NAME);
@@ -1120,6 +2052,28 @@ int main(int argc, const char** argv)
   };
   sample.m_contextInfo.addDeviceExtension(VK_EXT_FRAGMENT_SHADER_INTERLOCK_EXTENSION_NAME, true, &m_fragmentShaderInterlockFeatures);
 
+  // Also optional: State::shadingRate only uses pipeline shading rates.
+  VkPhysicalDeviceFragmentShadingRateFeaturesKHR m_fragmentShadingRateFeatures{
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FRAGMENT_SHADING_RATE_FEATURES_KHR,  // sType
+      nullptr,                                                               // pNext
+      VK_TRUE,                                                               // pipelineFragmentShadingRate
+      VK_FALSE,                                                              // primitiveFragmentShadingRate
+      VK_FALSE                                                               // attachmentFragmentShadingRate
+  };
+  sample.m_contextInfo.addDeviceExtension(VK_KHR_FRAGMENT_SHADING_RATE_EXTENSION_NAME, true, &m_fragmentShadingRateFeatures);
+
+  // Also optional: State::meshShaders needs task and mesh shaders.
+  VkPhysicalDeviceMeshShaderFeaturesEXT m_meshShaderFeatures{
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MESH_SHADER_FEATURES_EXT,  // sType
+      nullptr,                                                     // pNext
+      VK_TRUE,                                                     // taskShader
+      VK_TRUE,                                                     // meshShader
+      VK_FALSE,                                                    // multiviewMeshShader
+      VK_FALSE,                                                    // primitiveFragmentShadingRateMeshShader
+      VK_FALSE                                                     // meshShaderQueries
+  };
+  sample.m_contextInfo.addDeviceExtension(VK_EXT_MESH_SHADER_EXTENSION_NAME, true, &m_meshShaderFeatures);
+
   const int SAMPLE_WIDTH  = 1200;
   const int SAMPLE_HEIGHT = 1024;
   return sample.run(PROJECT_NAME, argc, argv, SAMPLE_WIDTH, SAMPLE_HEIGHT);
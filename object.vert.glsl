@@ -25,15 +25,30 @@
 
 layout(location = VERTEX_POS) in vec3 inPosition;
 layout(location = VERTEX_NORMAL) in vec3 inNormal;
+#if SCENE_INSTANCED
+// Each object is an instance of a unit sphere; since the scale is uniform,
+// the normals stay the same.
+layout(location = VERTEX_INSTANCE_BOUNDS) in vec4 inInstanceBounds;  // (center.xyz, radius)
+layout(location = VERTEX_INSTANCE_COLOR) in vec4 inInstanceColor;
+#else
 layout(location = VERTEX_COLOR) in vec4 inColor;
+#endif
 
 layout(location = 0) out Interpolants OUT;
 
 void main()
 {
-  gl_Position = scene.projViewMatrix * vec4(inPosition, 1.0);
-  OUT.depth   = (scene.viewMatrix * vec4(inPosition, 1.0)).z;
-  OUT.pos     = inPosition;
+#if SCENE_INSTANCED
+  const vec3 position = inInstanceBounds.xyz + inInstanceBounds.w * inPosition;
+  const vec4 color    = inInstanceColor;
+#else
+  const vec3 position = inPosition;
+  const vec4 color    = inColor;
+#endif
+
+  gl_Position = scene.projViewMatrix[VIEW_INDEX] * vec4(position, 1.0);
+  OUT.depth   = (scene.viewMatrix[VIEW_INDEX] * vec4(position, 1.0)).z;
+  OUT.pos     = position;
   OUT.normal  = inNormal;
-  OUT.color   = inColor;
+  OUT.color   = color;
 }
\ No newline at end of file
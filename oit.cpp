@@ -26,19 +26,56 @@
 #include <nvvk/error_vk.hpp>
 #include <nvvk/renderpasses_vk.hpp>
 
+#include <algorithm>
+
 void Sample::destroyFrameImages()
 {
-  m_colorImage.destroy(m_context, m_allocatorDma);
-  m_depthImage.destroy(m_context, m_allocatorDma);
-  m_oitABuffer.destroy(m_context, m_allocatorDma);
-  m_oitAuxImage.destroy(m_context, m_allocatorDma);
-  m_oitAuxSpinImage.destroy(m_context, m_allocatorDma);
-  m_oitAuxDepthImage.destroy(m_context, m_allocatorDma);
-  m_oitCounterImage.destroy(m_context, m_allocatorDma);
-  m_oitWeightedColorImage.destroy(m_context, m_allocatorDma);
-  m_oitWeightedRevealImage.destroy(m_context, m_allocatorDma);
-  m_downsampleImage.destroy(m_context, m_allocatorDma);
-  m_guiCompositeImage.destroy(m_context, m_allocatorDma);
+  // Frames in flight may still be using these, so retire them instead of
+  // destroying them right away.
+  retireImage(m_colorImage);
+  retireImage(m_depthImage);
+  retireBuffer(m_oitABuffer);
+  retireImage(m_oitAuxImage);
+  retireImage(m_oitAuxSpinImage);
+  retireImage(m_oitAuxDepthImage);
+  retireImage(m_oitCounterImage);
+  retireBuffer(m_oitCounterReadback);
+  retireImage(m_oitWeightedColorImage);
+  retireImage(m_oitWeightedRevealImage);
+  retireImage(m_oitMomentsImage);
+  retireImage(m_oitMomentsZerothImage);
+  retireImage(m_oitMomentsAccumImage);
+  retireImage(m_oitCompositeImage);
+  retireImage(m_fragmentStatsImage);
+  retireBuffer(m_fragmentStatsBuffer);
+  retireBuffer(m_fragmentStatsReadback);
+  m_fragmentStats = FragmentStatsSummary();
+  m_linkedListNodesHistory.clear();
+  m_meanFragmentsHistory.clear();
+  m_overflowPercentHistory.clear();
+  m_lockAttemptsHistory.clear();
+  retireImage(m_downsampleImage);
+  retireImage(m_guiCompositeImage);
+  // Once the images above are destroyed, their memory can be reused.
+  const std::vector<uint32_t> frameMemoryBlocks = m_frameMemory.retire();
+  retire([this, frameMemoryBlocks]() { m_frameMemory.release(frameMemoryBlocks); });
+
+  if(m_hizView != nullptr)
+  {
+    std::vector<VkImageView> views = m_hizLevelViews;
+    views.push_back(m_hizView);
+    nvvk::Image image = m_hizImage;
+    retire([this, views, image]() mutable {
+      for(VkImageView view : views)
+      {
+        vkDestroyImageView(m_context, view, nullptr);
+      }
+      m_allocatorDma.destroy(image);
+    });
+    m_hizView  = nullptr;
+    m_hizImage = nvvk::Image();
+  }
+  m_hizLevelViews.clear();
 }
 
 void Sample::createFrameImages(VkCommandBuffer cmdBuffer)
@@ -47,37 +84,48 @@ void Sample::createFrameImages(VkCommandBuffer cmdBuffer)
 
   const int swapchainWidth  = m_windowState.m_swapSize[0];
   const int swapchainHeight = m_windowState.m_swapSize[1];
+  // With multiview, each view covers its part of the swapchain side by side
+  // (see copyOffscreenToBackBuffer), and has its own layer of each image.
+  const uint32_t numViews  = m_state.numViews();
+  const int      viewWidth = (swapchainWidth + static_cast<int>(numViews) - 1) / static_cast<int>(numViews);
   // We implement supersample anti-aliasing by rendering to a larger texture.
-  const int bufferWidth  = swapchainWidth * m_state.supersample;
+  const int bufferWidth  = viewWidth * m_state.supersample;
   const int bufferHeight = swapchainHeight * m_state.supersample;
 
   // Offscreen color and depth buffer
   {
     // Color image, created with an sRGB format.
-    m_colorImage.create(m_context, m_allocatorDma, VK_IMAGE_TYPE_2D, VK_IMAGE_ASPECT_COLOR_BIT, VK_FORMAT_B8G8R8A8_SRGB, bufferWidth,
-                        bufferHeight, 1, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, m_state.msaa);
+    createFrameImage(m_colorImage, VK_IMAGE_ASPECT_COLOR_BIT, VK_FORMAT_B8G8R8A8_SRGB, bufferWidth, bufferHeight, numViews,
+                     VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, m_state.msaa);
     m_colorImage.setName(m_debug, "m_colorImage");
     // We'll put it into the layout for a color attachment later.
 
     // Depth image
     VkFormat depthFormat = nvvk::findDepthFormat(m_context.m_physicalDevice);
 
-    m_depthImage.create(m_context, m_allocatorDma, VK_IMAGE_TYPE_2D, VK_IMAGE_ASPECT_DEPTH_BIT, depthFormat,
-                        bufferWidth, bufferHeight, 1, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, m_state.msaa);
+    createFrameImage(m_depthImage, VK_IMAGE_ASPECT_DEPTH_BIT, depthFormat, bufferWidth, bufferHeight, numViews,
+                     VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, m_state.msaa);
     m_depthImage.setName(m_debug, "m_depthImage");
 
     // Intermediate storage for resolve - 1spp, swapchain sized, with the same format as the color image.
-    m_downsampleImage.create(m_context, m_allocatorDma, VK_IMAGE_TYPE_2D, VK_IMAGE_ASPECT_COLOR_BIT,
-                             m_colorImage.c_format, swapchainWidth, swapchainHeight, 1,
-                             VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, 1);
-    m_downsampleImage.setName(m_debug, "m_downsampleTargetImage");
+    // The compute resolve writes to m_guiCompositeImage directly, so it doesn't need this.
+    // It's only used after the transparent pass, so it shares memory with the
+    // weighted and moment-based targets (see the end of this function).
+    if(!m_state.computeResolve)
+    {
+      m_downsampleImage.createUnbound(m_context, VK_IMAGE_TYPE_2D, VK_IMAGE_ASPECT_COLOR_BIT, m_colorImage.c_format,
+                                      swapchainWidth, swapchainHeight, 1,
+                                      VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, 1);
+    }
 
     // Intermediate storage for rendering the GUI - 1spp, swapchain sized, with almost the same format as the swapchain
     // (with the exception that the channels have to be in the same order as m_colorImage)
-    m_guiCompositeImage.create(m_context, m_allocatorDma, VK_IMAGE_TYPE_2D, VK_IMAGE_ASPECT_COLOR_BIT,
-                               m_guiCompositeColorFormat, swapchainWidth, swapchainHeight, 1,
-                               VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
-                               1);
+    const VkImageUsageFlags guiCompositeUsage = (m_state.computeResolve ? VK_IMAGE_USAGE_STORAGE_BIT : 0);
+    createFrameImage(m_guiCompositeImage, VK_IMAGE_ASPECT_COLOR_BIT, m_guiCompositeColorFormat, swapchainWidth,
+                     swapchainHeight, 1,
+                     VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT
+                         | VK_IMAGE_USAGE_TRANSFER_DST_BIT | guiCompositeUsage,
+                     1);
     m_guiCompositeImage.setName(m_debug, "m_guiCompositeImage");
 
     // Initial resource transitions
@@ -85,8 +133,61 @@ void Sample::createFrameImages(VkCommandBuffer cmdBuffer)
     m_depthImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT);
   }
 
+  // Hi-Z pyramid for GPU culling, with levels down to 1x1. Each level is half
+  // the size of the previous level, rounded down, like mipmaps.
+  if(m_state.gpuCulling)
+  {
+    uint32_t numLevels = 1;
+    while((std::max(bufferWidth, bufferHeight) >> numLevels) != 0 && numLevels < HIZ_MAX_LEVELS)
+    {
+      numLevels++;
+    }
+
+    VkImageCreateInfo hizInfo = {VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO};
+    hizInfo.imageType         = VK_IMAGE_TYPE_2D;
+    hizInfo.format            = VK_FORMAT_R32_SFLOAT;
+    hizInfo.extent            = {static_cast<uint32_t>(bufferWidth), static_cast<uint32_t>(bufferHeight), 1};
+    hizInfo.mipLevels         = numLevels;
+    hizInfo.arrayLayers       = 1;
+    hizInfo.samples           = VK_SAMPLE_COUNT_1_BIT;
+    hizInfo.tiling            = VK_IMAGE_TILING_OPTIMAL;
+    hizInfo.usage             = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    hizInfo.sharingMode       = VK_SHARING_MODE_EXCLUSIVE;
+    hizInfo.initialLayout     = VK_IMAGE_LAYOUT_UNDEFINED;
+    m_hizImage                = m_allocatorDma.createImage(hizInfo);
+    m_debug.setObjectName(m_hizImage.image, "m_hizImage");
+
+    VkImageViewCreateInfo viewInfo = nvvk::makeImage2DViewCreateInfo(m_hizImage.image, hizInfo.format);
+    viewInfo.subresourceRange.levelCount = numLevels;
+    NVVK_CHECK(vkCreateImageView(m_context, &viewInfo, nullptr, &m_hizView));
+
+    viewInfo.subresourceRange.levelCount = 1;
+    m_hizLevelViews.resize(numLevels);
+    for(uint32_t level = 0; level < numLevels; level++)
+    {
+      viewInfo.subresourceRange.baseMipLevel = level;
+      NVVK_CHECK(vkCreateImageView(m_context, &viewInfo, nullptr, &m_hizLevelViews[level]));
+    }
+
+    // The pyramid stays in the general layout, since it's both written and read by compute shaders.
+    cmdImageTransition(cmdBuffer, m_hizImage.image, VK_IMAGE_ASPECT_COLOR_BIT, 0,
+                       VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
+  }
+
   // A-buffers
 
+  // In tiled mode, the A-buffer and auxiliary images only cover a single tile,
+  // which renderTiled reuses for each tile. (OIT_WEIGHTED and OIT_MOMENTS don't use an A-buffer.)
+  uint32_t oitWidth  = static_cast<uint32_t>(bufferWidth);
+  uint32_t oitHeight = static_cast<uint32_t>(bufferHeight);
+  if(m_state.tileSize != 0 && m_state.usesABuffer())
+  {
+    oitWidth  = std::min(oitWidth, m_state.tileSize);
+    oitHeight = std::min(oitHeight, m_state.tileSize);
+  }
+  m_oitTileExtent = {oitWidth, oitHeight};
+  m_oitTileCount  = ((bufferWidth + oitWidth - 1) / oitWidth) * ((bufferHeight + oitHeight - 1) / oitHeight);
+
   // Compute which buffers we need to allocate and their sizes
   VkDeviceSize aBufferElementsPerSample = 1;
   VkDeviceSize aBufferStrideBytes       = 0;
@@ -102,15 +203,19 @@ void Sample::createFrameImages(VkCommandBuffer cmdBuffer)
   // MSAA  True      False
   // SSAA  False     True
   const bool coverageShading = m_state.coverageShading();
-  const bool sampleShading   = m_state.sampleShading;
+  // Coverage shading entries store the mask in a third component, unless
+  // they're packed (see State::usesPackedABuffer); packed linked list nodes
+  // use three r32ui texels each.
+  const bool packed      = m_state.usesPackedABuffer();
+  const bool wideEntries = coverageShading && !packed;
 
   switch(m_state.algorithm)
   {
     case OIT_SIMPLE:
       allocAux                                 = true;
       aBufferElementsPerSample                 = m_state.oitLayers;
-      aBufferStrideBytes                       = coverageShading ? sizeof(uvec4) : sizeof(uvec2);
-      aBufferFormat                            = coverageShading ? VK_FORMAT_R32G32B32A32_UINT : VK_FORMAT_R32G32_UINT;
+      aBufferStrideBytes                       = wideEntries ? sizeof(uvec4) : sizeof(uvec2);
+      aBufferFormat                            = wideEntries ? VK_FORMAT_R32G32B32A32_UINT : VK_FORMAT_R32G32_UINT;
       m_sceneUbo.linkedListAllocatedPerElement = m_state.oitLayers;
       break;
     case OIT_INTERLOCK:
@@ -119,17 +224,17 @@ void Sample::createFrameImages(VkCommandBuffer cmdBuffer)
       allocAuxSpin                             = (m_state.algorithm == OIT_SPINLOCK);
       allocAuxDepth                            = true;
       aBufferElementsPerSample                 = m_state.oitLayers;
-      aBufferStrideBytes                       = coverageShading ? sizeof(uvec4) : sizeof(uvec2);
-      aBufferFormat                            = coverageShading ? VK_FORMAT_R32G32B32A32_UINT : VK_FORMAT_R32G32_UINT;
+      aBufferStrideBytes                       = wideEntries ? sizeof(uvec4) : sizeof(uvec2);
+      aBufferFormat                            = wideEntries ? VK_FORMAT_R32G32B32A32_UINT : VK_FORMAT_R32G32_UINT;
       m_sceneUbo.linkedListAllocatedPerElement = m_state.oitLayers;
       break;
     case OIT_LINKEDLIST:
       allocAux                                 = true;
       allocCounter                             = true;
       aBufferElementsPerSample                 = m_state.linkedListAllocatedPerElement;
-      aBufferStrideBytes                       = sizeof(uvec4);
-      aBufferFormat                            = VK_FORMAT_R32G32B32A32_UINT;
-      m_sceneUbo.linkedListAllocatedPerElement = m_state.linkedListAllocatedPerElement * bufferWidth * bufferHeight;
+      aBufferStrideBytes                       = getLinkedListNodeBytes();
+      aBufferFormat                            = packed ? VK_FORMAT_R32_UINT : VK_FORMAT_R32G32B32A32_UINT;
+      m_sceneUbo.linkedListAllocatedPerElement = m_state.linkedListAllocatedPerElement * oitWidth * oitHeight;
       break;
     case OIT_LOOP:
       allocAux                                 = true;
@@ -146,26 +251,27 @@ void Sample::createFrameImages(VkCommandBuffer cmdBuffer)
       m_sceneUbo.linkedListAllocatedPerElement = m_state.oitLayers;
       break;
     case OIT_WEIGHTED:
+    case OIT_MOMENTS:
       // Don't create anything other than the special textures below
       break;
     default:
       assert(!"createABuffers: Textures for algorithm not implemented!");
   }
 
-  if(sampleShading)
-  {
-    aBufferElementsPerSample *= m_state.msaa;
-    m_sceneUbo.linkedListAllocatedPerElement *= m_state.msaa;
-  }
+  // With sample shading or multiview, the A-buffer has a plane per sample and view.
+  aBufferElementsPerSample *= m_state.numABufferPlanes();
+  m_sceneUbo.linkedListAllocatedPerElement *= m_state.numABufferPlanes();
 
   // Reference: https://antiagainst.github.io/post/hlsl-for-vulkan-resources/
-  const VkDeviceSize aBufferSize = static_cast<VkDeviceSize>(bufferWidth) * static_cast<VkDeviceSize>(bufferHeight)
-                                   * aBufferElementsPerSample * aBufferStrideBytes;
+  const VkDeviceSize aBufferSize =
+      static_cast<VkDeviceSize>(getABufferPlaneSize()) * aBufferElementsPerSample * aBufferStrideBytes;
   if(aBufferSize != 0)
   {
     const VkBufferUsageFlagBits aBufferUsage =
         (m_state.algorithm == OIT_LOOP64 ? VK_BUFFER_USAGE_STORAGE_BUFFER_BIT : VK_BUFFER_USAGE_STORAGE_TEXEL_BUFFER_BIT);
-    m_oitABuffer.create(m_context, m_allocatorDma, aBufferSize, aBufferUsage, aBufferFormat);
+    const MemoryArena::Allocation allocation =
+        m_frameMemory.allocate(m_oitABuffer.createUnbound(m_context, aBufferSize, aBufferUsage));
+    m_oitABuffer.bind(m_context, allocation.memory, allocation.offset, aBufferFormat);
     m_oitABuffer.setName(m_debug, "m_oitABuffer");
   }
 
@@ -174,66 +280,492 @@ void Sample::createFrameImages(VkCommandBuffer cmdBuffer)
   const VkImageUsageFlags auxUsages = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
   // The ways that auxiliary images can be accessed
   const VkAccessFlags auxAccesses = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
-  // if `sampleShading`, then each auxiliary image is actually a texture array:
-  const uint32_t auxLayers = (sampleShading ? m_state.msaa : 1);
+  // if `sampleShading` or multiview, then each auxiliary image is actually a texture array:
+  const uint32_t auxLayers = m_state.numABufferPlanes();
 
   if(allocAux)
   {
-    m_oitAuxImage.create(m_context, m_allocatorDma, VK_IMAGE_TYPE_2D, VK_IMAGE_ASPECT_COLOR_BIT, VK_FORMAT_R32_UINT,
-                         bufferWidth, bufferHeight, auxLayers, auxUsages);
+    createFrameImage(m_oitAuxImage, VK_IMAGE_ASPECT_COLOR_BIT, VK_FORMAT_R32_UINT, oitWidth, oitHeight, auxLayers, auxUsages);
     m_oitAuxImage.setName(m_debug, "m_oitAuxImage");
     m_oitAuxImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_GENERAL, auxAccesses);
   }
 
   if(allocAuxSpin)
   {
-    m_oitAuxSpinImage.create(m_context, m_allocatorDma, VK_IMAGE_TYPE_2D, VK_IMAGE_ASPECT_COLOR_BIT, VK_FORMAT_R32_UINT,
-                             bufferWidth, bufferHeight, auxLayers, auxUsages);
+    createFrameImage(m_oitAuxSpinImage, VK_IMAGE_ASPECT_COLOR_BIT, VK_FORMAT_R32_UINT, oitWidth, oitHeight, auxLayers, auxUsages);
     m_oitAuxSpinImage.setName(m_debug, "m_oitAuxSpinImage");
     m_oitAuxSpinImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_GENERAL, auxAccesses);
   }
 
   if(allocAuxDepth)
   {
-    m_oitAuxDepthImage.create(m_context, m_allocatorDma, VK_IMAGE_TYPE_2D, VK_IMAGE_ASPECT_COLOR_BIT,
-                              VK_FORMAT_R32_UINT, bufferWidth, bufferHeight, auxLayers, auxUsages);
+    createFrameImage(m_oitAuxDepthImage, VK_IMAGE_ASPECT_COLOR_BIT, VK_FORMAT_R32_UINT, oitWidth, oitHeight, auxLayers, auxUsages);
     m_oitAuxDepthImage.setName(m_debug, "m_oitAuxDepthImage");
     m_oitAuxDepthImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_GENERAL, auxAccesses);
   }
 
   if(allocCounter)
   {
-    // Here, a counter is really a 1x1x1 image.
-    m_oitCounterImage.create(m_context, m_allocatorDma, VK_IMAGE_TYPE_2D, VK_IMAGE_ASPECT_COLOR_BIT, VK_FORMAT_R32_UINT,
-                             1, 1, 1, auxUsages);
+    // Here, a counter is really a 1x1x1 image. We also copy it to the host
+    // each frame to see how many linked list nodes were needed.
+    createFrameImage(m_oitCounterImage, VK_IMAGE_ASPECT_COLOR_BIT, VK_FORMAT_R32_UINT, 1, 1, 1,
+                     auxUsages | VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
     m_oitCounterImage.setName(m_debug, "m_oitCounter");
     m_oitCounterImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_GENERAL, auxAccesses);
+
+    // Each ring cycle's slot holds one counter per tile.
+    m_oitCounterReadback.create(m_allocatorDma, sizeof(uint32_t) * m_oitTileCount, m_ringFences.getCycleSize());
+    m_oitCounterReadback.setName(m_debug, "m_oitCounterReadback");
+    m_linkedListLowCount = 0;
+    m_linkedListLowPeak  = 0;
+  }
+
+  if(m_state.usesComputeComposite())
+  {
+    // Written by oitComposite.comp.glsl, and read by oitCompositeBlend.frag.glsl.
+    createFrameImage(m_oitCompositeImage, VK_IMAGE_ASPECT_COLOR_BIT, VK_FORMAT_R16G16B16A16_SFLOAT, oitWidth, oitHeight,
+                     auxLayers, VK_IMAGE_USAGE_STORAGE_BIT);
+    m_oitCompositeImage.setName(m_debug, "m_oitCompositeImage");
+    m_oitCompositeImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_GENERAL, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+  }
+
+  if(m_state.countsFragments())
+  {
+    // Unlike the auxiliary images, this always covers all of m_colorImage,
+    // and counts per pixel (see oitStats.glsl).
+    createFrameImage(m_fragmentStatsImage, VK_IMAGE_ASPECT_COLOR_BIT, VK_FORMAT_R32_UINT, bufferWidth, bufferHeight,
+                     NUM_STATS_LAYERS, auxUsages);
+    m_fragmentStatsImage.setName(m_debug, "m_fragmentStatsImage");
+    m_fragmentStatsImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_GENERAL, auxAccesses);
+
+    m_fragmentStatsBuffer = m_allocatorDma.createBuffer(sizeof(FragmentStats),  // Buffer size
+                                                        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT
+                                                            | VK_BUFFER_USAGE_TRANSFER_DST_BIT,  // Usage
+                                                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT      // Memory flags
+    );
+    m_debug.setObjectName(m_fragmentStatsBuffer.buffer, "m_fragmentStatsBuffer");
+
+    m_fragmentStatsReadback.create(m_allocatorDma, sizeof(FragmentStats), m_ringFences.getCycleSize());
+    m_fragmentStatsReadback.setName(m_debug, "m_fragmentStatsReadback");
   }
 
   if(m_state.algorithm == OIT_WEIGHTED)
   {
     // Weighted, Blended OIT's color and reveal textures will be used both as
     // color attachments and as storage images (i.e. accessed via imageLoad).
-    // We'll handle their transitions inside of drawTransparentWeighted.
+    // m_renderPassWeighted clears them and handles their transitions, starting
+    // from VK_IMAGE_LAYOUT_UNDEFINED, so they can alias m_downsampleImage.
     const VkImageUsageFlags weightedUsages = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
-    m_oitWeightedColorImage.create(m_context, m_allocatorDma, VK_IMAGE_TYPE_2D, VK_IMAGE_ASPECT_COLOR_BIT,
-                                   m_oitWeightedColorFormat, bufferWidth, bufferHeight, 1, weightedUsages, m_state.msaa);
-    m_oitWeightedRevealImage.create(m_context, m_allocatorDma, VK_IMAGE_TYPE_2D, VK_IMAGE_ASPECT_COLOR_BIT,
-                                    m_oitWeightedRevealFormat, bufferWidth, bufferHeight, 1, weightedUsages, m_state.msaa);
+    m_oitWeightedColorImage.createUnbound(m_context, VK_IMAGE_TYPE_2D, VK_IMAGE_ASPECT_COLOR_BIT, m_oitWeightedColorFormat,
+                                          bufferWidth, bufferHeight, numViews, weightedUsages, m_state.msaa);
+    m_oitWeightedRevealImage.createUnbound(m_context, VK_IMAGE_TYPE_2D, VK_IMAGE_ASPECT_COLOR_BIT, m_oitWeightedRevealFormat,
+                                           bufferWidth, bufferHeight, numViews, weightedUsages, m_state.msaa);
+  }
+
+  if(m_state.algorithm == OIT_MOMENTS)
+  {
+    // Like the weighted textures, these are color attachments in one subpass
+    // of m_renderPassMoments and input attachments in the next ones.
+    const VkImageUsageFlags momentsUsages = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
+    m_oitMomentsImage.createUnbound(m_context, VK_IMAGE_TYPE_2D, VK_IMAGE_ASPECT_COLOR_BIT, m_oitMomentsFormat,
+                                    bufferWidth, bufferHeight, numViews, momentsUsages, m_state.msaa);
+    m_oitMomentsZerothImage.createUnbound(m_context, VK_IMAGE_TYPE_2D, VK_IMAGE_ASPECT_COLOR_BIT, m_oitMomentsZerothFormat,
+                                          bufferWidth, bufferHeight, numViews, momentsUsages, m_state.msaa);
+    m_oitMomentsAccumImage.createUnbound(m_context, VK_IMAGE_TYPE_2D, VK_IMAGE_ASPECT_COLOR_BIT, m_oitMomentsAccumFormat,
+                                         bufferWidth, bufferHeight, numViews, momentsUsages, m_state.msaa);
+  }
+
+  // The transparent pass's targets are only used within its render pass, and
+  // m_downsampleImage only after it (see copyOffscreenToBackBuffer), so they
+  // can share memory. Images that weren't created above are skipped.
+  bindAliasedFrameImages({{&m_oitWeightedColorImage, &m_oitWeightedRevealImage, &m_oitMomentsImage,
+                           &m_oitMomentsZerothImage, &m_oitMomentsAccumImage},
+                          {&m_downsampleImage}});
+  if(m_downsampleImage.view != nullptr)
+  {
+    m_downsampleImage.setName(m_debug, "m_downsampleTargetImage");
+  }
+  if(m_oitWeightedColorImage.view != nullptr)
+  {
     m_oitWeightedColorImage.setName(m_debug, "m_oitWeightedColorImage");
     m_oitWeightedRevealImage.setName(m_debug, "m_oitWeightedRevealImage");
-    // Transition both of them to color attachments, which is the way they'll first be used:
-    // (see m_renderPassWeighted for reference)
-    m_oitWeightedColorImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
-    m_oitWeightedRevealImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
   }
+  if(m_oitMomentsImage.view != nullptr)
+  {
+    m_oitMomentsImage.setName(m_debug, "m_oitMomentsImage");
+    m_oitMomentsZerothImage.setName(m_debug, "m_oitMomentsZerothImage");
+    m_oitMomentsAccumImage.setName(m_debug, "m_oitMomentsAccumImage");
+  }
+
+  // Free the memory of earlier frame images that these didn't reuse.
+  m_frameMemory.trim();
+}
+
+void Sample::createFrameImage(ImageAndView&      image,
+                              VkImageAspectFlags viewAspect,
+                              VkFormat           format,
+                              uint32_t           width,
+                              uint32_t           height,
+                              uint32_t           arrayLayers,
+                              VkImageUsageFlags  usage,
+                              uint32_t           numSamples)
+{
+  const VkMemoryRequirements requirements =
+      image.createUnbound(m_context, VK_IMAGE_TYPE_2D, viewAspect, format, width, height, arrayLayers, usage, numSamples);
+  const MemoryArena::Allocation allocation = m_frameMemory.allocate(requirements);
+  image.bind(m_context, allocation.memory, allocation.offset);
+}
+
+void Sample::bindAliasedFrameImages(const std::vector<std::vector<ImageAndView*>>& groups)
+{
+  // Lay out each group, and compute requirements that fit all of them.
+  VkMemoryRequirements                   combined = {0, 1, ~0u};
+  std::vector<std::vector<VkDeviceSize>> offsets(groups.size());
+  for(size_t group = 0; group < groups.size(); group++)
+  {
+    VkDeviceSize size = 0;
+    for(ImageAndView* image : groups[group])
+    {
+      VkMemoryRequirements requirements = {};
+      if(image->image.image != nullptr)
+      {
+        vkGetImageMemoryRequirements(m_context, image->image.image, &requirements);
+        size               = (size + requirements.alignment - 1) & ~(requirements.alignment - 1);
+        combined.alignment = std::max(combined.alignment, requirements.alignment);
+        combined.memoryTypeBits &= requirements.memoryTypeBits;
+      }
+      offsets[group].push_back(size);
+      size += requirements.size;
+    }
+    combined.size = std::max(combined.size, size);
+  }
+
+  if(combined.size == 0)
+  {
+    return;
+  }
+
+  // If no memory type fits all of the images, give each image its own memory.
+  if(combined.memoryTypeBits == 0)
+  {
+    for(const std::vector<ImageAndView*>& group : groups)
+    {
+      for(ImageAndView* image : group)
+      {
+        bindAliasedFrameImages({{image}});
+      }
+    }
+    return;
+  }
+
+  const MemoryArena::Allocation allocation = m_frameMemory.allocate(combined);
+  for(size_t group = 0; group < groups.size(); group++)
+  {
+    for(size_t i = 0; i < groups[group].size(); i++)
+    {
+      if(groups[group][i]->image.image != nullptr)
+      {
+        groups[group][i]->bind(m_context, allocation.memory, allocation.offset + offsets[group][i]);
+      }
+    }
+  }
+}
+
+VkDeviceSize Sample::getLinkedListNodeBytes() const
+{
+  // (color, depth, mask, next), or (color, depth and mask, next) when packed
+  return m_state.usesPackedABuffer() ? 3 * sizeof(uint32_t) : sizeof(uvec4);
+}
+
+uint32_t Sample::getABufferPlaneSize() const
+{
+  const uint32_t width  = m_oitTileExtent.width;
+  const uint32_t height = m_oitTileExtent.height;
+  if(m_state.activeABufferLayout() == ABUFFER_LAYOUT_TILED)
+  {
+    const uint32_t blocksX = (width + ABUFFER_TILE_SIZE - 1) / ABUFFER_TILE_SIZE;
+    const uint32_t blocksY = (height + ABUFFER_TILE_SIZE - 1) / ABUFFER_TILE_SIZE;
+    return blocksX * blocksY * ABUFFER_TILE_SIZE * ABUFFER_TILE_SIZE;
+  }
+  return width * height;
+}
+
+void Sample::resizeLinkedListABuffer(VkDeviceSize numNodes)
+{
+  assert(m_state.algorithm == OIT_LINKEDLIST);
+
+  // The A-buffer may still be in use by frames in flight, so retire it.
+  // The new one comes from m_allocatorDma rather than m_frameMemory, since the
+  // arena only reuses memory once all frame images are recreated, and this can
+  // happen many times in between.
+  retireBuffer(m_oitABuffer);
+  m_oitABuffer.create(m_context, m_allocatorDma, numNodes * getLinkedListNodeBytes(), VK_BUFFER_USAGE_STORAGE_TEXEL_BUFFER_BIT,
+                      m_state.usesPackedABuffer() ? VK_FORMAT_R32_UINT : VK_FORMAT_R32G32B32A32_UINT);
+  m_oitABuffer.setName(m_debug, "m_oitABuffer");
+  // The shader tail-blends nodes past this index; this gets uploaded with the
+  // next call to updateUniformBuffer.
+  m_sceneUbo.linkedListAllocatedPerElement = static_cast<uint32_t>(numNodes);
+
+  // The current descriptor sets may also be in use, so this allocates new ones.
+  updateAllDescriptorSets();
+
+  LOGI("linked list: resized A-buffer to %zu nodes (%zu bytes)\n", static_cast<size_t>(numNodes),
+       static_cast<size_t>(m_oitABuffer.size));
+}
+
+void Sample::updateLinkedListCapacity()
+{
+  if(m_state.algorithm != OIT_LINKEDLIST)
+  {
+    return;
+  }
+
+  // Only read the slot if a copy was recorded into it; we've already waited
+  // for this ring cycle's fence, so the copy has completed.
+  const uint32_t* counters =
+      static_cast<const uint32_t*>(m_oitCounterReadback.read(m_ringFences.getCycleIndex(), m_frame));
+  if(counters == nullptr)
+  {
+    return;
+  }
+
+  // When using tiles, the A-buffer has to fit the tile that needed the most.
+  m_linkedListNodesUsed = 0;
+  for(uint32_t tile = 0; tile < m_oitTileCount; tile++)
+  {
+    m_linkedListNodesUsed = std::max(m_linkedListNodesUsed, counters[tile]);
+  }
+  m_linkedListNodesHistory.push(static_cast<float>(m_linkedListNodesUsed));
+
+  if(!m_state.linkedListAdaptive)
+  {
+    return;
+  }
+
+  // The counter keeps incrementing after the A-buffer is full, so this is the
+  // number of nodes the frame needed, even if some were tail-blended.
+  // Node 0 is the list terminator, so we need one more node than that.
+  const VkDeviceSize needed   = static_cast<VkDeviceSize>(m_linkedListNodesUsed) + 1;
+  const VkDeviceSize capacity = m_sceneUbo.linkedListAllocatedPerElement;
+
+  // Hysteresis: grow as soon as we use more than 90% of the A-buffer, but only
+  // shrink after using less than half of it for shrinkDelay readbacks in a
+  // row. Both resize to 125% of what was needed, which lies between the two
+  // thresholds, so that a steady scene doesn't oscillate between sizes.
+  const uint32_t shrinkDelay = 60;
+  VkDeviceSize   newCapacity = 0;
+  if(needed * 10 > capacity * 9)
+  {
+    newCapacity          = needed + needed / 4;
+    m_linkedListLowCount = 0;
+  }
+  else if(needed * 2 < capacity)
+  {
+    m_linkedListLowPeak = (m_linkedListLowCount == 0 ? static_cast<uint32_t>(needed) :
+                                                       std::max(m_linkedListLowPeak, static_cast<uint32_t>(needed)));
+    m_linkedListLowCount++;
+    if(m_linkedListLowCount >= shrinkDelay)
+    {
+      newCapacity          = static_cast<VkDeviceSize>(m_linkedListLowPeak) + m_linkedListLowPeak / 4;
+      m_linkedListLowCount = 0;
+    }
+  }
+  else
+  {
+    m_linkedListLowCount = 0;
+  }
+
+  if(newCapacity == 0)
+  {
+    return;
+  }
+
+  // Always allow at least one node per pixel or sample, and never exceed the
+  // largest storage texel buffer the device supports (packed nodes use three
+  // texels each).
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(m_context.m_physicalDevice, &properties);
+  const VkDeviceSize minCapacity = static_cast<VkDeviceSize>(m_oitTileExtent.width) * m_oitTileExtent.height
+                                   * m_state.numABufferPlanes();
+  const VkDeviceSize maxCapacity = properties.limits.maxTexelBufferElements / (m_state.usesPackedABuffer() ? 3 : 1);
+  newCapacity                    = std::min(std::max(newCapacity, minCapacity), maxCapacity);
+
+  if(newCapacity != capacity)
+  {
+    resizeLinkedListABuffer(newCapacity);
+  }
+}
+
+bool Sample::updateFragmentStats()
+{
+  if(!m_state.countsFragments())
+  {
+    return false;
+  }
+
+  // As in updateLinkedListCapacity, we've already waited for this ring
+  // cycle's fence, so the copy into its slot has completed.
+  const FragmentStats* newStats =
+      static_cast<const FragmentStats*>(m_fragmentStatsReadback.read(m_ringFences.getCycleIndex(), m_frame));
+  if(newStats == nullptr)
+  {
+    return false;
+  }
+  const FragmentStats& stats = *newStats;
+
+  FragmentStatsSummary summary;
+  summary.valid             = true;
+  summary.coveredPixels     = stats.coveredPixels;
+  summary.totalFragments    = stats.totalFragments;
+  summary.overflowFragments = stats.overflowFragments;
+  summary.overflowPixels    = stats.overflowPixels;
+  summary.maxFragments      = stats.maxFragments;
+  summary.aBufferWrites     = stats.aBufferWrites;
+  summary.lockAttempts      = stats.lockAttempts;
+  std::copy(std::begin(stats.histogram), std::end(stats.histogram), std::begin(summary.histogram));
+  if(stats.coveredPixels != 0)
+  {
+    summary.meanFragments = static_cast<double>(stats.totalFragments) / static_cast<double>(stats.coveredPixels);
+
+    // The 95th percentile is the first bin at which the running sum reaches
+    // 95% of the covered pixels. Since the last bin includes all larger
+    // counts, the result is at most STATS_HISTOGRAM_BINS - 1.
+    const uint64_t threshold = (static_cast<uint64_t>(stats.coveredPixels) * 95 + 99) / 100;
+    uint64_t       sum       = 0;
+    for(uint32_t bin = 0; bin < STATS_HISTOGRAM_BINS; bin++)
+    {
+      sum += stats.histogram[bin];
+      if(sum >= threshold)
+      {
+        summary.p95Fragments = bin;
+        break;
+      }
+    }
+  }
+  if(stats.totalFragments != 0)
+  {
+    summary.overflowPercent = 100.0 * static_cast<double>(stats.overflowFragments) / static_cast<double>(stats.totalFragments);
+    summary.writesPerFragment = static_cast<double>(stats.aBufferWrites) / static_cast<double>(stats.totalFragments);
+    summary.attemptsPerFragment = static_cast<double>(stats.lockAttempts) / static_cast<double>(stats.totalFragments);
+  }
+
+  m_fragmentStats = summary;
+  m_meanFragmentsHistory.push(static_cast<float>(summary.meanFragments));
+  m_overflowPercentHistory.push(static_cast<float>(summary.overflowPercent));
+  m_lockAttemptsHistory.push(static_cast<float>(summary.attemptsPerFragment));
+  return true;
+}
+
+void Sample::updateAdaptiveLayers(bool newStats)
+{
+  if(!m_state.usesAdaptiveLayers())
+  {
+    m_activeLayers           = m_state.oitLayers;
+    m_adaptiveLayersLowCount = 0;
+    return;
+  }
+
+  // Start with the most layers until the first statistics arrive, and only
+  // look at each readback once.
+  if(m_activeLayers == 0 || m_activeLayers > m_state.oitLayers)
+  {
+    m_activeLayers           = m_state.oitLayers;
+    m_adaptiveLayersLowCount = 0;
+  }
+  if(!newStats || !m_fragmentStats.valid || m_fragmentStats.totalFragments == 0)
+  {
+    return;
+  }
+
+  // The counts include all fragments no matter how many layers were used, so
+  // we can estimate how many fragments each layer count would let overflow:
+  // a pixel with n fragments overflows max(0, n - layers) of them. The counts
+  // are per pixel (see statsPerPixel); with sample shading, they're the
+  // average over the pixel's samples, each of which has its own layers, so
+  // they compare with the layers directly.
+  // The last bin includes all larger counts, so this underestimates the
+  // overflow of the most complex pixels; if the layers reach the last bin,
+  // we still count one overflowing fragment for each of its pixels.
+  const FragmentStatsSummary& stats        = m_fragmentStats;
+  const double                maxOverflow  = static_cast<double>(m_state.adaptiveOverflowPercent) / 100.0;
+  uint32_t                    neededLayers = m_state.oitLayers;
+  for(uint32_t layers : ADAPTIVE_LAYER_COUNTS)
+  {
+    if(layers >= m_state.oitLayers)
+    {
+      break;
+    }
+
+    const uint64_t slots    = layers;
+    uint64_t       overflow = 0;
+    for(uint64_t bin = std::min<uint64_t>(slots + 1, STATS_HISTOGRAM_BINS - 1); bin < STATS_HISTOGRAM_BINS; bin++)
+    {
+      overflow += stats.histogram[bin] * (bin > slots ? bin - slots : 1);
+    }
+    if(static_cast<double>(overflow) <= maxOverflow * static_cast<double>(stats.totalFragments))
+    {
+      neededLayers = layers;
+      break;
+    }
+  }
+
+  // Hysteresis, like in updateLinkedListCapacity: use more layers as soon as
+  // they're needed, but only use fewer once they were enough for shrinkDelay
+  // readbacks in a row, using the most those readbacks needed.
+  const uint32_t shrinkDelay = 30;
+  if(neededLayers >= m_activeLayers)
+  {
+    m_activeLayers           = neededLayers;
+    m_adaptiveLayersLowCount = 0;
+    return;
+  }
+
+  m_adaptiveLayersLowPeak = (m_adaptiveLayersLowCount == 0 ? neededLayers : std::max(m_adaptiveLayersLowPeak, neededLayers));
+  m_adaptiveLayersLowCount++;
+  if(m_adaptiveLayersLowCount >= shrinkDelay)
+  {
+    m_activeLayers           = m_adaptiveLayersLowPeak;
+    m_adaptiveLayersLowCount = 0;
+  }
+}
+
+const LayerVariant* Sample::getActiveLayerVariant() const
+{
+  if(!m_state.usesAdaptiveLayers() || m_activeLayers >= m_state.oitLayers)
+  {
+    return nullptr;
+  }
+
+  for(uint32_t i = 0; i < NUM_ADAPTIVE_LAYER_COUNTS; i++)
+  {
+    if(ADAPTIVE_LAYER_COUNTS[i] == m_activeLayers)
+    {
+      return &m_layerVariants[i];
+    }
+  }
+  return nullptr;
 }
 
 void Sample::destroyDescriptorSets()
 {
+  retireDescriptorPool();
+  // Unlike the descriptor pool, the layouts can be destroyed while frames in
+  // flight use descriptor sets and pipelines created with them.
   m_descriptorInfo.deinit();
 }
 
+void Sample::retireDescriptorPool()
+{
+  if(m_descriptorPool != nullptr)
+  {
+    VkDevice         device  = m_context;
+    VkDescriptorPool retired = m_descriptorPool;
+    retire([device, retired]() { vkDestroyDescriptorPool(device, retired, nullptr); });
+    m_descriptorPool = nullptr;
+  }
+  m_descriptorSet = nullptr;
+}
+
 void Sample::createDescriptorSets()
 {
   destroyDescriptorSets();
@@ -253,10 +785,13 @@ void Sample::createDescriptorSets()
 
   m_descriptorInfo.init(m_context);
 
+  // The stages that draw the scene's spheres
+  const VkShaderStageFlags sceneStages = getSceneShaderStages();
+
   // Descriptors get assigned to a triplet (descriptor set index,
   // binding index, array index). So we have to let the descriptor
   // set container know that the size of the array of each of these is 1.
-  m_descriptorInfo.addBinding(UBO_SCENE, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
+  m_descriptorInfo.addBinding(UBO_SCENE, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1, sceneStages);
   // OIT_LOOP64 uses a storage buffer A-buffer, while all other algorithms use a storage texel buffer A-buffer.
   if(m_state.algorithm == OIT_LOOP64)
   {
@@ -264,9 +799,10 @@ void Sample::createDescriptorSets()
   }
   else
   {
-    m_descriptorInfo.addBinding(IMG_ABUFFER, VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER, 1, VK_SHADER_STAGE_FRAGMENT_BIT);
+    m_descriptorInfo.addBinding(IMG_ABUFFER, VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER, 1,
+                                VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT);
   }
-  m_descriptorInfo.addBinding(IMG_AUX, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_FRAGMENT_BIT);
+  m_descriptorInfo.addBinding(IMG_AUX, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT);
   m_descriptorInfo.addBinding(IMG_AUXSPIN, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_FRAGMENT_BIT);
   m_descriptorInfo.addBinding(IMG_AUXDEPTH, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_FRAGMENT_BIT);
   m_descriptorInfo.addBinding(IMG_COUNTER, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_FRAGMENT_BIT);
@@ -274,51 +810,68 @@ void Sample::createDescriptorSets()
   // see how the render pass is created.
   m_descriptorInfo.addBinding(IMG_WEIGHTED_COLOR, VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, 1, VK_SHADER_STAGE_FRAGMENT_BIT);
   m_descriptorInfo.addBinding(IMG_WEIGHTED_REVEAL, VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, 1, VK_SHADER_STAGE_FRAGMENT_BIT);
-
-  // We'll create one descriptor set per swapchain image.
-  const uint32_t totalDescriptorSets = m_swapChain.getImageCount();
-
-  // Create the layout
+  // Moment-based OIT (see m_renderPassMoments)
+  m_descriptorInfo.addBinding(IMG_MOMENTS, VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, 1, VK_SHADER_STAGE_FRAGMENT_BIT);
+  m_descriptorInfo.addBinding(IMG_MOMENTS_ZEROTH, VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, 1, VK_SHADER_STAGE_FRAGMENT_BIT);
+  m_descriptorInfo.addBinding(IMG_MOMENTS_ACCUM, VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, 1, VK_SHADER_STAGE_FRAGMENT_BIT);
+  // GPU culling (see hiz.comp.glsl and cull.comp.glsl)
+  m_descriptorInfo.addBinding(IMG_DEPTH, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+  m_descriptorInfo.addBinding(IMG_HIZ, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+  m_descriptorInfo.addBinding(IMG_HIZ_LEVELS, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, HIZ_MAX_LEVELS, VK_SHADER_STAGE_COMPUTE_BIT);
+  m_descriptorInfo.addBinding(BUF_OBJECT_BOUNDS, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                              sceneStages & ~(VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT));
+  m_descriptorInfo.addBinding(BUF_DRAW_COMMANDS, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+  m_descriptorInfo.addBinding(BUF_DRAW_COUNTS, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+  m_descriptorInfo.addBinding(BUF_SORT_KEYS, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+  m_descriptorInfo.addBinding(BUF_SORT_BUCKETS, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+  // Compute composite (see oitComposite.comp.glsl)
+  m_descriptorInfo.addBinding(IMG_COMPOSITE, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT);
+  // Fragment statistics (see oitStats.glsl and fragmentStats.comp.glsl)
+  m_descriptorInfo.addBinding(IMG_FRAGMENT_STATS, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1,
+                              VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT);
+  m_descriptorInfo.addBinding(BUF_FRAGMENT_STATS, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+  // Compute resolve (see resolve.comp.glsl)
+  m_descriptorInfo.addBinding(IMG_RESOLVE_SRC, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+  m_descriptorInfo.addBinding(IMG_RESOLVE_DST, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+  // Mesh shaders (see sphere.mesh.glsl)
+  m_descriptorInfo.addBinding(BUF_INSTANCE_COLORS, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, sceneStages);
+
+  // Create the layout. The descriptor sets themselves are allocated by
+  // updateAllDescriptorSets.
   m_descriptorInfo.initLayout();
 
-  // Create a descriptor pool with space fot totalDescriptorSets descriptor sets,
-  // and allocate the descriptor sets.
-  m_descriptorInfo.initPool(totalDescriptorSets);
-
-// Set the descriptor sets' debug names.
-#ifdef _DEBUG
-  for(uint32_t i = 0; i < m_descriptorInfo.getSetsCount(); i++)
-  {
-    const std::string generatedName = "Descriptor Set " + std::to_string(i);
-    m_debug.setObjectName(m_descriptorInfo.getSet(i), generatedName.c_str());
-  }
-#endif
-
-  // Create the pipeline layout. This application doesn't use any push constants,
-  // so the function is relatively simple.
-  m_descriptorInfo.initPipeLayout(0, nullptr, 0);
+  // Create the pipeline layout. The push constants hold the tile offset and
+  // the culling parameters (see PushConstants in common.h).
+  VkPushConstantRange pushConstantRange = {};
+  pushConstantRange.stageFlags          = sceneStages;
+  pushConstantRange.offset              = 0;
+  pushConstantRange.size                = sizeof(PushConstants);
+  m_descriptorInfo.initPipeLayout(1, &pushConstantRange, 0);
 }
 
 void Sample::updateAllDescriptorSets()
 {
   std::vector<VkWriteDescriptorSet> updates;
 
-  // We create one descriptor set per swapchain image.
-  const uint32_t totalDescriptorSets = m_swapChain.getImageCount();
+  // UBO_SCENE is a dynamic uniform buffer, so all frames in flight can use
+  // the same descriptor set, binding their own slot of m_uniformBuffer.
+  // Frames in flight may still use the previous descriptor set, so instead of
+  // updating it, retire its pool and allocate a new one.
+  retireDescriptorPool();
+  const nvvk::DescriptorSetBindings& bindings = m_descriptorInfo.getBindings();
+  m_descriptorPool                             = bindings.createPool(m_context, 1);
+  m_descriptorSet = nvvk::allocateDescriptorSet(m_context, m_descriptorPool, m_descriptorInfo.getLayout());
+  m_debug.setObjectName(m_descriptorSet, "m_descriptorSet");
 
   // Information about the buffer and image descriptors we'll use.
   // When constructing VkWriteDescriptorSet objects, we'll take references
   // to these.
 
-  // UBO_SCENE
-  std::vector<VkDescriptorBufferInfo> uboBufferInfo;
-  uboBufferInfo.resize(totalDescriptorSets);
-  for(uint32_t ring = 0; ring < totalDescriptorSets; ring++)
-  {
-    uboBufferInfo[ring].buffer = m_uniformBuffers[ring].buffer;
-    uboBufferInfo[ring].offset = 0;
-    uboBufferInfo[ring].range  = sizeof(SceneData);
-  }
+  // UBO_SCENE; the offset of the frame's slot is added when binding the set.
+  VkDescriptorBufferInfo uboBufferInfo = {};
+  uboBufferInfo.buffer                 = m_uniformBuffer.buffer;
+  uboBufferInfo.offset                 = 0;
+  uboBufferInfo.range                  = sizeof(SceneData);
 
   // Auxiliary images (note that their image views may be nullptr - this is fixed later):
   VkDescriptorImageInfo oitAuxInfo = {};
@@ -335,6 +888,14 @@ void Sample::updateAllDescriptorSets()
   VkDescriptorImageInfo oitCounterInfo = oitAuxInfo;
   oitCounterInfo.imageView             = m_oitCounterImage.view;
 
+  VkDescriptorImageInfo oitCompositeInfo = oitAuxInfo;
+  oitCompositeInfo.imageView             = m_oitCompositeImage.view;
+
+  VkDescriptorImageInfo fragmentStatsInfo = oitAuxInfo;
+  fragmentStatsInfo.imageView             = m_fragmentStatsImage.view;
+
+  VkDescriptorBufferInfo fragmentStatsBufferInfo = {m_fragmentStatsBuffer.buffer, 0, VK_WHOLE_SIZE};
+
   VkDescriptorImageInfo oitWeightedColorInfo = {};
   oitWeightedColorInfo.imageLayout           = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
   oitWeightedColorInfo.imageView             = m_oitWeightedColorImage.view;
@@ -343,64 +904,153 @@ void Sample::updateAllDescriptorSets()
   VkDescriptorImageInfo oitWeightedRevealInfo = oitWeightedColorInfo;
   oitWeightedRevealInfo.imageView             = m_oitWeightedRevealImage.view;
 
+  VkDescriptorImageInfo oitMomentsInfo = oitWeightedColorInfo;
+  oitMomentsInfo.imageView             = m_oitMomentsImage.view;
+
+  VkDescriptorImageInfo oitMomentsZerothInfo = oitWeightedColorInfo;
+  oitMomentsZerothInfo.imageView             = m_oitMomentsZerothImage.view;
+
+  VkDescriptorImageInfo oitMomentsAccumInfo = oitWeightedColorInfo;
+  oitMomentsAccumInfo.imageView             = m_oitMomentsAccumImage.view;
+
+  // GPU culling
+  VkDescriptorImageInfo depthInfo = {};
+  depthInfo.imageLayout           = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+  depthInfo.imageView             = m_depthImage.view;
+  depthInfo.sampler               = m_nearestSampler;
+
+  VkDescriptorImageInfo hizInfo = {};
+  hizInfo.imageLayout           = VK_IMAGE_LAYOUT_GENERAL;
+  hizInfo.imageView             = m_hizView;
+  hizInfo.sampler               = m_nearestSampler;
+
+  // Every element of the array has to be valid, so repeat the last level.
+  std::array<VkDescriptorImageInfo, HIZ_MAX_LEVELS> hizLevelInfos = {};
+  for(uint32_t level = 0; level < HIZ_MAX_LEVELS && !m_hizLevelViews.empty(); level++)
+  {
+    hizLevelInfos[level].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    hizLevelInfos[level].imageView = m_hizLevelViews[std::min(level, static_cast<uint32_t>(m_hizLevelViews.size()) - 1)];
+  }
+
+  // Compute resolve
+  VkDescriptorImageInfo resolveSrcInfo = {};
+  resolveSrcInfo.imageLayout           = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  resolveSrcInfo.imageView             = m_colorImage.view;
+  resolveSrcInfo.sampler               = m_nearestSampler;
+
+  VkDescriptorImageInfo resolveDstInfo = {};
+  resolveDstInfo.imageLayout           = VK_IMAGE_LAYOUT_GENERAL;
+  resolveDstInfo.imageView             = m_guiCompositeImage.view;
+
+  VkDescriptorBufferInfo objectBoundsInfo = {m_objectBoundsBuffer.buffer, 0, VK_WHOLE_SIZE};
+  VkDescriptorBufferInfo drawCommandsInfo = {m_drawCommandsBuffer.buffer, 0, VK_WHOLE_SIZE};
+  VkDescriptorBufferInfo drawCountsInfo   = {m_drawCountsBuffer.buffer, 0, VK_WHOLE_SIZE};
+  VkDescriptorBufferInfo sortKeysInfo     = {m_sortKeysBuffer.buffer, 0, VK_WHOLE_SIZE};
+  VkDescriptorBufferInfo sortBucketsInfo  = {m_sortBucketsBuffer.buffer, 0, VK_WHOLE_SIZE};
+  VkDescriptorBufferInfo instanceColorsInfo = {m_instanceColorBuffer.buffer, 0, VK_WHOLE_SIZE};
+
   // IMG_ABUFFER (when used as a storage buffer instead of a storage texel buffer)
   VkDescriptorBufferInfo oitABufferInfo = {};
   oitABufferInfo.buffer                 = m_oitABuffer.buffer.buffer;
   oitABufferInfo.offset                 = 0;
   oitABufferInfo.range                  = VK_WHOLE_SIZE;
 
-  // Descriptor sets without the color buffer bound to the shader stage
-  for(uint32_t ring = 0; ring < totalDescriptorSets; ring++)
-  {
-    updates.push_back(m_descriptorInfo.makeWrite(ring, UBO_SCENE, &uboBufferInfo[ring]));
+  // The descriptor set, without the color buffer bound to the shader stage
+  updates.push_back(bindings.makeWrite(m_descriptorSet, UBO_SCENE, &uboBufferInfo));
 
-    if(m_state.algorithm == OIT_LOOP64)
-    {
-      // IMG_ABUFFER is a storage buffer
-      updates.push_back(m_descriptorInfo.makeWrite(ring, IMG_ABUFFER, &oitABufferInfo));
-    }
-    else
+  if(m_state.algorithm == OIT_LOOP64)
+  {
+    // IMG_ABUFFER is a storage buffer
+    updates.push_back(bindings.makeWrite(m_descriptorSet, IMG_ABUFFER, &oitABufferInfo));
+  }
+  else
+  {
+    // IMG_ABUFFER is a storage texel buffer (which is a kind of buffer in
+    // Vulkan, but a kind of texture in OpenGL).
+    if(m_oitABuffer.view != nullptr)
     {
-      // IMG_ABUFFER is a storage texel buffer (which is a kind of buffer in
-      // Vulkan, but a kind of texture in OpenGL).
-      if(m_oitABuffer.view != nullptr)
-      {
-        updates.push_back(m_descriptorInfo.makeWrite(ring, IMG_ABUFFER, &m_oitABuffer.view));
-      }
+      updates.push_back(bindings.makeWrite(m_descriptorSet, IMG_ABUFFER, &m_oitABuffer.view));
     }
+  }
 
-    if(oitAuxInfo.imageView != nullptr)
-    {
-      updates.push_back(m_descriptorInfo.makeWrite(ring, IMG_AUX, &oitAuxInfo));
-    }
+  if(oitAuxInfo.imageView != nullptr)
+  {
+    updates.push_back(bindings.makeWrite(m_descriptorSet, IMG_AUX, &oitAuxInfo));
+  }
 
-    if(oitAuxSpinInfo.imageView != nullptr)
-    {
-      updates.push_back(m_descriptorInfo.makeWrite(ring, IMG_AUXSPIN, &oitAuxSpinInfo));
-    }
+  if(oitAuxSpinInfo.imageView != nullptr)
+  {
+    updates.push_back(bindings.makeWrite(m_descriptorSet, IMG_AUXSPIN, &oitAuxSpinInfo));
+  }
 
-    if(oitAuxDepthInfo.imageView != nullptr)
-    {
-      updates.push_back(m_descriptorInfo.makeWrite(ring, IMG_AUXDEPTH, &oitAuxDepthInfo));
-    }
+  if(oitAuxDepthInfo.imageView != nullptr)
+  {
+    updates.push_back(bindings.makeWrite(m_descriptorSet, IMG_AUXDEPTH, &oitAuxDepthInfo));
+  }
 
-    if(oitCounterInfo.imageView != nullptr)
-    {
-      updates.push_back(m_descriptorInfo.makeWrite(ring, IMG_COUNTER, &oitCounterInfo));
-    }
+  if(oitCounterInfo.imageView != nullptr)
+  {
+    updates.push_back(bindings.makeWrite(m_descriptorSet, IMG_COUNTER, &oitCounterInfo));
+  }
 
-    if(oitWeightedColorInfo.imageView != nullptr)
-    {
-      updates.push_back(m_descriptorInfo.makeWrite(ring, IMG_WEIGHTED_COLOR, &oitWeightedColorInfo));
-    }
+  if(oitCompositeInfo.imageView != nullptr)
+  {
+    updates.push_back(bindings.makeWrite(m_descriptorSet, IMG_COMPOSITE, &oitCompositeInfo));
+  }
 
-    if(oitWeightedRevealInfo.imageView != nullptr)
-    {
-      updates.push_back(m_descriptorInfo.makeWrite(ring, IMG_WEIGHTED_REVEAL, &oitWeightedRevealInfo));
-    }
+  if(fragmentStatsInfo.imageView != nullptr)
+  {
+    updates.push_back(bindings.makeWrite(m_descriptorSet, IMG_FRAGMENT_STATS, &fragmentStatsInfo));
+    updates.push_back(bindings.makeWrite(m_descriptorSet, BUF_FRAGMENT_STATS, &fragmentStatsBufferInfo));
+  }
+
+  if(oitWeightedColorInfo.imageView != nullptr)
+  {
+    updates.push_back(bindings.makeWrite(m_descriptorSet, IMG_WEIGHTED_COLOR, &oitWeightedColorInfo));
+  }
+
+  if(oitWeightedRevealInfo.imageView != nullptr)
+  {
+    updates.push_back(bindings.makeWrite(m_descriptorSet, IMG_WEIGHTED_REVEAL, &oitWeightedRevealInfo));
+  }
+
+  if(oitMomentsInfo.imageView != nullptr)
+  {
+    updates.push_back(bindings.makeWrite(m_descriptorSet, IMG_MOMENTS, &oitMomentsInfo));
+    updates.push_back(bindings.makeWrite(m_descriptorSet, IMG_MOMENTS_ZEROTH, &oitMomentsZerothInfo));
+    updates.push_back(bindings.makeWrite(m_descriptorSet, IMG_MOMENTS_ACCUM, &oitMomentsAccumInfo));
+  }
+
+  // The Hi-Z pyramid only exists when GPU culling is on.
+  if(hizInfo.imageView != nullptr)
+  {
+    updates.push_back(bindings.makeWrite(m_descriptorSet, IMG_DEPTH, &depthInfo));
+    updates.push_back(bindings.makeWrite(m_descriptorSet, IMG_HIZ, &hizInfo));
+    updates.push_back(bindings.makeWriteArray(m_descriptorSet, IMG_HIZ_LEVELS, hizLevelInfos.data()));
   }
 
-  // Now go ahead and update the descriptor sets!
+  if(m_drawCommandsBuffer.buffer != nullptr)
+  {
+    updates.push_back(bindings.makeWrite(m_descriptorSet, BUF_OBJECT_BOUNDS, &objectBoundsInfo));
+    updates.push_back(bindings.makeWrite(m_descriptorSet, BUF_DRAW_COMMANDS, &drawCommandsInfo));
+    updates.push_back(bindings.makeWrite(m_descriptorSet, BUF_DRAW_COUNTS, &drawCountsInfo));
+    updates.push_back(bindings.makeWrite(m_descriptorSet, BUF_SORT_KEYS, &sortKeysInfo));
+    updates.push_back(bindings.makeWrite(m_descriptorSet, BUF_SORT_BUCKETS, &sortBucketsInfo));
+  }
+
+  // Only the instanced scene has per-object colors.
+  if(m_instanceColorBuffer.buffer != nullptr)
+  {
+    updates.push_back(bindings.makeWrite(m_descriptorSet, BUF_INSTANCE_COLORS, &instanceColorsInfo));
+  }
+
+  if(m_state.computeResolve)
+  {
+    updates.push_back(bindings.makeWrite(m_descriptorSet, IMG_RESOLVE_SRC, &resolveSrcInfo));
+    updates.push_back(bindings.makeWrite(m_descriptorSet, IMG_RESOLVE_DST, &resolveDstInfo));
+  }
+
+  // Now go ahead and update the descriptor set!
   vkUpdateDescriptorSets(m_context, static_cast<uint32_t>(updates.size()), updates.data(), 0, nullptr);
 }
 
@@ -457,23 +1107,47 @@ void Sample::createGUIRenderPass()
 
 void Sample::destroyNonGUIRenderPasses()
 {
-  if(m_renderPassColorDepthClear != nullptr)
+  VkDevice device = m_context;
+  for(VkRenderPass* renderPass :
+      {&m_renderPassColorDepthClear, &m_renderPassColorDepthLoad, &m_renderPassWeighted, &m_renderPassMoments, &m_renderPassTransparent})
   {
-    vkDestroyRenderPass(m_context, m_renderPassColorDepthClear, NULL);
-    m_renderPassColorDepthClear = nullptr;
+    if(*renderPass != nullptr)
+    {
+      VkRenderPass retired = *renderPass;
+      retire([device, retired]() { vkDestroyRenderPass(device, retired, nullptr); });
+      *renderPass = nullptr;
+    }
   }
+}
 
-  if(m_renderPassWeighted != nullptr)
-  {
-    vkDestroyRenderPass(m_context, m_renderPassWeighted, NULL);
-    m_renderPassWeighted = nullptr;
-  }
+VkDependencyFlags Sample::getFragmentDependencyFlags() const
+{
+  return VK_DEPENDENCY_BY_REGION_BIT | (m_state.usesMultiview() ? VK_DEPENDENCY_VIEW_LOCAL_BIT : 0);
 }
 
 void Sample::createNonGUIRenderPasses()
 {
   destroyNonGUIRenderPasses();
 
+  // With multiview, every subpass of these render passes draws all views at
+  // once. The views are correlated, since they see the same scene from
+  // nearby cameras. Each render pass has at most three subpasses.
+  const uint32_t                  viewMask      = (1u << m_state.numViews()) - 1;
+  const std::array<uint32_t, 3>   viewMasks     = {viewMask, viewMask, viewMask};
+  VkRenderPassMultiviewCreateInfo multiviewInfo = {VK_STRUCTURE_TYPE_RENDER_PASS_MULTIVIEW_CREATE_INFO};
+  multiviewInfo.pViewMasks                      = viewMasks.data();
+  multiviewInfo.correlationMaskCount            = 1;
+  multiviewInfo.pCorrelationMasks               = &viewMask;
+
+  auto addMultiview = [&](VkRenderPassCreateInfo& info) {
+    assert(info.subpassCount <= viewMasks.size());
+    if(m_state.usesMultiview())
+    {
+      multiviewInfo.subpassCount = info.subpassCount;
+      info.pNext                 = &multiviewInfo;
+    }
+  };
+
   // m_renderPassColorDepthClear
   // Render pass for rendering to m_colorImage and m_depthImage, clearing them
   // beforehand. Both are in VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL.
@@ -524,7 +1198,7 @@ void Sample::createNonGUIRenderPasses()
     selfDependency.dstStageMask    = selfDependency.srcStageMask;
     selfDependency.srcAccessMask   = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
     selfDependency.dstAccessMask   = selfDependency.srcAccessMask;
-    selfDependency.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;  // Required, since we use framebuffer-space stages
+    selfDependency.dependencyFlags = getFragmentDependencyFlags();  // Required, since we use framebuffer-space stages
 
     // No dependency on external data
     VkRenderPassCreateInfo rpInfo = {VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO};
@@ -534,17 +1208,95 @@ void Sample::createNonGUIRenderPasses()
     rpInfo.pSubpasses             = &subpass;
     rpInfo.dependencyCount        = 1;
     rpInfo.pDependencies          = &selfDependency;
+    addMultiview(rpInfo);
 
     NVVK_CHECK(vkCreateRenderPass(m_context, &rpInfo, NULL, &m_renderPassColorDepthClear));
     m_debug.setObjectName(m_renderPassColorDepthClear, "m_renderPassColorDepthClear");
+
+    // m_renderPassColorDepthLoad is the same, except that it keeps the
+    // previous contents of both attachments. Since it's compatible with
+    // m_renderPassColorDepthClear, it can use the same framebuffer and pipelines.
+    attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+    attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+    NVVK_CHECK(vkCreateRenderPass(m_context, &rpInfo, NULL, &m_renderPassColorDepthLoad));
+    m_debug.setObjectName(m_renderPassColorDepthLoad, "m_renderPassColorDepthLoad");
+  }
+
+  // m_renderPassTransparent
+  // Used with State::usesTransparentSubpasses. It loads m_colorImage and
+  // m_depthImage like m_renderPassColorDepthLoad, but has one subpass per
+  // transparent pass of the current algorithm, which all use both attachments.
+  // Instead of a pipeline barrier inside a single subpass, a by-region
+  // dependency orders each subpass's fragment shader writes (to the A-buffer
+  // and auxiliary images) before the next subpass's fragment shader. Since a
+  // dependency between subpasses is more specific than a barrier, drivers can
+  // keep the attachments on-chip between the passes, instead of storing them
+  // for the barrier and loading them again.
+  if(m_state.usesTransparentSubpasses())
+  {
+    std::array<VkAttachmentDescription, 2> attachments = {};  // Color attachment, depth attachment
+    attachments[0].format         = m_colorImage.c_format;
+    attachments[0].samples        = getSampleCountFlagBits(m_state.msaa);
+    attachments[0].loadOp         = VK_ATTACHMENT_LOAD_OP_LOAD;
+    attachments[0].storeOp        = VK_ATTACHMENT_STORE_OP_STORE;
+    attachments[0].stencilLoadOp  = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[0].initialLayout  = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    attachments[0].finalLayout    = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    attachments[1]               = attachments[0];
+    attachments[1].format        = m_depthImage.c_format;
+    attachments[1].initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    attachments[1].finalLayout   = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentReference colorAttachmentRef = {0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+    VkAttachmentReference depthAttachmentRef = {1, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
+
+    const uint32_t                    numSubpasses = m_state.numTransparentPasses();
+    std::vector<VkSubpassDescription> subpasses(numSubpasses);
+    std::vector<VkSubpassDependency>  dependencies(numSubpasses - 1);
+    for(uint32_t i = 0; i < numSubpasses; i++)
+    {
+      subpasses[i].pipelineBindPoint       = VK_PIPELINE_BIND_POINT_GRAPHICS;
+      subpasses[i].colorAttachmentCount    = 1;
+      subpasses[i].pColorAttachments       = &colorAttachmentRef;
+      subpasses[i].pDepthStencilAttachment = &depthAttachmentRef;
+
+      if(i + 1 < numSubpasses)
+      {
+        // Besides the A-buffer, this orders the color attachment writes of
+        // tail blending before the next subpass blends onto them.
+        dependencies[i].srcSubpass      = i;
+        dependencies[i].dstSubpass      = i + 1;
+        dependencies[i].srcStageMask    = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        dependencies[i].dstStageMask    = dependencies[i].srcStageMask;
+        dependencies[i].srcAccessMask   = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        dependencies[i].dstAccessMask   = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT
+                                          | VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        dependencies[i].dependencyFlags = getFragmentDependencyFlags();
+      }
+    }
+
+    VkRenderPassCreateInfo rpInfo = {VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO};
+    rpInfo.attachmentCount        = static_cast<uint32_t>(attachments.size());
+    rpInfo.pAttachments           = attachments.data();
+    rpInfo.subpassCount           = numSubpasses;
+    rpInfo.pSubpasses             = subpasses.data();
+    rpInfo.dependencyCount        = static_cast<uint32_t>(dependencies.size());
+    rpInfo.pDependencies          = dependencies.data();
+    addMultiview(rpInfo);
+
+    NVVK_CHECK(vkCreateRenderPass(m_context, &rpInfo, NULL, &m_renderPassTransparent));
+    m_debug.setObjectName(m_renderPassTransparent, "m_renderPassTransparent");
   }
 
   // m_renderPassWeighted
   // This render pass is used for Weighted, Blended Order-Independent
   // Transparency. It's somewhat tricky, and has two subpasses, with three
   // total attachments (weighted color, weighted reveal, color).
-  // The first two attachments are cleared, and the three attachments
-  // are all initially laid out for color attachments.
+  // The first two attachments are cleared (starting from an undefined
+  // layout), and the color attachment is initially laid out for color
+  // attachments.
   // Subpass 0 takes attachments 0 and 1, and draws to them.
   // Then subpass 1 takes attachments 0 and 1 as inputs in the
   // VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL layout and attachment 2 as an
@@ -556,11 +1308,14 @@ void Sample::createNonGUIRenderPasses()
     VkAttachmentDescription weightedColorAttachment = {};
     weightedColorAttachment.format                  = m_oitWeightedColorFormat;
     weightedColorAttachment.samples                 = static_cast<VkSampleCountFlagBits>(m_state.msaa);
+    // The weighted textures are cleared and only used within this render
+    // pass, so their previous contents don't matter - which lets them share
+    // memory with m_downsampleImage (see Sample::createFrameImages).
     weightedColorAttachment.loadOp                  = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    weightedColorAttachment.storeOp                 = VK_ATTACHMENT_STORE_OP_STORE;
+    weightedColorAttachment.storeOp                 = VK_ATTACHMENT_STORE_OP_DONT_CARE;
     weightedColorAttachment.stencilLoadOp           = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     weightedColorAttachment.stencilStoreOp          = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    weightedColorAttachment.initialLayout           = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    weightedColorAttachment.initialLayout           = VK_IMAGE_LAYOUT_UNDEFINED;
     weightedColorAttachment.finalLayout             = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 
     VkAttachmentDescription weightedRevealAttachment = weightedColorAttachment;
@@ -569,6 +1324,8 @@ void Sample::createNonGUIRenderPasses()
     VkAttachmentDescription colorAttachment = weightedColorAttachment;
     colorAttachment.format                  = m_colorImage.c_format;
     colorAttachment.loadOp                  = VK_ATTACHMENT_LOAD_OP_LOAD;
+    colorAttachment.storeOp                 = VK_ATTACHMENT_STORE_OP_STORE;
+    colorAttachment.initialLayout           = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 
     VkAttachmentDescription depthAttachment = colorAttachment;
     depthAttachment.format                  = m_depthImage.c_format;
@@ -615,11 +1372,13 @@ void Sample::createNonGUIRenderPasses()
 
     // Dependencies
     std::array<VkSubpassDependency, 3> subpassDependencies{};
+    // The previous frame's copies to and from m_downsampleImage, which shares
+    // memory with the attachments, must finish before they're cleared.
     subpassDependencies[0].srcSubpass    = VK_SUBPASS_EXTERNAL;
     subpassDependencies[0].dstSubpass    = 0;
-    subpassDependencies[0].srcStageMask  = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    subpassDependencies[0].srcStageMask  = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
     subpassDependencies[0].dstStageMask  = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    subpassDependencies[0].srcAccessMask = 0;
+    subpassDependencies[0].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
     subpassDependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
     //
     subpassDependencies[1].srcSubpass    = 0;
@@ -644,90 +1403,370 @@ void Sample::createNonGUIRenderPasses()
     renderPassInfo.pDependencies          = subpassDependencies.data();
     renderPassInfo.subpassCount           = static_cast<uint32_t>(subpasses.size());
     renderPassInfo.pSubpasses             = subpasses.data();
+    addMultiview(renderPassInfo);
     NVVK_CHECK(vkCreateRenderPass(m_context, &renderPassInfo, nullptr, &m_renderPassWeighted));
     m_debug.setObjectName(m_renderPassWeighted, "m_renderPassWeighted");
   }
+
+  // m_renderPassMoments
+  // This render pass is used for Moment-Based Order-Independent Transparency,
+  // and works like m_renderPassWeighted, but with three subpasses and five
+  // attachments (moments, zeroth moment, accumulated color, color, depth).
+  // Subpass 0 draws the moments and the zeroth moment (attachments 0 and 1).
+  // Subpass 1 reads them as inputs and draws the accumulated color
+  // (attachment 2); both subpasses test against m_depthImage.
+  // Subpass 2 reads the zeroth moment and the accumulated color as inputs and
+  // composites onto m_colorImage (attachment 3).
+  {
+    VkAttachmentDescription momentsAttachment = {};
+    momentsAttachment.format                  = m_oitMomentsFormat;
+    momentsAttachment.samples                 = static_cast<VkSampleCountFlagBits>(m_state.msaa);
+    momentsAttachment.loadOp                  = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    momentsAttachment.storeOp                 = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    momentsAttachment.stencilLoadOp           = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    momentsAttachment.stencilStoreOp          = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    momentsAttachment.initialLayout           = VK_IMAGE_LAYOUT_UNDEFINED;  // As in m_renderPassWeighted
+    momentsAttachment.finalLayout             = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentDescription zerothAttachment = momentsAttachment;
+    zerothAttachment.format                  = m_oitMomentsZerothFormat;
+
+    VkAttachmentDescription accumAttachment = momentsAttachment;
+    accumAttachment.format                  = m_oitMomentsAccumFormat;
+
+    // Only the color and depth attachments are needed after the render pass.
+    VkAttachmentDescription colorAttachment = momentsAttachment;
+    colorAttachment.format                  = m_colorImage.c_format;
+    colorAttachment.loadOp                  = VK_ATTACHMENT_LOAD_OP_LOAD;
+    colorAttachment.storeOp                 = VK_ATTACHMENT_STORE_OP_STORE;
+    colorAttachment.initialLayout           = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentDescription depthAttachment = colorAttachment;
+    depthAttachment.format                  = m_depthImage.c_format;
+    depthAttachment.initialLayout           = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depthAttachment.finalLayout             = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    const std::array<VkAttachmentDescription, 5> allAttachments = {momentsAttachment, zerothAttachment, accumAttachment,
+                                                                   colorAttachment, depthAttachment};
+
+    std::array<VkSubpassDescription, 3> subpasses{};
+
+    VkAttachmentReference depthAttachmentRef{};
+    depthAttachmentRef.attachment = 4;  // i.e. m_depthImage
+    depthAttachmentRef.layout     = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    // Subpass 0 - moments & depth texture for testing
+    std::array<VkAttachmentReference, 2> subpass0ColorAttachments{};
+    subpass0ColorAttachments[0].attachment = 0;
+    subpass0ColorAttachments[0].layout     = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    subpass0ColorAttachments[1].attachment = 1;
+    subpass0ColorAttachments[1].layout     = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    subpasses[0].pipelineBindPoint       = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpasses[0].colorAttachmentCount    = static_cast<uint32_t>(subpass0ColorAttachments.size());
+    subpasses[0].pColorAttachments       = subpass0ColorAttachments.data();
+    subpasses[0].pDepthStencilAttachment = &depthAttachmentRef;
+
+    // Subpass 1 - accumulated color & depth texture for testing
+    VkAttachmentReference subpass1ColorAttachment{};
+    subpass1ColorAttachment.attachment = 2;
+    subpass1ColorAttachment.layout     = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    std::array<VkAttachmentReference, 2> subpass1InputAttachments{};
+    subpass1InputAttachments[0].attachment = 0;
+    subpass1InputAttachments[0].layout     = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    subpass1InputAttachments[1].attachment = 1;
+    subpass1InputAttachments[1].layout     = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    subpasses[1].pipelineBindPoint       = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpasses[1].colorAttachmentCount    = 1;
+    subpasses[1].pColorAttachments       = &subpass1ColorAttachment;
+    subpasses[1].inputAttachmentCount    = static_cast<uint32_t>(subpass1InputAttachments.size());
+    subpasses[1].pInputAttachments       = subpass1InputAttachments.data();
+    subpasses[1].pDepthStencilAttachment = &depthAttachmentRef;
+
+    // Subpass 2 - composite
+    VkAttachmentReference subpass2ColorAttachment{};
+    subpass2ColorAttachment.attachment = 3;  // i.e. m_colorImage
+    subpass2ColorAttachment.layout     = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    std::array<VkAttachmentReference, 2> subpass2InputAttachments{};
+    subpass2InputAttachments[0].attachment = 1;
+    subpass2InputAttachments[0].layout     = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    subpass2InputAttachments[1].attachment = 2;
+    subpass2InputAttachments[1].layout     = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    subpasses[2].pipelineBindPoint    = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpasses[2].colorAttachmentCount = 1;
+    subpasses[2].pColorAttachments    = &subpass2ColorAttachment;
+    subpasses[2].inputAttachmentCount = static_cast<uint32_t>(subpass2InputAttachments.size());
+    subpasses[2].pInputAttachments    = subpass2InputAttachments.data();
+
+    // Dependencies
+    std::array<VkSubpassDependency, 4> subpassDependencies{};
+    // The previous frame's copies to and from m_downsampleImage, which shares
+    // memory with the attachments, must finish before they're cleared.
+    subpassDependencies[0].srcSubpass    = VK_SUBPASS_EXTERNAL;
+    subpassDependencies[0].dstSubpass    = 0;
+    subpassDependencies[0].srcStageMask  = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+    subpassDependencies[0].dstStageMask  = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    subpassDependencies[0].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    subpassDependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    // Each subpass reads what the previous one drew
+    for(uint32_t i = 1; i <= 2; i++)
+    {
+      subpassDependencies[i].srcSubpass    = i - 1;
+      subpassDependencies[i].dstSubpass    = i;
+      subpassDependencies[i].srcStageMask  = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+      subpassDependencies[i].dstStageMask  = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+      subpassDependencies[i].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+      subpassDependencies[i].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    }
+    // Allow the images to transition back to VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
+    subpassDependencies[3].srcSubpass    = 2;
+    subpassDependencies[3].dstSubpass    = VK_SUBPASS_EXTERNAL;
+    subpassDependencies[3].srcStageMask  = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    subpassDependencies[3].dstStageMask  = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    subpassDependencies[3].srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    subpassDependencies[3].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+
+    VkRenderPassCreateInfo renderPassInfo = {VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO};
+    renderPassInfo.attachmentCount        = static_cast<uint32_t>(allAttachments.size());
+    renderPassInfo.pAttachments           = allAttachments.data();
+    renderPassInfo.dependencyCount        = static_cast<uint32_t>(subpassDependencies.size());
+    renderPassInfo.pDependencies          = subpassDependencies.data();
+    renderPassInfo.subpassCount           = static_cast<uint32_t>(subpasses.size());
+    renderPassInfo.pSubpasses             = subpasses.data();
+    addMultiview(renderPassInfo);
+    NVVK_CHECK(vkCreateRenderPass(m_context, &renderPassInfo, nullptr, &m_renderPassMoments));
+    m_debug.setObjectName(m_renderPassMoments, "m_renderPassMoments");
+  }
 }
 
-void Sample::updateShaderDefinitions()
+std::string Sample::getShaderDefinitions(const State& state)
 {
-  m_shaderModuleManager.m_prepend = nvh::ShaderFileManager::format(
+  // gl_ViewIndex (see VIEW_INDEX in common.h) needs GL_EXT_multiview.
+  const std::string multiviewExtension = (state.numViews() > 1 ? "#extension GL_EXT_multiview : enable\n" : "");
+  return multiviewExtension + nvh::ShaderFileManager::format(
       "#extension GL_GOOGLE_cpp_style_line_directive : enable\n"
       "#define OIT_LAYERS %d\n"
       "#define OIT_TAILBLEND %d\n"
       "#define OIT_INTERLOCK_IS_ORDERED %d\n"
+      "#define OIT_INTERLOCK_MLAB %d\n"
       "#define OIT_MSAA %d\n"
-      "#define OIT_SAMPLE_SHADING %d\n",
-      m_state.oitLayers,                   //
-      m_state.tailBlend ? 1 : 0,           //
-      m_state.interlockIsOrdered ? 1 : 0,  //
-      m_state.msaa,                        //
-      m_state.sampleShading ? 1 : 0);
+      "#define OIT_SAMPLE_SHADING %d\n"
+      "#define OIT_SORT %d\n"
+      "#define OIT_STATS %d\n"
+      "#define OIT_PACKED_ABUFFER %d\n"
+      "#define OIT_SPIN_STRATEGY %d\n"
+      "#define OIT_LINKEDLIST_SUBGROUP %d\n"
+      "#define OIT_ABUFFER_LAYOUT %d\n"
+      "#define OIT_FRAME_TAGS %d\n"
+      "#define OIT_VIEWS %d\n",
+      state.oitLayers,                    //
+      state.tailBlend ? 1 : 0,            //
+      state.interlockIsOrdered ? 1 : 0,   //
+      state.usesMLAB() ? 1 : 0,           //
+      state.msaa,                         //
+      state.sampleShading ? 1 : 0,        //
+      state.sortStrategy,                 //
+      state.countsFragments() ? 1 : 0,    //
+      state.usesPackedABuffer() ? 1 : 0,  //
+      state.spinlockStrategy,             //
+      state.usesSubgroupAlloc() ? 1 : 0,  //
+      state.activeABufferLayout(),        //
+      state.usesFrameTags() ? 1 : 0,      //
+      state.numViews());
 }
 
-void Sample::createOrReloadShaderModules()
+void Sample::updateShaderDefinitions()
 {
-  updateShaderDefinitions();
+  m_shaderModuleManager.m_prepend = getShaderDefinitions(m_state);
+}
 
-  // You can set this to true to make sure that all of the shaders
-  // compile correctly.
-  const bool        loadEverything  = false;
+std::vector<ShaderModuleDesc> Sample::getShaderModuleDescs(const State& state, bool loadEverything)
+{
   const std::string defineDepth     = "#define PASS PASS_DEPTH\n";
   const std::string defineColor     = "#define PASS PASS_COLOR\n";
   const std::string defineComposite = "#define PASS PASS_COMPOSITE\n";
 
-  // Compile shaders
+  // Only the shaders that read the scene's vertices or draw commands depend on
+  // whether it's instanced.
+  const std::string defineInstanced = nvh::ShaderFileManager::format("#define SCENE_INSTANCED %d\n", state.instancedScene ? 1 : 0);
+
+  std::vector<ShaderModuleDesc> descs;
 
   // Scene (standard mesh rendering) and full-screen triangle vertex shaders
-  createOrReloadShaderModule(m_shaderSceneVert, VK_SHADER_STAGE_VERTEX_BIT, "object.vert.glsl");
-  createOrReloadShaderModule(m_shaderFullScreenTriangleVert, VK_SHADER_STAGE_VERTEX_BIT, "fullScreenTriangle.vert.glsl");
+  descs.push_back({&m_shaderSceneVert, VK_SHADER_STAGE_VERTEX_BIT, "object.vert.glsl", defineInstanced});
+  descs.push_back({&m_shaderFullScreenTriangleVert, VK_SHADER_STAGE_VERTEX_BIT, "fullScreenTriangle.vert.glsl"});
   // Opaque pass
-  createOrReloadShaderModule(m_shaderOpaqueFrag, VK_SHADER_STAGE_FRAGMENT_BIT, "opaque.frag.glsl");
+  descs.push_back({&m_shaderOpaqueFrag, VK_SHADER_STAGE_FRAGMENT_BIT, "opaque.frag.glsl"});
 
-  if((m_state.algorithm == OIT_SIMPLE) || loadEverything)
+  if((state.algorithm == OIT_SIMPLE) || loadEverything)
   {
     const std::string file = "oitSimple.frag.glsl";
-    createOrReloadShaderModule(m_shaderSimpleColorFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineColor);
-    createOrReloadShaderModule(m_shaderSimpleCompositeFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineComposite);
+    descs.push_back({&m_shaderSimpleColorFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineColor});
+    descs.push_back({&m_shaderSimpleCompositeFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineComposite});
   }
-  if((m_state.algorithm == OIT_LINKEDLIST) || loadEverything)
+  if((state.algorithm == OIT_LINKEDLIST) || loadEverything)
   {
     const std::string file = "oitLinkedList.frag.glsl";
-    createOrReloadShaderModule(m_shaderLinkedListColorFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineColor);
-    createOrReloadShaderModule(m_shaderLinkedListCompositeFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineComposite);
+    descs.push_back({&m_shaderLinkedListColorFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineColor});
+    descs.push_back({&m_shaderLinkedListCompositeFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineComposite});
   }
-  if((m_state.algorithm == OIT_LOOP) || loadEverything)
+  if((state.algorithm == OIT_LOOP) || loadEverything)
   {
     const std::string file = "oitLoop.frag.glsl";
-    createOrReloadShaderModule(m_shaderLoopDepthFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineDepth);
-    createOrReloadShaderModule(m_shaderLoopColorFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineColor);
-    createOrReloadShaderModule(m_shaderLoopCompositeFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineComposite);
+    descs.push_back({&m_shaderLoopDepthFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineDepth});
+    descs.push_back({&m_shaderLoopColorFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineColor});
+    descs.push_back({&m_shaderLoopCompositeFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineComposite});
   }
-  if((m_state.algorithm == OIT_LOOP64) || loadEverything)
+  if((state.algorithm == OIT_LOOP64) || loadEverything)
   {
-    assert(m_context.hasDeviceExtension(VK_KHR_SHADER_ATOMIC_INT64_EXTENSION_NAME));
     const std::string file = "oitLoop64.frag.glsl";
-    createOrReloadShaderModule(m_shaderLoop64ColorFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineColor);
-    createOrReloadShaderModule(m_shaderLoop64CompositeFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineComposite);
+    descs.push_back({&m_shaderLoop64ColorFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineColor});
+    descs.push_back({&m_shaderLoop64CompositeFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineComposite});
   }
-  if((m_state.algorithm == OIT_INTERLOCK) || loadEverything)
+  if((state.algorithm == OIT_INTERLOCK) || loadEverything)
   {
-    assert(m_context.hasDeviceExtension(VK_EXT_FRAGMENT_SHADER_INTERLOCK_EXTENSION_NAME));
     const std::string file = "oitInterlock.frag.glsl";
-    createOrReloadShaderModule(m_shaderInterlockColorFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineColor);
-    createOrReloadShaderModule(m_shaderInterlockCompositeFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineComposite);
+    descs.push_back({&m_shaderInterlockColorFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineColor});
+    descs.push_back({&m_shaderInterlockCompositeFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineComposite});
   }
-  if((m_state.algorithm == OIT_SPINLOCK) || loadEverything)
+  if((state.algorithm == OIT_SPINLOCK) || loadEverything)
   {
     const std::string file = "oitSpinlock.frag.glsl";
-    createOrReloadShaderModule(m_shaderSpinlockColorFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineColor);
-    createOrReloadShaderModule(m_shaderSpinlockCompositeFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineComposite);
+    descs.push_back({&m_shaderSpinlockColorFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineColor});
+    descs.push_back({&m_shaderSpinlockCompositeFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineComposite});
   }
-  if((m_state.algorithm == OIT_WEIGHTED) || loadEverything)
+  if((state.algorithm == OIT_WEIGHTED) || loadEverything)
   {
     const std::string file = "oitWeighted.frag.glsl";
-    createOrReloadShaderModule(m_shaderWeightedColorFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineColor);
-    createOrReloadShaderModule(m_shaderWeightedCompositeFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineComposite);
+    descs.push_back({&m_shaderWeightedColorFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineColor});
+    descs.push_back({&m_shaderWeightedCompositeFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineComposite});
+  }
+  if((state.algorithm == OIT_MOMENTS) || loadEverything)
+  {
+    const std::string file = "oitMoments.frag.glsl";
+    descs.push_back({&m_shaderMomentsDepthFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineDepth});
+    descs.push_back({&m_shaderMomentsColorFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineColor});
+    descs.push_back({&m_shaderMomentsCompositeFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineComposite});
+  }
+
+  // GPU culling
+  if(state.gpuCulling || loadEverything)
+  {
+    descs.push_back({&m_shaderHizComp, VK_SHADER_STAGE_COMPUTE_BIT, "hiz.comp.glsl"});
+    descs.push_back({&m_shaderCullComp, VK_SHADER_STAGE_COMPUTE_BIT, "cull.comp.glsl", defineInstanced});
+  }
+  if(state.usesFrontToBack() || loadEverything)
+  {
+    const std::string file = "cull.comp.glsl";
+    descs.push_back({&m_shaderCullScanComp, VK_SHADER_STAGE_COMPUTE_BIT, file, "#define CULL_PASS CULL_PASS_SCAN\n" + defineInstanced});
+    descs.push_back({&m_shaderCullScatterComp, VK_SHADER_STAGE_COMPUTE_BIT, file,
+                     "#define CULL_PASS CULL_PASS_SCATTER\n" + defineInstanced});
+  }
+
+  // Mesh shaders; these need VK_EXT_mesh_shader even when loading everything.
+  if(state.usesMeshShaders() || (loadEverything && isMeshShaderSupported()))
+  {
+    const std::string file = "sphere.task.glsl";
+    descs.push_back({&m_shaderSphereTask, VK_SHADER_STAGE_TASK_BIT_EXT, file});
+    descs.push_back({&m_shaderSphereTaskBackfaces, VK_SHADER_STAGE_TASK_BIT_EXT, file, "#define MESH_CULL_BACKFACES 1\n"});
+    descs.push_back({&m_shaderSphereMesh, VK_SHADER_STAGE_MESH_BIT_EXT, "sphere.mesh.glsl"});
+  }
+
+  // Compute composite
+  if(state.usesComputeComposite() || loadEverything)
+  {
+    descs.push_back({&m_shaderCompositeComp, VK_SHADER_STAGE_COMPUTE_BIT, "oitComposite.comp.glsl"});
+    descs.push_back({&m_shaderCompositeBlendFrag, VK_SHADER_STAGE_FRAGMENT_BIT, "oitCompositeBlend.frag.glsl"});
+  }
+
+  // Fragment statistics
+  if(state.countsFragments() || loadEverything)
+  {
+    descs.push_back({&m_shaderFragmentStatsComp, VK_SHADER_STAGE_COMPUTE_BIT, "fragmentStats.comp.glsl"});
+    descs.push_back({&m_shaderFragmentHeatmapFrag, VK_SHADER_STAGE_FRAGMENT_BIT, "fragmentHeatmap.frag.glsl"});
+  }
+
+  // Compute resolve
+  if(state.computeResolve || loadEverything)
+  {
+    descs.push_back({&m_shaderResolveComp, VK_SHADER_STAGE_COMPUTE_BIT, "resolve.comp.glsl"});
+  }
+
+  // Smaller layer counts of the current algorithm's passes for adaptive layer
+  // counts. Their prepend replaces the OIT_LAYERS of getShaderDefinitions.
+  if(state.usesAdaptiveLayers())
+  {
+    std::string file;
+    switch(state.algorithm)
+    {
+      case OIT_SIMPLE:
+        file = "oitSimple.frag.glsl";
+        break;
+      case OIT_LOOP:
+        file = "oitLoop.frag.glsl";
+        break;
+      case OIT_LOOP64:
+        file = "oitLoop64.frag.glsl";
+        break;
+      case OIT_INTERLOCK:
+        file = "oitInterlock.frag.glsl";
+        break;
+      case OIT_SPINLOCK:
+        file = "oitSpinlock.frag.glsl";
+        break;
+      default:
+        assert(!"getShaderModuleDescs: Adaptive layers not implemented for algorithm!");
+    }
+
+    for(uint32_t i = 0; i < NUM_ADAPTIVE_LAYER_COUNTS && ADAPTIVE_LAYER_COUNTS[i] < state.oitLayers; i++)
+    {
+      LayerVariant&     variant      = m_layerVariants[i];
+      const std::string defineLayers =
+          nvh::ShaderFileManager::format("#undef OIT_LAYERS\n#define OIT_LAYERS %u\n", ADAPTIVE_LAYER_COUNTS[i]);
+      if(state.algorithm == OIT_LOOP)
+      {
+        descs.push_back({&variant.depthFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineLayers + defineDepth});
+      }
+      descs.push_back({&variant.colorFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineLayers + defineColor});
+      if(state.usesComputeComposite())
+      {
+        descs.push_back({&variant.compositeComp, VK_SHADER_STAGE_COMPUTE_BIT, "oitComposite.comp.glsl", defineLayers});
+      }
+      else
+      {
+        descs.push_back({&variant.compositeFrag, VK_SHADER_STAGE_FRAGMENT_BIT, file, defineLayers + defineComposite});
+      }
+    }
+  }
+
+  return descs;
+}
+
+void Sample::createOrReloadShaderModules()
+{
+  updateShaderDefinitions();
+
+  // You can set this to true to make sure that all of the shaders
+  // compile correctly.
+  const bool loadEverything = false;
+  // OIT_LOOP64 and OIT_INTERLOCK need device extensions.
+  assert(loadEverything || isAlgorithmSupported(m_state.algorithm));
+
+  // The shader cache keys depend on the includes, which are the same for every
+  // module, so we only read and hash them once.
+  if(!m_shaderCacheDirectory.empty())
+  {
+    m_shaderIncludesHash = hashShaderIncludes();
+  }
+
+  // Compile shaders (or load them from the shader cache)
+  for(const ShaderModuleDesc& desc : getShaderModuleDescs(m_state, loadEverything))
+  {
+    createOrReloadShaderModule(*desc.shaderModule, desc.stage, desc.filename, desc.prepend);
   }
 
   // Verify that the shaders compiled correctly:
@@ -752,6 +1791,24 @@ void Sample::destroyGraphicsPipelines()
   destroyGraphicsPipeline(m_pipelineSpinlockComposite);
   destroyGraphicsPipeline(m_pipelineWeightedColor);
   destroyGraphicsPipeline(m_pipelineWeightedComposite);
+  destroyGraphicsPipeline(m_pipelineMomentsDepth);
+  destroyGraphicsPipeline(m_pipelineMomentsColor);
+  destroyGraphicsPipeline(m_pipelineMomentsComposite);
+  destroyGraphicsPipeline(m_pipelineHiz);
+  destroyGraphicsPipeline(m_pipelineCull);
+  destroyGraphicsPipeline(m_pipelineCullScan);
+  destroyGraphicsPipeline(m_pipelineCullScatter);
+  destroyGraphicsPipeline(m_pipelineCompositeCompute);
+  destroyGraphicsPipeline(m_pipelineCompositeBlend);
+  destroyGraphicsPipeline(m_pipelineFragmentStats);
+  destroyGraphicsPipeline(m_pipelineFragmentHeatmap);
+  destroyGraphicsPipeline(m_pipelineResolve);
+  for(LayerVariant& variant : m_layerVariants)
+  {
+    destroyGraphicsPipeline(variant.depth);
+    destroyGraphicsPipeline(variant.color);
+    destroyGraphicsPipeline(variant.composite);
+  }
 }
 
 void Sample::createGraphicsPipelines()
@@ -762,54 +1819,92 @@ void Sample::createGraphicsPipelines()
   m_pipelineOpaque =
       createGraphicsPipeline(m_shaderSceneVert, m_shaderOpaqueFrag, BlendMode::NONE, true, false, m_renderPassColorDepthClear);
 
+  if(m_state.gpuCulling)
+  {
+    m_pipelineHiz  = createComputePipeline(m_shaderHizComp);
+    m_pipelineCull = createComputePipeline(m_shaderCullComp);
+  }
+  if(m_state.usesFrontToBack())
+  {
+    m_pipelineCullScan    = createComputePipeline(m_shaderCullScanComp);
+    m_pipelineCullScatter = createComputePipeline(m_shaderCullScatterComp);
+  }
+
   const bool transparentDoubleSided = true;  // Iff transparent objects are double-sided
 
+  // These replace the composite pipeline of the algorithm below.
+  if(m_state.usesComputeComposite())
+  {
+    m_pipelineCompositeCompute = createComputePipeline(m_shaderCompositeComp);
+    m_pipelineCompositeBlend = createGraphicsPipeline(m_shaderFullScreenTriangleVert, m_shaderCompositeBlendFrag, BlendMode::PREMULTIPLIED,
+                                                      false, transparentDoubleSided, m_renderPassColorDepthClear);
+  }
+
+  if(m_state.countsFragments())
+  {
+    m_pipelineFragmentStats   = createComputePipeline(m_shaderFragmentStatsComp);
+    m_pipelineFragmentHeatmap = createGraphicsPipeline(m_shaderFullScreenTriangleVert, m_shaderFragmentHeatmapFrag, BlendMode::PREMULTIPLIED,
+                                                       false, transparentDoubleSided, m_renderPassColorDepthClear);
+  }
+
+  if(m_state.computeResolve)
+  {
+    m_pipelineResolve = createComputePipeline(m_shaderResolveComp);
+  }
+
+  // With State::usesTransparentSubpasses, the A-buffer algorithms' passes are
+  // subpasses of m_renderPassTransparent, in the order they're drawn.
+  const bool         subpasses        = m_state.usesTransparentSubpasses();
+  const VkRenderPass transparentPass  = (subpasses ? m_renderPassTransparent : m_renderPassColorDepthClear);
+  const uint32_t     loopColorSubpass = (subpasses ? 1 : 0);
+  const uint32_t     compositeSubpass = (subpasses ? m_state.numTransparentPasses() - 1 : 0);
+
   // Switch off between algorithms:
   switch(m_state.algorithm)
   {
     case OIT_SIMPLE:
       m_pipelineSimpleColor = createGraphicsPipeline(m_shaderSceneVert, m_shaderSimpleColorFrag, BlendMode::PREMULTIPLIED,
-                                                     true, transparentDoubleSided, m_renderPassColorDepthClear);
+                                                     true, transparentDoubleSided, transparentPass);
       m_pipelineSimpleComposite =
           createGraphicsPipeline(m_shaderFullScreenTriangleVert, m_shaderSimpleCompositeFrag, BlendMode::PREMULTIPLIED,
-                                 false, transparentDoubleSided, m_renderPassColorDepthClear);
+                                 false, transparentDoubleSided, transparentPass, compositeSubpass);
       break;
     case OIT_LINKEDLIST:
       m_pipelineLinkedListColor = createGraphicsPipeline(m_shaderSceneVert, m_shaderLinkedListColorFrag, BlendMode::PREMULTIPLIED,
-                                                         true, transparentDoubleSided, m_renderPassColorDepthClear);
+                                                         true, transparentDoubleSided, transparentPass);
       m_pipelineLinkedListComposite =
           createGraphicsPipeline(m_shaderFullScreenTriangleVert, m_shaderLinkedListCompositeFrag,
-                                 BlendMode::PREMULTIPLIED, false, transparentDoubleSided, m_renderPassColorDepthClear);
+                                 BlendMode::PREMULTIPLIED, false, transparentDoubleSided, transparentPass, compositeSubpass);
       break;
     case OIT_LOOP:
       m_pipelineLoopDepth = createGraphicsPipeline(m_shaderSceneVert, m_shaderLoopDepthFrag, BlendMode::PREMULTIPLIED,
-                                                   true, transparentDoubleSided, m_renderPassColorDepthClear);
+                                                   true, transparentDoubleSided, transparentPass);
       m_pipelineLoopColor = createGraphicsPipeline(m_shaderSceneVert, m_shaderLoopColorFrag, BlendMode::PREMULTIPLIED,
-                                                   true, transparentDoubleSided, m_renderPassColorDepthClear);
+                                                   true, transparentDoubleSided, transparentPass, loopColorSubpass);
       m_pipelineLoopComposite =
           createGraphicsPipeline(m_shaderFullScreenTriangleVert, m_shaderLoopCompositeFrag, BlendMode::PREMULTIPLIED,
-                                 false, transparentDoubleSided, m_renderPassColorDepthClear);
+                                 false, transparentDoubleSided, transparentPass, compositeSubpass);
       break;
     case OIT_LOOP64:
       m_pipelineLoop64Color = createGraphicsPipeline(m_shaderSceneVert, m_shaderLoop64ColorFrag, BlendMode::PREMULTIPLIED,
-                                                     true, transparentDoubleSided, m_renderPassColorDepthClear);
+                                                     true, transparentDoubleSided, transparentPass);
       m_pipelineLoop64Composite =
           createGraphicsPipeline(m_shaderFullScreenTriangleVert, m_shaderLoop64CompositeFrag, BlendMode::PREMULTIPLIED,
-                                 false, transparentDoubleSided, m_renderPassColorDepthClear);
+                                 false, transparentDoubleSided, transparentPass, compositeSubpass);
       break;
     case OIT_INTERLOCK:
       m_pipelineInterlockColor = createGraphicsPipeline(m_shaderSceneVert, m_shaderInterlockColorFrag, BlendMode::PREMULTIPLIED,
-                                                        true, transparentDoubleSided, m_renderPassColorDepthClear);
+                                                        true, transparentDoubleSided, transparentPass);
       m_pipelineInterlockComposite =
           createGraphicsPipeline(m_shaderFullScreenTriangleVert, m_shaderInterlockCompositeFrag,
-                                 BlendMode::PREMULTIPLIED, false, transparentDoubleSided, m_renderPassColorDepthClear);
+                                 BlendMode::PREMULTIPLIED, false, transparentDoubleSided, transparentPass, compositeSubpass);
       break;
     case OIT_SPINLOCK:
       m_pipelineSpinlockColor = createGraphicsPipeline(m_shaderSceneVert, m_shaderSpinlockColorFrag, BlendMode::PREMULTIPLIED,
-                                                       true, transparentDoubleSided, m_renderPassColorDepthClear);
+                                                       true, transparentDoubleSided, transparentPass);
       m_pipelineSpinlockComposite =
           createGraphicsPipeline(m_shaderFullScreenTriangleVert, m_shaderSpinlockCompositeFrag,
-                                 BlendMode::PREMULTIPLIED, false, transparentDoubleSided, m_renderPassColorDepthClear);
+                                 BlendMode::PREMULTIPLIED, false, transparentDoubleSided, transparentPass, compositeSubpass);
       break;
     case OIT_WEIGHTED:
       m_pipelineWeightedColor = createGraphicsPipeline(m_shaderSceneVert, m_shaderWeightedColorFrag, BlendMode::WEIGHTED_COLOR,
@@ -818,5 +1913,41 @@ void Sample::createGraphicsPipelines()
           createGraphicsPipeline(m_shaderFullScreenTriangleVert, m_shaderWeightedCompositeFrag,
                                  BlendMode::WEIGHTED_COMPOSITE, false, transparentDoubleSided, m_renderPassWeighted, 1);
       break;
+    case OIT_MOMENTS:
+      m_pipelineMomentsDepth = createGraphicsPipeline(m_shaderSceneVert, m_shaderMomentsDepthFrag, BlendMode::MOMENTS_DEPTH,
+                                                      true, transparentDoubleSided, m_renderPassMoments, 0);
+      m_pipelineMomentsColor = createGraphicsPipeline(m_shaderSceneVert, m_shaderMomentsColorFrag, BlendMode::MOMENTS_COLOR,
+                                                      true, transparentDoubleSided, m_renderPassMoments, 1);
+      m_pipelineMomentsComposite =
+          createGraphicsPipeline(m_shaderFullScreenTriangleVert, m_shaderMomentsCompositeFrag,
+                                 BlendMode::WEIGHTED_COMPOSITE, false, transparentDoubleSided, m_renderPassMoments, 2);
+      break;
   }
-}
\ No newline at end of file
+
+  // The same pipelines for the smaller layer counts, which use the same
+  // render passes and blend modes.
+  if(m_state.usesAdaptiveLayers())
+  {
+    for(uint32_t i = 0; i < NUM_ADAPTIVE_LAYER_COUNTS && ADAPTIVE_LAYER_COUNTS[i] < m_state.oitLayers; i++)
+    {
+      LayerVariant& variant = m_layerVariants[i];
+      if(m_state.algorithm == OIT_LOOP)
+      {
+        variant.depth = createGraphicsPipeline(m_shaderSceneVert, variant.depthFrag, BlendMode::PREMULTIPLIED, true,
+                                               transparentDoubleSided, transparentPass);
+      }
+      variant.color = createGraphicsPipeline(m_shaderSceneVert, variant.colorFrag, BlendMode::PREMULTIPLIED, true,
+                                             transparentDoubleSided, transparentPass,
+                                             (m_state.algorithm == OIT_LOOP ? loopColorSubpass : 0));
+      if(m_state.usesComputeComposite())
+      {
+        variant.composite = createComputePipeline(variant.compositeComp);
+      }
+      else
+      {
+        variant.composite = createGraphicsPipeline(m_shaderFullScreenTriangleVert, variant.compositeFrag, BlendMode::PREMULTIPLIED,
+                                                   false, transparentDoubleSided, transparentPass, compositeSubpass);
+      }
+    }
+  }
+}
@@ -22,7 +22,9 @@
 // Contains the declaration of the main sample class.
 // Its functions are defined in oit.cpp (resource creation for OIT
 // specifically), oitRender.cpp (main command buffer rendering, without GUI),
-// oitGui.cpp (GUI), and main.cpp (other resource creation and main()).
+// oitGui.cpp (GUI), oitBenchmark.cpp (command-line benchmark mode),
+// oitShaderCache.cpp (shader system and shader caches), and main.cpp (other
+// resource creation and main()).
 
 #include <imgui/imgui_helper.h>
 
@@ -37,8 +39,15 @@
 #include <nvvk/memorymanagement_vk.hpp>
 #include <nvvk/shadermodulemanager_vk.hpp>
 #include <nvvk/shaders_vk.hpp>
+#include <nvvk/stagingmemorymanager_vk.hpp>
 #include <nvvk/swapchain_vk.hpp>
 
+#include <array>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "common.h"
 #include "utilities_vk.h"
 
@@ -49,6 +58,11 @@ enum GuiEnums : uint32_t
   GUI_ALGORITHM,
   GUI_OITSAMPLES,
   GUI_AA,
+  GUI_TILESIZE,
+  GUI_SORT,
+  GUI_SPINLOCK,
+  GUI_ABUFFER_LAYOUT,
+  GUI_SHADING_RATE,
 };
 
 // A simple enumeration for a few blending modes.
@@ -60,6 +74,10 @@ enum class BlendMode
   // Weighted, Blended Order-Independent Transparency:
   WEIGHTED_COLOR,      // No depth writing, 2 attachments; ((c, a), r) ov ((d, b), s) = ((c+d, a+b), (1-r)s)
   WEIGHTED_COMPOSITE,  // No depth writing; (c, r) ov (d, s) = (c(1-r) + rd, (1-r) + rs)
+  // For these next two, see oitMoments.frag.glsl; its composite pass uses
+  // WEIGHTED_COMPOSITE.
+  MOMENTS_DEPTH,  // No depth writing, 2 attachments; (m, b) ov (n, c) = (m+n, b+c)
+  MOMENTS_COLOR,  // No depth writing; (c, a) ov (d, b) = (c+d, a+b)
 };
 
 // Contains the current settings of the rendering algorithm.
@@ -72,18 +90,155 @@ struct State
   uint32_t percentTransparent            = 100;
   bool     tailBlend                     = true;
   bool     interlockIsOrdered            = true;
+  bool     interlockMLAB                 = false;  // If true, OIT_INTERLOCK merges its backmost layers instead of tail blending (see usesMLAB).
   uint32_t numObjects                    = 1024;
   uint32_t subdiv                        = 16;
   float    scaleMin                      = 0.1f;
   float    scaleWidth                    = 0.9f;
   uint32_t aaType                        = AA_NONE;
+  bool     linkedListAdaptive            = false;  // If true, OIT_LINKEDLIST resizes its A-buffer to fit the scene.
+  bool     linkedListSubgroupAlloc       = false;  // If true, OIT_LINKEDLIST allocates nodes with one atomic per subgroup.
+  uint32_t tileSize                      = 0;  // If nonzero, the A-buffer covers tileSize x tileSize pixels, and transparent objects are drawn once per tile.
+  bool     gpuCulling                    = false;  // If true, culls objects on the GPU and draws them using indirect draws.
+  bool     frontToBack                   = false;  // If true (and gpuCulling), draws the visible transparent objects roughly from front to back.
+  bool     instancedScene                = false;  // If true, draws instances of one sphere instead of a mesh of all spheres.
+  // If true, OIT_SIMPLE, OIT_INTERLOCK, and OIT_SPINLOCK composite in a compute shader.
+  bool     computeComposite              = false;
+  uint32_t sortStrategy                  = SORT_BUBBLE;  // How composite fragment shaders sort fragments (SORT_*).
+  bool     fragmentStats                 = false;  // If true, counts each pixel's fragments and those that didn't fit into the A-buffer.
+  bool     fragmentHeatmap               = false;  // If true (and fragmentStats), draws the fragment counts over the image.
+  bool     adaptiveLayers                = false;  // If true, picks a layer count up to oitLayers per frame (see Sample::updateAdaptiveLayers).
+  float    adaptiveOverflowPercent       = 1.0f;   // The percentage of fragments adaptiveLayers lets overflow the A-buffer.
+  bool     packedABuffer                 = false;  // If true, packs each A-buffer entry's depth and coverage mask into one uint (OIT_PACKED_ABUFFER).
+  uint32_t spinlockStrategy              = SPIN_PLAIN;  // How OIT_SPINLOCK takes its per-pixel locks (SPIN_*).
+  uint32_t aBufferLayout                 = ABUFFER_LAYOUT_LAYERS;  // How the A-buffer orders its entries (see activeABufferLayout).
+  // If true, the A-buffer algorithms' passes are subpasses of m_renderPassTransparent (see
+  // usesTransparentSubpasses).
+  bool     subpassComposite              = false;
+  // If true, resolves and downsamples m_colorImage into m_guiCompositeImage in one compute pass.
+  bool     computeResolve                = false;
+  // If true, tags per-pixel counters and depths with the frame instead of clearing them
+  // (OIT_FRAME_TAGS).
+  bool     frameTags                     = false;
+  // If nonzero, records the render passes' draws into secondary command buffers on this many
+  // threads (see usesParallelRecording).
+  uint32_t recordingThreads              = 0;
+  uint32_t shadingRate                   = SHADING_RATE_1X1;  // The fragment size of the approximate algorithms' color passes (see activeShadingRate).
+  // If true, generates and culls the spheres' patches in task and mesh shaders (see usesMeshShaders).
+  bool     meshShaders                   = false;
+  bool     multiview                     = false;  // If true, draws a left and a right view in the same passes with VK_KHR_multiview (see usesMultiview).
+  float    eyeSeparation                 = 0.05f;  // The distance between the views' cameras with multiview.
   bool     drawUI                        = true;
 
   // These are implicitly set by aaType:
   int  msaa          = 1;      // Number of MSAA samples used for color + depth buffers.
   bool sampleShading = false;  // If true, uses an array in the A-buffer per sample instead of per-pixel.
   int  supersample   = 1;
-  bool coverageShading() { return ((msaa > 1) && (!sampleShading)); }
+  bool coverageShading() const { return ((msaa > 1) && (!sampleShading)); }
+  // Whether the current algorithm stores fragments in an A-buffer (the
+  // approximate algorithms use a fixed number of render targets instead).
+  bool usesABuffer() const { return (algorithm != OIT_WEIGHTED) && (algorithm != OIT_MOMENTS); }
+  // Whether the culling shader sorts the transparent objects by depth. The
+  // sort reorders the draw commands that GPU culling writes, so it needs them.
+  bool usesFrontToBack() const { return frontToBack && gpuCulling; }
+  // Whether OIT_INTERLOCK uses multi-layer alpha blending, keeping its layers
+  // sorted and merging the backmost two when a pixel runs out of space. Merged
+  // layers have a single color, so this doesn't apply to coverage shading.
+  bool usesMLAB() const { return interlockMLAB && (algorithm == OIT_INTERLOCK) && !coverageShading(); }
+  // Whether the current algorithm's composite pass sorts the A-buffer (using sortStrategy).
+  bool compositeSorts() const
+  {
+    return (algorithm == OIT_SIMPLE) || (algorithm == OIT_LINKEDLIST) || ((algorithm == OIT_INTERLOCK) && !usesMLAB())
+           || (algorithm == OIT_SPINLOCK);
+  }
+  // Whether the current algorithm composites using oitComposite.comp.glsl.
+  bool usesComputeComposite() const
+  {
+    return computeComposite && ((algorithm == OIT_SIMPLE) || (algorithm == OIT_INTERLOCK) || (algorithm == OIT_SPINLOCK));
+  }
+  // Whether the current algorithm switches between layer counts per frame.
+  // Only algorithms with oitLayers slots per pixel or sample can do this.
+  bool usesAdaptiveLayers() const
+  {
+    return adaptiveLayers && usesABuffer() && (algorithm != OIT_LINKEDLIST);
+  }
+  // The order of the A-buffer's entries (ABUFFER_LAYOUT_*, see abufferIndex in
+  // common.h). OIT_LINKEDLIST allocates its nodes in the order fragments
+  // arrive, so it always uses ABUFFER_LAYOUT_LAYERS.
+  uint32_t activeABufferLayout() const
+  {
+    return (usesABuffer() && (algorithm != OIT_LINKEDLIST)) ? aBufferLayout : ABUFFER_LAYOUT_LAYERS;
+  }
+  // Whether OIT_LINKEDLIST allocates the nodes of a subgroup's fragments
+  // with a single atomic on the counter (OIT_LINKEDLIST_SUBGROUP).
+  bool usesSubgroupAlloc() const { return linkedListSubgroupAlloc && (algorithm == OIT_LINKEDLIST); }
+  // Whether the current algorithm skips most clears of its auxiliary images
+  // by tagging their values with a frame tag (OIT_FRAME_TAGS, see
+  // counterCount and loopDepth in common.h). Some clears remain every frame:
+  // OIT_LINKEDLIST's head pointers need all 32 bits, so it still clears them,
+  // and OIT_INTERLOCK and OIT_SPINLOCK still clear the full-precision depths
+  // of USE_EARLYDEPTH (the ClearLockDepth profiler section).
+  bool usesFrameTags() const
+  {
+    return frameTags
+           && ((algorithm == OIT_SIMPLE) || (algorithm == OIT_INTERLOCK) || (algorithm == OIT_SPINLOCK)
+               || (algorithm == OIT_LOOP) || (algorithm == OIT_LOOP64));
+  }
+  // Whether the transparent passes of the current algorithm are subpasses of
+  // m_renderPassTransparent, with subpass dependencies instead of pipeline
+  // barriers between them. The compute composite has to leave the render pass.
+  bool usesTransparentSubpasses() const { return subpassComposite && usesABuffer() && !usesComputeComposite(); }
+  // The number of fragment passes the current A-buffer algorithm draws
+  // (depth, color, and composite for OIT_LOOP; color and composite otherwise).
+  uint32_t numTransparentPasses() const { return (algorithm == OIT_LOOP) ? 3 : 2; }
+  // Whether render records the opaque pass and each tile's transparent passes
+  // into secondary command buffers in parallel. Each of these has to stay in
+  // one subpass of one render pass, which the compute composite and
+  // transparent subpasses don't, and the approximate algorithms begin their
+  // own render passes.
+  bool usesParallelRecording() const
+  {
+    return (recordingThreads > 0) && usesABuffer() && !usesComputeComposite() && !usesTransparentSubpasses();
+  }
+  // The SHADING_RATE_* of the transparent color passes. Only OIT_WEIGHTED and
+  // OIT_MOMENTS can shade more than one pixel per invocation: they write
+  // color attachments, which the blend units update for every covered pixel
+  // and sample, while the A-buffer algorithms' image stores and atomics only
+  // address the pixel at gl_FragCoord. Sample shading always shades per sample.
+  uint32_t activeShadingRate() const
+  {
+    return (((algorithm == OIT_WEIGHTED) || (algorithm == OIT_MOMENTS)) && !sampleShading) ? shadingRate : SHADING_RATE_1X1;
+  }
+  // Whether the spheres are drawn by sphere.task.glsl and sphere.mesh.glsl
+  // instead of object.vert.glsl. These read each object's bounding sphere and
+  // color, which only the instanced scene has, and cull instead of GPU
+  // culling; each sphere's patches have to fit into one task workgroup.
+  bool usesMeshShaders() const { return meshShaders && instancedScene && !gpuCulling && (subdiv <= MESH_MAX_SUBDIV); }
+  // Whether each pass draws both views of a stereo pair at once, into the
+  // layers of the color, depth, and auxiliary images, and each view's planes
+  // of the A-buffer. GPU culling, mesh shaders, and the compute passes only
+  // use the matrices of view 0, and the fragment statistics only cover one
+  // layer, so this excludes them.
+  bool usesMultiview() const
+  {
+    return multiview && !gpuCulling && !usesMeshShaders() && !usesComputeComposite() && !computeResolve
+           && !fragmentStats && !usesAdaptiveLayers();
+  }
+  // The number of views each pass draws (see usesMultiview).
+  uint32_t numViews() const { return usesMultiview() ? OIT_MAX_VIEWS : 1; }
+  // The number of planes of the A-buffer per pixel, and of layers of the
+  // auxiliary images: one per sample with sample shading, for each view.
+  uint32_t numABufferPlanes() const { return (sampleShading ? msaa : 1) * numViews(); }
+  // Whether the transparent passes count fragments (see oitStats.glsl);
+  // adaptiveLayers picks layer counts from these counts.
+  bool countsFragments() const { return fragmentStats || usesAdaptiveLayers(); }
+  // Whether the A-buffer uses packed entries. This only makes entries smaller
+  // for linked list nodes and for coverage shading entries; the others already
+  // use 8 bytes or less.
+  bool usesPackedABuffer() const
+  {
+    return packedABuffer && compositeSorts() && ((algorithm == OIT_LINKEDLIST) || coverageShading());
+  }
 
   void recomputeAntialiasingSettings()
   {
@@ -119,6 +274,177 @@ struct State
   }
 };
 
+// A shader module the renderer needs for a State (see getShaderModuleDescs).
+struct ShaderModuleDesc
+{
+  nvvk::ShaderModuleID* shaderModule;  // The member that holds the module
+  VkShaderStageFlags    stage;
+  std::string           filename;
+  std::string           prepend;  // Defines in addition to getShaderDefinitions
+};
+
+// A shader module the background precompile thread compiles into the SPIR-V cache.
+struct ShaderPrecompileJob
+{
+  VkShaderStageFlags stage;
+  std::string        filename;
+  std::string        prepend;
+  std::string        definitions;  // getShaderDefinitions of the State it's for
+  std::string        cacheFilename;
+};
+
+// The CPU-side copy of a scene, generated on a background thread by initScene.
+// An instanced scene contains one unit sphere and a color per object;
+// otherwise, the vertices and indices contain all spheres.
+struct SceneGeometry
+{
+  std::vector<Vertex>    vertices;
+  std::vector<uint32_t>  indices;
+  std::vector<glm::vec4> objectBounds;               // vec4(center, radius) per object
+  std::vector<glm::vec4> instanceColors;             // Color per object; only for instanced scenes
+  uint32_t               objectTriangleIndices = 0;  // The number of indices used in each sphere.
+  uint32_t               subdiv                = 0;
+  bool                   instanced             = false;
+};
+
+// The GPU buffers of a scene that's being uploaded (see updateScene).
+struct SceneBuffers
+{
+  nvvk::Buffer vertices;
+  nvvk::Buffer indices;
+  nvvk::Buffer objectBounds;
+  nvvk::Buffer instanceColors;
+  nvvk::Buffer drawCommands;
+  nvvk::Buffer drawCounts;
+  nvvk::Buffer sortKeys;
+  nvvk::Buffer sortBuckets;
+};
+
+// One submission of updateScene's upload, with the staging memory it reads from.
+struct SceneUploadChunk
+{
+  uint64_t                          timelineValue;  // Value of m_sceneUploadSemaphore once it has finished
+  nvvk::StagingMemoryManager::SetID stagingSet;
+  VkCommandBuffer                   cmdBuffer;
+};
+
+// The layer counts below the largest one (State::oitLayers) that
+// State::adaptiveLayers can switch to, in increasing order.
+constexpr uint32_t NUM_ADAPTIVE_LAYER_COUNTS                      = 3;
+constexpr uint32_t ADAPTIVE_LAYER_COUNTS[NUM_ADAPTIVE_LAYER_COUNTS] = {4, 8, 16};
+
+// The shader modules and pipelines of the current algorithm's passes that
+// depend on OIT_LAYERS, compiled for one of ADAPTIVE_LAYER_COUNTS. The
+// largest layer count uses the usual modules and pipelines instead. All of
+// them share the A-buffer, which is sized for the largest layer count.
+struct LayerVariant
+{
+  nvvk::ShaderModuleID depthFrag;      // OIT_LOOP's depth pass
+  nvvk::ShaderModuleID colorFrag;
+  nvvk::ShaderModuleID compositeFrag;
+  nvvk::ShaderModuleID compositeComp;  // With State::usesComputeComposite
+  VkPipeline           depth     = nullptr;
+  VkPipeline           color     = nullptr;
+  VkPipeline           composite = nullptr;  // Graphics, or compute with State::usesComputeComposite
+};
+
+// The fragment statistics of a frame, computed from the FragmentStats that
+// fragmentStats.comp.glsl wrote (see updateFragmentStats). The per-pixel
+// values only include pixels with at least one transparent fragment.
+struct FragmentStatsSummary
+{
+  bool     valid             = false;  // Whether a frame's statistics have been read back yet
+  uint32_t coveredPixels     = 0;
+  uint32_t totalFragments    = 0;
+  uint32_t overflowFragments = 0;    // Fragments that were tail-blended or dropped
+  uint32_t overflowPixels    = 0;    // Pixels with at least one such fragment
+  uint32_t maxFragments      = 0;    // Per pixel
+  uint32_t aBufferWrites     = 0;    // Stores and atomics that wrote to the A-buffer
+  double   writesPerFragment = 0.0;
+  uint32_t lockAttempts      = 0;    // Atomic exchanges OIT_SPINLOCK used to take locks; 0 for other algorithms
+  double   attemptsPerFragment = 0.0;
+  double   meanFragments     = 0.0;  // Per pixel
+  uint32_t p95Fragments      = 0;    // 95th percentile per pixel; at most STATS_HISTOGRAM_BINS - 1
+  double   overflowPercent   = 0.0;  // Percentage of fragments that overflowed
+  uint32_t histogram[STATS_HISTOGRAM_BINS] = {};  // Number of pixels with each fragment count
+};
+
+// Command-line settings for the benchmark mode (see oitBenchmark.cpp).
+// Each of the lists is a comma-separated list of values for the State field
+// with the same name, such as "0,1,4"; the benchmark measures every combination
+// of them. An empty list keeps the default value from State.
+struct BenchmarkSettings
+{
+  std::string outputFilename;  // If not empty, runs the benchmark and writes <outputFilename>.csv and <outputFilename>.json.
+  std::string algorithms;
+  std::string aaTypes;
+  std::string oitLayers;
+  std::string linkedListAllocatedPerElement;
+  std::string numObjects;
+  std::string percentTransparent;
+  std::string computeComposite;  // 0 or 1; only applies to OIT_SIMPLE, OIT_INTERLOCK, and OIT_SPINLOCK.
+  std::string sortStrategy;      // SORT_* values; only applies to algorithms whose composite pass sorts.
+  std::string adaptiveLayers;    // 0 or 1; doesn't apply to OIT_LINKEDLIST, OIT_WEIGHTED, and OIT_MOMENTS.
+  std::string packedABuffer;     // 0 or 1; only applies where State::usesPackedABuffer can be true.
+  std::string interlockMLAB;     // 0 or 1; only applies where State::usesMLAB can be true.
+  std::string frontToBack;       // 0 or 1; if given, all combinations use GPU culling (if supported).
+  std::string spinlockStrategy;  // SPIN_* values; only applies to OIT_SPINLOCK.
+  std::string linkedListSubgroupAlloc;  // 0 or 1; only applies to OIT_LINKEDLIST.
+  std::string aBufferLayout;     // ABUFFER_LAYOUT_* values; doesn't apply to OIT_LINKEDLIST, OIT_WEIGHTED, and OIT_MOMENTS.
+  std::string frameTags;         // 0 or 1; only applies where State::usesFrameTags can be true.
+  std::string computeResolve;    // 0 or 1; applies to all algorithms (if supported).
+  std::string subpassComposite;  // 0 or 1; only applies where State::usesTransparentSubpasses can be true.
+  std::string recordingThreads;  // State::recordingThreads values; 0 records inline. Only applies where State::usesParallelRecording can be true.
+  std::string shadingRate;       // SHADING_RATE_* values; only applies where State::activeShadingRate can differ from SHADING_RATE_1X1 (if supported).
+  // 0 or 1; if given, all combinations use the instanced scene (if supported).
+  // Only applies where State::usesMeshShaders can be true.
+  std::string meshShaders;
+  uint32_t    fragmentStats = 0;   // If 1, also records fragment statistics, which adds some GPU work to the measured frames.
+  uint32_t    reference     = 0;   // If 1, also measures each combination's error against a reference image (see BenchmarkReference).
+  uint32_t    warmupFrames  = 16;  // Frames to discard after the renderer was rebuilt for a combination.
+  uint32_t    measureFrames = 64;  // Frames over which the profiler averages each section's timings.
+};
+
+// With BenchmarkSettings::reference, the benchmark first renders one reference
+// image for each scene and antialiasing type, using OIT_LINKEDLIST with the
+// most layers (BENCHMARK_REFERENCE_LAYERS in oitBenchmark.cpp) and an A-buffer
+// that grows to fit every fragment. This is exact unless a pixel has more
+// fragments than that, which overflowFragments reports.
+struct BenchmarkReference
+{
+  uint32_t             numObjects         = 0;
+  uint32_t             percentTransparent = 0;
+  uint32_t             aaType             = 0;
+  uint32_t             width              = 0;
+  uint32_t             height             = 0;
+  uint32_t             overflowFragments  = 0;  // From the reference's fragment statistics
+  std::vector<uint8_t> pixels;                  // 4 bytes per pixel of m_guiCompositeImage; empty until captured
+};
+
+// The timings and memory usage the benchmark recorded for one combination.
+struct BenchmarkResult
+{
+  struct SectionTiming
+  {
+    std::string name;
+    double      gpuMicroseconds = 0.0;
+    double      cpuMicroseconds = 0.0;
+    uint32_t    numAveraged     = 0;
+  };
+
+  State                      state;
+  VkDeviceSize               aBufferBytes    = 0;  // Size of m_oitABuffer
+  VkDeviceSize               auxImageBytes   = 0;  // Total size of the other OIT images
+  FragmentStatsSummary       fragmentStats;        // Only valid with BenchmarkSettings::fragmentStats
+  uint32_t                   activeLayers    = 0;  // The layer count State::adaptiveLayers used at the end
+  uint32_t                   linkedListNodes = 0;  // The nodes the last read-back frame needed; 0 for other algorithms
+  uint32_t                   readbackLatency = 0;  // Frames between rendering and reading back the last statistics
+  bool                       errorValid      = false;  // Whether psnr and maxError were measured (see BenchmarkSettings::reference)
+  double                     psnr            = 0.0;    // In dB over the 8-bit color channels; infinite if the images match
+  uint32_t                   maxError        = 0;      // The largest difference of an 8-bit color channel
+  std::vector<SectionTiming> sections;
+};
+
 class Sample : public nvvk::AppWindowProfilerVK
 {
 public:
@@ -126,16 +452,31 @@ public:
   nvvk::BatchSubmission      m_submission;
   nvvk::RingFences           m_ringFences;
   nvvk::RingCommandPool      m_ringCmdPool;
+  // With State::usesParallelRecording, the workers record secondary command
+  // buffers. Each worker allocates them from its own ring of command pools,
+  // since a command pool can only be used by one thread at a time.
+  WorkerPool                         m_recordingWorkers;
+  std::vector<nvvk::RingCommandPool> m_recordingCmdPools;  // One per worker
   nvvk::ResourceAllocatorDma m_allocatorDma;
+  MemoryArena                m_frameMemory;  // Holds the frame images (see createFrameImages)
   nvvk::DebugUtil            m_debug = nvvk::DebugUtil();
   bool                       m_submissionWaitForRead = false;
+  DeferredDestroyer          m_deferredDestroyer;  // Destroys replaced objects once frames in flight are done with them
+  bool                       m_swapchainSizeChanged = false;  // Set by resize; handled by the next frame
   // Per-frame objects
-  std::vector<nvvk::Buffer> m_uniformBuffers;
+  // m_uniformBuffer has one slot of m_uniformBufferStride bytes per ring
+  // cycle, and stays mapped. Each frame writes its cycle's slot, and binds it
+  // using UBO_SCENE's dynamic offset (see cmdBindDescriptorSet).
+  nvvk::Buffer m_uniformBuffer;
+  uint8_t*     m_uniformBufferMapped = nullptr;
+  VkDeviceSize m_uniformBufferStride = 0;
   // We only need one of each of these resources, since only one draw operation will run at once.
   VkViewport    m_viewportGUI               = {};
   VkRect2D      m_scissorGUI                = {};
   VkFramebuffer m_mainColorDepthFramebuffer = nullptr;
   VkFramebuffer m_weightedFramebuffer       = nullptr;
+  VkFramebuffer m_momentsFramebuffer        = nullptr;
+  VkFramebuffer m_transparentFramebuffer    = nullptr;
   VkFramebuffer m_guiFramebuffer            = nullptr;
   ImageAndView  m_depthImage;
   ImageAndView  m_colorImage;
@@ -144,16 +485,43 @@ public:
   ImageAndView  m_oitAuxSpinImage;
   ImageAndView  m_oitAuxDepthImage;
   ImageAndView  m_oitCounterImage;
+  ReadbackRing  m_oitCounterReadback;  // Host-visible copies of m_oitCounterImage, one uint32_t per tile and ring cycle.
   ImageAndView  m_oitWeightedColorImage;
   ImageAndView  m_oitWeightedRevealImage;
-  ImageAndView m_downsampleImage;  // A 1spp image with the same format as m_colorImage used for resolving m_colorImage.
+  ImageAndView  m_oitMomentsImage;        // b_1...b_4 (see oitMoments.frag.glsl)
+  ImageAndView  m_oitMomentsZerothImage;  // b_0
+  ImageAndView  m_oitMomentsAccumImage;   // The transmittance-weighted color sum
+  ImageAndView  m_oitCompositeImage;  // The output of the compute composite, with the same size as the auxiliary images.
+  // Fragment statistics (see State::fragmentStats)
+  ImageAndView      m_fragmentStatsImage;     // Per-pixel counts, with the size of m_colorImage and NUM_STATS_LAYERS layers.
+  nvvk::Buffer      m_fragmentStatsBuffer;    // One FragmentStats, written by fragmentStats.comp.glsl.
+  ReadbackRing      m_fragmentStatsReadback;  // Host-visible copies of m_fragmentStatsBuffer, one FragmentStats per ring cycle.
+  VkExtent2D    m_oitTileExtent = {0, 0};  // The size of the region the A-buffer and auxiliary images cover.
+  uint32_t      m_oitTileCount  = 1;       // The number of tiles of that size needed to cover m_colorImage.
+  VkRect2D      m_tile          = {};      // The tile last set by cmdSetTile.
+  ImageAndView m_downsampleImage;  // A 1spp image with the same format as m_colorImage used for resolving m_colorImage (unless State::computeResolve).
   ImageAndView m_guiCompositeImage;  // A 1spp image with the same format as the swapchain.
-  VkSampler    m_pointSampler = nullptr;
+  VkSampler    m_pointSampler   = nullptr;
+  VkSampler    m_nearestSampler = nullptr;  // Used for reading depth and Hi-Z texels, which may not support linear filtering.
   nvvk::Buffer m_vertexBuffer;
   nvvk::Buffer m_indexBuffer;
+  nvvk::Buffer m_instanceColorBuffer;  // One vec4 color per object, for the instanced scene.
+  // GPU culling
+  nvvk::Buffer             m_objectBoundsBuffer;      // One vec4(center, radius) per object.
+  nvvk::Buffer             m_drawCommandsBuffer;      // One VkDrawIndexedIndirectCommand per object.
+  nvvk::Buffer             m_drawCountsBuffer;        // One uint32_t per CULL_REGION_*.
+  nvvk::Buffer             m_sortKeysBuffer;          // One uvec2(object, bucket) per object, for State::frontToBack.
+  nvvk::Buffer             m_sortBucketsBuffer;       // Two uint32_t per OBJECT_SORT_BUCKETS bucket.
+  nvvk::Image              m_hizImage;                // Furthest-depth pyramid of m_depthImage, in VK_IMAGE_LAYOUT_GENERAL.
+  VkImageView              m_hizView = nullptr;       // All levels of m_hizImage
+  std::vector<VkImageView> m_hizLevelViews;           // One view per level of m_hizImage
+  PushConstants            m_pushConstants = {};      // The push constants last passed to cmdPushConstants.
   // Shaders
   nvvk::ShaderModuleManager m_shaderModuleManager;
   nvvk::ShaderModuleID      m_shaderSceneVert;
+  nvvk::ShaderModuleID      m_shaderSphereTask;           // With State::usesMeshShaders, for double-sided pipelines
+  nvvk::ShaderModuleID      m_shaderSphereTaskBackfaces;  // With State::usesMeshShaders, also culls back-facing patches
+  nvvk::ShaderModuleID      m_shaderSphereMesh;
   nvvk::ShaderModuleID      m_shaderOpaqueFrag;
   nvvk::ShaderModuleID      m_shaderFullScreenTriangleVert;
   nvvk::ShaderModuleID      m_shaderSimpleColorFrag;
@@ -171,13 +539,46 @@ public:
   nvvk::ShaderModuleID      m_shaderSpinlockCompositeFrag;
   nvvk::ShaderModuleID      m_shaderWeightedColorFrag;
   nvvk::ShaderModuleID      m_shaderWeightedCompositeFrag;
+  nvvk::ShaderModuleID      m_shaderMomentsDepthFrag;
+  nvvk::ShaderModuleID      m_shaderMomentsColorFrag;
+  nvvk::ShaderModuleID      m_shaderMomentsCompositeFrag;
+  nvvk::ShaderModuleID      m_shaderHizComp;
+  nvvk::ShaderModuleID      m_shaderCullComp;
+  nvvk::ShaderModuleID      m_shaderCullScanComp;
+  nvvk::ShaderModuleID      m_shaderCullScatterComp;
+  nvvk::ShaderModuleID      m_shaderCompositeComp;
+  nvvk::ShaderModuleID      m_shaderCompositeBlendFrag;
+  nvvk::ShaderModuleID      m_shaderFragmentStatsComp;
+  nvvk::ShaderModuleID      m_shaderFragmentHeatmapFrag;
+  nvvk::ShaderModuleID      m_shaderResolveComp;
+  // Shader and pipeline caches (see oitShaderCache.cpp)
+  std::vector<std::string> m_shaderDirectories;     // Where shader source files are searched
+  std::string              m_shaderCacheDirectory;  // Ends with a slash; empty if the on-disk caches are disabled
+  std::string              m_shaderCacheDeviceKey;  // Identifies the device and driver in cache keys
+  uint64_t                 m_shaderIncludesHash = 0;  // hashShaderIncludes, updated by createOrReloadShaderModules
+  VkPipelineCache          m_pipelineCache      = VK_NULL_HANDLE;
+  uint32_t                 m_shaderCacheEnabled = 1;  // -oitshadercache
+  uint32_t                 m_precompileShaders  = 0;  // -oitprecompile
+  // Background precompile
+  nvvk::ShaderModuleManager m_precompileShaderModuleManager;  // Only used by m_precompileThread
+  std::thread               m_precompileThread;
+  std::atomic<uint32_t>     m_precompileDone{0};
+  uint32_t                  m_precompileTotal = 0;
+  std::atomic<bool>         m_precompileCancel{false};
   // Descriptors
-  // Contains a layout, a pipeline layout, some reflection information, and a
-  // pool for a number of VkDescriptorSets created using the same layout.
+  // Contains a layout, a pipeline layout, and some reflection information.
   nvvk::DescriptorSetContainer m_descriptorInfo;
+  // The descriptor set, using m_descriptorInfo's layout. Since frames in
+  // flight may still use it, updateAllDescriptorSets allocates a new set from
+  // a new pool instead of updating it.
+  VkDescriptorPool m_descriptorPool = nullptr;
+  VkDescriptorSet  m_descriptorSet  = nullptr;
   // Render passes
   VkRenderPass m_renderPassColorDepthClear = nullptr;
+  VkRenderPass m_renderPassColorDepthLoad  = nullptr;  // Like m_renderPassColorDepthClear, but loads instead of clearing.
   VkRenderPass m_renderPassWeighted        = nullptr;
+  VkRenderPass m_renderPassMoments         = nullptr;
+  VkRenderPass m_renderPassTransparent     = nullptr;  // With State::usesTransparentSubpasses, one subpass per transparent pass.
   VkRenderPass m_renderPassGUI             = nullptr;
   // Graphics pipelines (organized by the algorithms that use them)
   VkPipeline m_pipelineOpaque              = nullptr;
@@ -196,6 +597,25 @@ public:
   VkPipeline m_pipelineSpinlockComposite   = nullptr;
   VkPipeline m_pipelineWeightedColor       = nullptr;
   VkPipeline m_pipelineWeightedComposite   = nullptr;
+  VkPipeline m_pipelineMomentsDepth        = nullptr;
+  VkPipeline m_pipelineMomentsColor        = nullptr;
+  VkPipeline m_pipelineMomentsComposite    = nullptr;
+  // Compute pipelines for GPU culling
+  VkPipeline m_pipelineHiz         = nullptr;
+  VkPipeline m_pipelineCull        = nullptr;
+  VkPipeline m_pipelineCullScan    = nullptr;
+  VkPipeline m_pipelineCullScatter = nullptr;
+  // Compute composite for OIT_SIMPLE, OIT_INTERLOCK, and OIT_SPINLOCK
+  VkPipeline m_pipelineCompositeCompute = nullptr;
+  VkPipeline m_pipelineCompositeBlend   = nullptr;
+  // Fragment statistics
+  VkPipeline m_pipelineFragmentStats   = nullptr;
+  VkPipeline m_pipelineFragmentHeatmap = nullptr;
+  // Compute resolve (see copyOffscreenToBackBuffer)
+  VkPipeline m_pipelineResolve = nullptr;
+  // Smaller layer counts for State::adaptiveLayers; element i is
+  // only used if ADAPTIVE_LAYER_COUNTS[i] < State::oitLayers.
+  std::array<LayerVariant, NUM_ADAPTIVE_LAYER_COUNTS> m_layerVariants;
 
   // GUI-specific variables
   ImGuiH::Registry m_imGuiRegistry;  // Helper class that tracks IDs for dear imgui
@@ -208,16 +628,75 @@ public:
   nvh::CameraControl m_cameraControl;      // A controllable camera
   SceneData          m_sceneUbo;           // Uniform Buffer Object for the scene, depends on m_cameraControl.
   uint32_t m_objectTriangleIndices = 0;  // The number of indices used in each sphere. (All objects have the same number of indices.)
-  uint32_t m_sceneTriangleIndices = 0;  // The total number of indices in the scene.
+  uint32_t m_sceneNumObjects = 0;  // The number of objects in the scene.
+  bool     m_sceneInstanced  = false;  // Whether the scene was built with State::instancedScene.
+  uint32_t m_sceneSubdiv     = 0;      // The State::subdiv the scene was built with.
+  // Scene generation and upload (see initScene and updateScene). Frames keep
+  // rendering the resident scene above until the new one has been uploaded.
+  SceneGeometry                 m_sceneGeometry;  // Written by m_sceneThread, then read by updateScene
+  std::thread                   m_sceneThread;
+  std::atomic<bool>             m_sceneGenerated{false};  // Whether m_sceneThread has finished
+  bool                          m_sceneRequested = false;  // Whether the scene settings changed during a build
+  bool                          m_sceneUploading = false;  // Whether m_pendingScene is being uploaded
+  SceneBuffers                  m_pendingScene;
+  size_t                        m_sceneUploadRegion = 0;  // Next of vertices, indices, and bounds to upload
+  VkDeviceSize                  m_sceneUploadOffset = 0;  // Next byte of that region to upload
+  nvvk::StagingMemoryManager    m_sceneStaging;
+  VkCommandPool                 m_sceneUploadCmdPool   = nullptr;  // For m_context.m_queueT
+  VkSemaphore                   m_sceneUploadSemaphore = nullptr;  // Timeline semaphore signaled by each upload chunk
+  uint64_t                      m_sceneUploadValue     = 0;        // Value signaled by the last chunk submitted
+  std::vector<SceneUploadChunk> m_sceneUploadChunks;  // Submitted chunks that haven't been released yet
 
   // We make these constants so that we can create their render passes without
   // creating the images yet.
   const VkFormat m_oitWeightedColorFormat  = VK_FORMAT_R16G16B16A16_SFLOAT;
   const VkFormat m_oitWeightedRevealFormat = VK_FORMAT_R16_SFLOAT;
+  // Power moments need 32-bit floats; the paper's 16-bit variant requires
+  // trigonometric moments or quantization.
+  const VkFormat m_oitMomentsFormat        = VK_FORMAT_R32G32B32A32_SFLOAT;
+  const VkFormat m_oitMomentsZerothFormat  = VK_FORMAT_R32_SFLOAT;
+  const VkFormat m_oitMomentsAccumFormat   = VK_FORMAT_R16G16B16A16_SFLOAT;
   const VkFormat m_guiCompositeColorFormat = VK_FORMAT_B8G8R8A8_UNORM;
 
   uint32_t m_frame = 0;
 
+  // Adaptive linked-list sizing (see updateLinkedListCapacity)
+  uint32_t m_linkedListNodesUsed  = 0;  // The counter's value from the most recent readback.
+  uint32_t m_linkedListLowCount   = 0;  // Number of consecutive readbacks that used little of the A-buffer.
+  uint32_t m_linkedListLowPeak    = 0;  // The most nodes used during those readbacks.
+
+  // Fragment statistics from the most recent readback (see updateFragmentStats)
+  FragmentStatsSummary m_fragmentStats;
+
+  // The readbacks' recent values, which the GUI plots.
+  ValueHistory m_linkedListNodesHistory;
+  ValueHistory m_meanFragmentsHistory;
+  ValueHistory m_overflowPercentHistory;
+  ValueHistory m_lockAttemptsHistory;  // Per fragment
+
+  // Adaptive layer counts (see updateAdaptiveLayers)
+  uint32_t m_activeLayers           = 0;  // The layer count this frame renders with.
+  uint32_t m_adaptiveLayersLowCount = 0;  // Number of consecutive readbacks that needed fewer layers.
+  uint32_t m_adaptiveLayersLowPeak  = 0;  // The most layers needed during those readbacks.
+
+  // Frame tags (see State::usesFrameTags and clearTransparent)
+  uint32_t m_frameTag       = 0;  // The tag of the last tile or frame; 0 makes the next clearTransparent clear fully.
+  uint32_t m_frameTagLayers = 0;  // m_activeLayers at the last full clear.
+
+  // Benchmark mode
+  BenchmarkSettings            m_benchmarkSettings;
+  std::vector<State>           m_benchmarkCells;           // Every combination of State the benchmark measures
+  std::vector<BenchmarkResult> m_benchmarkResults;         // One per measured element of m_benchmarkCells
+  uint32_t                     m_benchmarkCell      = 0;   // Index of the combination being measured
+  uint32_t                     m_benchmarkCellFrame = 0;   // Number of frames rendered with this combination
+  bool                         m_benchmarkActive    = false;
+  // Reference images (see BenchmarkSettings::reference). If there are any,
+  // the first m_benchmarkReferences.size() cells render them.
+  std::vector<BenchmarkReference> m_benchmarkReferences;
+  ReadbackRing                    m_benchmarkCapture;  // Host-visible copies of m_guiCompositeImage
+  uint32_t                        m_benchmarkCaptureCycle     = 0;      // The ring cycle of the last capture
+  bool                            m_benchmarkCaptureRequested = false;  // Whether this frame should be captured
+
 public:
   Sample()
       : AppWindowProfilerVK(false)
@@ -225,8 +704,42 @@ public:
 #if defined(NDEBUG)
     setVsync(false);
 #endif
+    setupConfigParameters();
   }
 
+  // Registers the command-line parameters of this sample with m_parameterList.
+  void setupConfigParameters();
+
+  // Returns whether the device supports the given OIT_* algorithm.
+  bool isAlgorithmSupported(uint32_t algorithm);
+
+  // Returns whether the device supports vkCmdDrawIndexedIndirectCount, which
+  // GPU culling uses.
+  bool isGpuCullingSupported();
+
+  // Returns whether the device has enough compute shared memory for the
+  // compute composite to sort m_state.oitLayers fragments per invocation.
+  bool isComputeCompositeSupported();
+  // Returns whether fragment shaders support subgroup ballots, which
+  // SPIN_SUBGROUP and State::linkedListSubgroupAlloc need.
+  bool isFragmentBallotSupported();
+  // Returns whether compute shaders can write to m_guiCompositeImage, which
+  // State::computeResolve needs.
+  bool isComputeResolveSupported();
+  // Returns whether the device supports VK_KHR_fragment_shading_rate, which
+  // State::shadingRate needs.
+  bool isShadingRateSupported();
+  // Returns whether the device supports task and mesh shaders from
+  // VK_EXT_mesh_shader, which State::meshShaders needs.
+  bool isMeshShaderSupported();
+  // Returns whether the device supports VK_KHR_multiview render passes with
+  // at least OIT_MAX_VIEWS views, which State::multiview needs.
+  bool isMultiviewSupported();
+  // The shader stages of the pipeline layout's push constants and of the
+  // descriptors the scene's shaders read; includes the task and mesh stages
+  // if they're supported.
+  VkShaderStageFlags getSceneShaderStages();
+
   /////////////////////////////////////////////////////////////////////////////
   // Callbacks                                                               //
   /////////////////////////////////////////////////////////////////////////////
@@ -245,16 +758,30 @@ public:
   bool begin() override;
 
   // Immediately creates and executes a command buffer that updates the state
-  // of the renderer. Usually called from cmdUpdateRendererFromState. Should
-  // usually be only called when m_state != m_lastState.
+  // of the renderer, then waits for the device to be idle. Only used at
+  // startup; afterwards, think records cmdUpdateRendererFromState into each
+  // frame's command buffer instead.
   void updateRendererImmediate(bool swapchainSizeChanged, bool forceRebuildAll);
 
   // Compares m_state to m_lastState. If m_state changed, then
   // it updates the parts of the rendering system that need to change, such
   // as by reloading shaders and by regenerating internal buffers.
   // It also essentially tracks which objects depend on which parameters.
+  // Replaced objects are retired instead of destroyed, so this doesn't wait
+  // for the frames in flight to finish.
   void cmdUpdateRendererFromState(VkCommandBuffer cmdBuffer, bool swapchainSizeChanged, bool forceRebuildAll);
 
+  // Destroys an object once all frames that may have used it (the ones
+  // submitted so far and the one being recorded) have finished on the GPU.
+  // Use this instead of destroying objects that frames in flight may use.
+  void retire(std::function<void()>&& destroy);
+
+  // Shorthands for retire that also reset the object.
+  void retireImage(ImageAndView& image);
+  void retireBuffer(BufferAndView& buffer);
+  void retireBuffer(nvvk::Buffer& buffer);
+  void retireBuffer(ReadbackRing& buffer);
+
   // Tear down the sample, essentially by running creation in reverse
   void end() override;
 
@@ -264,42 +791,122 @@ public:
   // Device must not be using resource when called.
   void createTextureSampler();
 
-  // Device must not be using resource when called.
-  void destroyUniformBuffers();
+  // Unmaps and retires m_uniformBuffer.
+  void destroyUniformBuffer();
 
-  // Depends only on the number of images in the swapchain.
-  // Device must not be using resource when called.
-  void createUniformBuffers();
+  // Creates and maps m_uniformBuffer. Depends only on the number of ring
+  // cycles, so this is only called once, from begin.
+  void createUniformBuffer();
 
-  // Destroys the vertex and index buffers used for the scene.
-  // Device must not be using resource when called.
+  // Destroys the vertex, index, and culling buffers used for the scene.
+  // Retires the objects it replaces, so frames in flight may still use them.
   void destroyScene();
 
-  // Recomputes the geometry used for the scene (which is a single mesh, described by
-  // m_bufferVertices and m_bufferIndices). Then adds upload instructions to the command buffer.
-  // Device must not be using resource when called.
-  void initScene(VkCommandBuffer commandBuffer);
+  // Starts recomputing the geometry used for the scene (which is a single
+  // mesh, described by m_vertexBuffer and m_indexBuffer, or with
+  // State::instancedScene, one sphere and m_instanceColorBuffer) and each
+  // object's bounding sphere on a background thread. If a scene is already being
+  // built, the new one is started once that one has finished.
+  void initScene();
 
-  // Device must not be using resource when called.
+  // Creates the objects updateScene uses to upload scenes on m_context.m_queueT.
+  void initSceneUpload();
+
+  // Destroys them, along with a scene that's still being built.
+  void destroySceneUpload();
+
+  // Advances building the scene initScene started: once it's generated,
+  // streams it to new buffers on the transfer queue, a chunk per call, and
+  // once the transfer queue has finished, replaces the resident scene with
+  // it. If waitUntilResident is true, does all of this before returning.
+  void updateScene(bool waitUntilResident);
+
+  // Whether a scene is being generated or uploaded.
+  bool isSceneBuilding() const { return m_sceneThread.joinable() || m_sceneUploading; }
+
+  // Retires the objects it replaces, so frames in flight may still use them.
   void destroyFrameImages();
 
   // Creates the intermediate buffers used for order-independent transparency -
   // these are all of the IMG_* textures referenced in common.h. Unlike static
   // textures, their contents are recomputed each frame.
-  // Device must not be using resource when called.
+  // Retires the objects it replaces, so frames in flight may still use them.
   void createFrameImages(VkCommandBuffer cmdBuffer);
 
-  // Device must not be using resource when called.
+  // Creates a 2D image like ImageAndView::create, with memory from m_frameMemory.
+  void createFrameImage(ImageAndView&      image,
+                        VkImageAspectFlags viewAspect,
+                        VkFormat           format,
+                        uint32_t           width,
+                        uint32_t           height,
+                        uint32_t           arrayLayers,
+                        VkImageUsageFlags  usage,
+                        uint32_t           numSamples = 1);
+
+  // Binds images from ImageAndView::createUnbound to memory from
+  // m_frameMemory. Each group's images are placed one after another, and all
+  // groups start at the same offset, so that images in different groups alias
+  // each other. Only use this for groups that are never used at the same time,
+  // and whose images discard their contents before each use.
+  void bindAliasedFrameImages(const std::vector<std::vector<ImageAndView*>>& groups);
+
+  // Replaces the OIT_LINKEDLIST A-buffer with one that can hold numNodes
+  // linked list nodes, and rebinds it in all descriptor sets. Unlike
+  // createFrameImages, this leaves all other resources and pipelines alone.
+  // Retires the previous A-buffer and descriptor sets.
+  void resizeLinkedListABuffer(VkDeviceSize numNodes);
+
+  // Returns the size of an OIT_LINKEDLIST A-buffer node, which depends on
+  // whether it's packed (see State::usesPackedABuffer).
+  VkDeviceSize getLinkedListNodeBytes() const;
+
+  // Returns the number of entries in each plane of the A-buffer (see
+  // abufferIndex in common.h) for m_oitTileExtent; ABUFFER_LAYOUT_TILED pads
+  // the planes to whole blocks.
+  uint32_t getABufferPlaneSize() const;
+
+  // Called once per frame after waiting for the current ring cycle's fence.
+  // Reads the atomic counter value that this cycle's last frame copied to
+  // m_oitCounterReadback - that is, the number of linked list nodes its
+  // fragments needed. If adaptive linked-list sizing is on, grows the A-buffer
+  // when it's close to overflowing, and shrinks it once the scene has used
+  // less than half of it for a while.
+  void updateLinkedListCapacity();
+
+  // Called once per frame after waiting for the current ring cycle's fence.
+  // If State::fragmentStats is on, reads the FragmentStats that this cycle's
+  // last frame copied to m_fragmentStatsReadback, and summarizes them in
+  // m_fragmentStats. Returns whether it read new statistics.
+  bool updateFragmentStats();
+
+  // Called once per frame after updateFragmentStats. If
+  // State::usesAdaptiveLayers(), estimates from the histogram of the newest
+  // statistics how many fragments each layer count would let overflow, and
+  // sets m_activeLayers to the smallest one below
+  // State::adaptiveOverflowPercent. Switches to more layers right away, but
+  // only to fewer layers once the scene has needed them for a while.
+  // Otherwise, sets m_activeLayers to State::oitLayers.
+  void updateAdaptiveLayers(bool newStats);
+
+  // Returns the variant that renders with m_activeLayers, or nullptr if that's
+  // State::oitLayers and the usual pipelines apply.
+  const LayerVariant* getActiveLayerVariant() const;
+
+  // Retires the descriptor sets and destroys the layouts.
   void destroyDescriptorSets();
 
+  // Retires m_descriptorPool and its descriptor sets.
+  void retireDescriptorPool();
+
   // This needs to be recreated whenever the algorithm changes to or from
   // OIT_LOOP64, as that algorithm uses a different descriptor type for
   // the A-buffer.
-  // Device must not be using resource when called.
+  // Retires the objects it replaces, so frames in flight may still use them.
   void createDescriptorSets();
 
   // This needs to be called whenever our buffers change. This will basically
   // cause VkCmdBindDescriptorSets to bind all of the textures we need at once.
+  // Allocates new descriptor sets, since frames in flight may use the old ones.
   void updateAllDescriptorSets();
 
   // Device must not be using resource when called.
@@ -308,31 +915,32 @@ public:
   // Creates the ImGui render pass. This should not be called twice.
   void createGUIRenderPass();
 
-  // Device must not be using resource when called.
+  // Retires the objects it replaces, so frames in flight may still use them.
   void destroyNonGUIRenderPasses();
 
   // Creates or recreates all non-ImGui render passes.
   void createNonGUIRenderPasses();
 
-  // Device must not be using resource when called.
+  // The dependency flags of the self-dependencies and barriers between the
+  // fragment passes inside these render passes: by region, and with
+  // multiview, also view-local (see State::usesMultiview).
+  VkDependencyFlags getFragmentDependencyFlags() const;
+
+  // Retires the objects it replaces, so frames in flight may still use them.
   void destroyFramebuffers();
 
-  // Device must not be using resource when called.
+  // Retires the objects it replaces, so frames in flight may still use them.
   void createFramebuffers();
 
+  // Returns the defines that all shaders are compiled with for the given state.
+  static std::string getShaderDefinitions(const State& state);
+
   // Updates global shader define; all shaders have to be recompiled after setting this.
   void updateShaderDefinitions();
 
-  // Helper function to add new shader module to m_shadermoduleManager if
-  // `shaderModule` isn't already set, or to reload `shaderModule` if it is set.
-  //   shaderStage: Which shader stage this shader will be used for, e.g. fragment or vertex
-  //   filename: The file containing the GLSL code for the shader.
-  //   prepend: Additional text to be placed after the #version directive,
-  //     such as preprocessor defines.
-  void createOrReloadShaderModule(nvvk::ShaderModuleID& shaderModule,
-                                  VkShaderStageFlags    shaderStage,
-                                  const std::string&    filename,
-                                  const std::string&    prepend = "");
+  // Returns the shader modules needed to render the given state, or all
+  // shader modules if loadEverything is true.
+  std::vector<ShaderModuleDesc> getShaderModuleDescs(const State& state, bool loadEverything);
 
   // Call this function whenever you need to update the shader definitions or
   // when the algorithm changes - this will create or reload only the shader
@@ -342,14 +950,15 @@ public:
   // only the shader modules we need.
   void createOrReloadShaderModules();
 
+  // Destroys a graphics or compute pipeline, if it exists.
   void destroyGraphicsPipeline(VkPipeline& pipeline);
 
-  // Device must not be using resource when called.
+  // Retires the objects it replaces, so frames in flight may still use them.
   void destroyGraphicsPipelines();
 
   // Destroys all graphics pipelines, and creates only the graphics pipeline
   // objects we need for a given algorithm.
-  // Device must not be using resource when called.
+  // Retires the objects it replaces, so frames in flight may still use them.
   void createGraphicsPipelines();
 
   // Creates a graphics pipeline, exposing only the features that are needed.
@@ -358,6 +967,8 @@ public:
   //   blendMode: An enum selecting how blending and depth writing work.
   //   usesVertexInput: Specifies whether or not we read from a vertex buffer.
   //     E.g. this is true for drawing spheres and false for fullscreen triangles.
+  //     With m_state.usesMeshShaders(), the spheres' task and mesh shaders
+  //     replace the vertex shader and vertex input instead.
   //   renderPass and subpass: The render pass and subpass in which this graphics pipeline will be used.
   VkPipeline createGraphicsPipeline(const nvvk::ShaderModuleID& vertShaderModuleID,
                                     const nvvk::ShaderModuleID& fragShaderModuleID,
@@ -367,6 +978,9 @@ public:
                                     VkRenderPass                renderPass,
                                     uint32_t                    subpass = 0);
 
+  // Creates a compute pipeline using the same pipeline layout as the graphics pipelines.
+  VkPipeline createComputePipeline(const nvvk::ShaderModuleID& compShaderModuleID);
+
   // Creates and begins a command buffer that will only be submitted once.
   VkCommandBuffer createTempCmdBuffer();
 
@@ -388,6 +1002,10 @@ public:
   // m_oitAuxImage: 1200 x 1024, 2 layers.
   void DoObjectSizeText(ImageAndView iv, const char* name);
 
+  // Plots the history as a small graph labeled with its newest value, scaled
+  // from 0 to the largest value in the history.
+  void DoValueHistoryPlot(const ValueHistory& history, const char* label, const char* format);
+
   // Displays the Dear ImGui interface.
   // This interface includes tooltips for each of the elements, and also shows
   // or hides fields based on the current OIT algorithm.
@@ -397,7 +1015,8 @@ public:
   // Main rendering logic                                                    //
   /////////////////////////////////////////////////////////////////////////////
 
-  void updateUniformBuffer(uint32_t currentImage, double time);
+  // Writes m_sceneUbo to the given ring cycle's slot of m_uniformBuffer.
+  void updateUniformBuffer(uint32_t ringCycle, double time);
 
   // Blit the offscreen color buffer to the main buffer, resolving MSAA
   // samples and downscaling in the process.
@@ -414,6 +1033,97 @@ public:
   // Renders the scene including transparency to m_colorImage.
   void render(VkCommandBuffer& cmdBuffer);
 
+  // Used by render when the A-buffer is smaller than m_colorImage: draws the
+  // opaque objects, then for each tile clears the A-buffer, and draws the
+  // transparent objects with the scissor rectangle set to the tile, in a
+  // render pass that loads m_colorImage and m_depthImage.
+  void renderTiled(VkCommandBuffer& cmdBuffer, int numTransparent, int numOpaque);
+
+  // Used by render with State::usesParallelRecording: the same as
+  // renderTiled, but records the opaque objects and each tile's transparent
+  // passes into secondary command buffers on m_recordingWorkers, and then only
+  // records the clears, barriers, and render passes that execute them.
+  void renderSecondary(VkCommandBuffer& cmdBuffer, int numTransparent, int numOpaque);
+
+  // Begins a secondary command buffer from the worker's command pool that
+  // continues subpass 0 of renderPass, and sets up the descriptor set,
+  // scissor rectangle, and push constants, which it doesn't inherit.
+  VkCommandBuffer beginSecondary(uint32_t worker, VkRenderPass renderPass, const VkRect2D& tile, const PushConstants& pushConstants);
+
+  // Returns the tiles of m_colorImage that the A-buffer covers, in the order
+  // they're drawn. Without tiling, this is the whole image.
+  std::vector<VkRect2D> getTiles() const;
+
+  // Sets the scissor rectangle to tile and pushes its offset, so that the
+  // OIT shaders index the A-buffer relative to the tile.
+  void cmdSetTile(VkCommandBuffer& cmdBuffer, const VkRect2D& tile);
+
+  // Pushes m_pushConstants to all shader stages.
+  void cmdPushConstants(VkCommandBuffer& cmdBuffer);
+
+  // Binds m_descriptorSet, with UBO_SCENE at the current ring cycle's slot.
+  void cmdBindDescriptorSet(VkCommandBuffer cmdBuffer, VkPipelineBindPoint bindPoint);
+
+  // Resets the draw counts and culls the opaque objects against the view
+  // frustum, writing their draw commands to CULL_REGION_OPAQUE. Must be called
+  // outside of a render pass.
+  void cullOpaque(VkCommandBuffer& cmdBuffer, int firstObject, int numObjects);
+
+  // Builds the Hi-Z pyramid from m_depthImage, then culls the transparent
+  // objects against the view frustum and the pyramid, writing their draw
+  // commands to CULL_REGION_TRANSPARENT (sorted by depth bucket, with
+  // m_state.usesFrontToBack()). Must be called outside of a render pass, after
+  // the opaque objects were drawn.
+  void cullTransparent(VkCommandBuffer& cmdBuffer, int numObjects);
+
+  // Draws numObjects objects starting with firstObject using the bound
+  // pipeline. With GPU culling, draws only the objects the culling shader
+  // wrote to cullRegion, using vkCmdDrawIndexedIndirectCount. With mesh
+  // shaders, launches a task workgroup per object instead.
+  void cmdDrawObjects(VkCommandBuffer& cmdBuffer, int firstObject, int numObjects, uint32_t cullRegion);
+
+  // Used instead of a composite pipeline when m_state.usesComputeComposite().
+  // Ends the current render pass, sorts and blends the A-buffer of the current
+  // tile in oitComposite.comp.glsl, then begins m_renderPassColorDepthLoad
+  // again and blends the result onto m_colorImage.
+  void compositeCompute(VkCommandBuffer& cmdBuffer);
+
+  // Clears m_fragmentStatsImage and m_fragmentStatsBuffer, if
+  // State::fragmentStats is on. Must be called outside of a render pass,
+  // before the transparent objects are drawn.
+  void clearFragmentStats(VkCommandBuffer& cmdBuffer);
+
+  // If State::fragmentStats is on, reduces m_fragmentStatsImage in
+  // fragmentStats.comp.glsl, copies the result to the current ring cycle's
+  // slot of m_fragmentStatsReadback, and with State::fragmentHeatmap, draws
+  // the counts over m_colorImage. Must be called outside of a render pass,
+  // after all tiles were drawn.
+  void finishFragmentStats(VkCommandBuffer& cmdBuffer);
+
+  // Clears the auxiliary buffers of the current algorithm; must be called
+  // outside of a render pass.
+  void clearTransparent(VkCommandBuffer& cmdBuffer);
+
+  // The part of clearTransparent that doesn't record commands: with
+  // State::usesFrameTags, advances m_frameTag and m_pushConstants.frameTag.
+  // Returns whether the auxiliary buffers still need to be cleared.
+  bool advanceFrameTag();
+
+  // The part of clearTransparent that clears the auxiliary buffers: all of
+  // them if fullClear, and otherwise only those without frame tags.
+  void clearTransparentBuffers(VkCommandBuffer& cmdBuffer, bool fullClear);
+
+  // Draws the first numObjects objects using the current algorithm.
+  // Assumes that m_renderPassColorDepthClear or m_renderPassColorDepthLoad has
+  // already been started - or m_renderPassTransparent, with
+  // State::usesTransparentSubpasses.
+  void drawTransparent(VkCommandBuffer& cmdBuffer, int numObjects);
+
+  // Makes the previous transparent pass's fragment shader writes visible to
+  // the next one: using a pipeline barrier, or by moving to the next subpass
+  // of m_renderPassTransparent.
+  void cmdNextTransparentPass(VkCommandBuffer& cmdBuffer);
+
   // Adds calls to bind vertex and index buffers and draw numObjects objects, starting
   // with firstObject. (In this sample, an object is a single sphere).
   // Assumes that a render pass has already been started, and that the bound pipeline
@@ -435,6 +1145,11 @@ public:
   // index and vertex buffers for the mesh and descriptors are already good to go.
   void drawTransparentLinkedList(VkCommandBuffer& cmdBuffer, int numObjects);
 
+  // Copies m_oitCounterImage into the current ring cycle's slot of
+  // m_oitCounterReadback for the given tile. Must be called outside of a
+  // render pass, after the linked-list color pass.
+  void copyLinkedListCounterToReadback(VkCommandBuffer& cmdBuffer, uint32_t tileIndex);
+
   void clearTransparentLoop(VkCommandBuffer& cmdBuffer);
 
   // Draws the first numObjects objects using the two-pass depth sorting OIT
@@ -453,6 +1168,9 @@ public:
 
   void clearTransparentLock(VkCommandBuffer& cmdBuffer, bool useInterlock);
 
+  // Clears only m_oitAuxDepthImage, which frame tags don't cover.
+  void clearTransparentLockDepth(VkCommandBuffer& cmdBuffer);
+
   // The interlock and spinlock algorithms both attempt to sort the frontmost
   // OIT_LAYERS fragments and tailblend the rest, but both do it in two passes
   // (as opposed to OIT_LOOP's 3) by making use of critical sections. Spinlock
@@ -467,4 +1185,112 @@ public:
   // targets, which we implement using a render pass (see the creation of the
   // render pass for more information as to how that's set up).
   void drawTransparentWeighted(VkCommandBuffer& cmdBuffer, int numObjects);
+
+  // Moment-Based Order-Independent Transparency is also approximate and uses
+  // a fixed amount of memory, but reconstructs each fragment's transmittance
+  // from the power moments of the pixel's absorbance over depth. Its depth,
+  // color, and composite passes are the three subpasses of
+  // m_renderPassMoments.
+  void drawTransparentMoments(VkCommandBuffer& cmdBuffer, int numObjects);
+
+  /////////////////////////////////////////////////////////////////////////////
+  // Shader system and caches                                                //
+  /////////////////////////////////////////////////////////////////////////////
+
+  // Sets up m_shaderModuleManager and the shader search paths, creates the
+  // cache directory unless -oitshadercache 0 was specified, and creates
+  // m_pipelineCache from the data the last run saved.
+  void initShaderSystem();
+
+  // Initializes a shader module manager with the shader search paths and includes.
+  void initShaderModuleManager(nvvk::ShaderModuleManager& manager);
+
+  // Returns a hash of the contents of all files that shaders can include.
+  // Callers compute this once for each set of modules and pass it to
+  // hashShaderSources, instead of reading the includes for every module.
+  uint64_t hashShaderIncludes() const;
+
+  // Returns a hash of the contents of this shader file, chained with the hash
+  // of the includes from hashShaderIncludes.
+  uint64_t hashShaderSources(const std::string& filename, uint64_t includesHash) const;
+
+  // Returns the name of the SPIR-V cache file for a shader module, relative to
+  // m_shaderCacheDirectory. This depends on the device and driver, the global
+  // definitions, the module's prepend, stage and filename, and its source hash.
+  std::string getShaderCacheFilename(VkShaderStageFlags shaderStage,
+                                     const std::string& filename,
+                                     const std::string& prepend,
+                                     const std::string& definitions,
+                                     uint64_t           sourceHash) const;
+
+  // Writes the SPIR-V of a compiled shader module to the cache. Returns whether it succeeded.
+  bool writeShaderCacheFile(nvvk::ShaderModuleManager& manager, nvvk::ShaderModuleID shaderModule, const std::string& cacheFilename) const;
+
+  // Helper function to add new shader module to m_shadermoduleManager if
+  // `shaderModule` isn't already set, or to reload `shaderModule` if it is set.
+  // If the shader cache is enabled, loads the module's SPIR-V from the cache
+  // instead of compiling it when possible.
+  //   shaderStage: Which shader stage this shader will be used for, e.g. fragment or vertex
+  //   filename: The file containing the GLSL code for the shader.
+  //   prepend: Additional text to be placed after the #version directive,
+  //     such as preprocessor defines.
+  void createOrReloadShaderModule(nvvk::ShaderModuleID& shaderModule,
+                                  VkShaderStageFlags    shaderStage,
+                                  const std::string&    filename,
+                                  const std::string&    prepend = "");
+
+  // Creates m_pipelineCache, using the data in the cache directory if it came from this device and driver.
+  void createPipelineCache();
+
+  // Saves m_pipelineCache to the cache directory, then destroys it.
+  // Device must not be using resource when called.
+  void destroyPipelineCache();
+
+  // If -oitprecompile 1 was specified, starts m_precompileThread to compile
+  // all shader modules that aren't in the SPIR-V cache yet.
+  void startShaderPrecompile();
+
+  // The function m_precompileThread runs.
+  void precompileShaders(std::vector<ShaderPrecompileJob> jobs);
+
+  // Cancels the background precompile and waits for m_precompileThread to finish.
+  void stopShaderPrecompile();
+
+  // Returns whether the background precompile is still compiling.
+  bool isShaderPrecompileRunning() const;
+
+  /////////////////////////////////////////////////////////////////////////////
+  // Benchmark mode                                                          //
+  /////////////////////////////////////////////////////////////////////////////
+
+  // Builds m_benchmarkCells from m_benchmarkSettings and starts the benchmark
+  // if an output file was specified on the command line.
+  void benchmarkBegin();
+
+  // Called once per frame while the benchmark is active, before the renderer
+  // is updated from m_state. Sets m_state to the current combination, resets
+  // the profiler after the warm-up frames, and records the timings once
+  // enough frames were measured. Closes the window when finished.
+  void benchmarkAdvance();
+
+  // Appends the profiler's averaged timings for the current combination to
+  // m_benchmarkResults, and its error if there's a reference image for it.
+  // For the cells that render reference images, stores the image instead.
+  void benchmarkRecordCell();
+
+  // Called by copyOffscreenToBackBuffer if m_benchmarkCaptureRequested.
+  // Copies m_guiCompositeImage, which has to be in TRANSFER_SRC_OPTIMAL
+  // layout, into the current ring cycle's slot of m_benchmarkCapture.
+  void cmdBenchmarkCapture(VkCommandBuffer cmdBuffer);
+
+  // Compares the captured image with the reference and stores PSNR and the
+  // maximum error in the result.
+  void benchmarkMeasureError(const BenchmarkReference& reference, const uint8_t* pixels, BenchmarkResult& result) const;
+
+  // Writes m_benchmarkResults to <outputFilename>.csv and <outputFilename>.json.
+  void benchmarkWriteResults();
+
+  // Returns the total size in bytes of the OIT images other than the
+  // A-buffer (auxiliary, spinlock, depth, counter, weighted, and composite images).
+  VkDeviceSize getAuxImageBytes() const;
 };
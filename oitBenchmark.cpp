@@ -0,0 +1,840 @@
+/*
+ * Copyright (c) 2020-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2020-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Contains the command-line benchmark mode. When the sample is started with
+// -oitbenchmark <filename>, it renders every combination of the algorithms,
+// antialiasing modes, and other settings listed on the command line, using a
+// fixed camera and without drawing the GUI. For each combination, it discards
+// a few frames while the renderer warms up, averages the profiler's timings
+// over a number of frames, and then writes all results to a CSV and a JSON
+// file before closing.
+
+#include "oit.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <limits>
+
+// The profiler sections that the benchmark records. Sections that a
+// combination doesn't use are written with numAveraged = 0.
+static const char* const BENCHMARK_SECTIONS[] = {"Main",
+                                                  "ClearSimple",
+                                                  "ClearLinkedList",
+                                                  "ClearLoop",
+                                                  "ClearLoop64",
+                                                  "ClearLock",
+                                                  "ClearLockDepth",
+                                                  "CullOpaque",
+                                                  "CullTransparent",
+                                                  "CompositeCompute",
+                                                  "FragmentStats",
+                                                  "RecordSecondary",
+                                                  "CopyOffscreenToBackBuffer"};
+
+// The layer count of the reference images (see BenchmarkReference); the most
+// that the GUI offers.
+static const uint32_t BENCHMARK_REFERENCE_LAYERS = 32;
+
+// Parses a comma-separated list of unsigned integers such as "0,1,4".
+// Elements that aren't unsigned integers are logged and skipped. If no
+// elements remain, returns a list containing only defaultValue.
+static std::vector<uint32_t> parseBenchmarkList(const std::string& list, uint32_t defaultValue)
+{
+  std::vector<uint32_t> values;
+  size_t                start = 0;
+  while(start < list.size())
+  {
+    size_t end = list.find(',', start);
+    if(end == std::string::npos)
+    {
+      end = list.size();
+    }
+
+    const std::string element = list.substr(start, end - start);
+    if(!element.empty())
+    {
+      // strtoul would skip whitespace and accept a sign, so require a digit.
+      const bool          isDigit    = (element[0] >= '0' && element[0] <= '9');
+      char*               elementEnd = nullptr;
+      const unsigned long value      = isDigit ? strtoul(element.c_str(), &elementEnd, 10) : 0;
+      if(elementEnd != element.c_str() + element.size() || value > std::numeric_limits<uint32_t>::max())
+      {
+        LOGE("Benchmark: ignoring \"%s\" in the list \"%s\", which is not an unsigned integer.\n", element.c_str(), list.c_str());
+      }
+      else
+      {
+        values.push_back(static_cast<uint32_t>(value));
+      }
+    }
+    start = end + 1;
+  }
+
+  if(values.empty())
+  {
+    values.push_back(defaultValue);
+  }
+  return values;
+}
+
+// Returns text as the contents of a JSON string, escaping quotes, backslashes
+// and control characters.
+static std::string escapeJsonString(const std::string& text)
+{
+  std::string escaped;
+  for(const char c : text)
+  {
+    if(c == '"' || c == '\\')
+    {
+      escaped += '\\';
+      escaped += c;
+    }
+    else if(static_cast<unsigned char>(c) < 0x20)
+    {
+      char code[8];
+      snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned int>(static_cast<unsigned char>(c)));
+      escaped += code;
+    }
+    else
+    {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+// One setting that the benchmark varies. benchmarkBegin measures every
+// combination of the values of its axes.
+struct BenchmarkAxis
+{
+  std::vector<uint32_t> values;
+  // The value of cells this axis doesn't apply to.
+  uint32_t unusedValue;
+  // Returns whether the values change anything for a cell whose earlier axes
+  // are set; if empty, the axis applies to all cells.
+  std::function<bool(const State& cell)> applies;
+  // Sets this axis' setting of a cell to a value.
+  std::function<void(State& cell, uint32_t value)> set;
+};
+
+// Returns whether the benchmark measures a combination of settings; this
+// excludes settings of different axes that don't work together.
+static bool isValidBenchmarkCell(const State& cell)
+{
+  // Front-to-back ordering reorders GPU culling's draw commands.
+  if(cell.frontToBack && !cell.gpuCulling)
+  {
+    return false;
+  }
+  if(cell.aBufferLayout >= NUM_ABUFFER_LAYOUTS)
+  {
+    return false;
+  }
+  // The compute composite doesn't draw, so it can't be a subpass.
+  if(cell.subpassComposite && cell.usesComputeComposite())
+  {
+    return false;
+  }
+  // Parallel recording doesn't apply to either of these.
+  if((cell.recordingThreads != 0) && (cell.usesComputeComposite() || cell.subpassComposite))
+  {
+    return false;
+  }
+  return true;
+}
+
+void Sample::benchmarkBegin()
+{
+  m_benchmarkActive = false;
+  m_benchmarkCells.clear();
+  m_benchmarkResults.clear();
+
+  if(m_benchmarkSettings.outputFilename.empty())
+  {
+    return;
+  }
+
+  const State           defaults;
+  std::vector<uint32_t> algorithms;
+  for(uint32_t algorithm : parseBenchmarkList(m_benchmarkSettings.algorithms, defaults.algorithm))
+  {
+    if(!isAlgorithmSupported(algorithm))
+    {
+      LOGI("Benchmark: skipping algorithm %u, which this device does not support.\n", algorithm);
+      continue;
+    }
+    algorithms.push_back(algorithm);
+  }
+  std::vector<uint32_t> aaTypes;
+  for(uint32_t aaType : parseBenchmarkList(m_benchmarkSettings.aaTypes, defaults.aaType))
+  {
+    if(aaType > AA_SSAA_8X)
+    {
+      LOGI("Benchmark: skipping unknown antialiasing type %u.\n", aaType);
+      continue;
+    }
+    aaTypes.push_back(aaType);
+  }
+  const std::vector<uint32_t> oitLayers  = parseBenchmarkList(m_benchmarkSettings.oitLayers, defaults.oitLayers);
+  const std::vector<uint32_t> listAllocs =
+      parseBenchmarkList(m_benchmarkSettings.linkedListAllocatedPerElement, defaults.linkedListAllocatedPerElement);
+  const std::vector<uint32_t> numObjects = parseBenchmarkList(m_benchmarkSettings.numObjects, defaults.numObjects);
+  const std::vector<uint32_t> percentTransparent =
+      parseBenchmarkList(m_benchmarkSettings.percentTransparent, defaults.percentTransparent);
+  const std::vector<uint32_t> computeComposites =
+      parseBenchmarkList(m_benchmarkSettings.computeComposite, defaults.computeComposite ? 1 : 0);
+  const std::vector<uint32_t> sortStrategies = parseBenchmarkList(m_benchmarkSettings.sortStrategy, defaults.sortStrategy);
+  const std::vector<uint32_t> adaptiveLayers =
+      parseBenchmarkList(m_benchmarkSettings.adaptiveLayers, defaults.adaptiveLayers ? 1 : 0);
+  const std::vector<uint32_t> packedABuffers =
+      parseBenchmarkList(m_benchmarkSettings.packedABuffer, defaults.packedABuffer ? 1 : 0);
+  const std::vector<uint32_t> interlockMLABs =
+      parseBenchmarkList(m_benchmarkSettings.interlockMLAB, defaults.interlockMLAB ? 1 : 0);
+  // Front-to-back ordering reorders GPU culling's draw commands, so comparing
+  // it turns on GPU culling for all combinations.
+  const std::vector<uint32_t> frontToBacks = parseBenchmarkList(m_benchmarkSettings.frontToBack, defaults.frontToBack ? 1 : 0);
+  const bool cellGpuCulling = (!m_benchmarkSettings.frontToBack.empty() && isGpuCullingSupported()) || m_state.gpuCulling;
+  std::vector<uint32_t> spinlockStrategies;
+  for(uint32_t strategy : parseBenchmarkList(m_benchmarkSettings.spinlockStrategy, defaults.spinlockStrategy))
+  {
+    if((strategy >= NUM_SPIN_STRATEGIES) || ((strategy == SPIN_SUBGROUP) && !isFragmentBallotSupported()))
+    {
+      LOGI("Benchmark: skipping spinlock strategy %u, which this device does not support.\n", strategy);
+      continue;
+    }
+    spinlockStrategies.push_back(strategy);
+  }
+  if(spinlockStrategies.empty())
+  {
+    spinlockStrategies.push_back(SPIN_PLAIN);
+  }
+  std::vector<uint32_t> listSubgroupAllocs =
+      parseBenchmarkList(m_benchmarkSettings.linkedListSubgroupAlloc, defaults.linkedListSubgroupAlloc ? 1 : 0);
+  if(!isFragmentBallotSupported() && !m_benchmarkSettings.linkedListSubgroupAlloc.empty())
+  {
+    LOGI("Benchmark: skipping the linked list's subgroup allocation, which this device does not support.\n");
+    listSubgroupAllocs = {0};
+  }
+  const std::vector<uint32_t> aBufferLayouts = parseBenchmarkList(m_benchmarkSettings.aBufferLayout, defaults.aBufferLayout);
+  const std::vector<uint32_t> frameTags = parseBenchmarkList(m_benchmarkSettings.frameTags, defaults.frameTags ? 1 : 0);
+  std::vector<uint32_t>       computeResolves =
+      parseBenchmarkList(m_benchmarkSettings.computeResolve, defaults.computeResolve ? 1 : 0);
+  if(!isComputeResolveSupported() && !m_benchmarkSettings.computeResolve.empty())
+  {
+    LOGI("Benchmark: skipping the compute resolve, which this device does not support.\n");
+    computeResolves = {0};
+  }
+  const std::vector<uint32_t> subpassComposites =
+      parseBenchmarkList(m_benchmarkSettings.subpassComposite, defaults.subpassComposite ? 1 : 0);
+  const std::vector<uint32_t> recordingThreads = parseBenchmarkList(m_benchmarkSettings.recordingThreads, defaults.recordingThreads);
+  std::vector<uint32_t>       shadingRates     = parseBenchmarkList(m_benchmarkSettings.shadingRate, defaults.shadingRate);
+  if(!isShadingRateSupported() && !m_benchmarkSettings.shadingRate.empty())
+  {
+    LOGI("Benchmark: skipping shading rates, which this device does not support.\n");
+    shadingRates = {SHADING_RATE_1X1};
+  }
+  // Mesh shaders need the instanced scene, so comparing them turns it on for
+  // all combinations. They replace GPU culling and need a subdivision of at
+  // most MESH_MAX_SUBDIV, so they're only measured where usesMeshShaders can
+  // be true.
+  std::vector<uint32_t> meshShaders = parseBenchmarkList(m_benchmarkSettings.meshShaders, defaults.meshShaders ? 1 : 0);
+  if(!isMeshShaderSupported() && !m_benchmarkSettings.meshShaders.empty())
+  {
+    LOGI("Benchmark: skipping mesh shaders, which this device does not support.\n");
+    meshShaders = {0};
+  }
+  const bool cellInstanced = (!m_benchmarkSettings.meshShaders.empty() && isMeshShaderSupported()) || m_state.instancedScene;
+
+  // The settings that all cells share.
+  State baseCell           = m_state;
+  baseCell.gpuCulling      = cellGpuCulling;
+  baseCell.instancedScene  = cellInstanced;
+  baseCell.fragmentStats   = (m_benchmarkSettings.fragmentStats != 0);
+  baseCell.fragmentHeatmap = false;
+  baseCell.drawUI          = false;
+
+  // The settings the cells vary, from the slowest-changing to the fastest.
+  // The approximate algorithms don't use oitLayers, only the linked list uses
+  // linkedListAllocatedPerElement, and only some algorithms have a compute
+  // composite, sort in their composite pass, can adapt their number of layers
+  // or A-buffer layout, have packed A-buffer entries, can use MLAB, or take
+  // locks; these axes only measure their unusedValue there. MLAB doesn't sort
+  // in its composite pass, so it comes before the sort strategies.
+  const uint32_t                   numWorkers = m_recordingWorkers.getNumWorkers();
+  const std::vector<BenchmarkAxis> axes       = {
+      {algorithms, OIT_SIMPLE, nullptr, [](State& cell, uint32_t value) { cell.algorithm = value; }},
+      {aaTypes, AA_NONE, nullptr,
+       [](State& cell, uint32_t value) {
+         cell.aaType = value;
+         cell.recomputeAntialiasingSettings();
+       }},
+      {oitLayers, oitLayers[0], [](const State& cell) { return cell.usesABuffer(); },
+       [](State& cell, uint32_t value) { cell.oitLayers = value; }},
+      {listAllocs, listAllocs[0], [](const State& cell) { return cell.algorithm == OIT_LINKEDLIST; },
+       [](State& cell, uint32_t value) { cell.linkedListAllocatedPerElement = value; }},
+      {numObjects, numObjects[0], nullptr, [](State& cell, uint32_t value) { cell.numObjects = value; }},
+      {percentTransparent, percentTransparent[0], nullptr,
+       [](State& cell, uint32_t value) { cell.percentTransparent = std::min(value, 100u); }},
+      {computeComposites, 0,
+       [](const State& cell) {
+         State composite            = cell;
+         composite.computeComposite = true;
+         return composite.usesComputeComposite();
+       },
+       [](State& cell, uint32_t value) { cell.computeComposite = (value != 0); }},
+      {interlockMLABs, 0,
+       [](const State& cell) {
+         State mlab         = cell;
+         mlab.interlockMLAB = true;
+         return mlab.usesMLAB();
+       },
+       [](State& cell, uint32_t value) { cell.interlockMLAB = (value != 0); }},
+      {sortStrategies, sortStrategies[0], [](const State& cell) { return cell.compositeSorts(); },
+       [](State& cell, uint32_t value) { cell.sortStrategy = std::min(value, static_cast<uint32_t>(NUM_SORTS - 1)); }},
+      {adaptiveLayers, 0,
+       [](const State& cell) {
+         State adaptive          = cell;
+         adaptive.adaptiveLayers = true;
+         return adaptive.usesAdaptiveLayers();
+       },
+       [](State& cell, uint32_t value) { cell.adaptiveLayers = (value != 0); }},
+      {packedABuffers, 0,
+       [](const State& cell) {
+         State packed         = cell;
+         packed.packedABuffer = true;
+         return packed.usesPackedABuffer();
+       },
+       [](State& cell, uint32_t value) { cell.packedABuffer = (value != 0); }},
+      {frontToBacks, 0, nullptr, [](State& cell, uint32_t value) { cell.frontToBack = (value != 0); }},
+      {spinlockStrategies, SPIN_PLAIN, [](const State& cell) { return cell.algorithm == OIT_SPINLOCK; },
+       [](State& cell, uint32_t value) { cell.spinlockStrategy = value; }},
+      {listSubgroupAllocs, 0,
+       [](const State& cell) {
+         State subgroup                   = cell;
+         subgroup.linkedListSubgroupAlloc = true;
+         return subgroup.usesSubgroupAlloc();
+       },
+       [](State& cell, uint32_t value) { cell.linkedListSubgroupAlloc = (value != 0); }},
+      {aBufferLayouts, ABUFFER_LAYOUT_LAYERS,
+       [](const State& cell) { return cell.usesABuffer() && (cell.algorithm != OIT_LINKEDLIST); },
+       [](State& cell, uint32_t value) { cell.aBufferLayout = value; }},
+      {frameTags, 0,
+       [](const State& cell) {
+         State tags     = cell;
+         tags.frameTags = true;
+         return tags.usesFrameTags();
+       },
+       [](State& cell, uint32_t value) { cell.frameTags = (value != 0); }},
+      {computeResolves, 0, nullptr, [](State& cell, uint32_t value) { cell.computeResolve = (value != 0); }},
+      {subpassComposites, 0, [](const State& cell) { return cell.usesABuffer(); },
+       [](State& cell, uint32_t value) { cell.subpassComposite = (value != 0); }},
+      {recordingThreads, 0, [](const State& cell) { return cell.usesABuffer(); },
+       [numWorkers](State& cell, uint32_t value) { cell.recordingThreads = std::min(value, numWorkers); }},
+      {shadingRates, SHADING_RATE_1X1,
+       [](const State& cell) {
+         State rate       = cell;
+         rate.shadingRate = SHADING_RATE_2X2;
+         return (rate.activeShadingRate() != SHADING_RATE_1X1);
+       },
+       [](State& cell, uint32_t value) { cell.shadingRate = std::min(value, static_cast<uint32_t>(NUM_SHADING_RATES - 1)); }},
+      {meshShaders, 0,
+       [](const State& cell) {
+         State mesh       = cell;
+         mesh.meshShaders = true;
+         return mesh.usesMeshShaders();
+       },
+       [](State& cell, uint32_t value) { cell.meshShaders = (value != 0); }},
+  };
+
+  // The predicates of later axes see their unusedValue until they're set.
+  for(const BenchmarkAxis& axis : axes)
+  {
+    axis.set(baseCell, axis.unusedValue);
+  }
+
+  // Walk the cartesian product of the axes like an odometer, where the last
+  // axis turns fastest. An axis that doesn't apply has a single position.
+  std::vector<size_t> positions(axes.size(), 0);
+  std::vector<size_t> numPositions(axes.size(), 1);
+  bool                done = algorithms.empty() || aaTypes.empty();
+  while(!done)
+  {
+    State cell = baseCell;
+    for(size_t i = 0; i < axes.size(); i++)
+    {
+      const BenchmarkAxis& axis    = axes[i];
+      const bool           applies = !axis.applies || axis.applies(cell);
+      numPositions[i]              = (applies ? axis.values.size() : 1);
+      axis.set(cell, applies ? axis.values[positions[i]] : axis.unusedValue);
+    }
+    if(isValidBenchmarkCell(cell))
+    {
+      m_benchmarkCells.push_back(cell);
+    }
+
+    done = true;
+    for(size_t i = axes.size(); i-- > 0;)
+    {
+      if(++positions[i] < numPositions[i])
+      {
+        done = false;
+        break;
+      }
+      positions[i] = 0;
+    }
+  }
+
+  if(m_benchmarkCells.empty())
+  {
+    LOGI("Benchmark: no supported combinations to measure.\n");
+    return;
+  }
+
+  // Render the reference images first, one for each scene and antialiasing
+  // type, so that each combination can be compared with its reference once
+  // it's measured.
+  m_benchmarkReferences.clear();
+  if(m_benchmarkSettings.reference != 0)
+  {
+    std::vector<State> referenceCells;
+    for(uint32_t aaType : aaTypes)
+    {
+      for(uint32_t objects : numObjects)
+      {
+        for(uint32_t percent : percentTransparent)
+        {
+          BenchmarkReference reference;
+          reference.numObjects         = objects;
+          reference.percentTransparent = std::min(percent, 100u);
+          reference.aaType             = aaType;
+          m_benchmarkReferences.push_back(reference);
+
+          // Only settings that change the image differ from the defaults.
+          State cell                         = m_state;
+          cell.algorithm                     = OIT_LINKEDLIST;
+          cell.aaType                        = aaType;
+          cell.oitLayers                     = BENCHMARK_REFERENCE_LAYERS;
+          cell.linkedListAllocatedPerElement = defaults.linkedListAllocatedPerElement;
+          cell.linkedListAdaptive            = true;
+          cell.tailBlend                     = true;
+          cell.packedABuffer                 = false;
+          cell.numObjects                    = reference.numObjects;
+          cell.percentTransparent            = reference.percentTransparent;
+          cell.gpuCulling                    = cellGpuCulling;
+          cell.instancedScene                = cellInstanced;
+          cell.meshShaders                   = false;
+          cell.computeResolve                = false;
+          cell.fragmentStats                 = true;
+          cell.fragmentHeatmap               = false;
+          cell.drawUI                        = false;
+          cell.recomputeAntialiasingSettings();
+          referenceCells.push_back(cell);
+        }
+      }
+    }
+    m_benchmarkCells.insert(m_benchmarkCells.begin(), referenceCells.begin(), referenceCells.end());
+
+    // The capture happens in the last warm-up frame, so that its copy isn't
+    // measured, and is read once the measured frames are done; make sure the
+    // scene is built by then and the capture's fence has been waited on.
+    const uint32_t minMeasureFrames = m_ringFences.getCycleSize();
+    if(m_benchmarkSettings.warmupFrames < 2 || m_benchmarkSettings.measureFrames < minMeasureFrames)
+    {
+      m_benchmarkSettings.warmupFrames  = std::max(m_benchmarkSettings.warmupFrames, 2u);
+      m_benchmarkSettings.measureFrames = std::max(m_benchmarkSettings.measureFrames, minMeasureFrames);
+      LOGI("Benchmark: reference images need at least 2 warm-up and %u measured frames.\n", minMeasureFrames);
+    }
+  }
+
+  LOGI("Benchmark: measuring %zu combinations, %u + %u frames each.\n", m_benchmarkCells.size(),
+       m_benchmarkSettings.warmupFrames, m_benchmarkSettings.measureFrames);
+
+  // Vsync would limit the frame rate to the display's refresh rate.
+  setVsync(false);
+  m_benchmarkCell      = 0;
+  m_benchmarkCellFrame = 0;
+  m_benchmarkActive    = true;
+}
+
+void Sample::benchmarkAdvance()
+{
+  assert(m_benchmarkActive && m_benchmarkCell < m_benchmarkCells.size());
+
+  if(m_benchmarkCellFrame == 0)
+  {
+    // Switching m_state makes cmdUpdateRendererFromState rebuild what it needs to.
+    m_state = m_benchmarkCells[m_benchmarkCell];
+  }
+  else if(isSceneBuilding())
+  {
+    // Don't count frames that still render the previous combination's scene.
+    return;
+  }
+  else if(m_benchmarkCellFrame == m_benchmarkSettings.warmupFrames)
+  {
+    // Discard timings from the warm-up frames, including the first frame
+    // after the renderer was rebuilt.
+    m_profiler.reset();
+  }
+  else if(m_benchmarkCellFrame == m_benchmarkSettings.warmupFrames + m_benchmarkSettings.measureFrames)
+  {
+    benchmarkRecordCell();
+
+    m_benchmarkCell++;
+    m_benchmarkCellFrame = 0;
+    if(m_benchmarkCell == m_benchmarkCells.size())
+    {
+      benchmarkWriteResults();
+      m_benchmarkActive = false;
+      close();
+    }
+    else
+    {
+      m_state = m_benchmarkCells[m_benchmarkCell];
+    }
+  }
+
+  // Capture the image once the scene and adaptive sizes have settled.
+  if((m_benchmarkSettings.reference != 0) && (m_benchmarkCellFrame + 1 == m_benchmarkSettings.warmupFrames))
+  {
+    m_benchmarkCaptureRequested = true;
+  }
+
+  m_benchmarkCellFrame++;
+}
+
+void Sample::benchmarkRecordCell()
+{
+  // The capture's fence was waited on during the measured frames, so this
+  // doesn't wait for the GPU.
+  const uint8_t* pixels = nullptr;
+  if(m_benchmarkSettings.reference != 0)
+  {
+    pixels = static_cast<const uint8_t*>(m_benchmarkCapture.read(m_benchmarkCaptureCycle, m_frame));
+    if(pixels == nullptr)
+    {
+      LOGE("Benchmark: combination %u was not captured!\n", m_benchmarkCell + 1);
+    }
+  }
+
+  if(m_benchmarkCell < m_benchmarkReferences.size())
+  {
+    BenchmarkReference& reference = m_benchmarkReferences[m_benchmarkCell];
+    reference.overflowFragments   = m_fragmentStats.overflowFragments;
+    if(pixels != nullptr)
+    {
+      reference.width  = m_guiCompositeImage.c_width;
+      reference.height = m_guiCompositeImage.c_height;
+      reference.pixels.assign(pixels, pixels + m_benchmarkCapture.slotSize);
+    }
+    if(reference.overflowFragments != 0)
+    {
+      LOGI("Benchmark: the reference for aaType %u with %u objects, %u%% transparent, is not exact: %u fragments "
+           "didn't fit into %u layers.\n",
+           reference.aaType, reference.numObjects, reference.percentTransparent, reference.overflowFragments,
+           BENCHMARK_REFERENCE_LAYERS);
+    }
+    LOGI("Benchmark: rendered reference %u of %zu.\n", m_benchmarkCell + 1, m_benchmarkReferences.size());
+    return;
+  }
+
+  BenchmarkResult result;
+  result.state           = m_state;
+  result.aBufferBytes    = (m_oitABuffer.buffer.buffer ? m_oitABuffer.size : 0);
+  result.auxImageBytes   = getAuxImageBytes();
+  // These are from a frame a few frames ago, which rendered the same image.
+  result.fragmentStats   = m_fragmentStats;
+  result.activeLayers    = m_activeLayers;
+  result.linkedListNodes = (m_state.algorithm == OIT_LINKEDLIST ? m_linkedListNodesUsed : 0);
+  result.readbackLatency = (m_state.algorithm == OIT_LINKEDLIST ? m_oitCounterReadback.latency : m_fragmentStatsReadback.latency);
+
+  for(const char* name : BENCHMARK_SECTIONS)
+  {
+    BenchmarkResult::SectionTiming timing;
+    timing.name = name;
+
+    nvh::Profiler::TimerInfo info;
+    if(m_profiler.getTimerInfo(name, info))
+    {
+      timing.gpuMicroseconds = info.gpu.average;
+      timing.cpuMicroseconds = info.cpu.average;
+      timing.numAveraged     = info.numAveraged;
+    }
+    result.sections.push_back(timing);
+  }
+
+  if(pixels != nullptr)
+  {
+    for(const BenchmarkReference& reference : m_benchmarkReferences)
+    {
+      if((reference.numObjects == m_state.numObjects) && (reference.percentTransparent == m_state.percentTransparent)
+         && (reference.aaType == m_state.aaType))
+      {
+        benchmarkMeasureError(reference, pixels, result);
+        break;
+      }
+    }
+  }
+
+  LOGI("Benchmark: finished combination %u of %zu (algorithm %u, aaType %u).\n", m_benchmarkCell + 1,
+       m_benchmarkCells.size(), m_state.algorithm, m_state.aaType);
+  m_benchmarkResults.push_back(result);
+}
+
+void Sample::cmdBenchmarkCapture(VkCommandBuffer cmdBuffer)
+{
+  assert(m_guiCompositeImage.currentLayout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+
+  // All combinations render at the window's size, but recreate the buffer if
+  // that changed.
+  const VkDeviceSize imageBytes = VkDeviceSize(m_guiCompositeImage.c_width) * m_guiCompositeImage.c_height * 4;
+  if(m_benchmarkCapture.slotSize != imageBytes)
+  {
+    retireBuffer(m_benchmarkCapture);
+    m_benchmarkCapture.create(m_allocatorDma, imageBytes, m_ringFences.getCycleSize());
+    m_benchmarkCapture.setName(m_debug, "m_benchmarkCapture");
+  }
+
+  const uint32_t slot = m_ringFences.getCycleIndex();
+
+  VkBufferImageCopy region           = {};
+  region.bufferOffset                = m_benchmarkCapture.getOffset(slot);
+  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.imageSubresource.layerCount = 1;
+  region.imageExtent                 = {m_guiCompositeImage.c_width, m_guiCompositeImage.c_height, 1};
+  vkCmdCopyImageToBuffer(cmdBuffer, m_guiCompositeImage.image.image, m_guiCompositeImage.currentLayout,
+                         m_benchmarkCapture.buffer.buffer, 1, &region);
+
+  VkMemoryBarrier barrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  barrier.srcAccessMask   = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask   = VK_ACCESS_HOST_READ_BIT;
+  vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,  //
+                       1, &barrier,                                                             //
+                       0, VK_NULL_HANDLE,                                                       //
+                       0, VK_NULL_HANDLE);
+
+  m_benchmarkCapture.markWritten(slot, m_frame);
+  m_benchmarkCaptureCycle = slot;
+}
+
+void Sample::benchmarkMeasureError(const BenchmarkReference& reference, const uint8_t* pixels, BenchmarkResult& result) const
+{
+  const size_t numPixels = size_t(reference.width) * reference.height;
+  if(reference.pixels.empty() || (m_guiCompositeImage.c_width != reference.width)
+     || (m_guiCompositeImage.c_height != reference.height))
+  {
+    return;
+  }
+
+  // Compare the color channels of each pixel, and ignore alpha. Both images
+  // store sRGB-encoded bytes, so this measures the error as displayed.
+  uint64_t sumSquaredError = 0;
+  uint32_t maxError        = 0;
+  for(size_t i = 0; i < numPixels; i++)
+  {
+    for(size_t channel = 0; channel < 3; channel++)
+    {
+      const int      difference = int(pixels[4 * i + channel]) - int(reference.pixels[4 * i + channel]);
+      const uint32_t error      = uint32_t(std::abs(difference));
+      sumSquaredError += uint64_t(error) * error;
+      maxError = std::max(maxError, error);
+    }
+  }
+
+  const double meanSquaredError = double(sumSquaredError) / double(3 * numPixels);
+  result.errorValid             = true;
+  result.maxError               = maxError;
+  result.psnr = (meanSquaredError > 0.0 ? 10.0 * std::log10(255.0 * 255.0 / meanSquaredError) :
+                                          std::numeric_limits<double>::infinity());
+}
+
+void Sample::benchmarkWriteResults()
+{
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(m_context.m_physicalDevice, &properties);
+
+  // CSV: one row per combination and profiler section.
+  const std::string csvFilename = m_benchmarkSettings.outputFilename + ".csv";
+  std::ofstream     csv(csvFilename);
+  if(!csv)
+  {
+    LOGE("Benchmark: could not open %s for writing!\n", csvFilename.c_str());
+  }
+  else
+  {
+    csv << "algorithm,aaType,oitLayers,linkedListAllocatedPerElement,numObjects,percentTransparent,computeComposite,sortStrategy,"
+           "adaptiveLayers,activeLayers,packedABuffer,interlockMLAB,frontToBack,spinlockStrategy,linkedListSubgroupAlloc,"
+           "aBufferLayout,frameTags,computeResolve,subpassComposite,recordingThreads,shadingRate,meshShaders,"
+           "aBufferBytes,auxImageBytes,linkedListNodes,readbackLatency,"
+           "psnr,maxError,"
+           "meanFragments,p95Fragments,maxFragments,"
+           "overflowPercent,overflowPixels,writesPerFragment,attemptsPerFragment,"
+           "section,gpuMicroseconds,cpuMicroseconds,numAveraged\n";
+    for(const BenchmarkResult& result : m_benchmarkResults)
+    {
+      const State&                s     = result.state;
+      const FragmentStatsSummary& stats = result.fragmentStats;
+      for(const BenchmarkResult::SectionTiming& timing : result.sections)
+      {
+        csv << s.algorithm << ',' << s.aaType << ',' << s.oitLayers << ',' << s.linkedListAllocatedPerElement << ','
+            << s.numObjects << ',' << s.percentTransparent << ',' << (s.computeComposite ? 1 : 0) << ',' << s.sortStrategy << ','
+            << (s.adaptiveLayers ? 1 : 0) << ',' << result.activeLayers << ',' << (s.packedABuffer ? 1 : 0) << ','
+            << (s.interlockMLAB ? 1 : 0) << ',' << (s.usesFrontToBack() ? 1 : 0) << ',' << s.spinlockStrategy << ','
+            << (s.linkedListSubgroupAlloc ? 1 : 0) << ',' << s.activeABufferLayout() << ','
+            << (s.usesFrameTags() ? 1 : 0) << ',' << (s.computeResolve ? 1 : 0) << ','
+            << (s.usesTransparentSubpasses() ? 1 : 0) << ',' << (s.usesParallelRecording() ? s.recordingThreads : 0) << ','
+            << s.activeShadingRate() << ',' << (s.usesMeshShaders() ? 1 : 0) << ',';
+        csv << result.aBufferBytes << ',' << result.auxImageBytes << ',' << result.linkedListNodes << ','
+            << result.readbackLatency << ',';
+        // Leave the error empty if there's no reference.
+        if(result.errorValid)
+        {
+          csv << result.psnr << ',' << result.maxError << ',';
+        }
+        else
+        {
+          csv << ",,";
+        }
+        // Leave the statistics empty if they weren't recorded.
+        if(stats.valid)
+        {
+          csv << stats.meanFragments << ',' << stats.p95Fragments << ',' << stats.maxFragments << ','
+              << stats.overflowPercent << ',' << stats.overflowPixels << ',' << stats.writesPerFragment << ','
+              << stats.attemptsPerFragment << ',';
+        }
+        else
+        {
+          csv << ",,,,,,,";
+        }
+        csv << timing.name << ',' << timing.gpuMicroseconds << ',' << timing.cpuMicroseconds << ',' << timing.numAveraged << '\n';
+      }
+    }
+    LOGI("Benchmark: wrote %s\n", csvFilename.c_str());
+  }
+
+  // JSON: the same data, plus information about the device and resolution.
+  const std::string jsonFilename = m_benchmarkSettings.outputFilename + ".json";
+  std::ofstream     json(jsonFilename);
+  if(!json)
+  {
+    LOGE("Benchmark: could not open %s for writing!\n", jsonFilename.c_str());
+    return;
+  }
+
+  json << "{\n";
+  json << "  \"device\": \"" << escapeJsonString(properties.deviceName) << "\",\n";
+  json << "  \"driverVersion\": " << properties.driverVersion << ",\n";
+  json << "  \"width\": " << getWidth() << ",\n";
+  json << "  \"height\": " << getHeight() << ",\n";
+  json << "  \"warmupFrames\": " << m_benchmarkSettings.warmupFrames << ",\n";
+  json << "  \"measureFrames\": " << m_benchmarkSettings.measureFrames << ",\n";
+  json << "  \"results\": [\n";
+  for(size_t i = 0; i < m_benchmarkResults.size(); i++)
+  {
+    const BenchmarkResult& result = m_benchmarkResults[i];
+    const State&           s      = result.state;
+    json << "    {\n";
+    json << "      \"algorithm\": " << s.algorithm << ",\n";
+    json << "      \"aaType\": " << s.aaType << ",\n";
+    json << "      \"oitLayers\": " << s.oitLayers << ",\n";
+    json << "      \"linkedListAllocatedPerElement\": " << s.linkedListAllocatedPerElement << ",\n";
+    json << "      \"numObjects\": " << s.numObjects << ",\n";
+    json << "      \"percentTransparent\": " << s.percentTransparent << ",\n";
+    json << "      \"computeComposite\": " << (s.computeComposite ? "true" : "false") << ",\n";
+    json << "      \"sortStrategy\": " << s.sortStrategy << ",\n";
+    json << "      \"adaptiveLayers\": " << (s.adaptiveLayers ? "true" : "false") << ",\n";
+    json << "      \"activeLayers\": " << result.activeLayers << ",\n";
+    json << "      \"packedABuffer\": " << (s.packedABuffer ? "true" : "false") << ",\n";
+    json << "      \"interlockMLAB\": " << (s.interlockMLAB ? "true" : "false") << ",\n";
+    json << "      \"frontToBack\": " << (s.usesFrontToBack() ? "true" : "false") << ",\n";
+    json << "      \"spinlockStrategy\": " << s.spinlockStrategy << ",\n";
+    json << "      \"linkedListSubgroupAlloc\": " << (s.linkedListSubgroupAlloc ? "true" : "false") << ",\n";
+    json << "      \"aBufferLayout\": " << s.activeABufferLayout() << ",\n";
+    json << "      \"frameTags\": " << (s.usesFrameTags() ? "true" : "false") << ",\n";
+    json << "      \"computeResolve\": " << (s.computeResolve ? "true" : "false") << ",\n";
+    json << "      \"subpassComposite\": " << (s.usesTransparentSubpasses() ? "true" : "false") << ",\n";
+    json << "      \"recordingThreads\": " << (s.usesParallelRecording() ? s.recordingThreads : 0) << ",\n";
+    json << "      \"shadingRate\": " << s.activeShadingRate() << ",\n";
+    json << "      \"meshShaders\": " << (s.usesMeshShaders() ? "true" : "false") << ",\n";
+    json << "      \"aBufferBytes\": " << result.aBufferBytes << ",\n";
+    json << "      \"auxImageBytes\": " << result.auxImageBytes << ",\n";
+    json << "      \"linkedListNodes\": " << result.linkedListNodes << ",\n";
+    json << "      \"readbackLatency\": " << result.readbackLatency << ",\n";
+    if(result.errorValid)
+    {
+      // JSON has no infinity, so identical images have a PSNR of null.
+      json << "      \"psnr\": ";
+      if(std::isinf(result.psnr))
+      {
+        json << "null";
+      }
+      else
+      {
+        json << result.psnr;
+      }
+      json << ",\n";
+      json << "      \"maxError\": " << result.maxError << ",\n";
+    }
+    if(result.fragmentStats.valid)
+    {
+      const FragmentStatsSummary& stats = result.fragmentStats;
+      json << "      \"fragmentStats\": {\"coveredPixels\": " << stats.coveredPixels
+           << ", \"totalFragments\": " << stats.totalFragments << ", \"meanFragments\": " << stats.meanFragments
+           << ", \"p95Fragments\": " << stats.p95Fragments << ", \"maxFragments\": " << stats.maxFragments
+           << ", \"overflowFragments\": " << stats.overflowFragments << ", \"overflowPixels\": " << stats.overflowPixels
+           << ", \"overflowPercent\": " << stats.overflowPercent << ", \"aBufferWrites\": " << stats.aBufferWrites
+           << ", \"writesPerFragment\": " << stats.writesPerFragment << ", \"lockAttempts\": " << stats.lockAttempts
+           << ", \"attemptsPerFragment\": " << stats.attemptsPerFragment << "},\n";
+    }
+    json << "      \"sections\": {\n";
+    for(size_t j = 0; j < result.sections.size(); j++)
+    {
+      const BenchmarkResult::SectionTiming& timing = result.sections[j];
+      json << "        \"" << escapeJsonString(timing.name) << "\": {\"gpuMicroseconds\": " << timing.gpuMicroseconds
+           << ", \"cpuMicroseconds\": " << timing.cpuMicroseconds << ", \"numAveraged\": " << timing.numAveraged
+           << "}" << (j + 1 < result.sections.size() ? "," : "") << "\n";
+    }
+    json << "      }\n";
+    json << "    }" << (i + 1 < m_benchmarkResults.size() ? "," : "") << "\n";
+  }
+  json << "  ]\n";
+  json << "}\n";
+  LOGI("Benchmark: wrote %s\n", jsonFilename.c_str());
+}
+
+VkDeviceSize Sample::getAuxImageBytes() const
+{
+  const ImageAndView* images[] = {&m_oitAuxImage,           &m_oitAuxSpinImage,        &m_oitAuxDepthImage,
+                                  &m_oitCounterImage,       &m_oitWeightedColorImage,  &m_oitWeightedRevealImage,
+                                  &m_oitMomentsImage,       &m_oitMomentsZerothImage,  &m_oitMomentsAccumImage,
+                                  &m_oitCompositeImage};
+
+  VkDeviceSize total = 0;
+  for(const ImageAndView* image : images)
+  {
+    if(image->view != nullptr)
+    {
+      total += image->c_memoryBytes;
+    }
+  }
+  return total;
+}
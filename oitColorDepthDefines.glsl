@@ -36,22 +36,49 @@
 #extension GL_ARB_post_depth_coverage : enable
 layout(post_depth_coverage) in;
 
-// If OIT_COVERAGE_SHADING is used, then the a-buffer uses three components;
-// otherwise, it uses two.
+// If OIT_COVERAGE_SHADING is used, then the a-buffer uses three components
+// (or two, if OIT_PACKED_ABUFFER packs the mask with the depth); otherwise,
+// it uses two.
 #if OIT_COVERAGE_SHADING
+#if OIT_PACKED_ABUFFER
+#define abufferType rg32ui
+#else  // #if OIT_PACKED_ABUFFER
 #define abufferType rgba32ui
+#endif  // #if OIT_PACKED_ABUFFER
 #define storeMask gl_SampleMaskIn[0]
 #else  // #if OIT_COVERAGE_SHADING
 #define abufferType rg32ui
 #define storeMask 0
 #endif  // #if OIT_COVERAGE_SHADING
 
+// Returns the A-buffer entry of this fragment, given its packed sRGB color:
+// the color, then the depth that entries are sorted by, then (unless
+// OIT_PACKED_ABUFFER packs it with the depth) the coverage mask.
+uvec4 abufferEntry(uint packedColor)
+{
+#if OIT_PACKED_ABUFFER
+  const uint depth24 = uint(clamp(gl_FragCoord.z, 0.0, 1.0) * 16777215.0 + 0.5);
+  return uvec4(packedColor, (depth24 << 8) | (uint(storeMask) & 0xFFu), 0, 0);
+#else   // #if OIT_PACKED_ABUFFER
+  return uvec4(packedColor, floatBitsToUint(gl_FragCoord.z), storeMask, 0);
+#endif  // #if OIT_PACKED_ABUFFER
+}
+
+// With OIT_VIEWS views, each view has its own samples' layers and A-buffer
+// planes, after those of the previous view.
 #if OIT_SAMPLE_SHADING && OIT != OIT_WEIGHTED
 #define uimage2DUsed uimage2DArray
-#define sampleID gl_SampleID
-ivec3 coord = ivec3(gl_FragCoord.xy, gl_SampleID);
+#define sampleID (VIEW_INDEX * OIT_MSAA + gl_SampleID)
+ivec3 coord = ivec3(ivec2(gl_FragCoord.xy) - pushConstants.tileOffset, sampleID);
+#elif OIT_VIEWS > 1 && OIT != OIT_WEIGHTED
+#define uimage2DUsed uimage2DArray
+#define sampleID VIEW_INDEX
+ivec3 coord = ivec3(ivec2(gl_FragCoord.xy) - pushConstants.tileOffset, sampleID);
 #else  // #if OIT_SAMPLE_SHADING && OIT != OIT_WEIGHTED
 #define uimage2DUsed uimage2D
 #define sampleID 0
-ivec2 coord = ivec2(gl_FragCoord.xy);
-#endif  // #if OIT_SAMPLE_SHADING && OIT != OIT_WEIGHTED
\ No newline at end of file
+ivec2 coord = ivec2(gl_FragCoord.xy) - pushConstants.tileOffset;
+#endif  // #if OIT_SAMPLE_SHADING && OIT != OIT_WEIGHTED
+
+// Fragment statistics, if enabled
+#include "oitStats.glsl"
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2020-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2020-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// An alternative to the composite passes of OIT_SIMPLE, OIT_INTERLOCK, and
+// OIT_SPINLOCK. Those load up to OIT_LAYERS fragments into an array in
+// registers and bubble sort them, which at 16 or 32 layers makes the
+// fragment shader spill registers and limits occupancy.
+// Instead, each invocation of this shader handles one pixel or sample of the
+// A-buffer: it copies its fragments to shared memory, sorts them there using
+// a bitonic sorting network, and writes the blended result to imgComposite.
+// oitCompositeBlend.frag.glsl then blends imgComposite onto the color image.
+// (The color image is sRGB and possibly multisampled, so it usually can't be
+// used as a storage image.)
+
+#version 460
+#extension GL_GOOGLE_include_directive : enable
+
+#include "shaderCommon.glsl"
+
+layout(local_size_x = COMPOSITE_WORKGROUP_SIZE, local_size_y = COMPOSITE_WORKGROUP_SIZE) in;
+
+#define NUM_THREADS (COMPOSITE_WORKGROUP_SIZE * COMPOSITE_WORKGROUP_SIZE)
+
+// Like oitCompositeDefines.glsl, but using the invocation ID instead of
+// gl_FragCoord and gl_SampleID.
+#if OIT_COVERAGE_SHADING && !OIT_PACKED_ABUFFER
+#define abufferType rgba32ui
+#define loadType uvec3
+#define loadOp(a) (a).rgb
+#else  // #if OIT_COVERAGE_SHADING && !OIT_PACKED_ABUFFER
+#define abufferType rg32ui
+#define loadType uvec2
+#define loadOp(a) (a).rg
+#endif  // #if OIT_COVERAGE_SHADING && !OIT_PACKED_ABUFFER
+
+#if OIT_SAMPLE_SHADING
+#define uimage2DUsed uimage2DArray
+#define image2DUsed image2DArray
+#define sampleID int(gl_GlobalInvocationID.z)
+ivec3 coord = ivec3(gl_GlobalInvocationID.xyz);
+#else  // #if OIT_SAMPLE_SHADING
+#define uimage2DUsed uimage2D
+#define image2DUsed image2D
+#define sampleID 0
+ivec2 coord = ivec2(gl_GlobalInvocationID.xy);
+#endif  // #if OIT_SAMPLE_SHADING
+
+// The bitonic sorting network sorts a power-of-two number of elements.
+#if OIT_LAYERS <= 1
+#define SORT_SIZE 1
+#elif OIT_LAYERS <= 2
+#define SORT_SIZE 2
+#elif OIT_LAYERS <= 4
+#define SORT_SIZE 4
+#elif OIT_LAYERS <= 8
+#define SORT_SIZE 8
+#elif OIT_LAYERS <= 16
+#define SORT_SIZE 16
+#elif OIT_LAYERS <= 32
+#define SORT_SIZE 32
+#else
+#define SORT_SIZE 64
+#endif
+
+// Stores up to OIT_LAYERS fragments per (MSAA) sample and their depths.
+layout(binding = IMG_ABUFFER, abufferType) uniform restrict readonly uimageBuffer imgAbuffer;
+// Stores the number of fragments processed so far per (MSAA) sample.
+layout(binding = IMG_AUX, r32ui) uniform restrict readonly uimage2DUsed imgAux;
+// The premultiplied, linear color of the sorted fragments.
+layout(binding = IMG_COMPOSITE, rgba16f) uniform restrict writeonly image2DUsed imgComposite;
+
+// Each invocation's fragments. Element i of an invocation is stored at
+// i * NUM_THREADS + gl_LocalInvocationIndex, so that when all invocations
+// access their ith element, they access consecutive words.
+shared loadType sFragments[SORT_SIZE * NUM_THREADS];
+
+int slot(int i)
+{
+  return i * NUM_THREADS + int(gl_LocalInvocationIndex);
+}
+
+void main()
+{
+  // Tiles at the right and bottom of the image can be smaller than the
+  // A-buffer; imgAux counts 0 fragments there, so these invocations have no work.
+  // Invocations never wait for each other, so they can return early.
+  if(any(greaterThanEqual(coord.xy, scene.viewport.xy)))
+  {
+    return;
+  }
+
+  // Get the distance between consecutive layers in the A-buffer.
+  const int layerStride = abufferLayerStride();
+  // Get the index of the current sample at the current pixel.
+  const int listPos = abufferIndex(coord.xy, sampleID, 0, OIT_LAYERS);
+
+  // The number of fragments for this sample.
+  const int fragments = min(OIT_LAYERS, int(counterCount(imageLoad(imgAux, coord).r)));
+
+  // Sort the smallest power of two that holds all fragments, padding with
+  // elements that are further away than all fragments.
+  int sortSize = 1;
+  while(sortSize < fragments)
+  {
+    sortSize *= 2;
+  }
+
+  for(int i = 0; i < sortSize; i++)
+  {
+    loadType fragment = loadType(0);
+    if(i < fragments)
+    {
+      fragment = loadOp(imageLoad(imgAbuffer, listPos + i * layerStride));
+    }
+    else
+    {
+      fragment.g = ENTRY_DEPTH_FAR;
+    }
+    sFragments[slot(i)] = fragment;
+  }
+
+  // Bitonic sort by depth (the second component). Each pass compares and
+  // swaps disjoint pairs of elements, merging sorted runs of length k/2 into
+  // sorted runs of length k. (With MLAB, the color pass already sorted them.)
+#if !OIT_INTERLOCK_MLAB
+  for(int k = 2; k <= sortSize; k *= 2)
+  {
+    for(int j = k / 2; j > 0; j /= 2)
+    {
+      for(int i = 0; i < sortSize; i++)
+      {
+        const int partner = i ^ j;
+        if(partner > i)
+        {
+          const loadType a         = sFragments[slot(i)];
+          const loadType b         = sFragments[slot(partner)];
+          const bool     ascending = ((i & k) == 0);
+          if((entryDepth(a) > entryDepth(b)) == ascending)
+          {
+            sFragments[slot(i)]       = b;
+            sFragments[slot(partner)] = a;
+          }
+        }
+      }
+    }
+  }
+#endif  // #if !OIT_INTERLOCK_MLAB
+
+  vec4 colorSum = vec4(0);  // Initially completely transparent
+
+#if OIT_COVERAGE_SHADING
+  // Compute the blended color of each MSAA sample from the fragments stored
+  // in the A-buffer. For each MSAA sample, we loop through the fragments
+  // and see which fragments covered this sample.
+  for(int s = 0; s < OIT_MSAA; s++)
+  {
+    vec4 sColor = vec4(0);
+    for(int i = 0; i < fragments; i++)
+    {
+      const loadType fragment = sFragments[slot(i)];
+      if((entryMask(fragment) & (1 << s)) != 0)
+      {
+        doBlendPacked(sColor, fragment.r);
+      }
+    }
+    colorSum += sColor;
+  }
+  colorSum /= OIT_MSAA;
+#else   // #if OIT_COVERAGE_SHADING
+  // Blend all of the fragments together:
+  for(int i = 0; i < fragments; i++)
+  {
+    doBlendPacked(colorSum, sFragments[slot(i)].r);
+  }
+#endif  // #if OIT_COVERAGE_SHADING
+
+  imageStore(imgComposite, coord, colorSum);
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2020-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2020-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Blends the output of oitComposite.comp.glsl onto the color image, using the
+// same premultiplied blending as the composite passes of the A-buffer
+// algorithms.
+
+#version 460
+#extension GL_GOOGLE_include_directive : enable
+
+#include "shaderCommon.glsl"
+
+#if OIT_SAMPLE_SHADING
+#define image2DUsed image2DArray
+ivec3 coord = ivec3(ivec2(gl_FragCoord.xy) - pushConstants.tileOffset, gl_SampleID);
+#else  // #if OIT_SAMPLE_SHADING
+#define image2DUsed image2D
+ivec2 coord = ivec2(gl_FragCoord.xy) - pushConstants.tileOffset;
+#endif  // #if OIT_SAMPLE_SHADING
+
+layout(binding = IMG_COMPOSITE, rgba16f) uniform restrict readonly image2DUsed imgComposite;
+
+layout(location = 0) out vec4 outColor;
+
+void main()
+{
+  outColor = imageLoad(imgComposite, coord);
+}
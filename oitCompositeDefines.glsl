@@ -21,26 +21,32 @@
 // Includes defines used for composite passes, as well as sorting functions
 // that depend upon these defines.
 
-// If OIT_COVERAGE_SHADING is used, then the a-buffer uses three components;
-// otherwise, it uses two.
-#if OIT_COVERAGE_SHADING
+// If OIT_COVERAGE_SHADING is used, then the a-buffer uses three components
+// (unless OIT_PACKED_ABUFFER packs the mask with the depth); otherwise, it
+// uses two.
+#if OIT_COVERAGE_SHADING && !OIT_PACKED_ABUFFER
 #define abufferType rgba32ui
 #define loadType uvec3
 #define loadOp(a) (a).rgb
-#else  // #if OIT_COVERAGE_SHADING
+#else  // #if OIT_COVERAGE_SHADING && !OIT_PACKED_ABUFFER
 #define abufferType rg32ui
 #define loadType uvec2
 #define loadOp(a) (a).rg
-#endif  // #if OIT_COVERAGE_SHADING
+#endif  // #if OIT_COVERAGE_SHADING && !OIT_PACKED_ABUFFER
 
+// These match oitColorDepthDefines.glsl.
 #if OIT_SAMPLE_SHADING
 #define uimage2DUsed uimage2DArray
-#define sampleID gl_SampleID
-ivec3 coord = ivec3(gl_FragCoord.xy, gl_SampleID);
+#define sampleID (VIEW_INDEX * OIT_MSAA + gl_SampleID)
+ivec3 coord = ivec3(ivec2(gl_FragCoord.xy) - pushConstants.tileOffset, sampleID);
+#elif OIT_VIEWS > 1
+#define uimage2DUsed uimage2DArray
+#define sampleID VIEW_INDEX
+ivec3 coord = ivec3(ivec2(gl_FragCoord.xy) - pushConstants.tileOffset, sampleID);
 #else  // #if OIT_SAMPLE_SHADING && OIT != OIT_WEIGHTED
 #define uimage2DUsed uimage2D
 #define sampleID 0
-ivec2 coord = ivec2(gl_FragCoord.xy);
+ivec2 coord = ivec2(gl_FragCoord.xy) - pushConstants.tileOffset;
 #endif  // #if OIT_SAMPLE_SHADING && OIT != OIT_WEIGHTED
 
 // These sorting routines depend on loadType, so we define them here.
@@ -55,7 +61,7 @@ void bubbleSort(inout uvec2 array[OIT_LAYERS], int n)
   {
     for(int j = 0; j <= i; ++j)
     {
-      if(uintBitsToFloat(array[j].g) >= uintBitsToFloat(array[j + 1].g))
+      if(entryDepth(array[j]) >= entryDepth(array[j + 1]))
       {
         // Swap array[j] and array[j+1]
         uvec2 temp   = array[j + 1];
@@ -76,7 +82,7 @@ void bubbleSort(inout uvec3 array[OIT_LAYERS], int n)
   {
     for(int j = 0; j <= i; ++j)
     {
-      if(uintBitsToFloat(array[j].g) >= uintBitsToFloat(array[j + 1].g))
+      if(entryDepth(array[j]) >= entryDepth(array[j + 1]))
       {
         // Swap array[j] and array[j+1]
         uvec3 temp   = array[j + 1];
@@ -95,7 +101,7 @@ void insertionSort(inout loadType array[OIT_LAYERS], loadType newitem)
 {
   for(int i = 0; i < OIT_LAYERS; ++i)
   {
-    if(uintBitsToFloat(newitem.g) < uintBitsToFloat(array[i].g))
+    if(entryDepth(newitem) < entryDepth(array[i]))
     {
       // shift rest
       for(int j = OIT_LAYERS - 1; j > i; j--)
@@ -116,11 +122,11 @@ void insertionSort(inout loadType array[OIT_LAYERS], loadType newitem)
 loadType insertionSortTail(inout loadType array[OIT_LAYERS], loadType newitem)
 {
   loadType newlast = newitem;
-  if(uintBitsToFloat(newitem.g) < uintBitsToFloat(array[OIT_LAYERS - 1].g))
+  if(entryDepth(newitem) < entryDepth(array[OIT_LAYERS - 1]))
   {
     for(int i = 0; i < OIT_LAYERS; ++i)
     {
-      if(uintBitsToFloat(newitem.g) < uintBitsToFloat(array[i].g))
+      if(entryDepth(newitem) < entryDepth(array[i]))
       {
         //newlast = oldlast;
         newlast = array[OIT_LAYERS - 1];
@@ -136,4 +142,96 @@ loadType insertionSortTail(inout loadType array[OIT_LAYERS], loadType newitem)
   }
 
   return newlast;
-}
\ No newline at end of file
+}
+
+// Sorts the first n elements of array in ascending order according to their
+// second components using insertion sort. Like bubble sort, this is O(n^2),
+// but it only moves elements that are out of order, and exits early for
+// sorted input.
+void insertionSortFirst(inout loadType array[OIT_LAYERS], int n)
+{
+  for(int i = 1; i < n; i++)
+  {
+    const loadType item = array[i];
+    int            j    = i - 1;
+    while(j >= 0 && entryDepth(array[j]) > entryDepth(item))
+    {
+      array[j + 1] = array[j];
+      j--;
+    }
+    array[j + 1] = item;
+  }
+}
+
+// Swaps array[i] and array[j] if array[i] is further away than array[j].
+void compareAndSwap(inout loadType array[OIT_LAYERS], int i, int j)
+{
+  if(entryDepth(array[i]) > entryDepth(array[j]))
+  {
+    loadType temp = array[i];
+    array[i]      = array[j];
+    array[j]      = temp;
+  }
+}
+
+// Sorts the first n elements of array in ascending order according to their
+// second components using a bitonic sorting network over all OIT_LAYERS
+// elements, which is O(n log^2 n). Since OIT_LAYERS is a compile-time
+// constant, all loops here have constant bounds; once they're unrolled, each
+// element is accessed with a constant index, so the array can stay in
+// registers instead of being indexed dynamically.
+// Elements from n on are set to ENTRY_DEPTH_FAR, so they're sorted to the end.
+// This works for any OIT_LAYERS, not just powers of two: in this form of
+// the network, every comparison sorts in the same direction, so omitting the
+// comparisons with elements past the end of the array is the same as padding
+// the array with ENTRY_DEPTH_FAR to the next power of two.
+void networkSort(inout loadType array[OIT_LAYERS], int n)
+{
+  for(int i = 0; i < OIT_LAYERS; i++)
+  {
+    if(i >= n)
+    {
+      array[i].g = ENTRY_DEPTH_FAR;
+    }
+  }
+
+  // Merge sorted blocks of size k/2 into sorted blocks of size k.
+  for(int k = 2; k < 2 * OIT_LAYERS; k *= 2)
+  {
+    // Compare each element of the first half of a block with its mirror
+    // image in the second half...
+    for(int i = 0; i < OIT_LAYERS; i++)
+    {
+      const int partner = i ^ (k - 1);
+      if(partner > i && partner < OIT_LAYERS)
+      {
+        compareAndSwap(array, i, partner);
+      }
+    }
+    // ...then sort each half of the resulting bitonic sequences.
+    for(int j = k / 4; j > 0; j /= 2)
+    {
+      for(int i = 0; i < OIT_LAYERS; i++)
+      {
+        const int partner = i ^ j;
+        if(partner > i && partner < OIT_LAYERS)
+        {
+          compareAndSwap(array, i, partner);
+        }
+      }
+    }
+  }
+}
+
+// Sorts the first n elements of array in ascending order according to their
+// second components, using the algorithm selected by OIT_SORT.
+void sortFragments(inout loadType array[OIT_LAYERS], int n)
+{
+#if OIT_SORT == SORT_NETWORK
+  networkSort(array, n);
+#elif OIT_SORT == SORT_INSERTION
+  insertionSortFirst(array, n);
+#else  // #if OIT_SORT == SORT_NETWORK
+  bubbleSort(array, n);
+#endif  // #if OIT_SORT == SORT_NETWORK
+}
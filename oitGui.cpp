@@ -22,6 +22,9 @@
 
 #include "oit.h"
 
+#include <algorithm>
+#include <cstdio>
+
 // If the cursor was hovering over the last item, displays a tooltip.
 void Sample::LastItemTooltip(const char* text)
 {
@@ -58,6 +61,18 @@ void Sample::DoObjectSizeText(ImageAndView iv, const char* name)
   }
 }
 
+// Plots the history as a small graph labeled with its newest value, scaled
+// from 0 to the largest value in the history.
+void Sample::DoValueHistoryPlot(const ValueHistory& history, const char* label, const char* format)
+{
+  const float newest   = history.values[(history.next + ValueHistory::LENGTH - 1) % ValueHistory::LENGTH];
+  const float maxValue = *std::max_element(history.values.begin(), history.values.end());
+  char        overlay[64];
+  snprintf(overlay, sizeof(overlay), format, newest);
+  ImGui::PlotLines(label, history.values.data(), ValueHistory::LENGTH, history.next, overlay, 0.0f,
+                   std::max(maxValue, 1e-6f), ImVec2(0.0f, 40.0f));
+}
+
 void Sample::DoGUI(int width, int height, double time)
 {
   ImGui::GetIO().DeltaTime   = static_cast<float>(time - m_uiTime);
@@ -137,6 +152,21 @@ void Sample::DoGUI(int width, int height, double time)
         "    float4 color = float4(accum.rgb / accum.a, 1 - reveal.a)\n"
         "onto the opaque image. This sample implements this using two "
         "render pass subpasses.";
+    algorithmDescriptions[OIT_MOMENTS] =  //
+        "Moment-Based Order-Independent Transparency is another approximate "
+        "OIT algorithm that does not use an A-buffer, and uses 28 bytes per "
+        "pixel or sample. Instead of a heuristic weight, it estimates how "
+        "much light reaches each fragment from the pixel's absorbance over "
+        "depth:\n"
+        "A first pass sums up each fragment's absorbance A_i = -ln(1 - a_i) "
+        "and its power moments A_i * (z_i, z_i^2, z_i^3, z_i^4) of depth. "
+        "A second pass draws the objects again, reconstructs the "
+        "transmittance T_i in front of each fragment from these moments, "
+        "and sums up T_i * rgba_i. The composite pass then blends the "
+        "normalized sum onto the opaque image with the total opacity "
+        "1 - exp(-sum(A_i)). This usually gets much closer to the ground "
+        "truth than weighted blending, at the cost of a second geometry pass. "
+        "This sample implements this using three render pass subpasses.";
     LastItemTooltip(algorithmDescriptions[m_state.algorithm]);
 
     ImGuiH::InputIntClamped("Percent transparent", &m_state.percentTransparent, 0, 100);
@@ -150,7 +180,7 @@ void Sample::DoGUI(int width, int height, double time)
     LastItemTooltip(
         "How large a range the object opacities can span over. "
         "Opacities are always within the range [alphaMin, alphaMin+alphaWidth].");
-    if(m_state.algorithm != OIT_WEIGHTED)
+    if(m_state.usesABuffer() && !m_state.usesMLAB())
     {
       ImGui::Checkbox("Tail blend", &m_state.tailBlend);
       LastItemTooltip(
@@ -168,15 +198,115 @@ void Sample::DoGUI(int width, int height, double time)
           "In particular, this makes it so that tail-blended fragments are "
           "blended in a consistent order. When this is unchecked, the "
           "interlock algorithm uses unordered interlock instead.");
+
+      ImGui::Checkbox("Multi-layer alpha blending", &m_state.interlockMLAB);
+      LastItemTooltip(
+          "If checked, the 'interlock' algorithm keeps each pixel's layers sorted "
+          "while it inserts fragments, and when it runs out of layers, blends the "
+          "two backmost layers together instead of tail blending. The composite "
+          "pass then doesn't need to sort. This approximates the result when a "
+          "pixel has more fragments than layers. It doesn't apply to MSAA without "
+          "sample shading, since merged layers can't keep separate coverage masks.");
     }
 
-    if(m_state.algorithm != OIT_WEIGHTED && m_state.algorithm != OIT_LINKEDLIST)
+    if(m_state.algorithm == OIT_SPINLOCK)
+    {
+      m_imGuiRegistry.enumCombobox(GUI_SPINLOCK, "lock", &m_state.spinlockStrategy);
+      const char* spinDescriptions[NUM_SPIN_STRATEGIES];
+      spinDescriptions[SPIN_PLAIN] = "Each fragment retries the atomic exchange on its pixel's lock until it succeeds.";
+      spinDescriptions[SPIN_BACKOFF] =
+          "After a failed attempt, each fragment reads the lock (which is cheaper than an atomic) up to "
+          "twice as many times as before, and tries again once it's free.";
+      spinDescriptions[SPIN_SUBGROUP] =
+          "The lanes of a subgroup that shade the same pixel elect one of them to take the lock, then "
+          "insert their fragments one after another, so that they only need one atomic.";
+      LastItemTooltip(spinDescriptions[m_state.spinlockStrategy]);
+    }
+
+    if(m_state.usesABuffer() && m_state.algorithm != OIT_LINKEDLIST)
     {
       m_imGuiRegistry.enumCombobox(GUI_OITSAMPLES, "layers", &m_state.oitLayers);
       LastItemTooltip(
           "How many slots in the A-buffer to reserve for each pixel "
           "or sample. Each pixel or sample has its own space, and tail-blends "
           "its remaining fragments once it runs out of space.");
+
+      ImGui::Checkbox("Adaptive layers", &m_state.adaptiveLayers);
+      LastItemTooltip(
+          "If checked, the A-buffer keeps the size for the number of layers above, and the "
+          "renderer switches between shaders compiled for 4, 8, 16, and that many layers "
+          "each frame. It counts each pixel's fragments, and uses the fewest layers that "
+          "would let at most the percentage below of the fragments overflow. It switches "
+          "to more layers as soon as they're needed (a few frames late), and to fewer once "
+          "they've been enough for a while.");
+      if(m_state.adaptiveLayers)
+      {
+        ImGui::SliderFloat("Adaptive: max overflow %", &m_state.adaptiveOverflowPercent, 0.0f, 10.0f);
+        LastItemTooltip("The percentage of fragments that may be tail-blended or dropped with fewer layers.");
+        ImGui::Text("Using %u of %u layers", m_activeLayers, m_state.oitLayers);
+      }
+    }
+
+    if((m_state.algorithm == OIT_SIMPLE || m_state.algorithm == OIT_INTERLOCK || m_state.algorithm == OIT_SPINLOCK)
+       && isComputeCompositeSupported())
+    {
+      ImGui::Checkbox("Compute composite", &m_state.computeComposite);
+      LastItemTooltip(
+          "If checked, sorts and blends the A-buffer in a compute shader instead of a "
+          "full-screen fragment shader. Each invocation sorts its fragments in shared "
+          "memory using a bitonic sorting network, which avoids the register pressure "
+          "of sorting OIT_LAYERS fragments in a local array. Compare the Main and "
+          "CompositeCompute profiler sections with this on and off.");
+    }
+
+    if(m_state.compositeSorts() && !m_state.usesComputeComposite())
+    {
+      m_imGuiRegistry.enumCombobox(GUI_SORT, "sort", &m_state.sortStrategy);
+      const char* sortDescriptions[NUM_SORTS];
+      sortDescriptions[SORT_BUBBLE] = "The composite pass sorts each pixel's fragments using bubble sort (O(n^2)).";
+      sortDescriptions[SORT_INSERTION] =
+          "The composite pass sorts each pixel's fragments using insertion sort, which is also "
+          "O(n^2), but only moves fragments that are out of order.";
+      sortDescriptions[SORT_NETWORK] =
+          "The composite pass sorts each pixel's fragments using a bitonic sorting network over "
+          "all OIT_LAYERS elements (O(n log^2 n)). Since OIT_LAYERS is fixed when the shader is "
+          "compiled, the network is fully unrolled, and the array can stay in registers.";
+      LastItemTooltip(sortDescriptions[m_state.sortStrategy]);
+    }
+
+    if(m_state.usesABuffer() && m_state.algorithm != OIT_LINKEDLIST)
+    {
+      m_imGuiRegistry.enumCombobox(GUI_ABUFFER_LAYOUT, "A-buffer layout", &m_state.aBufferLayout);
+      const char* layoutDescriptions[NUM_ABUFFER_LAYOUTS];
+      layoutDescriptions[ABUFFER_LAYOUT_LAYERS] =
+          "Stores the A-buffer as one plane per layer, with the pixels of each plane in rows.";
+      layoutDescriptions[ABUFFER_LAYOUT_TILED] =
+          "Stores the A-buffer as one plane per layer, with the pixels of each plane in 8x8 "
+          "blocks along a Morton curve, so that the pixels of a quad or warp share cache lines.";
+      layoutDescriptions[ABUFFER_LAYOUT_PIXELS] =
+          "Stores all layers of a pixel next to each other, so that walking a pixel's entries "
+          "reads consecutive memory, but neighboring pixels are further apart.";
+      LastItemTooltip(layoutDescriptions[m_state.aBufferLayout]);
+    }
+
+    if(m_state.usesABuffer() && m_state.algorithm != OIT_LINKEDLIST)
+    {
+      ImGui::Checkbox("Frame tags", &m_state.frameTags);
+      LastItemTooltip(
+          "If checked, tags the per-pixel fragment counters (and the Loop algorithms' depths) "
+          "with a number that increases every frame and tile, and treats values with older tags "
+          "as empty. This skips the Clear profiler sections on all but every 255th tag, at the "
+          "cost of 24-bit Loop depths.");
+    }
+
+    if(m_state.compositeSorts() && ((m_state.algorithm == OIT_LINKEDLIST) || m_state.coverageShading()))
+    {
+      ImGui::Checkbox("Packed A-buffer", &m_state.packedABuffer);
+      LastItemTooltip(
+          "If checked, stores each A-buffer entry's depth as a 24-bit value and packs its "
+          "coverage mask into the remaining 8 bits. This shrinks coverage shading entries "
+          "from 16 to 8 bytes and linked list nodes from 16 to 12 bytes, at the cost of "
+          "depth precision when sorting.");
     }
 
     if(m_state.algorithm == OIT_LINKEDLIST)
@@ -186,6 +316,21 @@ void Sample::DoGUI(int width, int height, double time)
           "How many A-buffer slots to allocate per pixel or sample on average (since the "
           "linked-list algorithm uses the A-buffer as a single block of memory)."
           "Once the A-buffer runs out of space, the remaining fragments are tail-blended.");
+      ImGui::Checkbox("List: Adaptive size", &m_state.linkedListAdaptive);
+      LastItemTooltip(
+          "If checked, starts with the A-buffer size above, then reads back how many linked "
+          "list nodes each frame needed (a few frames late), and resizes the A-buffer to fit. "
+          "It grows as soon as more than 90% of the A-buffer is used, and shrinks once less "
+          "than half of it has been used for a while.");
+      if(isFragmentBallotSupported())
+      {
+        ImGui::Checkbox("List: Subgroup allocation", &m_state.linkedListSubgroupAlloc);
+        LastItemTooltip(
+            "If checked, the lanes of each subgroup count their fragments with a ballot, and one "
+            "of them reserves nodes for all of them with a single atomic on the node counter. "
+            "Otherwise, every fragment increments the same counter. Compare the Main profiler "
+            "section with this on and off.");
+      }
     }
 
     // Anti-aliasing
@@ -199,11 +344,136 @@ void Sample::DoGUI(int width, int height, double time)
     antialiasingDescriptions[AA_SUPER_4X] = "Renders at twice the resolution and height.";
     LastItemTooltip(antialiasingDescriptions[m_state.aaType]);
 
+    if(m_state.usesABuffer())
+    {
+      m_imGuiRegistry.enumCombobox(GUI_TILESIZE, "tiles", &m_state.tileSize);
+      LastItemTooltip(
+          "If not off, the A-buffer and auxiliary images only cover a square tile "
+          "of this many pixels on a side, and the transparent objects are drawn "
+          "once per tile, clearing and compositing the A-buffer each time. This "
+          "trades extra vertex work for much less memory at high resolutions "
+          "and sample counts.");
+    }
+
+    if(isGpuCullingSupported())
+    {
+      ImGui::Checkbox("GPU culling", &m_state.gpuCulling);
+      LastItemTooltip(
+          "If checked, a compute shader culls the opaque spheres against the view frustum "
+          "before drawing them. It then builds a pyramid of the furthest opaque depths, "
+          "and culls the transparent spheres against the view frustum and this pyramid. "
+          "The remaining spheres are drawn using vkCmdDrawIndexedIndirectCount, which "
+          "avoids rasterizing hidden spheres into the A-buffer.");
+      if(m_state.gpuCulling)
+      {
+        ImGui::Checkbox("Front-to-back order", &m_state.frontToBack);
+        LastItemTooltip(
+            "If checked, the culling shader also sorts the visible transparent spheres into "
+            "256 buckets by their nearest depth, and writes their draw commands in bucket "
+            "order. When nearer fragments arrive first, the algorithms that insert into a "
+            "sorted A-buffer reject more fragments early and move fewer entries. Compare "
+            "the A-buffer writes in the fragment statistics with this on and off.");
+      }
+    }
+
+    if(m_state.usesABuffer() && !m_state.usesComputeComposite())
+    {
+      ImGui::Checkbox("Subpass composite", &m_state.subpassComposite);
+      LastItemTooltip(
+          "If checked, each transparent pass is a subpass of one render pass, with by-region "
+          "dependencies between them instead of pipeline barriers. This allows tile-based GPUs "
+          "to keep the color and depth attachments on chip from the color pass to the composite "
+          "pass. Compare the Main profiler section with this on and off.");
+    }
+
+    if(m_state.usesABuffer() && !m_state.usesComputeComposite() && !m_state.usesTransparentSubpasses())
+    {
+      ImGuiH::InputIntClamped("Recording threads", &m_state.recordingThreads, 0, m_recordingWorkers.getNumWorkers());
+      LastItemTooltip(
+          "If nonzero, the opaque objects and each tile's transparent passes are recorded into "
+          "secondary command buffers on this many threads, which the main command buffer then "
+          "executes. 0 records everything into the main command buffer. The RecordSecondary "
+          "profiler section shows the CPU time this takes; there's one command buffer per tile, "
+          "so use tiles to give the threads more work.");
+    }
+
+    if(((m_state.algorithm == OIT_WEIGHTED) || (m_state.algorithm == OIT_MOMENTS)) && isShadingRateSupported())
+    {
+      m_imGuiRegistry.enumCombobox(GUI_SHADING_RATE, "shading rate", &m_state.shadingRate);
+      LastItemTooltip(
+          "The fragment size of the transparent color passes: with more than 1x1, each fragment "
+          "shader invocation shades a block of pixels, and blending writes its color to each "
+          "covered pixel and sample. The spheres' shading varies slowly, so this mostly blurs "
+          "their edges. It doesn't apply to sample shading, and the A-buffer algorithms always "
+          "shade per pixel, since each invocation only writes the A-buffer at its own pixel.");
+    }
+
+    if(isComputeResolveSupported())
+    {
+      ImGui::Checkbox("Compute resolve", &m_state.computeResolve);
+      LastItemTooltip(
+          "If checked, a compute shader averages the MSAA samples and supersampled pixels of "
+          "the color image and writes the result straight into the image the GUI is drawn on. "
+          "Otherwise, the MSAA resolve or downsampling blit writes an intermediate image, which "
+          "is then copied to change its format. Compare the CopyOffscreenToBackBuffer profiler "
+          "section with this on and off.");
+    }
+
+    ImGui::Checkbox("Fragment statistics", &m_state.fragmentStats);
+    LastItemTooltip(
+        "If checked, the transparent passes count each pixel's fragments, and the fragments "
+        "that didn't fit into the A-buffer and were tail-blended or dropped. A compute shader "
+        "then reduces these counts to a histogram, which is shown below a few frames late. "
+        "This adds atomics to every transparent fragment, so it affects the timings.");
+    if(m_state.fragmentStats)
+    {
+      ImGui::Checkbox("Fragment heatmap", &m_state.fragmentHeatmap);
+      LastItemTooltip(
+          "If checked, draws each pixel's number of fragments over the image, from blue (1) "
+          "to green (the number of layers) to red (twice that or more). Pixels with "
+          "fragments that didn't fit into the A-buffer are hatched.");
+    }
+
+    if(isMultiviewSupported())
+    {
+      ImGui::Checkbox("Multiview (stereo)", &m_state.multiview);
+      LastItemTooltip(
+          "If checked, draws a left and a right view side by side. Each pass draws both views "
+          "at once with VK_KHR_multiview, into the layers of the color, depth, and auxiliary "
+          "images and each view's part of the A-buffer, so the clears, draws, and composites "
+          "are recorded once instead of twice. Doesn't apply with GPU culling, mesh shaders, "
+          "the compute composite or resolve, or fragment statistics.");
+      if(m_state.usesMultiview())
+      {
+        ImGui::SliderFloat("Eye separation", &m_state.eyeSeparation, 0.0f, 0.5f);
+        LastItemTooltip("The distance between the cameras of the left and right views.");
+      }
+    }
+
     ImGui::Separator();
     ImGui::Text("Scene");
 
-    ImGuiH::InputIntClamped("Number of objects", &m_state.numObjects, 1, 65536, 128, 1024);
-    LastItemTooltip("The number of spheres in the mesh.");
+    ImGui::Checkbox("Instanced spheres", &m_state.instancedScene);
+    LastItemTooltip(
+        "If checked, the scene is a single sphere drawn once per object, with each "
+        "object's position, radius, and color in per-instance vertex buffers. "
+        "Otherwise, all spheres are expanded into one mesh, whose size grows with "
+        "the number of objects times the square of the subdivision level.");
+    if(m_state.instancedScene && isMeshShaderSupported())
+    {
+      ImGui::Checkbox("Mesh shaders", &m_state.meshShaders);
+      LastItemTooltip(
+          "If checked, task shaders cull the patches of 8 x 8 quads of each sphere "
+          "against the view frustum, and also the patches of opaque spheres that "
+          "face away from the camera. Mesh shaders then generate the remaining "
+          "patches from each object's bounding sphere. Doesn't apply with GPU "
+          "culling or subdivision levels above 32.");
+    }
+    // The expanded mesh of a million spheres wouldn't fit in memory.
+    const uint32_t maxObjects = (m_state.instancedScene ? 1048576 : 65536);
+    m_state.numObjects        = std::min(m_state.numObjects, maxObjects);
+    ImGuiH::InputIntClamped("Number of objects", &m_state.numObjects, 1, maxObjects, 128, 1024);
+    LastItemTooltip("The number of spheres in the scene.");
     ImGuiH::InputIntClamped("Subdivision level", &m_state.subdiv, 2, 32, 1, 8);
     LastItemTooltip(
         "How finely to subdivide the spheres. The number of triangles "
@@ -212,16 +482,84 @@ void Sample::DoGUI(int width, int height, double time)
     LastItemTooltip("The radius of the smallest spheres.");
     ImGui::SliderFloat("Scale width", &m_state.scaleWidth, 0, 4.0f);
     LastItemTooltip("How much the radii of the spheres can vary.");
+    if(isSceneBuilding())
+    {
+      ImGui::Text("Building scene...");
+      LastItemTooltip(
+          "The new scene is generated on all cores and streamed to the GPU on the "
+          "transfer queue; the previous scene is rendered until it's resident.");
+    }
 
     ImGui::Separator();
     ImGui::Text("Object Sizes");
+    ImGui::Text("Frame memory: %.1f of %.1f MB, peak %.1f MB", static_cast<double>(m_frameMemory.getUsedBytes()) / 1e6,
+                static_cast<double>(m_frameMemory.getTotalBytes()) / 1e6, static_cast<double>(m_frameMemory.getPeakBytes()) / 1e6);
+    LastItemTooltip(
+        "The memory the frame images use, out of the memory allocated for them (which includes memory that frames in "
+        "flight may still use). Recreating the frame images reuses this memory, and the weighted and moment-based "
+        "targets share memory with the downsampled image.");
+    ImGui::Text("Frame memory blocks: %u, %u allocated so far", m_frameMemory.getNumBlocks(),
+                m_frameMemory.getNumDriverAllocations());
+    if(m_oitTileCount > 1)
+    {
+      ImGui::Text("Tiles: %u of %u x %u", m_oitTileCount, m_oitTileExtent.width, m_oitTileExtent.height);
+    }
     DoObjectSizeText(m_oitABuffer, "A-buffer");
     DoObjectSizeText(m_oitAuxImage, "Aux image");
     DoObjectSizeText(m_oitAuxSpinImage, "Spinlock image");
     DoObjectSizeText(m_oitAuxDepthImage, "Furthest depths");
     DoObjectSizeText(m_oitCounterImage, "Atomic counter");
+    if(m_state.algorithm == OIT_LINKEDLIST)
+    {
+      ImGui::Text("List nodes needed: %u of %u", m_linkedListNodesUsed, m_sceneUbo.linkedListAllocatedPerElement);
+      DoValueHistoryPlot(m_linkedListNodesHistory, "##nodes", "%.0f nodes");
+    }
     DoObjectSizeText(m_oitWeightedColorImage, "Weighted color");
     DoObjectSizeText(m_oitWeightedRevealImage, "Reveal image");
+    DoObjectSizeText(m_oitMomentsImage, "Moments");
+    DoObjectSizeText(m_oitMomentsZerothImage, "Zeroth moment");
+    DoObjectSizeText(m_oitMomentsAccumImage, "Accumulated color");
+    DoObjectSizeText(m_oitCompositeImage, "Composite image");
+    if(m_state.fragmentStats && m_fragmentStats.valid)
+    {
+      const FragmentStatsSummary& stats = m_fragmentStats;
+      ImGui::Text("Fragments per pixel: mean %.2f, p95 %u%s, max %u", stats.meanFragments, stats.p95Fragments,
+                  (stats.p95Fragments == STATS_HISTOGRAM_BINS - 1 ? "+" : ""), stats.maxFragments);
+      LastItemTooltip("Over the pixels with at least one transparent fragment.");
+      ImGui::Text("Overflowed: %.2f%% of %u fragments, %u of %u pixels", stats.overflowPercent, stats.totalFragments,
+                  stats.overflowPixels, stats.coveredPixels);
+      LastItemTooltip("Fragments that didn't fit into the A-buffer, and were tail-blended or dropped.");
+      ImGui::Text("A-buffer writes: %u, %.2f per fragment", stats.aBufferWrites, stats.writesPerFragment);
+      LastItemTooltip(
+          "The stores and atomics that wrote A-buffer entries, including moving entries to insert "
+          "a fragment, and the Loop algorithms' atomicMin insertion steps.");
+      if(m_state.algorithm == OIT_SPINLOCK)
+      {
+        ImGui::Text("Lock attempts: %u, %.2f per fragment", stats.lockAttempts, stats.attemptsPerFragment);
+        LastItemTooltip(
+            "The atomic exchanges the color pass used to take the per-pixel locks. Each fragment needs at least "
+            "one; the rest measure contention.");
+      }
+      DoValueHistoryPlot(m_meanFragmentsHistory, "Mean fragments", "%.2f");
+      DoValueHistoryPlot(m_overflowPercentHistory, "Overflow %", "%.2f%%");
+      if(m_state.algorithm == OIT_SPINLOCK)
+      {
+        DoValueHistoryPlot(m_lockAttemptsHistory, "Attempts", "%.2f per fragment");
+      }
+      ImGui::Text("Readback latency: %u frames", m_fragmentStatsReadback.latency);
+      LastItemTooltip(
+          "Statistics are copied into a host-visible ring with one slot per frame in flight, and read once "
+          "that frame's fence has signaled, so they never stall the CPU and arrive this many frames late.");
+    }
+
+    if(isShaderPrecompileRunning())
+    {
+      ImGui::Separator();
+      ImGui::Text("Precompiling shaders: %u of %u", m_precompileDone.load(), m_precompileTotal);
+      LastItemTooltip(
+          "A background thread is compiling the shaders of all algorithms, layer counts, "
+          "and antialiasing modes into the shader cache (-oitprecompile 1).");
+    }
   }
   ImGui::End();
 }
\ No newline at end of file
@@ -33,6 +33,15 @@
 // the same depth, the one that's blended first is consistently defined.
 //
 // The resolve pass then sorts and blends the fragments from front to back.
+//
+// If OIT_INTERLOCK_MLAB is set to 1, this implements multi-layer alpha
+// blending (Salvi and Vaidyanathan 2014) instead: the color pass keeps the
+// OIT_LAYERS entries of each pixel sorted from front to back, inserting each
+// new fragment in its place. When a pixel already has OIT_LAYERS entries,
+// the two backmost entries are blended together into one, using the depth of
+// the nearer one. No fragments are tail blended or dropped, and the resolve
+// pass only has to blend the entries in order. This needs entries to have a
+// single color, so it isn't used with coverage shading (see State::usesMLAB).
 
 #version 460
 #extension GL_GOOGLE_include_directive : enable
@@ -87,19 +96,92 @@ layout(binding = IMG_AUXDEPTH, r32ui) uniform coherent uimage2DUsed imgDepth;
 layout(location = 0) in Interpolants IN;
 layout(location = 0, index = 0) out vec4 outColor;
 
+#if OIT_INTERLOCK_MLAB
+// Returns the packed color of blending the packed color front over the
+// packed color back. Packed colors are rgba8 sRGB unpremultiplied colors.
+uint mergeLayers(uint front, uint back)
+{
+  vec4 merged = vec4(0);
+  doBlendPacked(merged, front);
+  doBlendPacked(merged, back);
+  // Convert back to unpremultiplied sRGB for storage
+  if(merged.a > 0)
+  {
+    merged.rgb /= merged.a;
+  }
+  return packUnorm4x8(unPremultLinearToSRGB(merged));
+}
+#endif  // #if OIT_INTERLOCK_MLAB
+
 void main()
 {
+  statsCountFragment();
+
   // Get the unpremultiplied linear-space RGBA color of this pixel
   vec4 color = shading(IN);
   // Convert to unpremultiplied sRGB for 8-bit storage
   const vec4 sRGBColor = unPremultLinearToSRGB(color);
 
   // Compute index in the A-buffer
-  const int viewSize = scene.viewport.z;
-  const int listPos  = viewSize * OIT_LAYERS * sampleID + (coord.y * scene.viewport.x + coord.x);
+  const int layerStride = abufferLayerStride();
+  const int listPos     = abufferIndex(coord.xy, sampleID, 0, OIT_LAYERS);
+
+  uvec4 storeValue = abufferEntry(packUnorm4x8(sRGBColor));
+  // Whether this fragment was inserted without evicting another one
+  bool stored = false;
+  // The number of A-buffer entries this fragment wrote
+  uint writes = 0;
+
+#if OIT_INTERLOCK_MLAB
+  // Critical section --
+  beginInvocationInterlock();
+  {
+    const uint oldCounter = counterCount(imageLoad(imgAux, coord).r);
+    const int  layers     = int(min(oldCounter, uint(OIT_LAYERS)));
+    imageStore(imgAux, coord, uvec4(counterTagged(oldCounter + 1)));
+
+    // Walk the sorted entries from front to back, inserting this fragment
+    // before the first entry behind it, and moving each entry behind it
+    // back by one. This leaves the backmost entry in storeValue.
+    for(int i = 0; i < layers; i++)
+    {
+      const uvec4 entry = imageLoad(imgAbuffer, listPos + i * layerStride);
+      if(entryDepth(storeValue) < entryDepth(entry))
+      {
+        imageStore(imgAbuffer, listPos + i * layerStride, storeValue);
+        storeValue = entry;
+        writes++;
+      }
+    }
 
-  uvec4 storeValue = uvec4(packUnorm4x8(sRGBColor), floatBitsToUint(gl_FragCoord.z), storeMask, 0);
+    if(layers < OIT_LAYERS)
+    {
+      imageStore(imgAbuffer, listPos + layers * layerStride, storeValue);
+      stored = true;
+      writes++;
+    }
+    else
+    {
+      // Blend the two backmost entries, keeping the nearer one's depth.
+      uvec4 back = imageLoad(imgAbuffer, listPos + (OIT_LAYERS - 1) * layerStride);
+      back.r     = mergeLayers(back.r, storeValue.r);
+      imageStore(imgAbuffer, listPos + (OIT_LAYERS - 1) * layerStride, back);
+      writes++;
+    }
+  }
+  endInvocationInterlock();
+  // -- End critical section
 
+  // If two entries were merged, count this as an overflow so that the
+  // statistics and adaptive layers see where more layers would help.
+  if(!stored)
+  {
+    statsCountOverflow();
+  }
+  statsCountWrites(writes);
+  // Nothing is tail blended.
+  outColor = vec4(0);
+#else  // #if OIT_INTERLOCK_MLAB
   // Critical section --
   beginInvocationInterlock();
 #if USE_EARLYDEPTH
@@ -107,15 +189,17 @@ void main()
   if(storeValue.y <= oldDepth)
 #endif  // #if USE_EARLYDEPTH
   {
-    const uint oldCounter = imageLoad(imgAux, coord).r;
-    imageStore(imgAux, coord, uvec4(oldCounter + 1));
+    const uint oldCounter = counterCount(imageLoad(imgAux, coord).r);
+    imageStore(imgAux, coord, uvec4(counterTagged(oldCounter + 1)));
 
     if(oldCounter < OIT_LAYERS)
     {
-      imageStore(imgAbuffer, listPos + int(oldCounter) * viewSize, storeValue);
+      imageStore(imgAbuffer, listPos + int(oldCounter) * layerStride, storeValue);
 
       // Inserted, so we won't tail-blend it:
-      color = vec4(0);
+      color  = vec4(0);
+      stored = true;
+      writes = 1;
     }
     else
     {
@@ -125,7 +209,7 @@ void main()
 
       for(int i = 0; i < OIT_LAYERS; i++)
       {
-        const uint testDepth = imageLoad(imgAbuffer, listPos + i * viewSize).g;
+        const uint testDepth = imageLoad(imgAbuffer, listPos + i * layerStride).g;
         if(testDepth > maxDepth)
         {
           maxDepth = testDepth;
@@ -136,8 +220,9 @@ void main()
       if(maxDepth > storeValue.g)
       {
         // Replace the furthest fragment, tail-blending it, with this fragment.
-        color = unPremultSRGBToLinear(unpackUnorm4x8(imageLoad(imgAbuffer, listPos + furthest * viewSize).r));
-        imageStore(imgAbuffer, listPos + furthest * viewSize, storeValue);
+        color = unPremultSRGBToLinear(unpackUnorm4x8(imageLoad(imgAbuffer, listPos + furthest * layerStride).r));
+        imageStore(imgAbuffer, listPos + furthest * layerStride, storeValue);
+        writes = 1;
 #if USE_EARLYDEPTH
         imageStore(imgDepth, coord, uvec4(maxDepth));
 #endif  // #if USE_EARLYDEPTH
@@ -146,9 +231,17 @@ void main()
   }
   endInvocationInterlock();
 // -- End critical section
+
+  // Either this fragment or the one it replaced were tail-blended.
+  if(!stored)
+  {
+    statsCountOverflow();
+  }
+  statsCountWrites(writes);
 #if OIT_TAILBLEND
   outColor = vec4(color.rgb * color.a, color.a);  // Premultiply the color
 #endif                                            // #if OIT_TAILBLEND
+#endif                                            // #if OIT_INTERLOCK_MLAB
 }
 
 #endif  // #if PASS == PASS_COLOR
@@ -179,24 +272,27 @@ void main()
 
   vec4 color = vec4(0);
 
-  // Get the number of pixels in the image.
-  int viewSize = scene.viewport.z;
+  // Get the distance between consecutive layers in the A-buffer.
+  int layerStride = abufferLayerStride();
   // Get the index of the current sample at the current fragment.
-  int listPos = viewSize * OIT_LAYERS * sampleID + coord.y * scene.viewport.x + coord.x;
+  int listPos = abufferIndex(coord.xy, sampleID, 0, OIT_LAYERS);
 
   // Load the number of fragments for the given sample. Then load those
   // fragments and sort them.
 
   // The number of fragments for this sample.
-  int fragments = int(imageLoad(imgAux, coord).r);
+  int fragments = int(counterCount(imageLoad(imgAux, coord).r));
   fragments     = min(OIT_LAYERS, fragments);
 
   for(int i = 0; i < fragments; i++)
   {
-    array[i] = loadOp(imageLoad(imgAbuffer, listPos + i * viewSize));
+    array[i] = loadOp(imageLoad(imgAbuffer, listPos + i * layerStride));
   }
 
-  bubbleSort(array, fragments);
+  // With MLAB, the color pass already sorted the entries.
+#if !OIT_INTERLOCK_MLAB
+  sortFragments(array, fragments);
+#endif  // #if !OIT_INTERLOCK_MLAB
 
   vec4 colorSum = vec4(0);  // Initially completely transparent
 
@@ -210,7 +306,7 @@ void main()
     vec4 sColor = vec4(0);
     for(int i = 0; i < fragments; i++)
     {
-      if((array[i].b & (1 << s)) != 0)
+      if((entryMask(array[i]) & (1 << s)) != 0)
       {
         doBlendPacked(sColor, array[i].r);
       }
@@ -26,12 +26,28 @@
 // add a new linked list node pointing to the previous head, and set the head
 // to the new linked list node. 0 represents nullptr here, and is used as a
 // list terminator.
+// Each node stores a color, a depth, a coverage mask, and the index of the
+// next node, in an rgba32ui texel. With OIT_PACKED_ABUFFER, the depth and mask
+// share a uint (see common.h), so a node is three consecutive r32ui texels
+// instead: 12 instead of 16 bytes.
+// Since all fragments allocate nodes from the same counter, it's a single
+// heavily contended address. With OIT_LINKEDLIST_SUBGROUP, each subgroup
+// counts its fragments with a ballot instead, and one lane reserves nodes for
+// all of them with a single atomic.
 
 #version 460
 #extension GL_GOOGLE_include_directive : enable
 
 #include "shaderCommon.glsl"
 
+#if OIT_PACKED_ABUFFER
+#define nodeType r32ui
+#define NODE_TEXELS 3
+#else  // #if OIT_PACKED_ABUFFER
+#define nodeType rgba32ui
+#define NODE_TEXELS 1
+#endif  // #if OIT_PACKED_ABUFFER
+
 ////////////////////////////////////////////////////////////////////////////////
 // Color                                                                      //
 ////////////////////////////////////////////////////////////////////////////////
@@ -39,26 +55,59 @@
 
 #include "oitColorDepthDefines.glsl"
 
-layout(binding = IMG_ABUFFER, rgba32ui) uniform coherent uimageBuffer imgAbuffer;
+layout(binding = IMG_ABUFFER, nodeType) uniform coherent uimageBuffer imgAbuffer;
 layout(binding = IMG_AUX, r32ui) uniform coherent uimage2DUsed imgAux;
 // One major difference from the OpenGL version is that we use a 1x1 image here
 // instead of an atomic counter variable.
 layout(binding = IMG_COUNTER, r32ui) uniform uimage2D imgCounter;
 
+#if OIT_LINKEDLIST_SUBGROUP
+#extension GL_KHR_shader_subgroup_basic : require
+#extension GL_KHR_shader_subgroup_ballot : require
+#endif  // #if OIT_LINKEDLIST_SUBGROUP
+
 layout(location = 0) in Interpolants IN;
 layout(location = 0, index = 0) out vec4 outColor;
 
+// Allocates a node for this fragment by adding to imgCounter[0,0], and returns
+// the number of nodes allocated before it.
+uint allocateNode()
+{
+#if OIT_LINKEDLIST_SUBGROUP
+  // Atomics of helper invocations have no effect, so these don't take part.
+  uint offset = 0;
+  if(!gl_HelperInvocation)
+  {
+    // Each active lane gets the index of its bit among the subgroup's lanes;
+    // the first lane adds the number of lanes to the counter, and shares the
+    // original value.
+    const uvec4 ballot = subgroupBallot(true);
+    uint        first  = 0;
+    if(subgroupElect())
+    {
+      first = imageAtomicAdd(imgCounter, ivec2(0), subgroupBallotBitCount(ballot));
+    }
+    offset = subgroupBroadcastFirst(first) + subgroupBallotExclusiveBitCount(ballot);
+  }
+  return offset;
+#else   // #if OIT_LINKEDLIST_SUBGROUP
+  return imageAtomicAdd(imgCounter, ivec2(0), 1);
+#endif  // #if OIT_LINKEDLIST_SUBGROUP
+}
+
 void main()
 {
-  // +1 as 0 is used as a list terminator. Adds 1 to imgCounter[0,0] and
-  // returns the original value.
-  const uint newOffset = imageAtomicAdd(imgCounter, ivec2(0), 1) + 1;
+  statsCountFragment();
+
+  // +1 as 0 is used as a list terminator.
+  const uint newOffset = allocateNode() + 1;
   // Get the unpremultiplied linear-space RGBA color of this pixel
   const vec4 color = shading(IN);
 
   if(newOffset >= scene.linkedListAllocatedPerElement)
   {
     // we ran out of memory, so tail-blend using premultiplied alpha if allowed
+    statsCountOverflow();
 #if OIT_TAILBLEND
     outColor = vec4(color.rgb * color.a, color.a);  // Premultiply alpha
 #else
@@ -74,12 +123,18 @@ void main()
   // Convert to unpremultiplied sRGB for 8-bit storage
   const vec4 sRGBColor = unPremultLinearToSRGB(color);
 
-  const uvec4 storeValue = uvec4(packUnorm4x8(sRGBColor),          //
-                                 floatBitsToUint(gl_FragCoord.z),  //
-                                 storeMask,                        //
-                                 oldOffset);
+  uvec4 storeValue = abufferEntry(packUnorm4x8(sRGBColor));
+  storeValue.a     = oldOffset;
 
+#if OIT_PACKED_ABUFFER
+  const int texel = int(newOffset) * NODE_TEXELS;
+  imageStore(imgAbuffer, texel, uvec4(storeValue.r));
+  imageStore(imgAbuffer, texel + 1, uvec4(storeValue.g));
+  imageStore(imgAbuffer, texel + 2, uvec4(storeValue.a));
+#else   // #if OIT_PACKED_ABUFFER
   imageStore(imgAbuffer, int(newOffset), storeValue);
+#endif  // #if OIT_PACKED_ABUFFER
+  statsCountWrites(1u);
 
   outColor = vec4(0);
 }
@@ -97,12 +152,26 @@ void main()
 // elements in the linked list are tail blended.
 
 #include "oitCompositeDefines.glsl"
+// Fragments past the first OIT_LAYERS of a list also count as overflowing.
+#include "oitStats.glsl"
 
-layout(binding = IMG_ABUFFER, abufferType) uniform restrict readonly uimageBuffer imgAbuffer;
+layout(binding = IMG_ABUFFER, nodeType) uniform restrict readonly uimageBuffer imgAbuffer;
 layout(binding = IMG_AUX, r32ui) uniform restrict readonly uimage2DUsed imgAux;
 
 layout(location = 0) out vec4 outColor;
 
+// Loads a node as (color, depth, mask, next); with OIT_PACKED_ABUFFER, the
+// mask is part of the depth, and the third component is unused.
+uvec4 loadNode(uint node)
+{
+#if OIT_PACKED_ABUFFER
+  const int texel = int(node) * NODE_TEXELS;
+  return uvec4(imageLoad(imgAbuffer, texel).r, imageLoad(imgAbuffer, texel + 1).r, 0, imageLoad(imgAbuffer, texel + 2).r);
+#else   // #if OIT_PACKED_ABUFFER
+  return imageLoad(imgAbuffer, int(node));
+#endif  // #if OIT_PACKED_ABUFFER
+}
+
 void main()
 {
   loadType array[OIT_LAYERS];
@@ -115,7 +184,7 @@ void main()
   // Traverse the linked list:
   while(startOffset != uint(0) && fragments < OIT_LAYERS)
   {
-    const uvec4 stored = imageLoad(imgAbuffer, int(startOffset));
+    const uvec4 stored = loadNode(startOffset);
     array[fragments]   = loadOp(stored);
     fragments++;
 
@@ -123,14 +192,15 @@ void main()
   }
 
   // Sort the fragments:
-  bubbleSort(array, fragments);
+  sortFragments(array, fragments);
 
   // Process the remaining fragments
   vec4 tailColor = vec4(0);
 
   while(startOffset != uint(0))
   {
-    uvec4 stored = imageLoad(imgAbuffer, int(startOffset));
+    statsCountOverflow();
+    uvec4 stored = loadNode(startOffset);
 // Push the value into the array and tail-blend the furthest value
 // that comes out:
 #if OIT_TAILBLEND
@@ -150,7 +220,7 @@ void main()
     vec4 sColor = vec4(0);
     for(int i = 0; i < fragments; i++)
     {
-      if((array[i].b & (1 << s)) != 0)
+      if((entryMask(array[i]) & (1 << s)) != 0)
       {
         doBlendPacked(sColor, array[i].r);
       }
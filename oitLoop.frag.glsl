@@ -29,7 +29,8 @@
 // floatBitsToUint(x) > floatBitsToUint(y). As such, this depends on the
 // viewport depths always being positive.
 
-// The A-buffer is laid out like this:
+// With ABUFFER_LAYOUT_LAYERS, the A-buffer is laid out like this (see
+// abufferIndex in common.h for the other layouts):
 // for each SSAA sample...
 //   for each OIT layer...
 //     for each pixel...
@@ -56,24 +57,24 @@ layout(location = 0, index = 0) out vec4 outColor;
 
 void main()
 {
-  // The number of pixels in the image
-  const int viewSize = scene.viewport.z;
-  const int listPos  = viewSize * OIT_LAYERS * 2 * sampleID + (coord.y * scene.viewport.x + coord.x);
+  // The distance between consecutive layers in the A-buffer
+  const int layerStride = abufferLayerStride();
+  const int listPos     = abufferIndex(coord.xy, sampleID, 0, OIT_LAYERS * 2);
 
-  // Insert the floating-point depth (reinterpreted as a uint) into the list of depths
-  uint zcur = floatBitsToUint(gl_FragCoord.z);
+  // Insert the depth (see loopDepth in common.h) into the list of depths
+  uint zcur = loopDepth(gl_FragCoord.z);
   int  i    = 0;  // Current position in the array
 
 #if USE_EARLYDEPTH
   // Do some early tests to minimize the amount of insertion-sorting work we
   // have to do.
   // If the fragment is further away than the last depth fragment, skip it:
-  uint pretest = imageLoad(imgAbuffer, listPos + (OIT_LAYERS - 1) * viewSize).x;
+  uint pretest = imageLoad(imgAbuffer, listPos + (OIT_LAYERS - 1) * layerStride).x;
   if(zcur > pretest)
     return;
   // Check to see if the fragment can be inserted in the latter half of the
   // depth array:
-  pretest = imageLoad(imgAbuffer, listPos + (OIT_LAYERS / 2) * viewSize).x;
+  pretest = imageLoad(imgAbuffer, listPos + (OIT_LAYERS / 2) * layerStride).x;
   if(zcur > pretest)
     i = (OIT_LAYERS / 2);
 #endif  // #if USE_EARLYDEPTH
@@ -81,10 +82,12 @@ void main()
   // Try to insert zcur in the place of the first element of the array that
   // is greater than or equal to it. In the former case, shift all of the
   // remaining elements in the array down.
+  uint writes = 0;
   for(; i < OIT_LAYERS; i++)
   {
-    const uint ztest = imageAtomicMin(imgAbuffer, listPos + i * viewSize, zcur);
-    if(ztest == 0xFFFFFFFFu || ztest == zcur)
+    const uint ztest = imageAtomicMin(imgAbuffer, listPos + i * layerStride, zcur);
+    writes++;
+    if(loopDepthEmpty(ztest) || ztest == zcur)
     {
       // In the former case, we just inserted zcur into an empty space in the
       // array. In the latter case, we found a depth value that exactly matched.
@@ -92,6 +95,7 @@ void main()
     }
     zcur = max(ztest, zcur);
   }
+  statsCountWrites(writes);
 
   // Note that this line is necessary, since otherwise we'll get a warning from
   // the validation layer saying that undefined values will be written.
@@ -119,22 +123,25 @@ layout(location = 0, index = 0) out vec4 outColor;
 
 void main()
 {
+  statsCountFragment();
+
   // Get the unpremultiplied linear-space RGBA color of this pixel
   vec4 color = shading(IN);
   // Convert to unpremultiplied sRGB for 8-bit storage
   const vec4 sRGBColor = unPremultLinearToSRGB(color);
 
   // Compute base index in the A-buffer
-  const int viewSize = scene.viewport.z;
-  const int listPos = viewSize * OIT_LAYERS * 2 * sampleID + (coord.y * scene.viewport.x + coord.x);
+  const int layerStride = abufferLayerStride();
+  const int listPos     = abufferIndex(coord.xy, sampleID, 0, OIT_LAYERS * 2);
 
-  const uint zcur = floatBitsToUint(gl_FragCoord.z);
+  const uint zcur = loopDepth(gl_FragCoord.z);
 
 #if USE_EARLYDEPTH
   // If this fragment was behind the frontmost OIT_LAYERS fragments, it didn't
   // make it in, so tail blend it:
-  if(imageLoad(imgAbuffer, listPos + (OIT_LAYERS - 1) * viewSize).x < zcur)
+  if(imageLoad(imgAbuffer, listPos + (OIT_LAYERS - 1) * layerStride).x < zcur)
   {
+    statsCountOverflow();
 #if OIT_TAILBLEND
     // Premultiply alpha
     outColor = vec4(color.rgb * color.a, color.a);
@@ -153,7 +160,7 @@ void main()
   while(start < end)
   {
     int mid = (start + end) / 2;
-    ztest = imageLoad(imgAbuffer, listPos + mid * viewSize).x;
+    ztest = imageLoad(imgAbuffer, listPos + mid * layerStride).x;
     if(ztest < zcur)
     {
       start = mid + 1;  // in [mid + 1, end]
@@ -166,7 +173,8 @@ void main()
 
   // We now have start == end. Insert the packed color into the A-buffer at
   // this index.
-  imageStore(imgAbuffer, listPos + (OIT_LAYERS + start) * viewSize, uvec4(packUnorm4x8(sRGBColor)));
+  imageStore(imgAbuffer, listPos + (OIT_LAYERS + start) * layerStride, uvec4(packUnorm4x8(sRGBColor)));
+  statsCountWrites(1u);
 
   // Inserted, so make this color transparent:
   outColor = vec4(0);
@@ -192,15 +200,15 @@ void main()
 {
   vec4 color = vec4(0);
 
-  const int viewSize = scene.viewport.z;
-  int       listPos  = viewSize * OIT_LAYERS * 2 * sampleID + (coord.y * scene.viewport.x + coord.x);
+  const int layerStride = abufferLayerStride();
+  int       listPos     = abufferIndex(coord.xy, sampleID, 0, OIT_LAYERS * 2);
 
   // Count the number of fragments for this pixel
   int fragments = 0;
   for(int i = 0; i < OIT_LAYERS; i++)
   {
-    const uint ztest = imageLoad(imgAbuffer, listPos + i * viewSize).r;
-    if(ztest != 0xFFFFFFFFu)
+    const uint ztest = imageLoad(imgAbuffer, listPos + i * layerStride).r;
+    if(!loopDepthEmpty(ztest))
     {
       fragments++;
     }
@@ -211,11 +219,11 @@ void main()
   }
 
   // Jump ahead to the color portion of the A-buffer
-  listPos += viewSize * OIT_LAYERS;
+  listPos += layerStride * OIT_LAYERS;
 
   for(int i = 0; i < fragments; i++)
   {
-    doBlendPacked(color, imageLoad(imgAbuffer, listPos + i * viewSize).r);
+    doBlendPacked(color, imageLoad(imgAbuffer, listPos + i * layerStride).r);
   }
 
   outColor = color;
@@ -30,7 +30,8 @@
 // floatBitsToUint(x) > floatBitsToUint(y). As such, this depends on the
 // viewport depths always being positive.
 
-// The A-buffer is laid out like this:
+// With ABUFFER_LAYOUT_LAYERS, the A-buffer is laid out like this (see
+// abufferIndex in common.h for the other layouts):
 // for each SSAA sample...
 //   for each OIT layer...
 //     for each pixel...
@@ -64,26 +65,28 @@ layout(location = 0, index = 0) out vec4 outColor;
 
 void main()
 {
+  statsCountFragment();
+
   // Get the unpremultiplied linear-space RGBA color of this pixel
   vec4 color = shading(IN);
   // Convert to unpremultiplied sRGB for 8-bit storage
   const vec4 sRGBColor = unPremultLinearToSRGB(color);
 
   // Compute base index in the A-buffer
-  const int viewSize = scene.viewport.z;
-  const int listPos  = viewSize * OIT_LAYERS * sampleID + (coord.y * scene.viewport.x + coord.x);
+  const int layerStride = abufferLayerStride();
+  const int listPos     = abufferIndex(coord.xy, sampleID, 0, OIT_LAYERS);
 
   bool canInsert = true;  // If false, canot be inserted into the A-buffer.
 
   // Store the color in the least significant bits and the depth in the most significant bits.
-  uint64_t zcur = packUint2x32(uvec2(packUnorm4x8(sRGBColor), floatBitsToUint(gl_FragCoord.z)));
+  uint64_t zcur = packUint2x32(uvec2(packUnorm4x8(sRGBColor), loopDepth(gl_FragCoord.z)));
   int      i    = 0;  // Current position in the array
 
 #if USE_EARLYDEPTH
   // Do some early tests to minimize the amount of insertion-sorting work we
   // have to do.
   // If the fragment is further away than the last depth fragment, skip it:
-  uint64_t pretest = abuffer[listPos + (OIT_LAYERS - 1) * viewSize];
+  uint64_t pretest = abuffer[listPos + (OIT_LAYERS - 1) * layerStride];
   if(zcur > pretest)
   {
     canInsert = false;
@@ -92,7 +95,7 @@ void main()
   {
     // Check to see if the fragment can be inserted in the latter half of the
     // depth array:
-    pretest = abuffer[listPos + (OIT_LAYERS / 2) * viewSize];
+    pretest = abuffer[listPos + (OIT_LAYERS / 2) * layerStride];
     if(zcur > pretest)
     {
       i = (OIT_LAYERS / 2);
@@ -100,7 +103,8 @@ void main()
   }
 #endif
 
-  bool evict = true;
+  bool evict  = true;
+  uint writes = 0;
   if(canInsert)
   {
     // Try to insert zcur in the place of the first element of the array that
@@ -108,9 +112,10 @@ void main()
     // remaining elements in the array down.
     for(; i < OIT_LAYERS; i++)
     {
-      uint64_t ztest = atomicMin(abuffer[listPos + i * viewSize], zcur);
+      uint64_t ztest = atomicMin(abuffer[listPos + i * layerStride], zcur);
+      writes++;
 
-      if(ztest == packUint2x32(uvec2(0xFFFFFFFFu, 0xFFFFFFFFu)))
+      if(loopDepthEmpty(unpackUint2x32(ztest).y))
       {
         // We just inserted zcur into an empty space in the array.
         evict = false;
@@ -120,6 +125,7 @@ void main()
       zcur = (ztest > zcur) ? ztest : zcur;
     }
   }
+  statsCountWrites(writes);
 
   if(!evict)
   {
@@ -128,6 +134,7 @@ void main()
   }
   else
   {
+    statsCountOverflow();
 #if OIT_TAILBLEND
     // Unpack the color of the fragment that cannot fit into the A-buffer and
     // premultiply it
@@ -163,13 +170,13 @@ void main()
 {
   vec4 color = vec4(0);
 
-  const int viewSize = scene.viewport.z;
-  const int listPos  = viewSize * OIT_LAYERS * sampleID + (coord.y * scene.viewport.x + coord.x);
+  const int layerStride = abufferLayerStride();
+  const int listPos     = abufferIndex(coord.xy, sampleID, 0, OIT_LAYERS);
 
   for(int i = 0; i < OIT_LAYERS; i++)
   {
-    uvec2 stored = abuffer[listPos + i * viewSize];
-    if(stored.y != 0xFFFFFFFFu)
+    uvec2 stored = abuffer[listPos + i * layerStride];
+    if(!loopDepthEmpty(stored.y))
     {
       doBlendPacked(color, stored.x);
     }
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2020-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2020-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+// Implements Moment-Based Order-Independent Transparency, from
+// Muenstermann, Krumpen, Klein, and Peters 2018,
+// http://momentsingraphics.de/I3D2018.html, using four power moments.
+// Like Weighted, Blended OIT, this is an approximate technique that uses a
+// fixed amount of memory per pixel or sample. Instead of a heuristic weight,
+// it reconstructs the transmittance in front of each fragment from a compact
+// representation of how the pixel's absorbance is distributed over depth:
+// Depth pass: each fragment with opacity a at warped depth z (in [-1, 1])
+//   adds its absorbance A = -ln(1 - a) to b_0, and A * (z, z^2, z^3, z^4)
+//   to b_1...b_4, using additive blending.
+// Color pass: each fragment reconstructs the transmittance T in front of it
+//   from the normalized moments b_1/b_0...b_4/b_0, and adds T times its
+//   premultiplied color to an accumulation target.
+// Composite pass: the total transmittance of the pixel is exp(-b_0), so we
+//   normalize the accumulated color and blend it onto the image with
+//   opacity 1 - exp(-b_0).
+// These are the three subpasses of m_renderPassMoments.
+
+#version 460
+#extension GL_GOOGLE_include_directive : enable
+
+#include "shaderCommon.glsl"
+
+#if OIT_MSAA != 1
+#define subpassInputUsed subpassInputMS
+#define loadInput(tex) subpassLoad(tex, gl_SampleID)
+#else
+#define subpassInputUsed subpassInput
+#define loadInput(tex) subpassLoad(tex)
+#endif
+
+// The near and far planes of the camera (see Sample::updateUniformBuffer).
+const float nearPlane = 0.01;
+const float farPlane  = 50.0;
+
+// Maps a view-space depth to [-1, 1]. Using the logarithm of the depth,
+// instead of gl_FragCoord.z, spreads the scene's fragments more evenly over
+// this range, which the moments represent best.
+float warpDepth(float viewDepth)
+{
+  const float logDepth = log(clamp(-viewDepth, nearPlane, farPlane));
+  return 2.0 * (logDepth - log(nearPlane)) / (log(farPlane) - log(nearPlane)) - 1.0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Depth                                                                      //
+////////////////////////////////////////////////////////////////////////////////
+#if PASS == PASS_DEPTH
+
+// Fragment statistics, if enabled. This algorithm never overflows.
+#include "oitStats.glsl"
+
+layout(location = 0) in Interpolants IN;
+layout(location = 0) out vec4 outMoments;  // b_1...b_4
+layout(location = 1) out float outZeroth;  // b_0
+
+void main()
+{
+  statsCountFragment();
+
+  // Fully opaque fragments would have infinite absorbance.
+  const float alpha      = shading(IN).a;
+  const float absorbance = -log(1.0 - min(alpha, 0.9999));
+
+  const float z  = warpDepth(IN.depth);
+  const float z2 = z * z;
+
+  // Blend function: ONE, ONE for both
+  outMoments = absorbance * vec4(z, z2, z2 * z, z2 * z2);
+  outZeroth  = absorbance;
+}
+
+#endif  // #if PASS == PASS_DEPTH
+
+////////////////////////////////////////////////////////////////////////////////
+// Color                                                                      //
+////////////////////////////////////////////////////////////////////////////////
+#if PASS == PASS_COLOR
+
+layout(input_attachment_index = 0, binding = IMG_MOMENTS) uniform subpassInputUsed texMoments;
+layout(input_attachment_index = 1, binding = IMG_MOMENTS_ZEROTH) uniform subpassInputUsed texZeroth;
+
+layout(location = 0) in Interpolants IN;
+layout(location = 0) out vec4 outColor;
+
+// Returns the transmittance in front of depth, given the total absorbance b0
+// and the normalized power moments b = (b_1, b_2, b_3, b_4) / b_0. This
+// computes a lower bound of the absorbance in front of depth that's
+// compatible with the moments (sharp, but biased towards the depth itself
+// by `overestimation`), as described in the paper.
+float transmittanceAtDepth(float b0, vec4 b, float depth)
+{
+  // Bias the moments towards those of a uniform distribution, which makes
+  // the Hankel matrix below well-conditioned even with rounding errors.
+  const float bias           = 5e-5;
+  const float overestimation = 0.25;
+  b                          = mix(b, vec4(0.0, 0.375, 0.0, 0.375), bias);
+
+  // Cholesky factorization of the Hankel matrix
+  // B = ((1, b_1, b_2), (b_1, b_2, b_3), (b_2, b_3, b_4))
+  const float L21D11 = fma(-b.x, b.y, b.z);
+  const float D11    = fma(-b.x, b.x, b.y);
+  const float L21    = L21D11 / D11;
+  const float D22    = fma(-L21D11, L21, fma(-b.y, b.y, b.w));
+
+  // Solve B * c = (1, depth, depth^2)
+  vec3 c = vec3(1.0, depth, depth * depth);
+  c.y -= b.x;
+  c.z -= b.y + L21 * c.y;
+  c.y /= D11;
+  c.z /= D22;
+  c.y -= L21 * c.z;
+  c.x -= dot(c.yz, b.xy);
+
+  // The roots of c.x + c.y * z + c.z * z^2, together with depth, are the
+  // support of the distribution that gives the bound.
+  const float p  = c.y / c.z;
+  const float q  = c.x / c.z;
+  const float r  = sqrt(max(p * p * 0.25 - q, 0.0));
+  const vec3  z  = vec3(depth, -p * 0.5 - r, -p * 0.5 + r);
+  const vec3  f  = vec3(overestimation, (z.y < z.x) ? 1.0 : 0.0, (z.z < z.x) ? 1.0 : 0.0);
+
+  // Interpolate the weights f at the points z with a quadratic polynomial
+  // (using divided differences), and integrate it against the moments.
+  const float f01  = (f.y - f.x) / (z.y - z.x);
+  const float f12  = (f.z - f.y) / (z.z - z.y);
+  const float f012 = (f12 - f01) / (z.z - z.x);
+  vec3        polynomial;
+  polynomial.z = f012;
+  polynomial.y = f01 - f012 * z.y;
+  polynomial.x = f.x - polynomial.y * z.x;
+  polynomial.y -= polynomial.z * z.x;
+  const float absorbance = polynomial.x + dot(b.xy, polynomial.yz);
+
+  return clamp(exp(-b0 * absorbance), 0.0, 1.0);
+}
+
+void main()
+{
+  vec4 color = shading(IN);
+  color.rgb *= color.a;  // Premultiply it
+
+  const float b0 = loadInput(texZeroth).r;
+  // Pixels with almost no absorbance can't be normalized, but there's
+  // nothing in front of their fragments either.
+  float transmittance = 1.0;
+  if(b0 > 1e-3)
+  {
+    transmittance = transmittanceAtDepth(b0, loadInput(texMoments) / b0, warpDepth(IN.depth));
+  }
+
+  // Blend function: ONE, ONE
+  outColor = transmittance * color;
+}
+
+#endif  // #if PASS == PASS_COLOR
+
+////////////////////////////////////////////////////////////////////////////////
+// Composite                                                                  //
+////////////////////////////////////////////////////////////////////////////////
+#if PASS == PASS_COMPOSITE
+
+layout(input_attachment_index = 0, binding = IMG_MOMENTS_ZEROTH) uniform subpassInputUsed texZeroth;
+layout(input_attachment_index = 1, binding = IMG_MOMENTS_ACCUM) uniform subpassInputUsed texAccum;
+
+layout(location = 0) out vec4 outColor;
+
+void main()
+{
+  const float b0    = loadInput(texZeroth).r;
+  const vec4  accum = loadInput(texAccum);
+  // Blend function: ONE_MINUS_SRC_ALPHA, SRC_ALPHA, as for Weighted, Blended
+  // OIT; the alpha channel is the total transmittance
+  outColor = vec4(accum.rgb / max(accum.a, 1e-5), exp(-b0));
+}
+
+#endif  // #if PASS == PASS_COMPOSITE
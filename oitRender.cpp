@@ -23,40 +23,16 @@
 
 #include "oit.h"
 
+#include <algorithm>
+#include <cstddef>
+
 void Sample::render(VkCommandBuffer& cmdBuffer)
 {
-  // Clear auxiliary buffers before we even start a render pass - this
-  // reduces the number of render passes we need to use by 1.
-  switch(m_state.algorithm)
-  {
-    case OIT_SIMPLE:
-      clearTransparentSimple(cmdBuffer);
-      break;
-    case OIT_LINKEDLIST:
-      clearTransparentLinkedList(cmdBuffer);
-      break;
-    case OIT_LOOP:
-      clearTransparentLoop(cmdBuffer);
-      break;
-    case OIT_LOOP64:
-      clearTransparentLoop64(cmdBuffer);
-      break;
-    case OIT_INTERLOCK:
-    case OIT_SPINLOCK:
-      clearTransparentLock(cmdBuffer, (m_state.algorithm == OIT_INTERLOCK));
-      break;
-    case OIT_WEIGHTED:
-      // Its render pass clears OIT_WEIGHTED for us
-      break;
-    default:
-      assert(!"Algorithm case not called in switch statement!");
-  }
-
   // We'll make the first m_state.percentTransparent percent of our spheres transparent;
   // the rest, at the end, will be opaque. Since we only have one mesh, we can do this
-  // by drawing the last range of triangles using an opaque shader, and then drawing
-  // the first using our OIT methods.
-  const int numObjects     = m_sceneTriangleIndices / m_objectTriangleIndices;
+  // by drawing the last range of triangles (or of instances, with an instanced
+  // scene) using an opaque shader, and then drawing the first using our OIT methods.
+  const int numObjects     = static_cast<int>(m_sceneNumObjects);
   int       numTransparent = (numObjects * m_state.percentTransparent) / 100;
   if(numTransparent > numObjects)
   {
@@ -64,6 +40,49 @@ void Sample::render(VkCommandBuffer& cmdBuffer)
   }
   const int numOpaque = numObjects - numTransparent;
 
+  // Bind the descriptor set (constant buffers, images)
+  // Pipeline layout depends only on descriptor set layout.
+  cmdBindDescriptorSet(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS);
+  if(m_state.gpuCulling || m_state.usesComputeComposite() || m_state.countsFragments())
+  {
+    cmdBindDescriptorSet(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE);
+  }
+
+  // Start with the scissor rectangle covering the whole image.
+  VkRect2D fullImage      = {};
+  fullImage.extent.width  = m_colorImage.c_width;
+  fullImage.extent.height = m_colorImage.c_height;
+  cmdSetTile(cmdBuffer, fullImage);
+
+  // With GPU culling, the opaque objects only need to be inside the view
+  // frustum. The transparent objects get culled once their depth is known.
+  if(m_state.gpuCulling)
+  {
+    cullOpaque(cmdBuffer, numTransparent, numOpaque);
+  }
+
+  // The fragment counts cover the whole image, so they're only cleared once,
+  // even when rendering in tiles.
+  clearFragmentStats(cmdBuffer);
+
+  if(m_state.usesParallelRecording())
+  {
+    renderSecondary(cmdBuffer, numTransparent, numOpaque);
+    finishFragmentStats(cmdBuffer);
+    return;
+  }
+
+  if(m_oitTileCount > 1)
+  {
+    renderTiled(cmdBuffer, numTransparent, numOpaque);
+    finishFragmentStats(cmdBuffer);
+    return;
+  }
+
+  // Clear auxiliary buffers before we even start a render pass - this
+  // reduces the number of render passes we need to use by 1.
+  clearTransparent(cmdBuffer);
+
   // Start the main render pass
   {
     const nvvk::ProfilerVK::Section scopedTimer(m_profilerVK, "Main", cmdBuffer);
@@ -75,6 +94,71 @@ void Sample::render(VkCommandBuffer& cmdBuffer)
                               VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
 
     // Set up the render pass
+    VkRenderPassBeginInfo renderPassInfo = {VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO};
+    renderPassInfo.renderPass            = m_renderPassColorDepthClear;
+    renderPassInfo.framebuffer           = m_mainColorDepthFramebuffer;
+    renderPassInfo.renderArea            = fullImage;
+
+    std::array<VkClearValue, 2> clearValues = {};
+    clearValues[0].color                    = {0.2f, 0.2f, 0.2f, 0.2f};  // Background color, in linear space
+    clearValues[1].depthStencil             = {1.0f, 0};                 // Clear depth
+    renderPassInfo.clearValueCount          = static_cast<uint32_t>(clearValues.size());
+    renderPassInfo.pClearValues             = clearValues.data();
+
+    vkCmdBeginRenderPass(cmdBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+    // Draw all of the opaque objects
+    drawSceneObjects(cmdBuffer, numTransparent, numOpaque);
+
+    // Culling the transparent objects against the opaque objects' depth needs
+    // a compute pass, so end the render pass and continue in one that loads
+    // the attachments. With State::usesTransparentSubpasses, the transparent
+    // passes need a render pass with more subpasses, so do the same.
+    if(m_state.gpuCulling || m_state.usesTransparentSubpasses())
+    {
+      vkCmdEndRenderPass(cmdBuffer);
+      if(m_state.gpuCulling)
+      {
+        cullTransparent(cmdBuffer, numTransparent);
+      }
+      cmdRenderPassBarrierSimple(cmdBuffer);
+
+      const bool subpasses           = m_state.usesTransparentSubpasses();
+      renderPassInfo.renderPass      = (subpasses ? m_renderPassTransparent : m_renderPassColorDepthLoad);
+      renderPassInfo.framebuffer     = (subpasses ? m_transparentFramebuffer : m_mainColorDepthFramebuffer);
+      renderPassInfo.clearValueCount = 0;
+      renderPassInfo.pClearValues    = nullptr;
+      vkCmdBeginRenderPass(cmdBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+    }
+
+    // Now, draw the transparent objects.
+    drawTransparent(cmdBuffer, numTransparent);
+
+    vkCmdEndRenderPass(cmdBuffer);
+  }
+
+  // Let the CPU know how many linked list nodes this frame needed.
+  if(m_state.algorithm == OIT_LINKEDLIST)
+  {
+    copyLinkedListCounterToReadback(cmdBuffer, 0);
+  }
+
+  finishFragmentStats(cmdBuffer);
+}
+
+void Sample::renderTiled(VkCommandBuffer& cmdBuffer, int numTransparent, int numOpaque)
+{
+  // Tiling trades drawing the transparent objects once per tile for an
+  // A-buffer that only needs to cover a single tile. Each tile goes through
+  // the same clear, color, and composite sequence as the untiled path.
+  const nvvk::ProfilerVK::Section scopedTimer(m_profilerVK, "Main", cmdBuffer);
+
+  m_colorImage.transitionTo(cmdBuffer,                                 // Command buffer
+                            VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,  // New layout
+                            VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
+
+  // Draw all of the opaque objects over the whole image.
+  {
     VkRenderPassBeginInfo renderPassInfo    = {VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO};
     renderPassInfo.renderPass               = m_renderPassColorDepthClear;
     renderPassInfo.framebuffer              = m_mainColorDepthFramebuffer;
@@ -89,54 +173,547 @@ void Sample::render(VkCommandBuffer& cmdBuffer)
     renderPassInfo.pClearValues             = clearValues.data();
 
     vkCmdBeginRenderPass(cmdBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+    drawSceneObjects(cmdBuffer, numTransparent, numOpaque);
+    vkCmdEndRenderPass(cmdBuffer);
+  }
 
-    // Draw all of the opaque objects
+  // Cull the transparent objects once for all tiles.
+  if(m_state.gpuCulling)
+  {
+    cullTransparent(cmdBuffer, numTransparent);
+  }
+
+  // Then draw the transparent objects, one tile at a time.
+  const std::vector<VkRect2D> tiles = getTiles();
+  for(uint32_t tileIndex = 0; tileIndex < static_cast<uint32_t>(tiles.size()); tileIndex++)
+  {
+    const VkRect2D& tile = tiles[tileIndex];
+
+    // The previous render pass wrote to m_colorImage, m_depthImage, and
+    // the A-buffer; finish that before clearing and drawing again.
+    cmdRenderPassBarrierSimple(cmdBuffer);
+    clearTransparent(cmdBuffer);
+
+    cmdSetTile(cmdBuffer, tile);
+
+    const bool            subpasses      = m_state.usesTransparentSubpasses();
+    VkRenderPassBeginInfo renderPassInfo = {VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO};
+    renderPassInfo.renderPass            = (subpasses ? m_renderPassTransparent : m_renderPassColorDepthLoad);
+    renderPassInfo.framebuffer           = (subpasses ? m_transparentFramebuffer : m_mainColorDepthFramebuffer);
+    renderPassInfo.renderArea            = tile;
+
+    vkCmdBeginRenderPass(cmdBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+    drawTransparent(cmdBuffer, numTransparent);
+    vkCmdEndRenderPass(cmdBuffer);
+
+    if(m_state.algorithm == OIT_LINKEDLIST)
+    {
+      copyLinkedListCounterToReadback(cmdBuffer, tileIndex);
+    }
+  }
+}
+
+void Sample::renderSecondary(VkCommandBuffer& cmdBuffer, int numTransparent, int numOpaque)
+{
+  const nvvk::ProfilerVK::Section scopedTimer(m_profilerVK, "Main", cmdBuffer);
+
+  const std::vector<VkRect2D> tiles     = getTiles();
+  const uint32_t              numTiles  = static_cast<uint32_t>(tiles.size());
+  VkRect2D                    fullImage = {};
+  fullImage.extent.width                = m_colorImage.c_width;
+  fullImage.extent.height               = m_colorImage.c_height;
+
+  // Each tile's clear may advance the frame tag, which the tile's draws push,
+  // so find out which tiles need a full clear and what they push before
+  // recording anything.
+  std::vector<PushConstants> tilePushConstants(numTiles);
+  std::vector<bool>          tileNeedsClear(numTiles);
+  for(uint32_t tileIndex = 0; tileIndex < numTiles; tileIndex++)
+  {
+    tileNeedsClear[tileIndex]               = advanceFrameTag();
+    tilePushConstants[tileIndex]            = m_pushConstants;
+    tilePushConstants[tileIndex].tileOffset = glm::ivec2(tiles[tileIndex].offset.x, tiles[tileIndex].offset.y);
+  }
+  PushConstants opaquePushConstants = m_pushConstants;
+  opaquePushConstants.tileOffset    = glm::ivec2(0, 0);
+
+  // Job 0 draws the opaque objects, and job 1 + i tile i's transparent
+  // passes. Recording only reads the renderer's state, so the jobs can run
+  // at the same time.
+  std::vector<VkCommandBuffer> secondaries(1 + numTiles);
+  {
+    const nvh::Profiler::Section recordTimer(m_profiler, "RecordSecondary");
+    m_recordingWorkers.run(1 + numTiles, m_state.recordingThreads, [&](uint32_t job, uint32_t worker) {
+      if(job == 0)
+      {
+        VkCommandBuffer secondary = beginSecondary(worker, m_renderPassColorDepthClear, fullImage, opaquePushConstants);
+        drawSceneObjects(secondary, numTransparent, numOpaque);
+        NVVK_CHECK(vkEndCommandBuffer(secondary));
+        secondaries[job] = secondary;
+      }
+      else
+      {
+        VkCommandBuffer secondary =
+            beginSecondary(worker, m_renderPassColorDepthLoad, tiles[job - 1], tilePushConstants[job - 1]);
+        drawTransparent(secondary, numTransparent);
+        NVVK_CHECK(vkEndCommandBuffer(secondary));
+        secondaries[job] = secondary;
+      }
+    });
+  }
+
+  m_colorImage.transitionTo(cmdBuffer,                                 // Command buffer
+                            VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,  // New layout
+                            VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
+
+  // Draw all of the opaque objects over the whole image.
+  {
+    VkRenderPassBeginInfo renderPassInfo = {VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO};
+    renderPassInfo.renderPass            = m_renderPassColorDepthClear;
+    renderPassInfo.framebuffer           = m_mainColorDepthFramebuffer;
+    renderPassInfo.renderArea            = fullImage;
+
+    std::array<VkClearValue, 2> clearValues = {};
+    clearValues[0].color                    = {0.2f, 0.2f, 0.2f, 0.2f};  // Background color, in linear space
+    clearValues[1].depthStencil             = {1.0f, 0};                 // Clear depth
+    renderPassInfo.clearValueCount          = static_cast<uint32_t>(clearValues.size());
+    renderPassInfo.pClearValues             = clearValues.data();
+
+    vkCmdBeginRenderPass(cmdBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+    vkCmdExecuteCommands(cmdBuffer, 1, &secondaries[0]);
+    vkCmdEndRenderPass(cmdBuffer);
+  }
+
+  if(m_state.gpuCulling)
+  {
+    cullTransparent(cmdBuffer, numTransparent);
+  }
+
+  // Then the transparent objects, one tile at a time. The secondary command
+  // buffers set their own push constants, so this only records the clears.
+  for(uint32_t tileIndex = 0; tileIndex < numTiles; tileIndex++)
+  {
+    cmdRenderPassBarrierSimple(cmdBuffer);
+    clearTransparentBuffers(cmdBuffer, tileNeedsClear[tileIndex]);
+
+    VkRenderPassBeginInfo renderPassInfo = {VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO};
+    renderPassInfo.renderPass            = m_renderPassColorDepthLoad;
+    renderPassInfo.framebuffer           = m_mainColorDepthFramebuffer;
+    renderPassInfo.renderArea            = tiles[tileIndex];
+
+    vkCmdBeginRenderPass(cmdBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+    vkCmdExecuteCommands(cmdBuffer, 1, &secondaries[1 + tileIndex]);
+    vkCmdEndRenderPass(cmdBuffer);
+
+    if(m_state.algorithm == OIT_LINKEDLIST)
     {
-      // Bind the descriptor set (constant buffers, images)
-      // Pipeline layout depends only on descriptor set layout.
-      VkDescriptorSet descriptorSet = m_descriptorInfo.getSet(m_swapChain.getActiveImageIndex());
-      vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_descriptorInfo.getPipeLayout(), 0, 1,
-                              &descriptorSet, 0, nullptr);
+      copyLinkedListCounterToReadback(cmdBuffer, tileIndex);
+    }
+  }
+}
+
+VkCommandBuffer Sample::beginSecondary(uint32_t worker, VkRenderPass renderPass, const VkRect2D& tile, const PushConstants& pushConstants)
+{
+  VkCommandBufferInheritanceInfo inheritanceInfo = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO};
+  inheritanceInfo.renderPass                     = renderPass;
+  inheritanceInfo.subpass                        = 0;
+  inheritanceInfo.framebuffer                    = m_mainColorDepthFramebuffer;
+
+  VkCommandBuffer secondary = m_recordingCmdPools[worker].createCommandBuffer(
+      VK_COMMAND_BUFFER_LEVEL_SECONDARY, true,
+      VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT, &inheritanceInfo);
+
+  cmdBindDescriptorSet(secondary, VK_PIPELINE_BIND_POINT_GRAPHICS);
+  vkCmdSetScissor(secondary, 0, 1, &tile);
+  vkCmdPushConstants(secondary, m_descriptorInfo.getPipeLayout(), getSceneShaderStages(), 0, sizeof(PushConstants), &pushConstants);
+  return secondary;
+}
 
-      drawSceneObjects(cmdBuffer, numTransparent, numOpaque);
+std::vector<VkRect2D> Sample::getTiles() const
+{
+  std::vector<VkRect2D> tiles;
+  for(uint32_t tileY = 0; tileY < m_colorImage.c_height; tileY += m_oitTileExtent.height)
+  {
+    for(uint32_t tileX = 0; tileX < m_colorImage.c_width; tileX += m_oitTileExtent.width)
+    {
+      VkRect2D tile      = {};
+      tile.offset.x      = static_cast<int32_t>(tileX);
+      tile.offset.y      = static_cast<int32_t>(tileY);
+      tile.extent.width  = std::min(m_oitTileExtent.width, m_colorImage.c_width - tileX);
+      tile.extent.height = std::min(m_oitTileExtent.height, m_colorImage.c_height - tileY);
+      tiles.push_back(tile);
     }
+  }
+  return tiles;
+}
 
-    // Now, draw the transparent objects.
-    switch(m_state.algorithm)
+void Sample::cmdSetTile(VkCommandBuffer& cmdBuffer, const VkRect2D& tile)
+{
+  vkCmdSetScissor(cmdBuffer, 0, 1, &tile);
+  m_tile = tile;
+
+  m_pushConstants.tileOffset = glm::ivec2(tile.offset.x, tile.offset.y);
+  cmdPushConstants(cmdBuffer);
+}
+
+void Sample::cmdPushConstants(VkCommandBuffer& cmdBuffer)
+{
+  // The push constant range covers all stages, so we have to push to all of them.
+  vkCmdPushConstants(cmdBuffer, m_descriptorInfo.getPipeLayout(), getSceneShaderStages(), 0, sizeof(PushConstants), &m_pushConstants);
+}
+
+void Sample::cmdBindDescriptorSet(VkCommandBuffer cmdBuffer, VkPipelineBindPoint bindPoint)
+{
+  const uint32_t uniformOffset = static_cast<uint32_t>(m_ringFences.getCycleIndex() * m_uniformBufferStride);
+  vkCmdBindDescriptorSets(cmdBuffer, bindPoint, m_descriptorInfo.getPipeLayout(), 0, 1, &m_descriptorSet, 1, &uniformOffset);
+}
+
+void Sample::cullOpaque(VkCommandBuffer& cmdBuffer, int firstObject, int numObjects)
+{
+  const nvvk::ProfilerVK::Section scopedTimer(m_profilerVK, "CullOpaque", cmdBuffer);
+
+  // Wait for the previous frame's indirect draws and culling shaders before
+  // overwriting their inputs.
+  VkMemoryBarrier barrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,  //
+                       1, &barrier,                                                                 //
+                       0, VK_NULL_HANDLE,                                                           //
+                       0, VK_NULL_HANDLE);
+
+  // Reset the number of draw commands in each region, and the number of
+  // objects in each depth bucket.
+  vkCmdFillBuffer(cmdBuffer, m_drawCountsBuffer.buffer, 0, VK_WHOLE_SIZE, 0);
+  if(m_state.usesFrontToBack())
+  {
+    vkCmdFillBuffer(cmdBuffer, m_sortBucketsBuffer.buffer, 0, VK_WHOLE_SIZE, 0);
+  }
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,  //
+                       1, &barrier,                                                                         //
+                       0, VK_NULL_HANDLE,                                                                   //
+                       0, VK_NULL_HANDLE);
+
+  if(numObjects > 0)
+  {
+    m_pushConstants.cullFirstObject  = static_cast<uint32_t>(firstObject);
+    m_pushConstants.cullNumObjects   = static_cast<uint32_t>(numObjects);
+    m_pushConstants.cullRegion       = CULL_REGION_OPAQUE;
+    m_pushConstants.cullOcclusion    = 0;
+    m_pushConstants.indicesPerObject = m_objectTriangleIndices;
+    m_pushConstants.cullSort         = 0;
+    cmdPushConstants(cmdBuffer);
+
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineCull);
+    vkCmdDispatch(cmdBuffer, (numObjects + CULL_WORKGROUP_SIZE - 1) / CULL_WORKGROUP_SIZE, 1, 1);
+  }
+
+  // Make sure the draw commands are written before drawing the opaque objects.
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+  vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0,  //
+                       1, &barrier,                                                                              //
+                       0, VK_NULL_HANDLE,                                                                        //
+                       0, VK_NULL_HANDLE);
+}
+
+void Sample::cullTransparent(VkCommandBuffer& cmdBuffer, int numObjects)
+{
+  const nvvk::ProfilerVK::Section scopedTimer(m_profilerVK, "CullTransparent", cmdBuffer);
+
+  // Read the opaque objects' depth in the compute shader.
+  m_depthImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, VK_ACCESS_SHADER_READ_BIT);
+
+  // Build the Hi-Z pyramid one level at a time, each from the previous one.
+  VkMemoryBarrier barrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  barrier.srcAccessMask   = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask   = VK_ACCESS_SHADER_READ_BIT;
+
+  vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineHiz);
+  const uint32_t numLevels = static_cast<uint32_t>(m_hizLevelViews.size());
+  for(uint32_t level = 0; level < numLevels; level++)
+  {
+    const uint32_t levelWidth  = std::max(1u, m_depthImage.c_width >> level);
+    const uint32_t levelHeight = std::max(1u, m_depthImage.c_height >> level);
+
+    m_pushConstants.hizLevel     = level;
+    m_pushConstants.hizNumLevels = numLevels;
+    cmdPushConstants(cmdBuffer);
+    vkCmdDispatch(cmdBuffer, (levelWidth + HIZ_WORKGROUP_SIZE - 1) / HIZ_WORKGROUP_SIZE,
+                  (levelHeight + HIZ_WORKGROUP_SIZE - 1) / HIZ_WORKGROUP_SIZE, 1);
+
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,  //
+                         1, &barrier,                                                                               //
+                         0, VK_NULL_HANDLE,                                                                         //
+                         0, VK_NULL_HANDLE);
+  }
+
+  // Cull the transparent objects against the frustum and the pyramid.
+  if(numObjects > 0)
+  {
+    m_pushConstants.cullFirstObject  = 0;
+    m_pushConstants.cullNumObjects   = static_cast<uint32_t>(numObjects);
+    m_pushConstants.cullRegion       = CULL_REGION_TRANSPARENT;
+    m_pushConstants.cullOcclusion    = 1;
+    m_pushConstants.indicesPerObject = m_objectTriangleIndices;
+    m_pushConstants.cullSort         = (m_state.usesFrontToBack() ? 1 : 0);
+    cmdPushConstants(cmdBuffer);
+
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineCull);
+    vkCmdDispatch(cmdBuffer, (numObjects + CULL_WORKGROUP_SIZE - 1) / CULL_WORKGROUP_SIZE, 1, 1);
+
+    // Then sort the visible objects by depth bucket: compute where each
+    // bucket starts, and write each object's draw command into its bucket.
+    if(m_state.usesFrontToBack())
     {
-      case OIT_SIMPLE:
-        drawTransparentSimple(cmdBuffer, numTransparent);
-        break;
-      case OIT_LINKEDLIST:
-        drawTransparentLinkedList(cmdBuffer, numTransparent);
-        break;
-      case OIT_LOOP:
-        drawTransparentLoop(cmdBuffer, numTransparent);
-        break;
-      case OIT_LOOP64:
-        drawTransparentLoop64(cmdBuffer, numTransparent);
-        break;
-      case OIT_INTERLOCK:
-      case OIT_SPINLOCK:
-        drawTransparentLock(cmdBuffer, numTransparent, (m_state.algorithm == OIT_INTERLOCK));
-        break;
-      case OIT_WEIGHTED:
-        drawTransparentWeighted(cmdBuffer, numTransparent);
-        break;
-      default:
-        assert(!"Algorithm case not called in switch statement!");
+      barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+      vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,  //
+                           1, &barrier,                                                                               //
+                           0, VK_NULL_HANDLE,                                                                         //
+                           0, VK_NULL_HANDLE);
+      vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineCullScan);
+      vkCmdDispatch(cmdBuffer, 1, 1, 1);
+
+      vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,  //
+                           1, &barrier,                                                                               //
+                           0, VK_NULL_HANDLE,                                                                         //
+                           0, VK_NULL_HANDLE);
+      vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineCullScatter);
+      vkCmdDispatch(cmdBuffer, (numObjects + CULL_WORKGROUP_SIZE - 1) / CULL_WORKGROUP_SIZE, 1, 1);
     }
+  }
 
-    vkCmdEndRenderPass(cmdBuffer);
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+  vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0,  //
+                       1, &barrier,                                                                              //
+                       0, VK_NULL_HANDLE,                                                                        //
+                       0, VK_NULL_HANDLE);
+
+  // Use the depth buffer as an attachment again.
+  m_depthImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+                            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT);
+}
+
+void Sample::cmdDrawObjects(VkCommandBuffer& cmdBuffer, int firstObject, int numObjects, uint32_t cullRegion)
+{
+  if(m_state.usesMeshShaders())
+  {
+    if(numObjects <= 0)
+    {
+      return;
+    }
+
+    // sphere.task.glsl reads its range of objects from the push constants.
+    // We push only these instead of m_pushConstants, since the secondary
+    // command buffers of parallel recording share it.
+    const uint32_t meshConstants[] = {static_cast<uint32_t>(firstObject), static_cast<uint32_t>(numObjects), m_sceneSubdiv};
+    vkCmdPushConstants(cmdBuffer, m_descriptorInfo.getPipeLayout(), getSceneShaderStages(),
+                       offsetof(PushConstants, meshFirstObject), sizeof(meshConstants), meshConstants);
+
+    // One task workgroup per object, in rows of MESH_TASK_GROUPS_X.
+    const uint32_t groupsX = std::min(static_cast<uint32_t>(numObjects), static_cast<uint32_t>(MESH_TASK_GROUPS_X));
+    const uint32_t groupsY = (static_cast<uint32_t>(numObjects) + MESH_TASK_GROUPS_X - 1) / MESH_TASK_GROUPS_X;
+    vkCmdDrawMeshTasksEXT(cmdBuffer, groupsX, groupsY, 1);
+    return;
+  }
+
+  if(!m_state.gpuCulling)
+  {
+    if(m_sceneInstanced)
+    {
+      vkCmdDrawIndexed(cmdBuffer, m_objectTriangleIndices, numObjects, 0, 0, firstObject);
+    }
+    else
+    {
+      vkCmdDrawIndexed(cmdBuffer, numObjects * m_objectTriangleIndices, 1, firstObject * m_objectTriangleIndices, 0, 0);
+    }
+    return;
+  }
+
+  // Each region of m_drawCommandsBuffer starts at its first object.
+  vkCmdDrawIndexedIndirectCount(cmdBuffer,                                           // Command buffer
+                                m_drawCommandsBuffer.buffer,                         // Draw commands
+                                sizeof(VkDrawIndexedIndirectCommand) * firstObject,  // Offset of the region
+                                m_drawCountsBuffer.buffer,                           // Draw counts
+                                sizeof(uint32_t) * cullRegion,                       // Offset of the region's count
+                                static_cast<uint32_t>(numObjects),                   // Maximum draw count
+                                sizeof(VkDrawIndexedIndirectCommand));               // Stride
+}
+
+void Sample::compositeCompute(VkCommandBuffer& cmdBuffer)
+{
+  vkCmdEndRenderPass(cmdBuffer);
+
+  {
+    const nvvk::ProfilerVK::Section scopedTimer(m_profilerVK, "CompositeCompute", cmdBuffer);
+
+    // Make sure the color pass's A-buffer writes are visible, and that the
+    // previous tile's blend pass has finished reading m_oitCompositeImage.
+    VkMemoryBarrier barrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+    barrier.srcAccessMask   = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask   = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,  //
+                         1, &barrier,                                                                               //
+                         0, VK_NULL_HANDLE,                                                                         //
+                         0, VK_NULL_HANDLE);
+
+    // One invocation per pixel of the A-buffer, and one layer per sample with sample shading.
+    const LayerVariant* variant = getActiveLayerVariant();
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, (variant ? variant->composite : m_pipelineCompositeCompute));
+    vkCmdDispatch(cmdBuffer, (m_oitTileExtent.width + COMPOSITE_WORKGROUP_SIZE - 1) / COMPOSITE_WORKGROUP_SIZE,
+                  (m_oitTileExtent.height + COMPOSITE_WORKGROUP_SIZE - 1) / COMPOSITE_WORKGROUP_SIZE,
+                  m_oitCompositeImage.c_layers);
+
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,  //
+                         1, &barrier,                                                                               //
+                         0, VK_NULL_HANDLE,                                                                         //
+                         0, VK_NULL_HANDLE);
+  }
+
+  // Continue with the same attachments and render area, and blend the result
+  // onto m_colorImage.
+  cmdRenderPassBarrierSimple(cmdBuffer);
+
+  VkRenderPassBeginInfo renderPassInfo = {VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO};
+  renderPassInfo.renderPass            = m_renderPassColorDepthLoad;
+  renderPassInfo.framebuffer           = m_mainColorDepthFramebuffer;
+  renderPassInfo.renderArea            = m_tile;
+  vkCmdBeginRenderPass(cmdBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+  vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineCompositeBlend);
+  // Draw a full-screen triangle
+  vkCmdDraw(cmdBuffer, 3, 1, 0, 0);
+}
+
+void Sample::clearTransparent(VkCommandBuffer& cmdBuffer)
+{
+  const bool needsClear = advanceFrameTag();
+  if(m_state.usesFrameTags())
+  {
+    cmdPushConstants(cmdBuffer);
+  }
+  clearTransparentBuffers(cmdBuffer, needsClear);
+}
+
+bool Sample::advanceFrameTag()
+{
+  if(!m_state.usesFrameTags())
+  {
+    return true;
+  }
+
+  // Advancing the tag makes the shaders treat everything written so far as
+  // empty. This needs a full clear after the last tag, after the renderer
+  // was rebuilt, and when the layer count changes, since that changes
+  // where the Loop algorithms look for their depths.
+  if((m_frameTag != 0) && (m_frameTag < FRAME_TAG_MAX) && (m_frameTagLayers == m_activeLayers))
+  {
+    m_frameTag++;
+    m_pushConstants.frameTag = m_frameTag;
+    return false;
+  }
+
+  m_frameTag               = 1;
+  m_frameTagLayers         = m_activeLayers;
+  m_pushConstants.frameTag = m_frameTag;
+  return true;
+}
+
+void Sample::clearTransparentBuffers(VkCommandBuffer& cmdBuffer, bool fullClear)
+{
+  if(!fullClear)
+  {
+    // The early depth test of the lock algorithms compares against full
+    // 32-bit A-buffer depths, which leave no room for a tag.
+    if((m_state.algorithm == OIT_INTERLOCK) || (m_state.algorithm == OIT_SPINLOCK))
+    {
+      clearTransparentLockDepth(cmdBuffer);
+    }
+    return;
+  }
+
+  switch(m_state.algorithm)
+  {
+    case OIT_SIMPLE:
+      clearTransparentSimple(cmdBuffer);
+      break;
+    case OIT_LINKEDLIST:
+      clearTransparentLinkedList(cmdBuffer);
+      break;
+    case OIT_LOOP:
+      clearTransparentLoop(cmdBuffer);
+      break;
+    case OIT_LOOP64:
+      clearTransparentLoop64(cmdBuffer);
+      break;
+    case OIT_INTERLOCK:
+    case OIT_SPINLOCK:
+      clearTransparentLock(cmdBuffer, (m_state.algorithm == OIT_INTERLOCK));
+      break;
+    case OIT_WEIGHTED:
+    case OIT_MOMENTS:
+      // Their render passes clear OIT_WEIGHTED and OIT_MOMENTS for us
+      break;
+    default:
+      assert(!"Algorithm case not called in switch statement!");
+  }
+}
+
+void Sample::cmdNextTransparentPass(VkCommandBuffer& cmdBuffer)
+{
+  if(m_state.usesTransparentSubpasses())
+  {
+    // The subpass dependencies of m_renderPassTransparent order the passes.
+    vkCmdNextSubpass(cmdBuffer, VK_SUBPASS_CONTENTS_INLINE);
+  }
+  else
+  {
+    cmdFragmentBarrierSimple(cmdBuffer, getFragmentDependencyFlags());
+  }
+}
+
+void Sample::drawTransparent(VkCommandBuffer& cmdBuffer, int numObjects)
+{
+  switch(m_state.algorithm)
+  {
+    case OIT_SIMPLE:
+      drawTransparentSimple(cmdBuffer, numObjects);
+      break;
+    case OIT_LINKEDLIST:
+      drawTransparentLinkedList(cmdBuffer, numObjects);
+      break;
+    case OIT_LOOP:
+      drawTransparentLoop(cmdBuffer, numObjects);
+      break;
+    case OIT_LOOP64:
+      drawTransparentLoop64(cmdBuffer, numObjects);
+      break;
+    case OIT_INTERLOCK:
+    case OIT_SPINLOCK:
+      drawTransparentLock(cmdBuffer, numObjects, (m_state.algorithm == OIT_INTERLOCK));
+      break;
+    case OIT_WEIGHTED:
+      drawTransparentWeighted(cmdBuffer, numObjects);
+      break;
+    case OIT_MOMENTS:
+      drawTransparentMoments(cmdBuffer, numObjects);
+      break;
+    default:
+      assert(!"Algorithm case not called in switch statement!");
   }
 }
 
 void Sample::drawSceneObjects(VkCommandBuffer& cmdBuffer, int firstObject, int numObjects)
 {
-  // Bind the vertex and index buffers
-  VkBuffer     vertexBuffers[] = {m_vertexBuffer.buffer};
-  VkDeviceSize offsets[]       = {0};
-  vkCmdBindVertexBuffers(cmdBuffer, 0, 1, vertexBuffers, offsets);
+  // Bind the vertex and index buffers, and the instanced scene's per-instance
+  // bounding spheres and colors
+  VkBuffer     vertexBuffers[] = {m_vertexBuffer.buffer, m_objectBoundsBuffer.buffer, m_instanceColorBuffer.buffer};
+  VkDeviceSize offsets[]       = {0, 0, 0};
+  vkCmdBindVertexBuffers(cmdBuffer, 0, (m_sceneInstanced ? 3 : 1), vertexBuffers, offsets);
 
   vkCmdBindIndexBuffer(cmdBuffer, m_indexBuffer.buffer, 0, VK_INDEX_TYPE_UINT32);
 
@@ -144,7 +721,7 @@ void Sample::drawSceneObjects(VkCommandBuffer& cmdBuffer, int firstObject, int n
   vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineOpaque);
 
   // Draw!
-  vkCmdDrawIndexed(cmdBuffer, numObjects * m_objectTriangleIndices, 1, firstObject * m_objectTriangleIndices, 0, 0);
+  cmdDrawObjects(cmdBuffer, firstObject, numObjects, CULL_REGION_OPAQUE);
 }
 
 void Sample::clearTransparentSimple(VkCommandBuffer& cmdBuffer)
@@ -175,22 +752,30 @@ void Sample::clearTransparentSimple(VkCommandBuffer& cmdBuffer)
 
 void Sample::drawTransparentSimple(VkCommandBuffer& cmdBuffer, int numObjects)
 {
+  // With adaptive layer counts, this frame may use pipelines with fewer layers.
+  const LayerVariant* variant = getActiveLayerVariant();
+
   // COLOR
   // Stores the first OIT_LAYERS fragments per pixel or sample in the A-buffer,
   // and tail-blends the rest.
   {
-    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineSimpleColor);
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, (variant ? variant->color : m_pipelineSimpleColor));
     // Draw all objects
-    vkCmdDrawIndexed(cmdBuffer, numObjects * m_objectTriangleIndices, 1, 0, 0, 0);
+    cmdDrawObjects(cmdBuffer, 0, numObjects, CULL_REGION_TRANSPARENT);
   }
 
   // Make sure the color pass completes before the composite pass
-  cmdFragmentBarrierSimple(cmdBuffer);
+  cmdNextTransparentPass(cmdBuffer);
 
   // COMPOSITE
   // Sorts the stored fragments per pixel or sample and composites them onto the color image.
+  if(m_state.usesComputeComposite())
   {
-    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineSimpleComposite);
+    compositeCompute(cmdBuffer);
+  }
+  else
+  {
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, (variant ? variant->composite : m_pipelineSimpleComposite));
     // Draw a full-screen triangle:
     vkCmdDraw(cmdBuffer, 3, 1, 0, 0);
   }
@@ -224,11 +809,11 @@ void Sample::drawTransparentLinkedList(VkCommandBuffer& cmdBuffer, int numObject
   {
     vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLinkedListColor);
     // Draw all objects
-    vkCmdDrawIndexed(cmdBuffer, numObjects * m_objectTriangleIndices, 1, 0, 0, 0);
+    cmdDrawObjects(cmdBuffer, 0, numObjects, CULL_REGION_TRANSPARENT);
   }
 
   // Make sure the color pass completes before the composite pass
-  cmdFragmentBarrierSimple(cmdBuffer);
+  cmdNextTransparentPass(cmdBuffer);
 
   // COMPOSITE
   // Iterates through the linked lists and sorts and tail-blends fragments.
@@ -239,6 +824,150 @@ void Sample::drawTransparentLinkedList(VkCommandBuffer& cmdBuffer, int numObject
   }
 }
 
+void Sample::copyLinkedListCounterToReadback(VkCommandBuffer& cmdBuffer, uint32_t tileIndex)
+{
+  const uint32_t slot = m_ringFences.getCycleIndex();
+
+  // Make sure the color pass's atomics complete before the copy.
+  VkMemoryBarrier barrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  barrier.srcAccessMask   = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask   = VK_ACCESS_TRANSFER_READ_BIT;
+  vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,  //
+                       1, &barrier,                                                                        //
+                       0, VK_NULL_HANDLE,                                                                  //
+                       0, VK_NULL_HANDLE);
+
+  VkBufferImageCopy region           = {};
+  region.bufferOffset                = m_oitCounterReadback.getOffset(slot) + sizeof(uint32_t) * tileIndex;
+  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.imageSubresource.layerCount = 1;
+  region.imageExtent                 = {1, 1, 1};
+  vkCmdCopyImageToBuffer(cmdBuffer, m_oitCounterImage.image.image, m_oitCounterImage.currentLayout,
+                         m_oitCounterReadback.buffer.buffer, 1, &region);
+
+  // Make the result visible to the host, and make sure the copy finishes
+  // before the next frame clears the counter.
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_HOST_BIT, 0,  //
+                       1, &barrier,                                                                                           //
+                       0, VK_NULL_HANDLE,                                                                                     //
+                       0, VK_NULL_HANDLE);
+
+  m_oitCounterReadback.markWritten(slot, m_frame);
+}
+
+void Sample::clearFragmentStats(VkCommandBuffer& cmdBuffer)
+{
+  if(!m_state.countsFragments())
+  {
+    return;
+  }
+
+  // Wait for the previous frame's reduction, heatmap, and readback copy before
+  // overwriting their inputs.
+  VkMemoryBarrier barrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  vkCmdPipelineBarrier(cmdBuffer,
+                       VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0,  //
+                       1, &barrier,                        //
+                       0, VK_NULL_HANDLE,                  //
+                       0, VK_NULL_HANDLE);
+
+  VkClearColorValue clearColor;
+  clearColor.uint32[0] = 0;  // Since m_fragmentStatsImage is R32UINT
+  VkImageSubresourceRange clearRange;
+  clearRange.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT;
+  clearRange.baseArrayLayer = 0;
+  clearRange.baseMipLevel   = 0;
+  clearRange.layerCount     = m_fragmentStatsImage.c_layers;
+  clearRange.levelCount     = 1;
+  vkCmdClearColorImage(cmdBuffer, m_fragmentStatsImage.image.image, VK_IMAGE_LAYOUT_GENERAL, &clearColor, 1, &clearRange);
+  vkCmdFillBuffer(cmdBuffer, m_fragmentStatsBuffer.buffer, 0, VK_WHOLE_SIZE, 0);
+
+  // The color passes write the image, and the reduction the buffer.
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,  //
+                       1, &barrier,                                                                      //
+                       0, VK_NULL_HANDLE,                                                                //
+                       0, VK_NULL_HANDLE);
+}
+
+void Sample::finishFragmentStats(VkCommandBuffer& cmdBuffer)
+{
+  if(!m_state.countsFragments())
+  {
+    return;
+  }
+
+  const uint32_t slot = m_ringFences.getCycleIndex();
+
+  {
+    const nvvk::ProfilerVK::Section scopedTimer(m_profilerVK, "FragmentStats", cmdBuffer);
+
+    // Make sure the color and composite passes' counts are visible.
+    VkMemoryBarrier barrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+    barrier.srcAccessMask   = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask   = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,  //
+                         1, &barrier,                                                                      //
+                         0, VK_NULL_HANDLE,                                                                //
+                         0, VK_NULL_HANDLE);
+
+    // One invocation per pixel of m_colorImage.
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineFragmentStats);
+    vkCmdDispatch(cmdBuffer, (m_fragmentStatsImage.c_width + STATS_WORKGROUP_SIZE - 1) / STATS_WORKGROUP_SIZE,
+                  (m_fragmentStatsImage.c_height + STATS_WORKGROUP_SIZE - 1) / STATS_WORKGROUP_SIZE, 1);
+
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,  //
+                         1, &barrier,                                                                       //
+                         0, VK_NULL_HANDLE,                                                                 //
+                         0, VK_NULL_HANDLE);
+
+    VkBufferCopy region = {};
+    region.dstOffset    = m_fragmentStatsReadback.getOffset(slot);
+    region.size         = sizeof(FragmentStats);
+    vkCmdCopyBuffer(cmdBuffer, m_fragmentStatsBuffer.buffer, m_fragmentStatsReadback.buffer.buffer, 1, &region);
+
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,  //
+                         1, &barrier,                                                             //
+                         0, VK_NULL_HANDLE,                                                       //
+                         0, VK_NULL_HANDLE);
+
+    m_fragmentStatsReadback.markWritten(slot, m_frame);
+  }
+
+  if(m_state.fragmentStats && m_state.fragmentHeatmap)
+  {
+    // The scissor rectangle may still be set to the last tile.
+    VkRect2D fullImage      = {};
+    fullImage.extent.width  = m_colorImage.c_width;
+    fullImage.extent.height = m_colorImage.c_height;
+    cmdSetTile(cmdBuffer, fullImage);
+
+    cmdRenderPassBarrierSimple(cmdBuffer);
+
+    VkRenderPassBeginInfo renderPassInfo = {VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO};
+    renderPassInfo.renderPass            = m_renderPassColorDepthLoad;
+    renderPassInfo.framebuffer           = m_mainColorDepthFramebuffer;
+    renderPassInfo.renderArea            = fullImage;
+    vkCmdBeginRenderPass(cmdBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineFragmentHeatmap);
+    // Draw a full-screen triangle
+    vkCmdDraw(cmdBuffer, 3, 1, 0, 0);
+
+    vkCmdEndRenderPass(cmdBuffer);
+  }
+}
+
 void Sample::clearTransparentLoop(VkCommandBuffer& cmdBuffer)
 {
   // Set all depth values in m_oitABuffer to 0xFFFFFFFF.
@@ -248,15 +977,25 @@ void Sample::clearTransparentLoop(VkCommandBuffer& cmdBuffer)
   // should improve bandwidth. See the memory layout described in oitScene.frag.glsl
   // for more information.
 
-  const size_t clearSize = m_sceneUbo.viewport.z * sizeof(uint32_t) * m_state.oitLayers;
-
-  for(size_t i = 0; i < (m_state.sampleShading ? m_state.msaa : 1); i++)
+  // The layout depends on the number of layers this frame uses (see updateAdaptiveLayers).
+  // With ABUFFER_LAYOUT_PIXELS, depths and colors alternate per pixel, so
+  // this clears the whole A-buffer instead.
+  if(m_state.activeABufferLayout() == ABUFFER_LAYOUT_PIXELS)
   {
-    vkCmdFillBuffer(cmdBuffer,                   // Command buffer
-                    m_oitABuffer.buffer.buffer,  // Buffer
-                    i * clearSize * 2,           // Offset
-                    clearSize,                   // Size
-                    0xFFFFFFFFu);                // Data
+    vkCmdFillBuffer(cmdBuffer, m_oitABuffer.buffer.buffer, 0, VK_WHOLE_SIZE, 0xFFFFFFFFu);
+  }
+  else
+  {
+    const size_t clearSize = m_sceneUbo.viewport.z * sizeof(uint32_t) * m_activeLayers;
+
+    for(size_t i = 0; i < m_state.numABufferPlanes(); i++)
+    {
+      vkCmdFillBuffer(cmdBuffer,                   // Command buffer
+                      m_oitABuffer.buffer.buffer,  // Buffer
+                      i * clearSize * 2,           // Offset
+                      clearSize,                   // Size
+                      0xFFFFFFFFu);                // Data
+    }
   }
 
   // Make sure this completes before using m_oitABuffer again.
@@ -265,32 +1004,34 @@ void Sample::clearTransparentLoop(VkCommandBuffer& cmdBuffer)
 
 void Sample::drawTransparentLoop(VkCommandBuffer& cmdBuffer, int numObjects)
 {
+  const LayerVariant* variant = getActiveLayerVariant();
+
   // DEPTH
   // Sorts the frontmost OIT_LAYERS depths per sample.
   {
-    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLoopDepth);
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, (variant ? variant->depth : m_pipelineLoopDepth));
     // Draw all objects
-    vkCmdDrawIndexed(cmdBuffer, numObjects * m_objectTriangleIndices, 1, 0, 0, 0);
+    cmdDrawObjects(cmdBuffer, 0, numObjects, CULL_REGION_TRANSPARENT);
   }
 
   // Make sure the depth pass completes before the composite pass
-  cmdFragmentBarrierSimple(cmdBuffer);
+  cmdNextTransparentPass(cmdBuffer);
 
   // COLOR
   // Uses the sorted depth information to sort colors into layers
   {
-    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLoopColor);
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, (variant ? variant->color : m_pipelineLoopColor));
     // Draw all objects
-    vkCmdDrawIndexed(cmdBuffer, numObjects * m_objectTriangleIndices, 1, 0, 0, 0);
+    cmdDrawObjects(cmdBuffer, 0, numObjects, CULL_REGION_TRANSPARENT);
   }
 
   // Make sure the color pass completes before the composite pass
-  cmdFragmentBarrierSimple(cmdBuffer);
+  cmdNextTransparentPass(cmdBuffer);
 
   // COMPOSITE
   // Blends the sorted colors together.
   {
-    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLoopComposite);
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, (variant ? variant->composite : m_pipelineLoopComposite));
     // Draw a full-screen triangle
     vkCmdDraw(cmdBuffer, 3, 1, 0, 0);
   }
@@ -308,21 +1049,23 @@ void Sample::clearTransparentLoop64(VkCommandBuffer& cmdBuffer)
 
 void Sample::drawTransparentLoop64(VkCommandBuffer& cmdBuffer, int numObjects)
 {
+  const LayerVariant* variant = getActiveLayerVariant();
+
   // (DEPTH +) COLOR
   // Sorts the frontmost OIT_LAYERS (depth, color) pairs per sample.
   {
-    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLoop64Color);
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, (variant ? variant->color : m_pipelineLoop64Color));
     // Draw all objects
-    vkCmdDrawIndexed(cmdBuffer, numObjects * m_objectTriangleIndices, 1, 0, 0, 0);
+    cmdDrawObjects(cmdBuffer, 0, numObjects, CULL_REGION_TRANSPARENT);
   }
 
   // Make sure the depth + color pass completes before the composite pass
-  cmdFragmentBarrierSimple(cmdBuffer);
+  cmdNextTransparentPass(cmdBuffer);
 
   // COMPOSITE
   // Blends the sorted colors together
   {
-    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLoop64Composite);
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, (variant ? variant->composite : m_pipelineLoop64Composite));
     // Draw a full-screen triangle
     vkCmdDraw(cmdBuffer, 3, 1, 0, 0);
   }
@@ -355,24 +1098,50 @@ void Sample::clearTransparentLock(VkCommandBuffer& cmdBuffer, bool useInterlock)
   cmdTransferBarrierSimple(cmdBuffer);
 }
 
+void Sample::clearTransparentLockDepth(VkCommandBuffer& cmdBuffer)
+{
+  // Sets the values in IMG_AUXDEPTH to 0xFFFFFFFF.
+  const nvvk::ProfilerVK::Section scopedTimer(m_profilerVK, "ClearLockDepth", cmdBuffer);
+
+  VkClearColorValue auxClearColorF;
+  auxClearColorF.uint32[0] = 0xFFFFFFFFu;
+  VkImageSubresourceRange auxClearRanges;
+  auxClearRanges.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT;
+  auxClearRanges.baseArrayLayer = 0;
+  auxClearRanges.baseMipLevel   = 0;
+  auxClearRanges.layerCount     = m_oitAuxDepthImage.c_layers;
+  auxClearRanges.levelCount     = 1;
+
+  vkCmdClearColorImage(cmdBuffer, m_oitAuxDepthImage.image.image, m_oitAuxDepthImage.currentLayout, &auxClearColorF, 1, &auxClearRanges);
+  cmdTransferBarrierSimple(cmdBuffer);
+}
+
 void Sample::drawTransparentLock(VkCommandBuffer& cmdBuffer, int numObjects, bool useInterlock)
 {
+  const LayerVariant* variant = getActiveLayerVariant();
+
   // COLOR
   // Sorts the frontmost OIT_LAYERS (depth, color) pairs per pixel.
   {
-    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, (useInterlock ? m_pipelineInterlockColor : m_pipelineSpinlockColor));
+    VkPipeline colorPipeline = (useInterlock ? m_pipelineInterlockColor : m_pipelineSpinlockColor);
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, (variant ? variant->color : colorPipeline));
     // Draw all objects
-    vkCmdDrawIndexed(cmdBuffer, numObjects * m_objectTriangleIndices, 1, 0, 0, 0);
+    cmdDrawObjects(cmdBuffer, 0, numObjects, CULL_REGION_TRANSPARENT);
   }
 
   // Make sure the color pass completes before the composite pass
-  cmdFragmentBarrierSimple(cmdBuffer);
+  cmdNextTransparentPass(cmdBuffer);
 
   // COMPOSITE
   // Blends the sorted colors together
+  if(m_state.usesComputeComposite())
+  {
+    compositeCompute(cmdBuffer);
+  }
+  else
   {
-    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                      (useInterlock ? m_pipelineInterlockComposite : m_pipelineSpinlockComposite));
+    VkPipeline compositePipeline = (useInterlock ? m_pipelineInterlockComposite : m_pipelineSpinlockComposite);
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, (variant ? variant->composite : compositePipeline));
     // Draw a full-screen triangle
     vkCmdDraw(cmdBuffer, 3, 1, 0, 0);
   }
@@ -409,7 +1178,7 @@ void Sample::drawTransparentWeighted(VkCommandBuffer& cmdBuffer, int numObjects)
   {
     vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineWeightedColor);
     // Draw all objects
-    vkCmdDrawIndexed(cmdBuffer, numObjects * m_objectTriangleIndices, 1, 0, 0, 0);
+    cmdDrawObjects(cmdBuffer, 0, numObjects, CULL_REGION_TRANSPARENT);
   }
 
   // Move to the next subpass
@@ -421,4 +1190,53 @@ void Sample::drawTransparentWeighted(VkCommandBuffer& cmdBuffer, int numObjects)
     // Draw a full-screen triangle
     vkCmdDraw(cmdBuffer, 3, 1, 0, 0);
   }
-}
\ No newline at end of file
+}
+
+void Sample::drawTransparentMoments(VkCommandBuffer& cmdBuffer, int numObjects)
+{
+  // Swap out the render pass for MBOIT's render pass
+  vkCmdEndRenderPass(cmdBuffer);
+
+  // Transition the color image to work as an attachment
+  m_colorImage.transitionTo(cmdBuffer, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                            VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
+
+  VkRenderPassBeginInfo renderPassInfo    = {VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO};
+  renderPassInfo.renderPass               = m_renderPassMoments;
+  renderPassInfo.framebuffer              = m_momentsFramebuffer;
+  renderPassInfo.renderArea.offset        = {0, 0};
+  renderPassInfo.renderArea.extent.width  = m_oitMomentsImage.c_width;
+  renderPassInfo.renderArea.extent.height = m_oitMomentsImage.c_height;
+  // The moments, zeroth moment, and accumulated color all start at 0.
+  std::array<VkClearValue, 3> clearValues{};
+  renderPassInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
+  renderPassInfo.pClearValues    = clearValues.data();
+
+  vkCmdBeginRenderPass(cmdBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+  // DEPTH PASS
+  // Sums up the absorbance of the fragments and its power moments.
+  {
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineMomentsDepth);
+    // Draw all objects
+    cmdDrawObjects(cmdBuffer, 0, numObjects, CULL_REGION_TRANSPARENT);
+  }
+
+  vkCmdNextSubpass(cmdBuffer, VK_SUBPASS_CONTENTS_INLINE);
+  // COLOR PASS
+  // Sums up the fragments' colors, weighted by their estimated transmittance.
+  {
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineMomentsColor);
+    // Draw all objects
+    cmdDrawObjects(cmdBuffer, 0, numObjects, CULL_REGION_TRANSPARENT);
+  }
+
+  vkCmdNextSubpass(cmdBuffer, VK_SUBPASS_CONTENTS_INLINE);
+  // COMPOSITE PASS
+  // Normalizes the accumulated color and blends it onto the image.
+  {
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineMomentsComposite);
+    // Draw a full-screen triangle
+    vkCmdDraw(cmdBuffer, 3, 1, 0, 0);
+  }
+}
@@ -0,0 +1,472 @@
+/*
+ * Copyright (c) 2020-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2020-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Contains the shader system and its on-disk caches. Compiling GLSL at
+// runtime and creating pipelines without a VkPipelineCache can take hundreds
+// of milliseconds whenever the algorithm or antialiasing mode changes. To
+// avoid this, createOrReloadShaderModule stores each shader module it compiles
+// as a SPIR-V file named after a hash of the driver, the defines from
+// getShaderDefinitions, and the shader's source code, and loads that file
+// instead of compiling when it exists. The VkPipelineCache is loaded when the
+// sample starts and saved when it closes. With -oitprecompile 1, a background
+// thread fills the SPIR-V cache with the shaders of every algorithm, number of
+// layers, and antialiasing mode, so that switching between them later only
+// needs to load SPIR-V.
+
+#include "oit.h"
+
+#include <nvh/nvprint.hpp>
+#include <nvp/nvpsystem.hpp>
+#include <nvvk/error_vk.hpp>
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <set>
+#include <sstream>
+
+// Files that shaders include, relative to the shader directories.
+static const char* const SHADER_INCLUDES[] = {"common.h", "oitColorDepthDefines.glsl", "oitCompositeDefines.glsl",
+                                              "oitStats.glsl", "shaderCommon.glsl", "sphereMesh.glsl"};
+
+static const char* const PIPELINE_CACHE_FILENAME = "pipelines.bin";
+
+// 64-bit FNV-1a hash; hashes are chained by passing the previous result as `hash`.
+static const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+
+static uint64_t hashFNV1a(uint64_t hash, const void* data, size_t size)
+{
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  for(size_t i = 0; i < size; i++)
+  {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// Hashes a string followed by a terminator, so that e.g. ("ab", "c") and
+// ("a", "bc") hash differently.
+static uint64_t hashFNV1a(uint64_t hash, const std::string& text)
+{
+  hash = hashFNV1a(hash, text.data(), text.size());
+  return hashFNV1a(hash, "", 1);
+}
+
+// Reads the first file with this name in one of the directories; returns an
+// empty string if there isn't one.
+static std::string readShaderFile(const std::vector<std::string>& directories, const std::string& filename)
+{
+  for(const std::string& directory : directories)
+  {
+    std::ifstream file(directory + "/" + filename, std::ios::binary);
+    if(file.is_open())
+    {
+      std::stringstream contents;
+      contents << file.rdbuf();
+      return contents.str();
+    }
+  }
+  return std::string();
+}
+
+// Writes to a temporary file and then renames it, so that other threads and
+// later runs never see a partially written file.
+static bool writeFileAtomically(const std::string& filename, const void* data, size_t size)
+{
+  std::ostringstream tempFilename;
+  tempFilename << filename << "." << std::this_thread::get_id() << ".tmp";
+  {
+    std::ofstream file(tempFilename.str(), std::ios::binary | std::ios::trunc);
+    if(!file.is_open())
+    {
+      return false;
+    }
+    file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+    if(!file.good())
+    {
+      return false;
+    }
+  }
+
+  std::error_code error;
+  std::filesystem::rename(tempFilename.str(), filename, error);
+  if(error)
+  {
+    std::filesystem::remove(tempFilename.str(), error);
+    return false;
+  }
+  return true;
+}
+
+void Sample::initShaderSystem()
+{
+  // Add search paths for files and includes
+  m_shaderDirectories = {
+      "GLSL_" PROJECT_NAME,  // For when running in the install directory
+      ".",
+      NVPSystem::exePath() + PROJECT_RELDIRECTORY,
+      NVPSystem::exePath() + PROJECT_RELDIRECTORY + "..",
+      "..",                              // for when working directory in Debug is $(ProjectDir)
+      "../..",                           // for when using $(TargetDir)
+      "../shipped/" PROJECT_NAME,        // For when running from the bin_x64 directory on Linux
+      "../../shipped/" PROJECT_NAME,     // for when using $(TargetDir)
+      "../../../shipped/" PROJECT_NAME,  // for when using $(TargetDir) and build_all
+  };
+
+  // The driver's pipeline cache UUID changes whenever its compiler does, so we
+  // include it in every cache key (as well as the device and driver version).
+  {
+    const VkPhysicalDeviceProperties& properties = m_context.m_physicalInfo.properties10;
+    std::ostringstream                key;
+    key << std::hex << properties.vendorID << "-" << properties.deviceID << "-" << properties.driverVersion << "-";
+    for(uint8_t byte : properties.pipelineCacheUUID)
+    {
+      key << std::setw(2) << std::setfill('0') << static_cast<uint32_t>(byte);
+    }
+    m_shaderCacheDeviceKey = key.str();
+  }
+
+  m_shaderCacheDirectory.clear();
+  if(m_shaderCacheEnabled)
+  {
+    const std::string directory = NVPSystem::exePath() + "oit_cache";
+    std::error_code   error;
+    std::filesystem::create_directories(directory, error);
+    if(error)
+    {
+      LOGE("Could not create the shader cache directory %s; shaders won't be cached.\n", directory.c_str());
+    }
+    else
+    {
+      m_shaderCacheDirectory = directory + "/";
+    }
+  }
+
+  // Initialize shader system (this keeps track of shaders so that you can reload all of them at once):
+  initShaderModuleManager(m_shaderModuleManager);
+
+  createPipelineCache();
+}
+
+void Sample::initShaderModuleManager(nvvk::ShaderModuleManager& manager)
+{
+  // Mesh shaders need SPIR-V 1.4, so target the context's Vulkan version.
+  manager.init(m_context, m_contextInfo.apiMajor, m_contextInfo.apiMinor);
+  for(const std::string& directory : m_shaderDirectories)
+  {
+    manager.addDirectory(directory);
+  }
+  if(!m_shaderCacheDirectory.empty())
+  {
+    // So that cached SPIR-V files can be loaded by name
+    manager.addDirectory(m_shaderCacheDirectory);
+    // So that we can write compiled modules to the cache
+    manager.m_keepModuleSPIRV = true;
+  }
+  // We have to manually set up paths to files we could include.
+  for(const char* include : SHADER_INCLUDES)
+  {
+    manager.registerInclude(include);
+  }
+}
+
+uint64_t Sample::hashShaderIncludes() const
+{
+  uint64_t hash = FNV_OFFSET_BASIS;
+  for(const char* include : SHADER_INCLUDES)
+  {
+    hash = hashFNV1a(hash, readShaderFile(m_shaderDirectories, include));
+  }
+  return hash;
+}
+
+uint64_t Sample::hashShaderSources(const std::string& filename, uint64_t includesHash) const
+{
+  const uint64_t hash = hashFNV1a(FNV_OFFSET_BASIS, readShaderFile(m_shaderDirectories, filename));
+  return hashFNV1a(hash, &includesHash, sizeof(includesHash));
+}
+
+std::string Sample::getShaderCacheFilename(VkShaderStageFlags shaderStage,
+                                           const std::string& filename,
+                                           const std::string& prepend,
+                                           const std::string& definitions,
+                                           uint64_t           sourceHash) const
+{
+  uint64_t hash = hashFNV1a(FNV_OFFSET_BASIS, m_shaderCacheDeviceKey);
+  hash          = hashFNV1a(hash, definitions);
+  hash          = hashFNV1a(hash, prepend);
+  hash          = hashFNV1a(hash, filename);
+  hash          = hashFNV1a(hash, &shaderStage, sizeof(shaderStage));
+  hash          = hashFNV1a(hash, &sourceHash, sizeof(sourceHash));
+
+  char cacheFilename[32];
+  snprintf(cacheFilename, sizeof(cacheFilename), "%016llx.spv", static_cast<unsigned long long>(hash));
+  return cacheFilename;
+}
+
+bool Sample::writeShaderCacheFile(nvvk::ShaderModuleManager& manager, nvvk::ShaderModuleID shaderModule, const std::string& cacheFilename) const
+{
+  size_t      codeSize = 0;
+  const char* code     = manager.getCode(shaderModule, &codeSize);
+  if(code == nullptr || codeSize == 0)
+  {
+    return false;
+  }
+  return writeFileAtomically(m_shaderCacheDirectory + cacheFilename, code, codeSize);
+}
+
+void Sample::createOrReloadShaderModule(nvvk::ShaderModuleID& shaderModule,
+                                        VkShaderStageFlags    shaderStage,
+                                        const std::string&    filename,
+                                        const std::string&    prepend)
+{
+  if(m_shaderCacheDirectory.empty())
+  {
+    if(shaderModule.isValid())
+    {
+      // Reload and recompile this module from source.
+      m_shaderModuleManager.reloadModule(shaderModule);
+    }
+    else
+    {
+      // Register and compile the shader module with the shader module manager.
+      shaderModule = m_shaderModuleManager.createShaderModule(shaderStage, filename, prepend);
+    }
+  }
+  else
+  {
+    // The module's defines usually changed, so it has a different cache entry;
+    // replace it instead of reloading it.
+    if(shaderModule.isValid())
+    {
+      m_shaderModuleManager.destroyShaderModule(shaderModule);
+      shaderModule = nvvk::ShaderModuleID();
+    }
+
+    const std::string cacheFilename = getShaderCacheFilename(shaderStage, filename, prepend, m_shaderModuleManager.m_prepend,
+                                                             hashShaderSources(filename, m_shaderIncludesHash));
+    std::error_code   error;
+    if(std::filesystem::exists(m_shaderCacheDirectory + cacheFilename, error))
+    {
+      shaderModule = m_shaderModuleManager.createShaderModule(shaderStage, cacheFilename, "", nvh::ShaderFileManager::FILETYPE_SPIRV);
+      if(!m_shaderModuleManager.isValid(shaderModule))
+      {
+        LOGE("Could not load cached shader %s for %s; recompiling it.\n", cacheFilename.c_str(), filename.c_str());
+        m_shaderModuleManager.destroyShaderModule(shaderModule);
+        shaderModule = nvvk::ShaderModuleID();
+      }
+    }
+
+    if(!shaderModule.isValid())
+    {
+      // Cache miss: compile the shader module as usual, then store its SPIR-V.
+      shaderModule = m_shaderModuleManager.createShaderModule(shaderStage, filename, prepend);
+      if(m_shaderModuleManager.isValid(shaderModule) && !writeShaderCacheFile(m_shaderModuleManager, shaderModule, cacheFilename))
+      {
+        LOGE("Could not write cached shader %s.\n", cacheFilename.c_str());
+      }
+    }
+  }
+  assert(shaderModule.isValid());
+#ifdef _DEBUG
+  std::string generatedShaderName = filename + " " + prepend;
+  m_debug.setObjectName(m_shaderModuleManager.get(shaderModule), generatedShaderName.c_str());
+#endif  // #if _DEBUG
+}
+
+void Sample::createPipelineCache()
+{
+  // Load the data the last run saved, if it came from the same driver.
+  // Drivers validate the data as well, but aren't required to handle data
+  // from other devices gracefully. See the Vulkan specification's
+  // "Pipeline Cache Header" for the layout of this header.
+  std::vector<char> data;
+  if(!m_shaderCacheDirectory.empty())
+  {
+    std::ifstream file(m_shaderCacheDirectory + PIPELINE_CACHE_FILENAME, std::ios::binary);
+    if(file.is_open())
+    {
+      data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+    const VkPhysicalDeviceProperties& properties = m_context.m_physicalInfo.properties10;
+    const size_t headerSize = 16 + VK_UUID_SIZE;
+    uint32_t     header[4]  = {};
+    if(data.size() >= headerSize)
+    {
+      memcpy(header, data.data(), sizeof(header));
+    }
+    if(data.size() < headerSize || header[0] < headerSize || header[1] != VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+       || header[2] != properties.vendorID || header[3] != properties.deviceID
+       || memcmp(data.data() + 16, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+    {
+      data.clear();
+    }
+  }
+
+  VkPipelineCacheCreateInfo createInfo = {VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO};
+  createInfo.initialDataSize           = data.size();
+  createInfo.pInitialData              = data.empty() ? nullptr : data.data();
+  NVVK_CHECK(vkCreatePipelineCache(m_context, &createInfo, nullptr, &m_pipelineCache));
+}
+
+void Sample::destroyPipelineCache()
+{
+  if(m_pipelineCache == VK_NULL_HANDLE)
+  {
+    return;
+  }
+
+  if(!m_shaderCacheDirectory.empty())
+  {
+    size_t dataSize = 0;
+    if(vkGetPipelineCacheData(m_context, m_pipelineCache, &dataSize, nullptr) == VK_SUCCESS && dataSize > 0)
+    {
+      std::vector<char> data(dataSize);
+      if(vkGetPipelineCacheData(m_context, m_pipelineCache, &dataSize, data.data()) == VK_SUCCESS
+         && !writeFileAtomically(m_shaderCacheDirectory + PIPELINE_CACHE_FILENAME, data.data(), dataSize))
+      {
+        LOGE("Could not write the pipeline cache.\n");
+      }
+    }
+  }
+
+  vkDestroyPipelineCache(m_context, m_pipelineCache, nullptr);
+  m_pipelineCache = VK_NULL_HANDLE;
+}
+
+void Sample::startShaderPrecompile()
+{
+  if(!m_precompileShaders || m_shaderCacheDirectory.empty())
+  {
+    return;
+  }
+
+  // Gather the shader modules of every combination of algorithm, number of
+  // layers, and antialiasing mode that isn't in the cache yet. The other
+  // settings (such as tailblending) keep their current values. Many modules
+  // are shared between combinations, so we skip duplicate cache entries.
+  std::vector<ShaderPrecompileJob> jobs;
+  std::set<std::string>            cacheFilenames;
+  std::map<std::string, uint64_t>  sourceHashes;
+  const uint64_t                   includesHash = hashShaderIncludes();
+  for(uint32_t algorithm = 0; algorithm < NUM_ALGORITHMS; algorithm++)
+  {
+    if(!isAlgorithmSupported(algorithm))
+    {
+      continue;
+    }
+
+    for(uint32_t oitLayers = 1; oitLayers <= 32; oitLayers *= 2)
+    {
+      for(uint32_t aaType = 0; aaType < NUM_AATYPES; aaType++)
+      {
+        State state     = m_state;
+        state.algorithm = algorithm;
+        state.oitLayers = oitLayers;
+        state.aaType    = aaType;
+        state.recomputeAntialiasingSettings();
+
+        const std::string definitions = getShaderDefinitions(state);
+        for(const ShaderModuleDesc& desc : getShaderModuleDescs(state, false))
+        {
+          auto sourceHash = sourceHashes.find(desc.filename);
+          if(sourceHash == sourceHashes.end())
+          {
+            sourceHash = sourceHashes.emplace(desc.filename, hashShaderSources(desc.filename, includesHash)).first;
+          }
+
+          ShaderPrecompileJob job;
+          job.stage         = desc.stage;
+          job.filename      = desc.filename;
+          job.prepend       = desc.prepend;
+          job.definitions   = definitions;
+          job.cacheFilename = getShaderCacheFilename(desc.stage, desc.filename, desc.prepend, definitions, sourceHash->second);
+
+          std::error_code error;
+          if(cacheFilenames.insert(job.cacheFilename).second
+             && !std::filesystem::exists(m_shaderCacheDirectory + job.cacheFilename, error))
+          {
+            jobs.push_back(job);
+          }
+        }
+      }
+    }
+  }
+
+  m_precompileTotal  = static_cast<uint32_t>(jobs.size());
+  m_precompileDone   = 0;
+  m_precompileCancel = false;
+  if(jobs.empty())
+  {
+    return;
+  }
+
+  // The thread gets its own shader module manager, since the main thread uses
+  // m_shaderModuleManager at the same time. We create and destroy it on the
+  // main thread because the managers share a reference-counted compiler.
+  LOGI("Precompiling %u shader modules in the background.\n", m_precompileTotal);
+  initShaderModuleManager(m_precompileShaderModuleManager);
+  m_precompileThread = std::thread(&Sample::precompileShaders, this, std::move(jobs));
+}
+
+void Sample::precompileShaders(std::vector<ShaderPrecompileJob> jobs)
+{
+  nvvk::ShaderModuleManager& manager = m_precompileShaderModuleManager;
+  for(const ShaderPrecompileJob& job : jobs)
+  {
+    if(m_precompileCancel)
+    {
+      break;
+    }
+
+    // The main thread may have compiled this module in the meantime.
+    std::error_code error;
+    if(!std::filesystem::exists(m_shaderCacheDirectory + job.cacheFilename, error))
+    {
+      manager.m_prepend                 = job.definitions;
+      nvvk::ShaderModuleID shaderModule = manager.createShaderModule(job.stage, job.filename, job.prepend);
+      if(manager.isValid(shaderModule))
+      {
+        writeShaderCacheFile(manager, shaderModule, job.cacheFilename);
+      }
+      manager.destroyShaderModule(shaderModule);
+    }
+
+    m_precompileDone++;
+  }
+}
+
+void Sample::stopShaderPrecompile()
+{
+  m_precompileCancel = true;
+  if(m_precompileThread.joinable())
+  {
+    m_precompileThread.join();
+    m_precompileShaderModuleManager.deinit();
+  }
+}
+
+bool Sample::isShaderPrecompileRunning() const
+{
+  return m_precompileThread.joinable() && (m_precompileDone < m_precompileTotal);
+}
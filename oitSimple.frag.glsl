@@ -49,15 +49,17 @@ layout(location = 0, index = 0) out vec4 outColor;
 
 void main()
 {
+  statsCountFragment();
+
   // Get the unpremultiplied linear-space RGBA color of this pixel
   vec4 color = shading(IN);
   // Convert to unpremultiplied sRGB for 8-bit storage
   const vec4 sRGBColor = unPremultLinearToSRGB(color);
 
-  // Get the number of pixels in the image
-  const int viewSize = scene.viewport.z;  // The number of pixels in the image
+  // Get the distance between consecutive layers in the A-buffer
+  const int layerStride = abufferLayerStride();
   // Get the index of the current sample at the current fragment
-  int listPos = viewSize * OIT_LAYERS * sampleID + coord.y * scene.viewport.x + coord.x;
+  int listPos = abufferIndex(coord.xy, sampleID, 0, OIT_LAYERS);
 
   // For the first OIT_LAYERS fragments for this sample, store them in the
   // A-buffer. For the rest, blend them together using normal blending
@@ -65,22 +67,29 @@ void main()
 
   // We'll sort the elements in the A-buffer against the second component here;
   // the first and third components act as a payload. When using MSAA with
-  // coverage shading, the third component let us know what MSAA samples this
-  // element of the A-buffer covers.
-  uvec4 storeValue = uvec4(packUnorm4x8(sRGBColor), floatBitsToUint(gl_FragCoord.z), storeMask, 0);
+  // coverage shading, the third component (or with OIT_PACKED_ABUFFER, the low
+  // bits of the second) lets us know what MSAA samples this element of the
+  // A-buffer covers.
+  uvec4 storeValue = abufferEntry(packUnorm4x8(sRGBColor));
 
   // Get the previous number of fragments stored in the A-buffer for this sample,
-  // and increment it.
-  uint oldCounter = imageAtomicAdd(imgAux, coord, 1u);
+  // and increment it. With OIT_FRAME_TAGS, first reset the counter to 0 if
+  // it's from an earlier frame.
+#if OIT_FRAME_TAGS
+  imageAtomicMax(imgAux, coord, counterTagged(0u));
+#endif  // #if OIT_FRAME_TAGS
+  uint oldCounter = counterCount(imageAtomicAdd(imgAux, coord, 1u));
   if(oldCounter < OIT_LAYERS)
   {
-    imageStore(imgAbuffer, listPos + int(oldCounter) * viewSize, storeValue);
+    imageStore(imgAbuffer, listPos + int(oldCounter) * layerStride, storeValue);
+    statsCountWrites(1u);
 
     // Inserted, so make this fragment transparent:
     outColor = vec4(0);
   }
   else
   {
+    statsCountOverflow();
 #if OIT_TAILBLEND
     // Premultiply alpha
     outColor = vec4(color.rgb * color.a, color.a);
@@ -118,24 +127,24 @@ void main()
 
   vec4 color = vec4(0);
 
-  // Get the number of pixels in the image.
-  int viewSize = scene.viewport.z;
+  // Get the distance between consecutive layers in the A-buffer.
+  int layerStride = abufferLayerStride();
   // Get the index of the current sample at the current fragment.
-  int listPos = viewSize * OIT_LAYERS * sampleID + coord.y * scene.viewport.x + coord.x;
+  int listPos = abufferIndex(coord.xy, sampleID, 0, OIT_LAYERS);
 
   // Load the number of fragments for the given sample. Then load those
   // fragments and sort them.
 
   // The number of fragments for this sample.
-  int fragments = int(imageLoad(imgAux, coord).r);
+  int fragments = int(counterCount(imageLoad(imgAux, coord).r));
   fragments     = min(OIT_LAYERS, fragments);
 
   for(int i = 0; i < fragments; i++)
   {
-    array[i] = loadOp(imageLoad(imgAbuffer, listPos + i * viewSize));
+    array[i] = loadOp(imageLoad(imgAbuffer, listPos + i * layerStride));
   }
 
-  bubbleSort(array, fragments);
+  sortFragments(array, fragments);
 
   vec4 colorSum = vec4(0);  // Initially completely transparent
 
@@ -149,7 +158,7 @@ void main()
     vec4 sColor = vec4(0);
     for(int i = 0; i < fragments; i++)
     {
-      if((array[i].b & (1 << s)) != 0)
+      if((entryMask(array[i]) & (1 << s)) != 0)
       {
         doBlendPacked(sColor, array[i].r);
       }
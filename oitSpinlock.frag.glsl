@@ -25,6 +25,14 @@
 // see if they're in the frontmost OIT_LAYERS fragments so far, and if so,
 // replace the furthest fragment.
 // The resolve pass then sorts and blends the fragments from front to back.
+//
+// How fragments take the per-pixel lock depends on OIT_SPIN_STRATEGY (see
+// State::spinlockStrategy). SPIN_PLAIN retries the atomic exchange until it
+// succeeds. SPIN_BACKOFF waits between attempts by reading the lock, which
+// doesn't need exclusive access to its cache line, for up to twice as long
+// each time. SPIN_SUBGROUP takes the lock once for all lanes of a subgroup
+// that shade the same pixel. With fragment statistics, the color pass counts
+// its attempts to take the lock, which measures contention.
 
 #version 460
 #extension GL_GOOGLE_include_directive : enable
@@ -43,21 +51,77 @@ layout(r32ui, binding = IMG_AUX) uniform coherent uimage2DUsed imgAux;
 layout(r32ui, binding = IMG_AUXSPIN) uniform coherent uimage2DUsed imgSpin;
 layout(r32ui, binding = IMG_AUXDEPTH) uniform coherent uimage2DUsed imgDepth;
 
+#if OIT_SPIN_STRATEGY == SPIN_SUBGROUP
+#extension GL_KHR_shader_subgroup_basic : require
+#extension GL_KHR_shader_subgroup_ballot : require
+#endif  // #if OIT_SPIN_STRATEGY == SPIN_SUBGROUP
+
 layout(location = 0) in Interpolants IN;
 layout(location = 0, index = 0) out vec4 outColor;
 
+// The critical section: inserts storeValue into the A-buffer, or replaces the
+// furthest entry with it. Sets color to the color to tail blend, if any.
+void insertFragment(inout vec4 color, inout bool stored, inout uint writes, uvec4 storeValue, int listPos, int layerStride)
+{
+  // See if there's enough space to avoid having to evict another fragment.
+  const uint oldCounter = counterCount(imageLoad(imgAux, coord).r);
+  imageStore(imgAux, coord, uvec4(counterTagged(oldCounter + 1)));
+
+  if(oldCounter < OIT_LAYERS)
+  {
+    imageStore(imgAbuffer, listPos + int(oldCounter) * layerStride, storeValue);
+    color  = vec4(0);  // Inserted, so won't be tailblended
+    stored = true;
+    writes = 1;
+  }
+  else
+  {
+    // Find the furthest element
+    int  furthest = 0;
+    uint maxDepth = 0;
+    for(int i = 0; i < OIT_LAYERS; i++)
+    {
+      uint testDepth = imageLoad(imgAbuffer, listPos + i * layerStride).g;
+      if(testDepth > maxDepth)
+      {
+        maxDepth = testDepth;
+        furthest = i;
+      }
+    }
+
+    if(maxDepth > storeValue.g)
+    {
+      // Replace the furthest fragment, tail-blending it, with this fragment.
+      color = unPremultSRGBToLinear(unpackUnorm4x8(imageLoad(imgAbuffer, listPos + furthest * layerStride).r));
+      imageStore(imgAbuffer, listPos + furthest * layerStride, storeValue);
+      writes = 1;
+#if USE_EARLYDEPTH
+      imageStore(imgDepth, coord, uvec4(maxDepth));
+#endif  // #if USE_EARLYDEPTH
+    }
+  }
+}
+
 void main()
 {
+  statsCountFragment();
+
   // Get the unpremultiplied linear-space RGBA color of this ixel
   vec4 color = shading(IN);
   // Convert to unpremultiplied sRGB for 8-bit storage
   const vec4 sRGBColor = unPremultLinearToSRGB(color);
 
   // Compute index in the A-buffer
-  const int viewSize = scene.viewport.z;
-  const int listPos  = viewSize * OIT_LAYERS * sampleID + (coord.y * scene.viewport.x + coord.x);
+  const int layerStride = abufferLayerStride();
+  const int listPos     = abufferIndex(coord.xy, sampleID, 0, OIT_LAYERS);
 
-  uvec4 storeValue = uvec4(packUnorm4x8(sRGBColor), floatBitsToUint(gl_FragCoord.z), storeMask, 0);
+  uvec4 storeValue = abufferEntry(packUnorm4x8(sRGBColor));
+  // Whether this fragment was inserted without evicting another one
+  bool stored = false;
+  // The number of A-buffer entries this fragment wrote
+  uint writes = 0;
+  // The number of times this fragment tried to take the lock
+  uint attempts = 0;
 
   // gl_order_independent_transparency has an #if for a different version of a
   // spinlock here, but since it's unstable (it flickers) and is disabled by
@@ -72,56 +136,92 @@ void main()
     // If the current thread is a helper thread, there's nothing to do.
     bool done = gl_SampleMaskIn[0] == 0;
 
+#if OIT_SPIN_STRATEGY == SPIN_SUBGROUP
+    // Lanes of the same subgroup that shade the same pixel (or sample) share
+    // one lock acquisition: each iteration handles the lanes with the same
+    // coordinates as the first remaining lane. One of them takes the lock,
+    // then they run the critical section one after another, and one of them
+    // releases it. Since lanes of the same subgroup never wait for each
+    // other's lock, this can't livelock on hardware without independent
+    // thread scheduling, and issues one atomic per pixel per subgroup.
     while(!done)
     {
-      // Atomically set the value of imgSpin at coord to 1 ("in use").
-      // If the original value was 0 (i.e. "this was the first thread to set it
-      // to 1"), then we can enter the critical section.
-      uint old = imageAtomicExchange(imgSpin, coord, 1u);
-      if(old == 0u)
+      if(all(equal(coord, subgroupBroadcastFirst(coord))))
       {
-        // Critical section --
-
-        // See if there's enough space to avoid having to evict another fragment.
-        const uint oldCounter = imageLoad(imgAux, coord).r;
-        imageStore(imgAux, coord, uvec4(oldCounter + 1));
-
-        if(oldCounter < OIT_LAYERS)
-        {
-          imageStore(imgAbuffer, listPos + int(oldCounter) * viewSize, storeValue);
-          color = vec4(0);  // Inserted, so won't be tailblended
-        }
-        else
+        if(subgroupElect())
         {
-          // Find the furthest element
-          int  furthest = 0;
-          uint maxDepth = 0;
-          for(int i = 0; i < OIT_LAYERS; i++)
+          attempts++;
+          while(imageAtomicExchange(imgSpin, coord, 1u) != 0u)
           {
-            uint testDepth = imageLoad(imgAbuffer, listPos + i * viewSize).g;
-            if(testDepth > maxDepth)
-            {
-              maxDepth = testDepth;
-              furthest = i;
-            }
+            attempts++;
           }
+        }
+        memoryBarrierImage();
 
-          if(maxDepth > storeValue.g)
+        bool waiting = true;
+        while(waiting)
+        {
+          if(subgroupElect())
           {
-            // Replace the furthest fragment, tail-blending it, with this fragment.
-            color = unPremultSRGBToLinear(unpackUnorm4x8(imageLoad(imgAbuffer, listPos + furthest * viewSize).r));
-            imageStore(imgAbuffer, listPos + furthest * viewSize, storeValue);
-#if USE_EARLYDEPTH
-            imageStore(imgDepth, coord, uvec4(maxDepth));
-#endif  // #if USE_EARLYDEPTH
+            insertFragment(color, stored, writes, storeValue, listPos, layerStride);
+            memoryBarrierImage();
+            waiting = false;
           }
         }
+
+        if(subgroupElect())
+        {
+          imageAtomicExchange(imgSpin, coord, 0u);
+        }
+        done = true;
+      }
+    }
+#else  // #if OIT_SPIN_STRATEGY == SPIN_SUBGROUP
+#if OIT_SPIN_STRATEGY == SPIN_BACKOFF
+    // After each failed attempt, wait up to twice as long (reading the lock
+    // without writing it) before trying again.
+    uint backoff = 1;
+#endif  // #if OIT_SPIN_STRATEGY == SPIN_BACKOFF
+
+    while(!done)
+    {
+      // Atomically set the value of imgSpin at coord to 1 ("in use").
+      // If the original value was 0 (i.e. "this was the first thread to set it
+      // to 1"), then we can enter the critical section.
+      attempts++;
+      uint old = imageAtomicExchange(imgSpin, coord, 1u);
+      if(old == 0u)
+      {
+        // Critical section --
+        insertFragment(color, stored, writes, storeValue, listPos, layerStride);
         // -- End critical section
         imageAtomicExchange(imgSpin, coord, 0u);
         done = true;
       }
+#if OIT_SPIN_STRATEGY == SPIN_BACKOFF
+      else
+      {
+        for(uint i = 0; i < backoff; i++)
+        {
+          if(imageLoad(imgSpin, coord).r == 0u)
+          {
+            break;
+          }
+        }
+        backoff = min(backoff * 2, SPIN_MAX_BACKOFF);
+      }
+#endif  // #if OIT_SPIN_STRATEGY == SPIN_BACKOFF
     }
+#endif  // #if OIT_SPIN_STRATEGY == SPIN_SUBGROUP
+  }
+
+  // Either this fragment or the one it replaced were tail-blended.
+  if(!stored)
+  {
+    statsCountOverflow();
   }
+  statsCountWrites(writes);
+  statsCountLockAttempts(attempts);
 
 #if OIT_TAILBLEND
   outColor = vec4(color.rgb * color.a, color.a);  // Premultiply the color
@@ -156,24 +256,24 @@ void main()
 
   vec4 color = vec4(0);
 
-  // Get the number of pixels in the image.
-  int viewSize = scene.viewport.z;
+  // Get the distance between consecutive layers in the A-buffer.
+  int layerStride = abufferLayerStride();
   // Get the index of the current sample at the current fragment.
-  int listPos = viewSize * OIT_LAYERS * sampleID + coord.y * scene.viewport.x + coord.x;
+  int listPos = abufferIndex(coord.xy, sampleID, 0, OIT_LAYERS);
 
   // Load the number of fragments for the given sample. Then load those
   // fragments and sort them.
 
   // The number of fragments for this sample.
-  int fragments = int(imageLoad(imgAux, coord).r);
+  int fragments = int(counterCount(imageLoad(imgAux, coord).r));
   fragments     = min(OIT_LAYERS, fragments);
 
   for(int i = 0; i < fragments; i++)
   {
-    array[i] = loadOp(imageLoad(imgAbuffer, listPos + i * viewSize));
+    array[i] = loadOp(imageLoad(imgAbuffer, listPos + i * layerStride));
   }
 
-  bubbleSort(array, fragments);
+  sortFragments(array, fragments);
 
   vec4 colorSum = vec4(0);  // Initially completely transparent
 
@@ -187,7 +287,7 @@ void main()
     vec4 sColor = vec4(0);
     for(int i = 0; i < fragments; i++)
     {
-      if((array[i].b & (1 << s)) != 0)
+      if((entryMask(array[i]) & (1 << s)) != 0)
       {
         doBlendPacked(sColor, array[i].r);
       }
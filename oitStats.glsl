@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2020-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2020-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+
+// Per-pixel fragment statistics (see State::fragmentStats). If OIT_STATS is
+// 1, the color passes count each transparent fragment of a pixel, each
+// fragment that didn't fit into the A-buffer and was tail-blended or dropped,
+// the stores and atomics that wrote A-buffer entries (the insertion work,
+// which drawing objects front to back reduces), and OIT_SPINLOCK's attempts to
+// take a lock (its contention), in IMG_FRAGMENT_STATS. These use the pixel in
+// m_colorImage, so they cover the whole image even if the A-buffer only covers
+// a tile. With sample shading, each invocation counts its sample, so the
+// values are sums over the pixel's samples; the readers convert them to
+// per-pixel counts with statsPerPixel.
+// Otherwise, these functions do nothing.
+
+#ifndef OIT_STATS_GLSL
+#define OIT_STATS_GLSL
+
+#if OIT_STATS
+
+layout(binding = IMG_FRAGMENT_STATS, r32ui) uniform uimage2DArray imgFragmentStats;
+
+void statsCountFragment()
+{
+  imageAtomicAdd(imgFragmentStats, ivec3(ivec2(gl_FragCoord.xy), STATS_LAYER_FRAGMENTS), 1u);
+}
+
+void statsCountOverflow()
+{
+  imageAtomicAdd(imgFragmentStats, ivec3(ivec2(gl_FragCoord.xy), STATS_LAYER_OVERFLOW), 1u);
+}
+
+void statsCountWrites(uint writes)
+{
+  if(writes != 0)
+  {
+    imageAtomicAdd(imgFragmentStats, ivec3(ivec2(gl_FragCoord.xy), STATS_LAYER_WRITES), writes);
+  }
+}
+
+void statsCountLockAttempts(uint attempts)
+{
+  if(attempts != 0)
+  {
+    imageAtomicAdd(imgFragmentStats, ivec3(ivec2(gl_FragCoord.xy), STATS_LAYER_LOCK_ATTEMPTS), attempts);
+  }
+}
+
+#else  // #if OIT_STATS
+
+void statsCountFragment() {}
+void statsCountOverflow() {}
+void statsCountWrites(uint writes) {}
+void statsCountLockAttempts(uint attempts) {}
+
+#endif  // #if OIT_STATS
+
+#endif  // #ifndef OIT_STATS_GLSL
@@ -46,12 +46,17 @@
 ////////////////////////////////////////////////////////////////////////////////
 #if PASS == PASS_COLOR
 
+// Fragment statistics, if enabled. This algorithm never overflows.
+#include "oitStats.glsl"
+
 layout(location = 0) in Interpolants IN;
 layout(location = 0) out vec4 outColor;
 layout(location = 1) out float outReveal;
 
 void main()
 {
+  statsCountFragment();
+
   vec4 color = shading(IN);
   color.rgb *= color.a;  // Premultiply it
 
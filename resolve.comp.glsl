@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2020-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2020-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+// Replaces the resolve, blit, and copy of copyOffscreenToBackBuffer when
+// State::computeResolve is on: each invocation averages all samples of the
+// pixels of m_colorImage that cover one pixel of m_guiCompositeImage (the
+// MSAA samples, and the supersample x supersample block with SSAA), and
+// writes the result straight to m_guiCompositeImage.
+// m_colorImage is sRGB, so sampling it returns linear colors, which this
+// averages before encoding the result as sRGB again. m_guiCompositeImage is
+// UNORM (see Sample::m_guiCompositeColorFormat), so it stores the encoded
+// values as they are, just like the vkCmdCopyImage did.
+
+#version 460
+#extension GL_GOOGLE_include_directive : enable
+
+#include "shaderCommon.glsl"
+
+layout(local_size_x = RESOLVE_WORKGROUP_SIZE, local_size_y = RESOLVE_WORKGROUP_SIZE) in;
+
+#if OIT_MSAA != 1
+layout(binding = IMG_RESOLVE_SRC) uniform sampler2DMS texColor;
+#else
+layout(binding = IMG_RESOLVE_SRC) uniform sampler2D texColor;
+#endif
+
+// B8G8R8A8 has no format qualifier, so this relies on
+// shaderStorageImageWriteWithoutFormat (see Sample::isComputeResolveSupported).
+layout(binding = IMG_RESOLVE_DST) uniform restrict writeonly image2D imgResolved;
+
+void main()
+{
+  const ivec2 dstSize = imageSize(imgResolved);
+  const ivec2 coord   = ivec2(gl_GlobalInvocationID.xy);
+  if(any(greaterThanEqual(coord, dstSize)))
+  {
+    return;
+  }
+
+#if OIT_MSAA != 1
+  const ivec2 srcSize = textureSize(texColor);
+#else
+  const ivec2 srcSize = textureSize(texColor, 0);
+#endif
+  // The supersampling factor (1 without SSAA)
+  const ivec2 scale = srcSize / dstSize;
+
+  vec4 color = vec4(0.0);
+  for(int y = 0; y < scale.y; y++)
+  {
+    for(int x = 0; x < scale.x; x++)
+    {
+      const ivec2 srcCoord = coord * scale + ivec2(x, y);
+#if OIT_MSAA != 1
+      for(int i = 0; i < OIT_MSAA; i++)
+      {
+        color += texelFetch(texColor, srcCoord, i);
+      }
+#else
+      color += texelFetch(texColor, srcCoord, 0);
+#endif
+    }
+  }
+  color /= float(scale.x * scale.y * OIT_MSAA);
+
+  imageStore(imgResolved, coord, unPremultLinearToSRGB(color));
+}
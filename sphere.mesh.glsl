@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2020-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2020-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+// Mesh shader for State::meshShaders: each workgroup generates one patch of
+// a sphere that sphere.task.glsl didn't cull, with the same outputs as
+// object.vert.glsl.
+
+#version 460
+#extension GL_GOOGLE_include_directive : enable
+#extension GL_EXT_mesh_shader : require
+
+#include "sphereMesh.glsl"
+
+layout(local_size_x = MESH_WORKGROUP_SIZE) in;
+layout(triangles, max_vertices = MESH_MAX_VERTICES, max_primitives = MESH_MAX_PRIMITIVES) out;
+
+layout(std430, binding = BUF_OBJECT_BOUNDS) readonly buffer objectBoundsBuffer
+{
+  vec4 objectBounds[];  // (center.xyz, radius)
+};
+
+layout(std430, binding = BUF_INSTANCE_COLORS) readonly buffer instanceColorsBuffer
+{
+  vec4 instanceColors[];
+};
+
+taskPayloadSharedEXT SpherePayload payload;
+
+layout(location = 0) out Interpolants OUT[];
+
+void main()
+{
+  const uint  packedPatch = payload.patches[gl_WorkGroupID.x];
+  const uvec2 patchIndex  = uvec2(packedPatch & 0xFFFFu, packedPatch >> 16);
+  uvec2       firstQuad, numQuads;
+  spherePatchQuads(patchIndex, firstQuad, numQuads);
+
+  const uint rowVertices  = numQuads.x + 1;
+  const uint numVertices  = rowVertices * (numQuads.y + 1);
+  const uint numTriangles = 2 * numQuads.x * numQuads.y;
+  SetMeshOutputsEXT(numVertices, numTriangles);
+
+  const vec4 bounds = objectBounds[payload.object];
+  const vec4 color  = instanceColors[payload.object];
+
+  for(uint v = gl_LocalInvocationIndex; v < numVertices; v += MESH_WORKGROUP_SIZE)
+  {
+    // Each object is a scaled and translated unit sphere, as in object.vert.glsl.
+    const vec3 normal   = sphereDirection(vec2(firstQuad + uvec2(v % rowVertices, v / rowVertices)));
+    const vec3 position = bounds.xyz + bounds.w * normal;
+
+    gl_MeshVerticesEXT[v].gl_Position = scene.projViewMatrix[0] * vec4(position, 1.0);
+    OUT[v].depth                      = (scene.viewMatrix[0] * vec4(position, 1.0)).z;
+    OUT[v].pos                        = position;
+    OUT[v].normal                     = normal;
+    OUT[v].color                      = color;
+  }
+
+  for(uint t = gl_LocalInvocationIndex; t < numTriangles; t += MESH_WORKGROUP_SIZE)
+  {
+    // Two triangles per quad, with the same winding as nvh::geometry::Sphere.
+    // One of them is degenerate in the quads next to the poles; Sphere skips
+    // these, so we cull them.
+    const uint  quad     = t / 2;
+    const uvec2 quadXZ   = uvec2(quad % numQuads.x, quad / numQuads.x);
+    const uint  v00      = quadXZ.y * rowVertices + quadXZ.x;  // The quad's first vertex
+    const uint  v01      = v00 + rowVertices;                  // The next vertex towards the north pole
+    const uint  sphereZ  = firstQuad.y + quadXZ.y;
+    const bool  isSecond = ((t & 1) != 0);
+    gl_PrimitiveTriangleIndicesEXT[t]         = (isSecond ? uvec3(v01 + 1, v00 + 1, v00) : uvec3(v00, v01, v01 + 1));
+    gl_MeshPrimitivesEXT[t].gl_CullPrimitiveEXT = (isSecond ? (sphereZ == 0) : (sphereZ == sphereQuads().y - 1));
+  }
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2020-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2020-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+// Task shader for State::meshShaders: each workgroup culls the patches of one
+// sphere (see sphereMesh.glsl), with one invocation per patch, and launches a
+// sphere.mesh.glsl workgroup for each patch that might be visible.
+//
+// Patches outside the view frustum are always culled. With
+// MESH_CULL_BACKFACES (for the opaque pass, which culls back faces), so are
+// patches whose triangles all face away from the camera. The transparent
+// spheres are double-sided, so their back faces stay.
+
+#version 460
+#extension GL_GOOGLE_include_directive : enable
+#extension GL_EXT_mesh_shader : require
+
+#include "sphereMesh.glsl"
+
+#ifndef MESH_CULL_BACKFACES
+#define MESH_CULL_BACKFACES 0
+#endif
+
+layout(local_size_x = MESH_WORKGROUP_SIZE) in;
+
+layout(std430, binding = BUF_OBJECT_BOUNDS) readonly buffer objectBoundsBuffer
+{
+  vec4 objectBounds[];  // (center.xyz, radius)
+};
+
+taskPayloadSharedEXT SpherePayload payload;
+
+shared uint s_numVisible;
+
+// Returns whether any triangle of a patch might face the camera. Every point
+// of the patch is within coneAngle of the axis, as seen from the sphere's
+// center. Each triangle's normal points at the center of the circle through
+// its vertices; since the triangles are close to right triangles, that's
+// within its quad, so the normals are within coneAngle plus a quad's
+// diagonal of the axis. A triangle faces away from the camera if the camera
+// is behind its plane, which is at least radius * cos(quad's diagonal) from
+// the sphere's center.
+bool isPatchFrontFacing(vec4 bounds, vec3 axis, float coneAngle)
+{
+  // The view matrix is a rotation and translation.
+  const vec3  eye            = -(transpose(mat3(scene.viewMatrix[0])) * scene.viewMatrix[0][3].xyz);
+  const vec3  toCenter       = bounds.xyz - eye;
+  const float toCenterLength = length(toCenter);
+  if(toCenterLength == 0.0)
+  {
+    return true;
+  }
+
+  const vec2  quadAngles   = sphereQuadAngles();
+  const float quadDiagonal = quadAngles.x + quadAngles.y;
+  const float normalAngle  = acos(clamp(dot(axis, toCenter) / toCenterLength, -1.0, 1.0)) + coneAngle + quadDiagonal;
+  // The smallest dot product of a normal with toCenter / toCenterLength
+  const float minCosine = (normalAngle >= PI ? -1.0 : cos(normalAngle));
+  return toCenterLength * minCosine <= -bounds.w * max(cos(quadDiagonal), 0.0);
+}
+
+void main()
+{
+  // Objects are spread over rows of MESH_TASK_GROUPS_X workgroups (see Sample::cmdDrawObjects).
+  const uint objectOffset = gl_WorkGroupID.y * MESH_TASK_GROUPS_X + gl_WorkGroupID.x;
+  const uint object       = pushConstants.meshFirstObject + objectOffset;
+  if(gl_LocalInvocationIndex == 0)
+  {
+    s_numVisible   = 0;
+    payload.object = object;
+  }
+  barrier();
+
+  const uvec2 numPatches = spherePatches();
+  const uint  patchSlot  = gl_LocalInvocationIndex;
+  if((objectOffset < pushConstants.meshNumObjects) && (patchSlot < numPatches.x * numPatches.y))
+  {
+    const vec4  bounds     = objectBounds[object];
+    const uvec2 patchIndex = uvec2(patchSlot % numPatches.x, patchSlot / numPatches.x);
+    uvec2       firstQuad, numQuads;
+    spherePatchQuads(patchIndex, firstQuad, numQuads);
+
+    // The angle from the patch's middle to any of its points is at most the
+    // angle to its parallel plus the angle along that parallel.
+    const vec3  axis      = sphereDirection(vec2(firstQuad) + 0.5 * vec2(numQuads));
+    const vec2  halfSpan  = 0.5 * vec2(numQuads) * sphereQuadAngles();
+    const float coneAngle = halfSpan.x + halfSpan.y;
+
+    // Bound the patch by a sphere: the cap within coneAngle of the axis (and
+    // so its triangles) fits into the sphere around the cap's base circle.
+    vec3  center = bounds.xyz;
+    float radius = bounds.w;
+    if(coneAngle < 0.5 * PI)
+    {
+      center += bounds.w * cos(coneAngle) * axis;
+      radius = bounds.w * sin(coneAngle);
+    }
+
+    bool visible = isSphereInFrustum(center, radius);
+#if MESH_CULL_BACKFACES
+    visible = visible && isPatchFrontFacing(bounds, axis, coneAngle);
+#endif
+
+    if(visible)
+    {
+      const uint slot       = atomicAdd(s_numVisible, 1);
+      payload.patches[slot] = (patchIndex.y << 16) | patchIndex.x;
+    }
+  }
+  barrier();
+
+  EmitMeshTasksEXT(s_numVisible, 1, 1);
+}
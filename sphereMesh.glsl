@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2020-2021, NVIDIA CORPORATION.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-FileCopyrightText: Copyright (c) 2020-2021 NVIDIA CORPORATION
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+
+// Shared by sphere.task.glsl and sphere.mesh.glsl, which draw the instanced
+// scene's spheres without vertex or index buffers (see State::meshShaders).
+// They generate the same vertices and triangles as nvh::geometry::Sphere in
+// generateScene, so drawing with mesh shaders gives the same image:
+// pushConstants.meshSubdiv * 2 quads around the z axis, times
+// pushConstants.meshSubdiv quads from the south pole to the north pole. Each
+// patch covers up to MESH_PATCH_QUADS x MESH_PATCH_QUADS of these quads.
+
+#extension GL_GOOGLE_include_directive : enable
+
+#include "shaderCommon.glsl"
+
+#define MESH_MAX_PATCHES MESH_WORKGROUP_SIZE
+#define MESH_MAX_VERTICES ((MESH_PATCH_QUADS + 1) * (MESH_PATCH_QUADS + 1))
+#define MESH_MAX_PRIMITIVES (2 * MESH_PATCH_QUADS * MESH_PATCH_QUADS)
+
+#define PI 3.14159265358979323846
+
+// Written by each task workgroup, and read by the mesh workgroups it launches.
+struct SpherePayload
+{
+  uint object;
+  uint patches[MESH_MAX_PATCHES];  // (patch.y << 16) | patch.x for each patch that might be visible
+};
+
+// The number of the sphere's quads in each direction.
+uvec2 sphereQuads()
+{
+  return uvec2(2, 1) * min(pushConstants.meshSubdiv, uint(MESH_MAX_SUBDIV));
+}
+
+uvec2 spherePatches()
+{
+  return (sphereQuads() + MESH_PATCH_QUADS - 1) / MESH_PATCH_QUADS;
+}
+
+// The angles each quad spans around the z axis and from pole to pole.
+vec2 sphereQuadAngles()
+{
+  return vec2(2.0 * PI, PI) / vec2(sphereQuads());
+}
+
+// Returns the point of the unit sphere (which is also its normal) at a
+// position in quads, which doesn't have to be a vertex.
+vec3 sphereDirection(vec2 quadPosition)
+{
+  const float xyAngle = quadPosition.x * sphereQuadAngles().x;
+  const float zAngle  = quadPosition.y * sphereQuadAngles().y - 0.5 * PI;
+  return vec3(cos(xyAngle) * cos(zAngle), sin(xyAngle) * cos(zAngle), sin(zAngle));
+}
+
+// The first quad of a patch, and its number of quads in each direction.
+void spherePatchQuads(uvec2 patchIndex, out uvec2 firstQuad, out uvec2 numQuads)
+{
+  firstQuad = patchIndex * MESH_PATCH_QUADS;
+  numQuads  = min(uvec2(MESH_PATCH_QUADS), sphereQuads() - firstQuad);
+}
@@ -25,13 +25,21 @@
 // binding description and attribute description for the geometry that this
 // sample specifically uses.
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <nvh/geometry.hpp>
 #include <glm/glm.hpp>
 #include <nvvk/resourceallocator_vk.hpp>
 #include <nvvk/buffers_vk.hpp>
 #include <nvvk/context_vk.hpp>
 #include <nvvk/debug_util_vk.hpp>
+#include <nvvk/error_vk.hpp>
 #include <nvvk/images_vk.hpp>
 #include <vulkan/vulkan_core.h>
 
@@ -42,6 +50,8 @@ struct Vertex
   glm::vec3 normal;
   glm::vec4 color;
 
+  Vertex() = default;
+
   // Must have a constructor from nvh::geometry::Vertex in order for initScene
   // to work
   Vertex(const nvh::geometry::Vertex& vertex)
@@ -85,6 +95,253 @@ struct Vertex
 
     return attributeDescriptions;
   }
+
+  // The instanced scene reads each object's bounding sphere (vec4(center,
+  // radius)) and color from two per-instance vertex buffers, which replace
+  // the vertex color.
+  static std::array<VkVertexInputBindingDescription, 2> getInstanceBindingDescriptions()
+  {
+    std::array<VkVertexInputBindingDescription, 2> bindingDescriptions = {};
+
+    bindingDescriptions[0].binding   = 1;
+    bindingDescriptions[0].stride    = sizeof(glm::vec4);
+    bindingDescriptions[0].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+
+    bindingDescriptions[1].binding   = 2;
+    bindingDescriptions[1].stride    = sizeof(glm::vec4);
+    bindingDescriptions[1].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+
+    return bindingDescriptions;
+  }
+
+  static std::array<VkVertexInputAttributeDescription, 2> getInstanceAttributeDescriptions()
+  {
+    std::array<VkVertexInputAttributeDescription, 2> attributeDescriptions = {};
+
+    attributeDescriptions[0].binding  = 1;
+    attributeDescriptions[0].location = 3;
+    attributeDescriptions[0].format   = VK_FORMAT_R32G32B32A32_SFLOAT;
+    attributeDescriptions[0].offset   = 0;
+
+    attributeDescriptions[1].binding  = 2;
+    attributeDescriptions[1].location = 4;
+    attributeDescriptions[1].format   = VK_FORMAT_R32G32B32A32_SFLOAT;
+    attributeDescriptions[1].offset   = 0;
+
+    return attributeDescriptions;
+  }
+};
+
+// Suballocates device-local memory for resources that are created and
+// destroyed together - here, the frame images - from a few large blocks, so
+// that recreating them (e.g. when resizing the window or switching
+// algorithms) reuses memory instead of going back to the driver each time.
+// Allocations are linear and are never freed one by one. Instead, retire()
+// hands over all blocks that the current set of resources uses; once the GPU
+// has finished with those resources, release() lets later allocations reuse
+// the blocks, and trim() frees the ones nothing reused.
+// Resources that are never used at the same time can alias each other by
+// sharing one allocation (see Sample::bindAliasedFrameImages).
+class MemoryArena
+{
+public:
+  struct Allocation
+  {
+    VkDeviceMemory memory = nullptr;
+    VkDeviceSize   offset = 0;
+  };
+
+  void init(VkDevice device, VkPhysicalDevice physicalDevice, VkDeviceSize blockSize = VkDeviceSize(128) * 1024 * 1024)
+  {
+    m_device    = device;
+    m_blockSize = blockSize;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &m_memoryProperties);
+    // Buffers and optimally tiled images can share a block, so keep them at
+    // least this far apart.
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    m_granularity = properties.limits.bufferImageGranularity;
+  }
+
+  // Frees all blocks; should only be called when the device is idle.
+  void deinit()
+  {
+    for(const Block& block : m_blocks)
+    {
+      vkFreeMemory(m_device, block.memory, nullptr);
+    }
+    m_blocks.clear();
+    m_totalBytes = 0;
+  }
+
+  Allocation allocate(const VkMemoryRequirements& requirements)
+  {
+    const uint32_t     memoryType = findMemoryType(requirements.memoryTypeBits);
+    const VkDeviceSize alignment  = std::max(requirements.alignment, m_granularity);
+
+    // Place it after the previous allocations of one of the current blocks,
+    for(Block& block : m_blocks)
+    {
+      const VkDeviceSize offset = (block.used + alignment - 1) & ~(alignment - 1);
+      if(block.state == BLOCK_CURRENT && block.memoryType == memoryType && offset + requirements.size <= block.size)
+      {
+        block.used = offset + requirements.size;
+        return {block.memory, offset};
+      }
+    }
+
+    // or at the start of the smallest released block it fits into,
+    Block* reused = nullptr;
+    for(Block& block : m_blocks)
+    {
+      if(block.state == BLOCK_FREE && block.memoryType == memoryType && requirements.size <= block.size
+         && (reused == nullptr || block.size < reused->size))
+      {
+        reused = &block;
+      }
+    }
+
+    // or else in a new block.
+    if(reused == nullptr)
+    {
+      Block block;
+      block.id         = m_nextId++;
+      block.memoryType = memoryType;
+      block.size       = std::max(m_blockSize, requirements.size);
+
+      VkMemoryAllocateInfo allocateInfo = {VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
+      allocateInfo.allocationSize       = block.size;
+      allocateInfo.memoryTypeIndex      = memoryType;
+      NVVK_CHECK(vkAllocateMemory(m_device, &allocateInfo, nullptr, &block.memory));
+
+      m_blocks.push_back(block);
+      reused       = &m_blocks.back();
+      m_totalBytes += block.size;
+      m_peakBytes  = std::max(m_peakBytes, m_totalBytes);
+      m_numDriverAllocations++;
+    }
+
+    reused->state = BLOCK_CURRENT;
+    reused->used  = requirements.size;
+    return {reused->memory, 0};
+  }
+
+  // Returns the IDs of the blocks that the current resources use; pass them
+  // to release() once the GPU has finished using those resources. Later
+  // allocations go to other blocks.
+  std::vector<uint32_t> retire()
+  {
+    std::vector<uint32_t> retired;
+    for(Block& block : m_blocks)
+    {
+      if(block.state == BLOCK_CURRENT)
+      {
+        block.state = BLOCK_RETIRED;
+        retired.push_back(block.id);
+      }
+    }
+    return retired;
+  }
+
+  void release(const std::vector<uint32_t>& blockIds)
+  {
+    for(Block& block : m_blocks)
+    {
+      if(std::find(blockIds.begin(), blockIds.end(), block.id) != blockIds.end())
+      {
+        block.state = BLOCK_FREE;
+        block.used  = 0;
+      }
+    }
+  }
+
+  // Frees the released blocks, for instance after creating a new set of
+  // resources that reused what it could of them.
+  void trim()
+  {
+    for(size_t i = 0; i < m_blocks.size();)
+    {
+      if(m_blocks[i].state == BLOCK_FREE)
+      {
+        vkFreeMemory(m_device, m_blocks[i].memory, nullptr);
+        m_totalBytes -= m_blocks[i].size;
+        m_blocks.erase(m_blocks.begin() + i);
+      }
+      else
+      {
+        i++;
+      }
+    }
+  }
+
+  // The bytes allocated from the driver, including retired blocks that frames
+  // in flight may still use.
+  VkDeviceSize getTotalBytes() const { return m_totalBytes; }
+  // The most bytes the arena has had allocated from the driver at any time.
+  VkDeviceSize getPeakBytes() const { return m_peakBytes; }
+  // The bytes in the current blocks that the current resources cover.
+  VkDeviceSize getUsedBytes() const
+  {
+    VkDeviceSize used = 0;
+    for(const Block& block : m_blocks)
+    {
+      used += (block.state == BLOCK_CURRENT ? block.used : 0);
+    }
+    return used;
+  }
+  uint32_t getNumBlocks() const { return static_cast<uint32_t>(m_blocks.size()); }
+  // How many times the arena had to allocate a new block from the driver.
+  uint32_t getNumDriverAllocations() const { return m_numDriverAllocations; }
+
+private:
+  enum BlockState
+  {
+    BLOCK_CURRENT,  // Used by the current resources
+    BLOCK_RETIRED,  // Used by resources that frames in flight may still use
+    BLOCK_FREE      // Released, and waiting to be reused or trimmed
+  };
+
+  struct Block
+  {
+    VkDeviceMemory memory     = nullptr;
+    uint32_t       id         = 0;
+    uint32_t       memoryType = 0;
+    VkDeviceSize   size       = 0;
+    VkDeviceSize   used       = 0;  // The end of the last allocation, in bytes
+    BlockState     state      = BLOCK_CURRENT;
+  };
+
+  // Prefers device-local memory types that fit the type bits.
+  uint32_t findMemoryType(uint32_t memoryTypeBits) const
+  {
+    for(uint32_t i = 0; i < m_memoryProperties.memoryTypeCount; i++)
+    {
+      if((memoryTypeBits & (1u << i)) != 0
+         && (m_memoryProperties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) != 0)
+      {
+        return i;
+      }
+    }
+    for(uint32_t i = 0; i < m_memoryProperties.memoryTypeCount; i++)
+    {
+      if((memoryTypeBits & (1u << i)) != 0)
+      {
+        return i;
+      }
+    }
+    assert(!"MemoryArena: No memory type fits the requirements!");
+    return 0;
+  }
+
+  VkDevice                         m_device      = nullptr;
+  VkDeviceSize                     m_blockSize   = 0;
+  VkDeviceSize                     m_granularity = 1;
+  VkPhysicalDeviceMemoryProperties m_memoryProperties{};
+  std::vector<Block>               m_blocks;
+  uint32_t                         m_nextId               = 0;
+  VkDeviceSize                     m_totalBytes           = 0;
+  VkDeviceSize                     m_peakBytes            = 0;
+  uint32_t                         m_numDriverAllocations = 0;
 };
 
 // A BufferAndView is an NVVK buffer (i.e. Vulkan buffer and underlying memory),
@@ -92,9 +349,10 @@ struct Vertex
 // that works for this sample!
 struct BufferAndView
 {
-  nvvk::Buffer buffer;
-  VkBufferView    view = nullptr;
-  VkDeviceSize    size = 0;  // In bytes
+  nvvk::Buffer       buffer;
+  VkBufferView       view  = nullptr;
+  VkDeviceSize       size  = 0;  // In bytes
+  VkBufferUsageFlags usage = 0;
 
   // Creates a buffer and view with the given size, usage, and view format.
   // The memory properties are always VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT.
@@ -102,6 +360,7 @@ struct BufferAndView
   {
     assert(buffer.buffer == nullptr);  // Destroy the buffer before recreating it, please!
     buffer = allocator.createBuffer(bufferSize, bufferUsage);
+    usage  = bufferUsage;
     if((bufferUsage & (VK_BUFFER_USAGE_STORAGE_TEXEL_BUFFER_BIT | VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT)) != 0)
     {
       view = nvvk::createBufferView(context, nvvk::makeBufferViewCreateInfo(buffer.buffer, viewFormat, bufferSize));
@@ -109,13 +368,46 @@ struct BufferAndView
     size = bufferSize;
   }
 
+  // Like create, but for buffers whose memory comes from somewhere else, such
+  // as a MemoryArena: creates the buffer and returns its memory requirements.
+  // Call bind before using it.
+  VkMemoryRequirements createUnbound(nvvk::Context& context, VkDeviceSize bufferSize, VkBufferUsageFlags bufferUsage)
+  {
+    assert(buffer.buffer == nullptr);  // Destroy the buffer before recreating it, please!
+    const VkBufferCreateInfo bufferInfo = nvvk::makeBufferCreateInfo(bufferSize, bufferUsage);
+    NVVK_CHECK(vkCreateBuffer(context.m_device, &bufferInfo, nullptr, &buffer.buffer));
+    usage = bufferUsage;
+    size  = bufferSize;
+
+    VkMemoryRequirements memoryRequirements;
+    vkGetBufferMemoryRequirements(context.m_device, buffer.buffer, &memoryRequirements);
+    return memoryRequirements;
+  }
+
+  // Binds memory to a buffer from createUnbound, and creates its view.
+  void bind(nvvk::Context& context, VkDeviceMemory memory, VkDeviceSize offset, VkFormat viewFormat)
+  {
+    assert(buffer.buffer != nullptr && view == nullptr);
+    NVVK_CHECK(vkBindBufferMemory(context.m_device, buffer.buffer, memory, offset));
+    if((usage & (VK_BUFFER_USAGE_STORAGE_TEXEL_BUFFER_BIT | VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT)) != 0)
+    {
+      view = nvvk::createBufferView(context, nvvk::makeBufferViewCreateInfo(buffer.buffer, viewFormat, size));
+    }
+  }
+
   // To destroy the object, provide its context and allocator.
   void destroy(nvvk::Context& context, nvvk::ResourceAllocatorDma& allocator)
   {
-    if(buffer.buffer != nullptr)
+    // Buffers from createUnbound don't own their memory.
+    if(buffer.buffer != nullptr && buffer.memHandle != nullptr)
     {
       allocator.destroy(buffer);
     }
+    else if(buffer.buffer != nullptr)
+    {
+      vkDestroyBuffer(context.m_device, buffer.buffer, nullptr);
+    }
+    buffer = nvvk::Buffer();
 
     if(view != nullptr)
     {
@@ -123,7 +415,8 @@ struct BufferAndView
       view = nullptr;
     }
 
-    size = 0;
+    size  = 0;
+    usage = 0;
   }
 
   void setName(nvvk::DebugUtil& util, const char* name)
@@ -136,21 +429,109 @@ struct BufferAndView
   }
 };
 
-// Creates a simple texture with 1 mip, 1 array layer, 1 sample per texel, with
+// A host-visible buffer that small GPU results, such as counters and
+// statistics, are copied into so that the CPU can read them without waiting
+// for the GPU. It has one slot per ring cycle: a frame's command buffer
+// copies into its cycle's slot, and the next frame that uses the same cycle
+// reads it after waiting for the cycle's fence - that is, the results arrive
+// one ring's worth of frames late, but never stall the CPU. The buffer stays
+// mapped for its whole lifetime.
+struct ReadbackRing
+{
+  nvvk::Buffer          buffer;
+  const uint8_t*        mapped   = nullptr;
+  VkDeviceSize          slotSize = 0;  // In bytes
+  std::vector<bool>     pending;       // Whether each slot was written and hasn't been read yet
+  std::vector<uint32_t> writtenFrame;  // The frame that last wrote each slot
+  uint32_t              latency = 0;   // Frames between the write and read of the last slot read
+
+  // Creates a buffer with numCycles slots of slotBytes each. The memory is
+  // host-visible, host-coherent, and can be the destination of transfers.
+  void create(nvvk::ResourceAllocatorDma& allocator, VkDeviceSize slotBytes, uint32_t numCycles)
+  {
+    assert(buffer.buffer == nullptr);  // Destroy the buffer before recreating it, please!
+    buffer   = allocator.createBuffer(slotBytes * numCycles, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    mapped   = static_cast<const uint8_t*>(allocator.map(buffer));
+    slotSize = slotBytes;
+    pending.assign(numCycles, false);
+    writtenFrame.assign(numCycles, 0);
+    latency = 0;
+  }
+
+  void destroy(nvvk::ResourceAllocatorDma& allocator)
+  {
+    if(buffer.buffer != nullptr)
+    {
+      allocator.unmap(buffer);
+      allocator.destroy(buffer);
+    }
+    mapped   = nullptr;
+    slotSize = 0;
+    pending.clear();
+    writtenFrame.clear();
+  }
+
+  void setName(nvvk::DebugUtil& util, const char* name) { util.setObjectName(buffer.buffer, name); }
+
+  // The offset of the cycle's slot in the buffer, for copies into it.
+  VkDeviceSize getOffset(uint32_t cycle) const { return slotSize * cycle; }
+
+  // Records that the given frame's command buffer copies into the cycle's
+  // slot. Call this after recording the copy and a barrier that makes it
+  // visible to the host.
+  void markWritten(uint32_t cycle, uint32_t frame)
+  {
+    pending[cycle]      = true;
+    writtenFrame[cycle] = frame;
+  }
+
+  // If the cycle's slot was written and hasn't been read since, returns its
+  // contents and marks it as read; otherwise, returns nullptr. Only call this
+  // after waiting for the cycle's fence.
+  const void* read(uint32_t cycle, uint32_t frame)
+  {
+    if(buffer.buffer == nullptr || !pending[cycle])
+    {
+      return nullptr;
+    }
+    pending[cycle] = false;
+    latency        = frame - writtenFrame[cycle];
+    return mapped + getOffset(cycle);
+  }
+};
+
+// The most recent values of a statistic, for plotting with ImGui::PlotLines.
+struct ValueHistory
+{
+  static const int          LENGTH = 128;
+  std::array<float, LENGTH> values = {};
+  int                       next   = 0;  // The index of the next value to write, which is also the oldest value.
+
+  void push(float value)
+  {
+    values[next] = value;
+    next         = (next + 1) % LENGTH;
+  }
+
+  void clear()
+  {
+    values.fill(0.0f);
+    next = 0;
+  }
+};
+
+// Describes a simple texture with 1 mip, 1 array layer, 1 sample per texel, with
 // optimal tiling, in an undefined layout, with the VK_IMAGE_USAGE_SAMPLED_BIT flag
 // (and possibly additional flags), and accessible only from a single queue family.
-inline nvvk::Image createImageSimple(nvvk::ResourceAllocatorDma& allocator,
-                                        VkImageType         imageType,
-                                        VkFormat            format,
-                                        uint32_t            width,
-                                        uint32_t            height,
-                                        uint32_t            arrayLayers          = 1,
-                                        VkImageUsageFlags   additionalUsageFlags = 0,
-                                        uint32_t            numSamples           = 1)
+inline VkImageCreateInfo makeImageInfoSimple(VkImageType       imageType,
+                                             VkFormat          format,
+                                             uint32_t          width,
+                                             uint32_t          height,
+                                             uint32_t          arrayLayers          = 1,
+                                             VkImageUsageFlags additionalUsageFlags = 0,
+                                             uint32_t          numSamples           = 1)
 {
-  // There are several different ways to create images using the NVVK framework.
-  // Here, we'll use AllocatorDma::createImage.
-
   VkImageCreateInfo imageInfo = {VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO};
   imageInfo.imageType         = imageType;
   imageInfo.extent.width      = width;
@@ -164,8 +545,22 @@ inline nvvk::Image createImageSimple(nvvk::ResourceAllocatorDma& allocator,
   imageInfo.usage             = VK_IMAGE_USAGE_SAMPLED_BIT | additionalUsageFlags;
   imageInfo.samples           = static_cast<VkSampleCountFlagBits>(numSamples);
   imageInfo.sharingMode       = VK_SHARING_MODE_EXCLUSIVE;
+  return imageInfo;
+}
 
-  return allocator.createImage(imageInfo);
+// Creates a simple texture as described by makeImageInfoSimple.
+inline nvvk::Image createImageSimple(nvvk::ResourceAllocatorDma& allocator,
+                                        VkImageType         imageType,
+                                        VkFormat            format,
+                                        uint32_t            width,
+                                        uint32_t            height,
+                                        uint32_t            arrayLayers          = 1,
+                                        VkImageUsageFlags   additionalUsageFlags = 0,
+                                        uint32_t            numSamples           = 1)
+{
+  // There are several different ways to create images using the NVVK framework.
+  // Here, we'll use AllocatorDma::createImage.
+  return allocator.createImage(makeImageInfoSimple(imageType, format, width, height, arrayLayers, additionalUsageFlags, numSamples));
 }
 
 inline VkSampleCountFlagBits getSampleCountFlagBits(int msaa)
@@ -203,6 +598,8 @@ struct ImageAndView
   uint32_t c_height = 0;                    // Should not be changed once the texture is created!
   uint32_t c_layers = 0;                    // Should not be changed once the texture is created!
   VkFormat c_format = VK_FORMAT_UNDEFINED;  // Should not be changed once the texture is created!
+  VkDeviceSize c_memoryBytes = 0;           // The size of the image's memory requirements, in bytes.
+  VkImageAspectFlags c_viewAspect = 0;      // The aspects that the view covers.
 
   // Information for pipeline transitions. These should generally only be
   // modified via transitionTo or when ending render passes.
@@ -226,15 +623,36 @@ public:
   {
     assert(view == nullptr);  // Destroy the image before recreating it, please!
     image = createImageSimple(allocator, imageType, format, width, height, arrayLayers, additionalUsageFlags, numSamples);
-    VkImageViewCreateInfo viewInfo       = nvvk::makeImage2DViewCreateInfo(image.image, format, viewAspect);
-    viewInfo.subresourceRange.layerCount = arrayLayers;
-    viewInfo.viewType                    = (arrayLayers == 1 ? VK_IMAGE_VIEW_TYPE_2D : VK_IMAGE_VIEW_TYPE_2D_ARRAY);
-    vkCreateImageView(context.m_device, &viewInfo, nullptr, &view);
+    setInfo(context, viewAspect, format, width, height, arrayLayers);
+    createView(context);
+  }
 
-    c_width  = width;
-    c_height = height;
-    c_layers = arrayLayers;
-    c_format = format;
+  // Like create, but for images whose memory comes from somewhere else, such
+  // as a MemoryArena: creates the image and returns its memory requirements.
+  // Call bind before using it.
+  VkMemoryRequirements createUnbound(nvvk::Context&     context,
+                                     VkImageType        imageType,
+                                     VkImageAspectFlags viewAspect,
+                                     VkFormat           format,
+                                     uint32_t           width,
+                                     uint32_t           height,
+                                     uint32_t           arrayLayers          = 1,
+                                     VkImageUsageFlags  additionalUsageFlags = 0,
+                                     uint32_t           numSamples           = 1)
+  {
+    assert(view == nullptr && image.image == nullptr);  // Destroy the image before recreating it, please!
+    const VkImageCreateInfo imageInfo =
+        makeImageInfoSimple(imageType, format, width, height, arrayLayers, additionalUsageFlags, numSamples);
+    NVVK_CHECK(vkCreateImage(context.m_device, &imageInfo, nullptr, &image.image));
+    return setInfo(context, viewAspect, format, width, height, arrayLayers);
+  }
+
+  // Binds memory to an image from createUnbound, and creates its view.
+  void bind(nvvk::Context& context, VkDeviceMemory memory, VkDeviceSize offset)
+  {
+    assert(image.image != nullptr && view == nullptr);
+    NVVK_CHECK(vkBindImageMemory(context.m_device, image.image, memory, offset));
+    createView(context);
   }
 
   // To destroy the object, provide its context and allocator.
@@ -243,7 +661,16 @@ public:
     if(view != nullptr)
     {
       vkDestroyImageView(context.m_device, view, nullptr);
-      allocator.destroy(image);
+      // Images from createUnbound don't own their memory.
+      if(image.memHandle != nullptr)
+      {
+        allocator.destroy(image);
+      }
+      else
+      {
+        vkDestroyImage(context.m_device, image.image, nullptr);
+        image = nvvk::Image();
+      }
       view            = nullptr;
       currentLayout   = VK_IMAGE_LAYOUT_UNDEFINED;
       currentAccesses = 0;
@@ -257,12 +684,14 @@ public:
     // Note that in larger applications, we could batch together pipeline
     // barriers for better performance!
 
-    // Maps to barrier.subresourceRange.aspectMask
+    // Maps to barrier.subresourceRange.aspectMask. Depth images can also be
+    // transitioned to layouts for reading them in shaders, so check the format.
     VkImageAspectFlags aspectMask = 0;
-    if(dstLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
+    if(c_format == VK_FORMAT_D16_UNORM || c_format == VK_FORMAT_X8_D24_UNORM_PACK32 || c_format == VK_FORMAT_D32_SFLOAT
+       || c_format == VK_FORMAT_D16_UNORM_S8_UINT || c_format == VK_FORMAT_D24_UNORM_S8_UINT || c_format == VK_FORMAT_D32_SFLOAT_S8_UINT)
     {
       aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-      if(c_format == VK_FORMAT_D32_SFLOAT_S8_UINT || c_format == VK_FORMAT_D24_UNORM_S8_UINT)
+      if(c_format == VK_FORMAT_D16_UNORM_S8_UINT || c_format == VK_FORMAT_D24_UNORM_S8_UINT || c_format == VK_FORMAT_D32_SFLOAT_S8_UINT)
       {
         aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
       }
@@ -283,11 +712,43 @@ public:
   // pass that includes a image layout transition finishes.
   void endRenderPass(VkImageLayout dstLayout) { currentLayout = dstLayout; }
 
+  // Should be called before using an image whose memory other resources may
+  // have written to since (see Sample::bindAliasedFrameImages): the next
+  // transition discards its contents, and also waits for `aliasAccesses`.
+  void discard(VkAccessFlags aliasAccesses)
+  {
+    currentLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    currentAccesses |= aliasAccesses;
+  }
+
   void setName(nvvk::DebugUtil& util, const char* name)
   {
     util.setObjectName(image.image, name);
     util.setObjectName(view, name);
   }
+
+private:
+  VkMemoryRequirements setInfo(nvvk::Context& context, VkImageAspectFlags viewAspect, VkFormat format, uint32_t width, uint32_t height, uint32_t arrayLayers)
+  {
+    VkMemoryRequirements memoryRequirements;
+    vkGetImageMemoryRequirements(context.m_device, image.image, &memoryRequirements);
+
+    c_width       = width;
+    c_height      = height;
+    c_layers      = arrayLayers;
+    c_format      = format;
+    c_memoryBytes = memoryRequirements.size;
+    c_viewAspect  = viewAspect;
+    return memoryRequirements;
+  }
+
+  void createView(nvvk::Context& context)
+  {
+    VkImageViewCreateInfo viewInfo       = nvvk::makeImage2DViewCreateInfo(image.image, c_format, c_viewAspect);
+    viewInfo.subresourceRange.layerCount = c_layers;
+    viewInfo.viewType                    = (c_layers == 1 ? VK_IMAGE_VIEW_TYPE_2D : VK_IMAGE_VIEW_TYPE_2D_ARRAY);
+    vkCreateImageView(context.m_device, &viewInfo, nullptr, &view);
+  }
 };
 
 // Adds a simple command that ensures that all transfer writes have finished before all
@@ -318,8 +779,9 @@ inline void cmdTransferBarrierSimple(VkCommandBuffer cmdBuffer)
 // memory barriers for each of the individual objects (and in fact may run into issues with the
 // Vulkan specification).
 // The dependency flags are BY_REGION_BIT by default, since most calls to cmdBarrier come from
-// dependencies inside render passes, which require this (according to section 6.6.1).
-inline void cmdFragmentBarrierSimple(VkCommandBuffer cmdBuffer)
+// dependencies inside render passes, which require this (according to section 6.6.1). They
+// have to match the flags of the subpass's self-dependency.
+inline void cmdFragmentBarrierSimple(VkCommandBuffer cmdBuffer, VkDependencyFlags dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT)
 {
   const VkPipelineStageFlags stageFlags = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
 
@@ -327,8 +789,175 @@ inline void cmdFragmentBarrierSimple(VkCommandBuffer cmdBuffer)
   barrier.srcAccessMask   = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
   barrier.dstAccessMask   = barrier.srcAccessMask;
 
-  vkCmdPipelineBarrier(cmdBuffer, stageFlags, stageFlags, VK_DEPENDENCY_BY_REGION_BIT,  //
+  vkCmdPipelineBarrier(cmdBuffer, stageFlags, stageFlags, dependencyFlags,  //
                        1, &barrier,                                  //
                        0, VK_NULL_HANDLE,                            //
                        0, VK_NULL_HANDLE);
-}
\ No newline at end of file
+}
+
+// Adds a command that ensures that the attachment writes and fragment shader
+// reads and writes of a render pass have finished before subsequent transfer
+// commands and render passes use the same resources (for instance, when
+// rendering the same A-buffer once per tile).
+inline void cmdRenderPassBarrierSimple(VkCommandBuffer cmdBuffer)
+{
+  const VkPipelineStageFlags srcStageFlags = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT
+                                             | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  const VkPipelineStageFlags dstStageFlags = srcStageFlags | VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+
+  VkMemoryBarrier barrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT
+                          | VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+                          | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT;
+
+  vkCmdPipelineBarrier(cmdBuffer, srcStageFlags, dstStageFlags, 0,  //
+                       1, &barrier,                                 //
+                       0, VK_NULL_HANDLE,                           //
+                       0, VK_NULL_HANDLE);
+}
+
+// Keeps objects alive until the GPU has finished every frame that could still
+// use them, so that they can be replaced without waiting for the device to be
+// idle. Each ring cycle has a list of destruction functions; objects retired
+// while a cycle is current are destroyed the next time that cycle's fence has
+// been waited on, since by then all previously submitted frames have finished.
+class DeferredDestroyer
+{
+public:
+  void init(uint32_t cycleSize) { m_cycles.resize(cycleSize); }
+
+  // Runs `destroy` once the frames submitted up to now have finished.
+  void retire(uint32_t cycleIndex, std::function<void()>&& destroy) { m_cycles[cycleIndex].push_back(std::move(destroy)); }
+
+  // Should be called after waiting for the cycle's fence.
+  void releaseCycle(uint32_t cycleIndex)
+  {
+    for(std::function<void()>& destroy : m_cycles[cycleIndex])
+    {
+      destroy();
+    }
+    m_cycles[cycleIndex].clear();
+  }
+
+  // Should only be called when the device is idle.
+  void releaseAll()
+  {
+    for(uint32_t cycleIndex = 0; cycleIndex < static_cast<uint32_t>(m_cycles.size()); cycleIndex++)
+    {
+      releaseCycle(cycleIndex);
+    }
+  }
+
+private:
+  std::vector<std::vector<std::function<void()>>> m_cycles;
+};
+
+// A fixed set of threads that run the iterations of a loop in parallel, so
+// that work that's done every frame doesn't have to start threads each time.
+// The thread that calls run() takes part as worker 0, and run() returns once
+// all iterations have finished.
+class WorkerPool
+{
+public:
+  // Starts numWorkers - 1 threads.
+  void init(uint32_t numWorkers)
+  {
+    m_numWorkers = std::max(1u, numWorkers);
+    for(uint32_t worker = 1; worker < m_numWorkers; worker++)
+    {
+      m_threads.emplace_back(&WorkerPool::workerLoop, this, worker);
+    }
+  }
+
+  void deinit()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_quit = true;
+    }
+    m_wake.notify_all();
+    for(std::thread& thread : m_threads)
+    {
+      thread.join();
+    }
+    m_threads.clear();
+    m_quit       = false;
+    m_numWorkers = 1;
+  }
+
+  uint32_t getNumWorkers() const { return m_numWorkers; }
+
+  // Calls job(jobIndex, workerIndex) once for each jobIndex in [0, numJobs),
+  // using workers 0 to maxWorkers - 1. Each worker only runs one job at a
+  // time, so per-worker resources can be indexed by workerIndex.
+  void run(uint32_t numJobs, uint32_t maxWorkers, const std::function<void(uint32_t, uint32_t)>& job)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_job           = &job;
+      m_numJobs       = numJobs;
+      m_activeWorkers = std::max(1u, std::min(maxWorkers, m_numWorkers));
+      m_nextJob       = 0;
+      m_busyThreads   = static_cast<uint32_t>(m_threads.size());
+      m_generation++;
+    }
+    m_wake.notify_all();
+
+    runJobs(0);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this]() { return m_busyThreads == 0; });
+    m_job = nullptr;
+  }
+
+private:
+  void workerLoop(uint32_t workerIndex)
+  {
+    uint32_t generation = 0;
+    while(true)
+    {
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wake.wait(lock, [&]() { return m_quit || (m_generation != generation); });
+        if(m_quit)
+        {
+          return;
+        }
+        generation = m_generation;
+      }
+
+      if(workerIndex < m_activeWorkers)
+      {
+        runJobs(workerIndex);
+      }
+
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if(--m_busyThreads == 0)
+      {
+        m_done.notify_one();
+      }
+    }
+  }
+
+  void runJobs(uint32_t workerIndex)
+  {
+    for(uint32_t jobIndex = m_nextJob++; jobIndex < m_numJobs; jobIndex = m_nextJob++)
+    {
+      (*m_job)(jobIndex, workerIndex);
+    }
+  }
+
+  std::vector<std::thread>                       m_threads;
+  std::mutex                                     m_mutex;
+  std::condition_variable                        m_wake;  // Signals a new run() or deinit()
+  std::condition_variable                        m_done;  // Signals that all threads finished the run
+  const std::function<void(uint32_t, uint32_t)>* m_job           = nullptr;
+  uint32_t                                       m_numJobs       = 0;
+  uint32_t                                       m_activeWorkers = 1;
+  std::atomic<uint32_t>                          m_nextJob{0};
+  uint32_t                                       m_busyThreads = 0;  // Threads that haven't finished the current run
+  uint32_t                                       m_generation  = 0;  // Incremented by each run()
+  uint32_t                                       m_numWorkers  = 1;
+  bool                                           m_quit        = false;
+};